@@ -5,7 +5,7 @@ namespace gl
 {
   namespace Utils
   {
-    static void APIENTRY DebugOutput(
+    static void GLAPIENTRY DebugOutput(
       GLenum source,
       GLenum type,
       GLuint id,
@@ -94,7 +94,8 @@ namespace gl
       case gl::Utils::DebugMessageSeverity::HIGH:
         glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_HIGH, 0, NULL, GL_TRUE);
       }
-      glDebugMessageCallback(&DebugOutput, NULL);
+      // Newer GLEW versions declare userParam const.
+      glDebugMessageCallback(reinterpret_cast<GLDEBUGPROC>(&DebugOutput), NULL);
     }
 
     ezResult CheckError(const ezString& sTitle)
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <Foundation\Containers\HashTable.h>
+#include <Foundation/Containers/HashTable.h>
 
 namespace gl
 {
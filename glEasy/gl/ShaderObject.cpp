@@ -7,8 +7,8 @@
 
 #include <GL/glew.h>
 
-#include <Foundation/io/FileSystem/FileReader.h>
-#include <Foundation/io/OSFile.h>
+#include <Foundation/IO/FileSystem/FileReader.h>
+#include <Foundation/IO/OSFile.h>
 #include <Foundation/Types/ArrayPtr.h>
 
 namespace gl
@@ -55,6 +55,11 @@ namespace gl
   }
 
   ezResult ShaderObject::AddShaderFromFile(ShaderType Type, const ezString& sFilename, std::initializer_list<ezString> defines)
+  {
+    return AddShaderFromFileWithDirectives(Type, sFilename, GetDefineDirectives(defines));
+  }
+
+  ezResult ShaderObject::AddShaderFromFileWithDirectives(ShaderType Type, const ezString& sFilename, const ezString& sDefineDirectives)
   {
     // load new code
     ezSet<ezString> includingFiles;
@@ -62,7 +67,7 @@ namespace gl
     if(sourceCode == "")
       return EZ_FAILURE;
 
-    ezResult result = AddShaderFromSource(Type, sourceCode.GetData(), sFilename, defines);
+    ezResult result = AddShaderFromSourceWithDirectives(Type, sourceCode.GetData(), sFilename, sDefineDirectives);
 
     if(result != EZ_FAILURE)
     {
@@ -152,7 +157,20 @@ namespace gl
     return sourceCode;
   }
 
+  ezString ShaderObject::GetDefineDirectives(std::initializer_list<ezString> defines)
+  {
+    ezStringBuilder directives;
+    for(auto it = defines.begin(); it != defines.end(); ++it)
+      directives.AppendFormat("#define %s\n", it->GetData());
+    return directives;
+  }
+
   ezResult ShaderObject::AddShaderFromSource(ShaderType type, const ezString& pSourceCode, const ezString& sOriginName, std::initializer_list<ezString> defines)
+  {
+    return AddShaderFromSourceWithDirectives(type, pSourceCode, sOriginName, GetDefineDirectives(defines));
+  }
+
+  ezResult ShaderObject::AddShaderFromSourceWithDirectives(ShaderType type, const ezString& pSourceCode, const ezString& sOriginName, const ezString& sDefineDirectives)
   {
     Shader& shader = m_aShader[static_cast<ezUInt32>(type)];
 
@@ -184,13 +202,20 @@ namespace gl
       break;
     }
 
-    // attach defines
+    // attach defines, #version needs to stay the first directive
     ezStringBuilder sourceRaw(pSourceCode.GetData());
-    for(auto it = defines.begin(); it != defines.end(); ++it)
+    if(!sDefineDirectives.IsEmpty())
     {
-      sourceRaw.PrependFormat("#define %s\n", it->GetData());
+      const char* pInsertPosition = sourceRaw.GetData();
+      const char* pVersion = sourceRaw.FindSubString("#version");
+      if(pVersion != NULL)
+      {
+        const char* pLineEnd = sourceRaw.FindSubString("\n", pVersion);
+        pInsertPosition = pLineEnd != NULL ? pLineEnd + 1 : sourceRaw.GetData() + sourceRaw.GetElementCount();
+      }
+      sourceRaw.ReplaceSubString(pInsertPosition, pInsertPosition, sDefineDirectives.GetData());
     }
-      
+
 
 
     // compile shader
@@ -231,6 +256,7 @@ namespace gl
       // memorize new data only if loading successful - this way a failed reload won't affect anything
       shader.shaderObject = shaderObjectTemp;
       shader.sOrigin = sOriginName;
+      shader.sDefineDirectives = sDefineDirectives;
 
       // remove old associated files
       for(auto it=m_filesPerShaderType.GetIterator(); it.IsValid(); ++it)
@@ -588,8 +614,9 @@ namespace gl
     {
       if (m_aShader[type].bLoaded)
       {
-        ezString origin(m_aShader[type].sOrigin);  // need to copy the string, since it could be deleted in the course of reloading..
-        if (AddShaderFromFile(static_cast<ShaderType>(type), origin) != EZ_FAILURE && m_bContainsAssembledProgram)
+        ezString origin(m_aShader[type].sOrigin);  // need to copy the strings, since they could be deleted in the course of reloading..
+        ezString defineDirectives(m_aShader[type].sDefineDirectives);
+        if (AddShaderFromFileWithDirectives(static_cast<ShaderType>(type), origin, defineDirectives) != EZ_FAILURE && m_bContainsAssembledProgram)
           CreateProgram();
       }
     }
@@ -36,6 +36,7 @@ namespace gl
 
     const ezString& GetName() const { return m_name; }
 
+    /// \param defines   Each entry becomes a #define directive right after the #version line, e.g. "NAME" or "NAME value".
     ezResult AddShaderFromFile(ShaderType type, const ezString& sFilename, std::initializer_list<ezString> defines = {});
     /// \todo Perform lookup if shader is already created. Store source code hash
     ezResult AddShaderFromSource(ShaderType type, const ezString& pSourceCode, const ezString& sOriginName, std::initializer_list<ezString> defines = {});
@@ -103,8 +104,13 @@ namespace gl
     /// file handler event for hot reloading
     void FileEventHandler(const ezString& changedShaderFile);
 
+    /// Defines as a block of #define directives, kept with each shader so that hot reloading compiles the same variant.
+    static ezString GetDefineDirectives(std::initializer_list<ezString> defines);
+    ezResult AddShaderFromFileWithDirectives(ShaderType type, const ezString& sFilename, const ezString& sDefineDirectives);
+    ezResult AddShaderFromSourceWithDirectives(ShaderType type, const ezString& pSourceCode, const ezString& sOriginName, const ezString& sDefineDirectives);
+
     /// Reads shader source code from file and performs parsing of #include directives
-    static ezStringBuilder ReadShaderFromFile(const ezString& filename, ezSet<ezString>& includingFiles = ezSet<ezString>());
+    static ezStringBuilder ReadShaderFromFile(const ezString& filename, ezSet<ezString>& includingFiles);
 
 
 
@@ -135,9 +141,10 @@ namespace gl
     {
       ShaderId  shaderObject;
       ezString  sOrigin;
+      ezString  sDefineDirectives;
       bool      bLoaded;
     };
-    Shader m_aShader[ShaderType::NUM_SHADER_TYPES];
+    Shader m_aShader[static_cast<ezUInt32>(ShaderType::NUM_SHADER_TYPES)];
 
     // meta information
     GlobalUniformInfos m_GlobalUniformInfo;
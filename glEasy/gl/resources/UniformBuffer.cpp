@@ -20,6 +20,13 @@ namespace gl
 
   UniformBuffer::~UniformBuffer(void)
   {
+    // Deleting the buffer unbinds it, a new UniformBuffer at the same address must not assume it is still bound.
+    for(ezUInt32 i = 0; i < sizeof(s_pBoundUBOs) / sizeof(UniformBuffer*); ++i)
+    {
+      if(s_pBoundUBOs[i] == this)
+        s_pBoundUBOs[i] = NULL;
+    }
+
     EZ_DEFAULT_DELETE(m_pBufferData);
     glDeleteBuffers(1, &m_BufferObject);
   }
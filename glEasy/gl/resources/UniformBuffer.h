@@ -2,8 +2,12 @@
 
 #include "../ShaderDataMetaInfo.h"
 
+#include <initializer_list>
+
 namespace gl
 {
+  class ShaderObject;
+
   class UniformBuffer
   {
   public:
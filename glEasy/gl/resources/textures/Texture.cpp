@@ -44,9 +44,9 @@ namespace gl
       return iMipMapSetting;
   }
 
-  void Texture::BindImage(GLuint slotIndex, Texture::ImageAccess access, GLenum format)
+  void Texture::BindImage(GLuint slotIndex, Texture::ImageAccess access, GLenum format, ezUInt32 mipLevel)
   {
-    glBindImageTexture(slotIndex, m_TextureHandle, 0, GL_TRUE, 0, static_cast<GLenum>(access), format);
+    glBindImageTexture(slotIndex, m_TextureHandle, mipLevel, GL_TRUE, 0, static_cast<GLenum>(access), format);
     gl::Utils::CheckError("glBindImageTexture");
   }
 
@@ -19,7 +19,7 @@ namespace gl
       
     /// Binds as image, currently without redundancy checking!
     void BindImage(GLuint slotIndex, ImageAccess access) { BindImage(0, access, m_format); }
-    void BindImage(GLuint slotIndex, ImageAccess access, GLenum format);
+    void BindImage(GLuint slotIndex, ImageAccess access, GLenum format, ezUInt32 mipLevel = 0);
 
     static void ResetImageBinding(GLuint slotIndex) { glBindImageTexture(0, 0, 0, false, 0, GL_READ_WRITE, GL_RGBA8); }
 
@@ -0,0 +1,469 @@
+#include "PCH.h"
+#include "GpuFlowBenchmark.h"
+
+#include "simulation/TerrainGenerator.h"
+#include "simulation/SimulationParameters.h"
+#include "math/Random.h"
+
+#include "gl/resources/textures/Texture2D.h"
+#include "gl/GLUtils.h"
+
+namespace
+{
+  /// Same as in activeTiles.glsl.
+  const ezUInt32 s_simulationTileSize = 16;
+  /// Same as TELEMETRY_WATER_SCALE in simulationCommon.glsl.
+  const double s_telemetryWaterScale = 4096.0;
+
+  /// Steady state detection of CheckSleepingLakeVolume. The lake is at rest from the start, so its tiles fall asleep after
+  /// s_lakeSleepSteps and stay asleep for the remaining steps.
+  const ezUInt32 s_lakeSleepSteps = 20;
+  const ezUInt32 s_lakeCheckSteps = 60;
+  const float s_lakeSleepThreshold_perStep = 1.0e-4f;
+  /// Largest accepted change of the volume relative to the first step, well above the rounding of the fixed point sums.
+  const double s_maxLakeVolumeChange = 1.0e-5;
+}
+
+GpuFlowBenchmark::GpuFlowBenchmark() :
+  m_activeTilesShader("activeTiles"),
+  m_updateFlowShader("updateFlow"),
+  m_applyFlowShader("applyFlow"),
+  m_splitPlanesShader("splitSimulationPlanes"),
+  m_mergePlanesShader("mergeSimulationPlanes"),
+  m_planarStorage(false),
+  m_halfPrecisionFlow(false),
+  m_gridResolution(0),
+  m_terrainData(NULL),
+  m_waterOutgoingFlow(NULL),
+  m_waterFlowMap(NULL),
+  m_terrainHeight(NULL),
+  m_waterHeight(NULL),
+  m_currentTileWetBuffer(0),
+  m_activeTileListBuffer(0),
+  m_tileRateBuffer(0),
+  m_tileActivityBuffer(0),
+  m_simulationStatsBuffer(0),
+  m_mipDirtyTileFlagBuffer(0),
+  m_mipDirtyTileListBuffer(0)
+{
+  m_tileWetBuffer[0] = m_tileWetBuffer[1] = 0;
+}
+
+GpuFlowBenchmark::~GpuFlowBenchmark()
+{
+  ReleaseResources();
+}
+
+ezResult GpuFlowBenchmark::Init(const Settings& settings)
+{
+  m_planarStorage = settings.planarStorage;
+  m_halfPrecisionFlow = settings.halfPrecisionFlow;
+
+  // Same defines as Terrain::LoadSimulationShaders.
+  ezString storageDefine = m_planarStorage ? "SIMULATION_PLANAR_STORAGE 1" : "SIMULATION_PLANAR_STORAGE 0";
+  ezString flowFormatDefine = m_halfPrecisionFlow ? "SIMULATION_FLOW_FORMAT rgba16f" : "SIMULATION_FLOW_FORMAT rgba32f";
+  if(m_activeTilesShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "flowActiveTiles.comp") == EZ_FAILURE ||
+     m_activeTilesShader.CreateProgram() == EZ_FAILURE ||
+     m_updateFlowShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "flowUpdate.comp", { storageDefine, flowFormatDefine }) == EZ_FAILURE ||
+     m_updateFlowShader.CreateProgram() == EZ_FAILURE ||
+     m_applyFlowShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "flowApply.comp", { storageDefine, flowFormatDefine }) == EZ_FAILURE ||
+     m_applyFlowShader.CreateProgram() == EZ_FAILURE)
+  {
+    return EZ_FAILURE;
+  }
+  if(m_planarStorage &&
+     (m_splitPlanesShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "simulationPlanes.comp", { "SIMULATION_PLANES_SPLIT" }) == EZ_FAILURE ||
+      m_splitPlanesShader.CreateProgram() == EZ_FAILURE ||
+      m_mergePlanesShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "simulationPlanes.comp") == EZ_FAILURE ||
+      m_mergePlanesShader.CreateProgram() == EZ_FAILURE))
+  {
+    return EZ_FAILURE;
+  }
+
+  return m_simulationParametersUBO.Init({ &m_activeTilesShader, &m_updateFlowShader, &m_applyFlowShader }, "SimulationParameters");
+}
+
+const char* GpuFlowBenchmark::GetPassName(Pass pass)
+{
+  const char* names[NUM_PASSES] = { "activeTiles", "flowUpdate", "flowApply", "mergePlanes" };
+  return names[pass];
+}
+
+double GpuFlowBenchmark::EstimateMemoryTrafficPerCell(const Settings& settings)
+{
+  double flowBytes = settings.halfPrecisionFlow ? 8 : 16;
+  if(!settings.planarStorage)
+    return 3 * 16 + 3 * flowBytes + 4;
+  return 5 * 4 + 3 * flowBytes + (4 + 2 * 16) / static_cast<double>(ezMath::Max(settings.stepsPerFrame, 1u));
+}
+
+ezResult GpuFlowBenchmark::CheckGridResolution(ezUInt32 gridResolution) const
+{
+  if(gridResolution == 0 || gridResolution % s_simulationTileSize != 0)
+  {
+    ezLog::Error("Grid resolution %u is not a multiple of the simulation tile size %u.", gridResolution, s_simulationTileSize);
+    return EZ_FAILURE;
+  }
+  return EZ_SUCCESS;
+}
+
+bool GpuFlowBenchmark::CreateResources(const Settings& settings, bool sleepingLake)
+{
+  // Errors of earlier runs must not be mistaken for this one.
+  while(glGetError() != GL_NO_ERROR);
+
+  // Initial state, generated on the CPU like Terrain::CreateHeightmapFromNoiseAndResetSim.
+  ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+  ezColor* initialData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, numTexels);
+  if(sleepingLake)
+  {
+    // Paraboloid bowl with a flat lake up to half its radius, far from the open grid border.
+    float center = 0.5f * (m_gridResolution - 1);
+    float lakeLevel = 0.25f * settings.heightScale;
+    for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+    {
+      for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+      {
+        ezVec2 toCenter((x - center) / center, (y - center) / center);
+        ezColor& texel = initialData[x + y * m_gridResolution];
+        texel = ezColor(settings.heightScale * toCenter.GetLengthSquared(), 0.0f, 0.0f, 0.0f);
+        texel.a = ezMath::Max(lakeLevel - texel.r, 0.0f);
+      }
+    }
+  }
+  else
+  {
+    Random::Init(settings.randomSeed);
+    TerrainGenerator::CreateHeightmapFromNoise(initialData, m_gridResolution, settings.heightScale);
+    for(ezUInt32 i = 0; i < numTexels; ++i)
+      initialData[i].a += settings.waterHeight;
+  }
+
+  m_terrainData = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_RGBA32F, 1);
+  m_terrainData->SetData(0, initialData);
+  ezMemoryUtils::ZeroFill(initialData, numTexels);
+  m_waterOutgoingFlow = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, settings.halfPrecisionFlow ? GL_RGBA16F : GL_RGBA32F, 1);
+  m_waterOutgoingFlow->SetData(0, initialData);
+  m_waterFlowMap = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_RG16F, 1);
+  EZ_DEFAULT_DELETE_RAW_BUFFER(initialData);
+
+  // Planes are split off the terrain data like in Terrain::SplitSimulationPlanes.
+  if(settings.planarStorage)
+  {
+    m_terrainHeight = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_R32F, 1);
+    m_waterHeight = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_R32F, 1);
+    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F);
+    m_terrainHeight->BindImage(1, gl::Texture::ImageAccess::WRITE, GL_R32F);
+    m_waterHeight->BindImage(3, gl::Texture::ImageAccess::WRITE, GL_R32F);
+    m_splitPlanesShader.Activate();
+    glDispatchCompute(m_gridResolution / s_simulationTileSize, m_gridResolution / s_simulationTileSize, 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+  }
+
+  // Sparse simulation buffers as in Terrain, everything wet and at full rate.
+  ezUInt32 numTilesPerSide = m_gridResolution / s_simulationTileSize;
+  ezUInt32 numTiles = numTilesPerSide * numTilesPerSide;
+  ezUInt32 allWet = 1;
+  glGenBuffers(2, m_tileWetBuffer);
+  for(int i = 0; i < 2; ++i)
+  {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileWetBuffer[i]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ezUInt32) * numTiles, NULL, GL_DYNAMIC_COPY);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &allWet);
+  }
+  m_currentTileWetBuffer = 0;
+
+  ezUInt32 dispatchArguments[3] = { 0, 1, 1 };
+  glGenBuffers(1, &m_activeTileListBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_activeTileListBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(dispatchArguments) + sizeof(ezUInt32) * numTiles, NULL, GL_DYNAMIC_COPY);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(dispatchArguments), dispatchArguments);
+
+  ezUInt32 fullRate = 0;
+  glGenBuffers(1, &m_tileRateBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileRateBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ezUInt32) * numTiles, NULL, GL_STATIC_DRAW);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &fullRate);
+
+  // Quiet steps, flow change and water sum per tile, see TileActivityInfo in activeTiles.glsl.
+  ezUInt32 zero = 0;
+  glGenBuffers(1, &m_tileActivityBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileActivityBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, 3 * sizeof(ezUInt32) * numTiles, NULL, GL_DYNAMIC_COPY);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+  // Max flow speed and water depth, the simulated and sleeping tile counts and the telemetry of one step, see SimulationStats in
+  // simulationCommon.glsl.
+  glGenBuffers(1, &m_simulationStatsBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_simulationStatsBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, (4 + 5) * sizeof(ezUInt32), NULL, GL_DYNAMIC_READ);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+  glGenBuffers(1, &m_mipDirtyTileFlagBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_mipDirtyTileFlagBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ezUInt32) * numTiles, NULL, GL_DYNAMIC_COPY);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+  glGenBuffers(1, &m_mipDirtyTileListBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_mipDirtyTileListBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(dispatchArguments) + sizeof(ezUInt32) * numTiles, NULL, GL_DYNAMIC_COPY);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(dispatchArguments), dispatchArguments);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  // Drivers may defer the allocation until the memory is used for the first time.
+  glFinish();
+  if(glGetError() == GL_OUT_OF_MEMORY)
+    return false;
+
+  SimulationParameters parameters = SimulationParameters::Compute(ezTime::Seconds(1.0f / settings.simulationStepsPerSecond), settings.flowDamping,
+                                                                  settings.flowAcceleration, settings.cellDistance);
+  m_simulationParametersUBO["FlowFriction_perStep"].Set(parameters.flowFriction_perStep);
+  m_simulationParametersUBO["WaterAcceleration_perStep"].Set(parameters.waterAcceleration_perStep);
+  m_simulationParametersUBO["CellAreaInv_timeScaled"].Set(parameters.cellAreaInv_timeScaled);
+  // The benchmark simulates every active tile in every step, telemetry and sleeping tiles would skew the measurement.
+  m_simulationParametersUBO["TelemetrySlot"].Set(sleepingLake ? 0u : static_cast<ezUInt32>(0xFFFFFFFF));
+  m_simulationParametersUBO["TileSleepSteps"].Set(sleepingLake ? s_lakeSleepSteps : 0u);
+  m_simulationParametersUBO["TileSleepThreshold_perStep"].Set(sleepingLake ? s_lakeSleepThreshold_perStep : 0.0f);
+
+  return true;
+}
+
+void GpuFlowBenchmark::ReleaseResources()
+{
+  if(m_terrainData == NULL)
+    return;
+
+  EZ_DEFAULT_DELETE(m_terrainData);
+  EZ_DEFAULT_DELETE(m_waterOutgoingFlow);
+  EZ_DEFAULT_DELETE(m_waterFlowMap);
+  if(m_terrainHeight != NULL)
+    EZ_DEFAULT_DELETE(m_terrainHeight);
+  if(m_waterHeight != NULL)
+    EZ_DEFAULT_DELETE(m_waterHeight);
+  m_terrainData = m_waterOutgoingFlow = m_waterFlowMap = m_terrainHeight = m_waterHeight = NULL;
+
+  glDeleteBuffers(2, m_tileWetBuffer);
+  glDeleteBuffers(1, &m_activeTileListBuffer);
+  glDeleteBuffers(1, &m_tileRateBuffer);
+  glDeleteBuffers(1, &m_tileActivityBuffer);
+  glDeleteBuffers(1, &m_simulationStatsBuffer);
+  glDeleteBuffers(1, &m_mipDirtyTileFlagBuffer);
+  glDeleteBuffers(1, &m_mipDirtyTileListBuffer);
+  m_tileWetBuffer[0] = m_tileWetBuffer[1] = m_activeTileListBuffer = m_tileRateBuffer = m_tileActivityBuffer = m_simulationStatsBuffer = 0;
+  m_mipDirtyTileFlagBuffer = m_mipDirtyTileListBuffer = 0;
+}
+
+void GpuFlowBenchmark::PerformSimulationStep(ezUInt32 stepIndex, bool mergePlanes, GLuint* timestampQueries)
+{
+  // Same sequence as Terrain::PerformSimulationStep, followed by the merge of Terrain::UpdateTerrainDataMips at the end of a frame.
+  // timestampQueries are written before, between and after the passes.
+  m_simulationParametersUBO["SimulationStepIndex"].Set(stepIndex);
+  m_simulationParametersUBO.BindBuffer(5);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, m_simulationStatsBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, m_tileRateBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_mipDirtyTileFlagBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, m_mipDirtyTileListBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_tileActivityBuffer);
+
+  if(timestampQueries)
+    glQueryCounter(timestampQueries[0], GL_TIMESTAMP);
+
+  ezUInt32 numActiveTiles = 0;
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_tileWetBuffer[m_currentTileWetBuffer]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_tileWetBuffer[1 - m_currentTileWetBuffer]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_activeTileListBuffer);
+  glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, sizeof(ezUInt32), GL_RED_INTEGER, GL_UNSIGNED_INT, &numActiveTiles);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  ezUInt32 numTilesPerSide = m_gridResolution / s_simulationTileSize;
+  m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F);
+  m_activeTilesShader.Activate();
+  glDispatchCompute((numTilesPerSide + 7) / 8, (numTilesPerSide + 7) / 8, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+  if(timestampQueries)
+    glQueryCounter(timestampQueries[1], GL_TIMESTAMP);
+
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, m_activeTileListBuffer);
+
+  if(m_planarStorage)
+  {
+    m_terrainHeight->BindImage(0, gl::Texture::ImageAccess::READ, GL_R32F);
+    m_waterHeight->BindImage(3, gl::Texture::ImageAccess::READ, GL_R32F);
+  }
+  else
+    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F);
+  m_waterOutgoingFlow->BindImage(1, gl::Texture::ImageAccess::READ_WRITE, m_waterOutgoingFlow->GetFormat());
+  m_updateFlowShader.Activate();
+  glDispatchComputeIndirect(0);
+  // Apply reads the outgoing flow image and the flow changes of each tile.
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+  if(timestampQueries)
+    glQueryCounter(timestampQueries[2], GL_TIMESTAMP);
+
+  if(m_planarStorage)
+    m_waterHeight->BindImage(3, gl::Texture::ImageAccess::READ_WRITE, GL_R32F);
+  else
+    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
+  m_waterOutgoingFlow->BindImage(1, gl::Texture::ImageAccess::READ, m_waterOutgoingFlow->GetFormat());
+  m_waterFlowMap->BindImage(2, gl::Texture::ImageAccess::WRITE, GL_RG16F);
+  m_applyFlowShader.Activate();
+  glDispatchComputeIndirect(0);
+  // The next step reads the water heights and wet flags written by apply.
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+  if(timestampQueries)
+    glQueryCounter(timestampQueries[3], GL_TIMESTAMP);
+
+  // The dirty list holds every tile after the first step, since it is never consumed.
+  if(mergePlanes)
+  {
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, m_mipDirtyTileListBuffer);
+    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
+    m_waterHeight->BindImage(3, gl::Texture::ImageAccess::READ, GL_R32F);
+    m_mergePlanesShader.Activate();
+    glDispatchComputeIndirect(0);
+    // The active tile pass of the next step reads the merged terrain data.
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+  }
+
+  if(timestampQueries)
+    glQueryCounter(timestampQueries[4], GL_TIMESTAMP);
+
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+  m_currentTileWetBuffer = 1 - m_currentTileWetBuffer;
+}
+
+ezResult GpuFlowBenchmark::Run(ezUInt32 gridResolution, const Settings& settings, Result& result)
+{
+  EZ_ASSERT(settings.planarStorage == m_planarStorage && settings.halfPrecisionFlow == m_halfPrecisionFlow,
+            "The shaders were compiled for a different storage layout.");
+  if(CheckGridResolution(gridResolution) == EZ_FAILURE)
+    return EZ_FAILURE;
+
+  m_gridResolution = gridResolution;
+  if(!CreateResources(settings, false))
+  {
+    ezLog::Warning("Not enough GPU memory for a %ux%u grid.", gridResolution, gridResolution);
+    ReleaseResources();
+    return EZ_FAILURE;
+  }
+
+  ezUInt32 stepIndex = 0;
+  ezUInt32 stepsPerFrame = ezMath::Max(settings.stepsPerFrame, 1u);
+  for(ezUInt32 step = 0; step < settings.numWarmupSteps; ++step, ++stepIndex)
+    PerformSimulationStep(stepIndex, m_planarStorage && (stepIndex + 1) % stepsPerFrame == 0, NULL);
+  glFinish();
+
+  // Queries are only read after the last step, so they don't synchronize with the GPU in between.
+  ezDynamicArray<GLuint> timestampQueries;
+  timestampQueries.SetCount((NUM_PASSES + 1) * settings.numSteps);
+  GLuint* queries = static_cast<ezArrayPtr<GLuint>>(timestampQueries).GetPtr();
+  glGenQueries(timestampQueries.GetCount(), queries);
+
+  ezTime startTime = ezTime::Now();
+  for(ezUInt32 step = 0; step < settings.numSteps; ++step, ++stepIndex)
+    PerformSimulationStep(stepIndex, m_planarStorage && (stepIndex + 1) % stepsPerFrame == 0, queries + step * (NUM_PASSES + 1));
+  glFinish();
+  result.wallDuration = ezTime::Now() - startTime;
+
+  result.gridResolution = gridResolution;
+  result.numSteps = settings.numSteps;
+  result.memoryTrafficPerCell = EstimateMemoryTrafficPerCell(settings);
+  GLuint64 passNanoseconds[NUM_PASSES] = {};
+  for(ezUInt32 step = 0; step < settings.numSteps; ++step)
+  {
+    GLuint64 timestamps[NUM_PASSES + 1];
+    for(ezUInt32 i = 0; i <= NUM_PASSES; ++i)
+      glGetQueryObjectui64v(queries[step * (NUM_PASSES + 1) + i], GL_QUERY_RESULT, &timestamps[i]);
+    for(ezUInt32 pass = 0; pass < NUM_PASSES; ++pass)
+      passNanoseconds[pass] += timestamps[pass + 1] - timestamps[pass];
+  }
+  for(ezUInt32 pass = 0; pass < NUM_PASSES; ++pass)
+    result.passDurations[pass] = ezTime::Seconds(passNanoseconds[pass] * 1e-9);
+  glDeleteQueries(timestampQueries.GetCount(), queries);
+
+  ezUInt32 numActiveTiles = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_activeTileListBuffer);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ezUInt32), &numActiveTiles);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  ezUInt32 numTilesPerSide = gridResolution / s_simulationTileSize;
+  result.activeTileFraction = static_cast<float>(numActiveTiles) / (numTilesPerSide * numTilesPerSide);
+
+  gl::Texture::ResetImageBinding(0);
+  gl::Texture::ResetImageBinding(1);
+  gl::Texture::ResetImageBinding(2);
+  gl::Texture::ResetImageBinding(3);
+
+  ezResult glResult = gl::Utils::CheckError("GpuFlowBenchmark::Run");
+  ReleaseResources();
+  return glResult;
+}
+
+ezResult GpuFlowBenchmark::CheckSleepingLakeVolume(ezUInt32 gridResolution, const Settings& settings)
+{
+  EZ_ASSERT(settings.planarStorage == m_planarStorage && settings.halfPrecisionFlow == m_halfPrecisionFlow,
+            "The shaders were compiled for a different storage layout.");
+  if(CheckGridResolution(gridResolution) == EZ_FAILURE)
+    return EZ_FAILURE;
+
+  m_gridResolution = gridResolution;
+  if(!CreateResources(settings, true))
+  {
+    ezLog::Warning("Not enough GPU memory for a %ux%u grid.", gridResolution, gridResolution);
+    ReleaseResources();
+    return EZ_FAILURE;
+  }
+
+  // The first step simulates every tile, its volume is the reference. Each step is read back right away, like telemetry in Terrain.
+  double referenceVolume = 0.0;
+  double maxVolumeChange = 0.0;
+  ezUInt32 numSleepingTiles = 0;
+  for(ezUInt32 step = 0; step < s_lakeCheckSteps; ++step)
+  {
+    ezUInt32 zero = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_simulationStatsBuffer);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    PerformSimulationStep(step, m_planarStorage, NULL);
+
+    // SimulationStats header followed by StepTelemetry, see simulationCommon.glsl.
+    ezUInt32 stats[4 + 5];
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_simulationStatsBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(stats), stats);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    numSleepingTiles = stats[3];
+    ezUInt64 totalWaterHeight = (static_cast<ezUInt64>(stats[5]) << 32) | stats[4];
+    double volume = totalWaterHeight / s_telemetryWaterScale * settings.cellDistance * settings.cellDistance;
+
+    if(step == 0)
+      referenceVolume = volume;
+    maxVolumeChange = ezMath::Max(maxVolumeChange, ezMath::Abs(volume - referenceVolume));
+  }
+
+  gl::Texture::ResetImageBinding(0);
+  gl::Texture::ResetImageBinding(1);
+  gl::Texture::ResetImageBinding(2);
+  gl::Texture::ResetImageBinding(3);
+  ezResult glResult = gl::Utils::CheckError("GpuFlowBenchmark::CheckSleepingLakeVolume");
+  ReleaseResources();
+  if(glResult == EZ_FAILURE)
+    return EZ_FAILURE;
+
+  ezUInt32 numTilesPerSide = gridResolution / s_simulationTileSize;
+  double relativeVolumeChange = referenceVolume > 0.0 ? maxVolumeChange / referenceVolume : 0.0;
+  printf("%ux%u: %u of %u tiles asleep, %.0f m^3 of water changed by up to %.3g %%\n", gridResolution, gridResolution, numSleepingTiles,
+         numTilesPerSide * numTilesPerSide, referenceVolume, relativeVolumeChange * 100.0);
+  if(referenceVolume <= 0.0 || numSleepingTiles == 0)
+  {
+    ezLog::Error("The lake didn't fall asleep within %u steps.", s_lakeCheckSteps);
+    return EZ_FAILURE;
+  }
+  if(relativeVolumeChange > s_maxLakeVolumeChange)
+  {
+    ezLog::Error("The water volume changed by %.3g %% while the lake fell asleep.", relativeVolumeChange * 100.0);
+    return EZ_FAILURE;
+  }
+  return EZ_SUCCESS;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "gl/ShaderObject.h"
+#include "gl/resources/UniformBuffer.h"
+
+namespace gl
+{
+  class Texture2D;
+}
+
+/// Runs the simulation compute shaders of Terrain (flowActiveTiles.comp, flowUpdate.comp, flowApply.comp) on grids of a given size and
+/// measures them, in any of the storage layouts of simulationStorage.glsl.
+///
+/// Every step is issued exactly as in Terrain::PerformSimulationStep, with all tiles at full rate. A uniform water layer on top of the
+/// lake keeps every tile active, so the numbers describe the dense worst case and don't depend on how far the water spreads. Each pass is
+/// timed with GPU timestamps, the whole run additionally with the wall clock after a glFinish.
+class GpuFlowBenchmark
+{
+public:
+  enum Pass
+  {
+    PASS_ACTIVE_TILES,
+    PASS_FLOW_UPDATE,
+    PASS_FLOW_APPLY,
+    /// Only with planar storage, once per frame.
+    PASS_MERGE_PLANES,
+
+    NUM_PASSES
+  };
+
+  struct Settings
+  {
+    Settings() :
+      numSteps(100),
+      numWarmupSteps(10),
+      randomSeed(231656522),
+      heightScale(300.0f),
+      cellDistance(1.0f),
+      waterHeight(1.0f),
+      simulationStepsPerSecond(60.0f),
+      flowDamping(0.98f),
+      flowAcceleration(10.0f),
+      planarStorage(false),
+      halfPrecisionFlow(false),
+      stepsPerFrame(1)
+    {}
+
+    ezUInt32 numSteps;
+    /// Steps before the measurement, they let the driver finish lazy allocations and shader compilation.
+    ezUInt32 numWarmupSteps;
+    ezUInt32 randomSeed;
+    float heightScale;
+    /// World size of a cell. Kept constant over all grid sizes, so every size runs with the same stability margin.
+    float cellDistance;
+    /// Water added on top of every cell of the generated heightmap.
+    float waterHeight;
+
+    float simulationStepsPerSecond;
+    float flowDamping;
+    float flowAcceleration;
+
+    /// Storage layout, see Terrain::SetPlanarSimulationStorage and Terrain::SetHalfPrecisionFlow.
+    bool planarStorage;
+    bool halfPrecisionFlow;
+    /// The planar storage merges the water back into the terrain data after this many steps, like Terrain does once per frame.
+    ezUInt32 stepsPerFrame;
+  };
+
+  struct Result
+  {
+    ezUInt32 gridResolution;
+    ezUInt32 numSteps;
+    ezTime wallDuration;
+    /// Sum of the GPU time of a pass over all measured steps.
+    ezTime passDurations[NUM_PASSES];
+    /// Active tiles of the last step relative to all tiles.
+    float activeTileFraction;
+    /// EstimateMemoryTrafficPerCell for the settings of the run.
+    double memoryTrafficPerCell;
+
+    double GetStepsPerSecond() const { return numSteps / wallDuration.GetSeconds(); }
+    double GetCellsPerSecond() const { return static_cast<double>(gridResolution) * gridResolution * GetStepsPerSecond(); }
+    double GetNanosecondsPerCell() const { return 1e9 / GetCellsPerSecond(); }
+    /// Based on EstimateMemoryTrafficPerCell, so this is what the passes need at least, not what the caches make of it.
+    double GetBytesPerSecond() const { return memoryTrafficPerCell * GetCellsPerSecond(); }
+  };
+
+  GpuFlowBenchmark();
+  ~GpuFlowBenchmark();
+
+  /// Compiles the shaders for the storage layout of the settings. The shader directory needs to be registered with ezFileSystem beforehand
+  /// and a context must be current.
+  ezResult Init(const Settings& settings);
+
+  /// Creates all resources for a grid of the given size, runs the steps and frees everything again. Fails if the GPU runs out of memory,
+  /// later sizes can still be tried. The storage layout needs to be the one passed to Init.
+  ezResult Run(ezUInt32 gridResolution, const Settings& settings, Result& result);
+
+  /// Lets a lake in a bowl come to rest with steady state detection (see activeTiles.glsl) instead of the benchmark and checks that the
+  /// water volume of the step telemetry stays the same while its tiles fall asleep. Fails if it changes or no tile falls asleep.
+  ezResult CheckSleepingLakeVolume(ezUInt32 gridResolution, const Settings& settings);
+
+  /// Image traffic of a dense step per cell. With the packed layout flowUpdate.comp reads terrain data and outgoing flow and writes the
+  /// flow, flowApply.comp reads both, writes terrain data and the RG16F flow map: 3 * 16 + 3 * flow + 4 bytes. With the planar layout
+  /// the passes only touch the heights they need, 5 * 4 + 3 * flow bytes, plus the merge of 4 + 2 * 16 bytes once per frame. Flow takes
+  /// 16 bytes, 8 with half precision. Halo loads of the 18x18 workgroups are assumed to hit the cache.
+  static double EstimateMemoryTrafficPerCell(const Settings& settings);
+
+  static const char* GetPassName(Pass pass);
+
+private:
+  ezResult CheckGridResolution(ezUInt32 gridResolution) const;
+  /// Returns false if the GPU ran out of memory.
+  /// \param sleepingLake   Creates the resting lake of CheckSleepingLakeVolume with telemetry and steady state detection.
+  bool CreateResources(const Settings& settings, bool sleepingLake);
+  void ReleaseResources();
+  void PerformSimulationStep(ezUInt32 stepIndex, bool mergePlanes, GLuint* timestampQueries);
+
+  gl::ShaderObject m_activeTilesShader;
+  gl::ShaderObject m_updateFlowShader;
+  gl::ShaderObject m_applyFlowShader;
+  gl::ShaderObject m_splitPlanesShader;
+  gl::ShaderObject m_mergePlanesShader;
+  gl::UniformBuffer m_simulationParametersUBO;
+  /// Storage layout the shaders were compiled for.
+  bool m_planarStorage;
+  bool m_halfPrecisionFlow;
+
+  // Resources of the current run.
+
+  ezUInt32 m_gridResolution;
+  gl::Texture2D* m_terrainData;
+  gl::Texture2D* m_waterOutgoingFlow;
+  gl::Texture2D* m_waterFlowMap;
+  /// Only with planar storage.
+  gl::Texture2D* m_terrainHeight;
+  gl::Texture2D* m_waterHeight;
+
+  GLuint m_tileWetBuffer[2];
+  ezUInt32 m_currentTileWetBuffer;
+  GLuint m_activeTileListBuffer;
+  GLuint m_tileRateBuffer;
+  GLuint m_tileActivityBuffer;
+  /// Header of SimulationStats followed by the telemetry of a single step.
+  GLuint m_simulationStatsBuffer;
+  /// Dirty tile flags and list for incremental terrain mips, see terrainMipDirtyTiles.glsl. Never consumed, so every tile is only
+  /// appended once.
+  GLuint m_mipDirtyTileFlagBuffer;
+  GLuint m_mipDirtyTileListBuffer;
+};
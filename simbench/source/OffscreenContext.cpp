@@ -0,0 +1,179 @@
+#include "PCH.h"
+#include "OffscreenContext.h"
+
+#if defined(_WIN32)
+
+OffscreenContext::OffscreenContext() :
+  m_window(NULL),
+  m_deviceContext(NULL),
+  m_renderContext(NULL)
+{
+}
+
+ezResult OffscreenContext::Create()
+{
+  WNDCLASSW windowClass = {};
+  windowClass.lpfnWndProc = DefWindowProcW;
+  windowClass.hInstance = GetModuleHandleW(NULL);
+  windowClass.lpszClassName = L"simbench";
+  RegisterClassW(&windowClass);
+
+  // Never shown, only needed for a device context.
+  m_window = CreateWindowW(windowClass.lpszClassName, L"simbench", WS_OVERLAPPEDWINDOW, 0, 0, 16, 16, NULL, NULL, windowClass.hInstance, NULL);
+  if(m_window == NULL)
+  {
+    ezLog::Error("Failed to create a hidden window.");
+    return EZ_FAILURE;
+  }
+  m_deviceContext = GetDC(m_window);
+
+  PIXELFORMATDESCRIPTOR pfd = {};
+  pfd.nSize = sizeof(PIXELFORMATDESCRIPTOR);
+  pfd.nVersion = 1;
+  pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL;
+  pfd.iPixelType = PFD_TYPE_RGBA;
+  pfd.cColorBits = 24;
+  pfd.iLayerType = PFD_MAIN_PLANE;
+  int pixelFormat = ChoosePixelFormat(m_deviceContext, &pfd);
+  if(pixelFormat == 0 || !SetPixelFormat(m_deviceContext, pixelFormat, &pfd))
+  {
+    ezLog::Error("Failed to set a pixel format for the hidden window.");
+    return EZ_FAILURE;
+  }
+
+  // Like RenderWindowGL, the drivers return a compatibility context of the highest supported version.
+  m_renderContext = wglCreateContext(m_deviceContext);
+  if(m_renderContext == NULL || !wglMakeCurrent(m_deviceContext, m_renderContext))
+  {
+    ezLog::Error("Failed to create an OpenGL context.");
+    return EZ_FAILURE;
+  }
+
+  return LoadFunctions();
+}
+
+void OffscreenContext::Destroy()
+{
+  if(m_renderContext != NULL)
+  {
+    wglMakeCurrent(NULL, NULL);
+    wglDeleteContext(m_renderContext);
+    m_renderContext = NULL;
+  }
+  if(m_window != NULL)
+  {
+    ReleaseDC(m_window, m_deviceContext);
+    DestroyWindow(m_window);
+    m_window = NULL;
+    m_deviceContext = NULL;
+  }
+}
+
+#else
+
+OffscreenContext::OffscreenContext() :
+  m_display(EGL_NO_DISPLAY),
+  m_context(EGL_NO_CONTEXT)
+{
+}
+
+ezResult OffscreenContext::Create()
+{
+  // Mesa's surfaceless platform needs no display server. Other implementations may only provide the default display.
+  m_display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if(m_display != EGL_NO_DISPLAY && !eglInitialize(m_display, NULL, NULL))
+    m_display = EGL_NO_DISPLAY;
+  if(m_display == EGL_NO_DISPLAY)
+  {
+    m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if(m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, NULL, NULL))
+    {
+      ezLog::Error("Failed to initialize EGL.");
+      m_display = EGL_NO_DISPLAY;
+      return EZ_FAILURE;
+    }
+  }
+
+  const EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+  EGLConfig config;
+  EGLint numConfigs = 0;
+  if(!eglChooseConfig(m_display, configAttributes, &config, 1, &numConfigs) || numConfigs == 0 || !eglBindAPI(EGL_OPENGL_API))
+  {
+    ezLog::Error("EGL provides no desktop OpenGL configuration.");
+    return EZ_FAILURE;
+  }
+
+  const EGLint contextAttributes[] = { EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 3,
+                                       EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+  m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, contextAttributes);
+  if(m_context == EGL_NO_CONTEXT)
+  {
+    ezLog::Error("Failed to create an OpenGL 4.3 core context.");
+    return EZ_FAILURE;
+  }
+
+  // Compute only, no default framebuffer needed (EGL_KHR_surfaceless_context).
+  if(!eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, m_context))
+  {
+    ezLog::Error("Failed to make the context current without a surface.");
+    return EZ_FAILURE;
+  }
+
+  return LoadFunctions();
+}
+
+void OffscreenContext::Destroy()
+{
+  if(m_display == EGL_NO_DISPLAY)
+    return;
+
+  eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if(m_context != EGL_NO_CONTEXT)
+    eglDestroyContext(m_display, m_context);
+  eglTerminate(m_display);
+  m_context = EGL_NO_CONTEXT;
+  m_display = EGL_NO_DISPLAY;
+}
+
+#endif
+
+OffscreenContext::~OffscreenContext()
+{
+  Destroy();
+}
+
+ezResult OffscreenContext::LoadFunctions()
+{
+  glewExperimental = GL_TRUE;
+  GLenum glewResult = glewInit();
+#if defined(GLEW_ERROR_NO_GLX_DISPLAY)
+  // GLEW built for GLX loads all OpenGL functions before it looks for the X display an EGL context doesn't have.
+  if(glewResult == GLEW_ERROR_NO_GLX_DISPLAY)
+    glewResult = GLEW_OK;
+#endif
+  if(glewResult != GLEW_OK)
+  {
+    ezLog::Error("glewInit failed: %s", reinterpret_cast<const char*>(glewGetErrorString(glewResult)));
+    return EZ_FAILURE;
+  }
+  // glewInit queries extensions the old way, which is an error in core contexts.
+  glGetError();
+
+  if(!GLEW_VERSION_4_3)
+  {
+    ezLog::Error("OpenGL 4.3 is not supported by \"%s\" (%s).", GetRendererName(), GetVersionName());
+    return EZ_FAILURE;
+  }
+
+  return EZ_SUCCESS;
+}
+
+const char* OffscreenContext::GetRendererName() const
+{
+  return reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+}
+
+const char* OffscreenContext::GetVersionName() const
+{
+  return reinterpret_cast<const char*>(glGetString(GL_VERSION));
+}
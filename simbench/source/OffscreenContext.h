@@ -0,0 +1,40 @@
+#pragma once
+
+#if defined(_WIN32)
+  #include <Windows.h>
+#else
+  #include <EGL/egl.h>
+  #include <EGL/eglext.h>
+#endif
+
+/// OpenGL 4.3 context without any visible window, for running the compute shaders on machines without a display.
+///
+/// Windows uses a hidden window with WGL. Everywhere else a surfaceless EGL context is created, preferably on Mesa's surfaceless platform,
+/// which works with llvmpipe even without a display server or GPU. Other EGL implementations fall back to the default display.
+class OffscreenContext
+{
+public:
+  OffscreenContext();
+  /// Destroys the context if it was created.
+  ~OffscreenContext();
+
+  /// Creates the context, makes it current on the calling thread and loads all functions with GLEW.
+  ezResult Create();
+  void Destroy();
+
+  /// Renderer and version string of the driver, valid after Create.
+  const char* GetRendererName() const;
+  const char* GetVersionName() const;
+
+private:
+  ezResult LoadFunctions();
+
+#if defined(_WIN32)
+  HWND m_window;
+  HDC m_deviceContext;
+  HGLRC m_renderContext;
+#else
+  EGLDisplay m_display;
+  EGLContext m_context;
+#endif
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+// Same foundation headers as the terrainwatersim PCH. The graphics context is created by OffscreenContext instead of a window.
+
+#include <memory>
+
+#include <Foundation/Basics.h>
+
+#include <Foundation/Logging/Log.h>
+#include <Foundation/Time/Time.h>
+#include <Foundation/Strings/String.h>
+#include <Foundation/Configuration/CVar.h>
+#include <Foundation/Utilities/ConversionUtils.h>
+
+#include <Foundation/Math/Declarations.h>
+#include <Foundation/Math/Mat4.h>
+#include <Foundation/Math/Vec2.h>
+#include <Foundation/Math/Vec3.h>
+#include <Foundation/Math/Color.h>
+#include <Foundation/Math/Size.h>
+
+#include "gl/gl.h"
@@ -0,0 +1,415 @@
+#include "PCH.h"
+
+#include "OffscreenContext.h"
+#include "GpuFlowBenchmark.h"
+
+#include <Foundation/Configuration/Startup.h>
+#include <Foundation/Logging/ConsoleWriter.h>
+#include <Foundation/IO/OSFile.h>
+#include <Foundation/IO/FileSystem/FileSystem.h>
+#include <Foundation/IO/FileSystem/DataDirTypeFolder.h>
+
+#include <cstdio>
+
+// Benchmark for the GPU water simulation. Runs the compute shaders of the application in an offscreen context, so it also works on
+// machines without a display, e.g. with Mesa's llvmpipe on a headless Linux server.
+
+namespace
+{
+  const ezUInt32 s_maxNumSizes = 16;
+
+  /// Storage layouts of simulationStorage.glsl, the first one is the reference for comparisons.
+  struct StorageLayout
+  {
+    const char* szName;
+    bool planarStorage;
+    bool halfPrecisionFlow;
+  };
+  const StorageLayout s_storageLayouts[] = { { "packed", false, false }, { "packed16", false, true }, { "planar", true, false }, { "planar16", true, true } };
+  const ezUInt32 s_numStorageLayouts = EZ_ARRAY_SIZE(s_storageLayouts);
+
+  struct Settings
+  {
+    Settings() :
+      numSizes(0),
+      numStorageLayouts(1),
+      szShaderDir(NULL),
+      szJsonFile(NULL),
+      szLabel(""),
+      sleepCheck(false)
+    {}
+
+    ezUInt32 gridResolutions[s_maxNumSizes];
+    ezUInt32 numSizes;
+    /// Indices into s_storageLayouts.
+    ezUInt32 storageLayouts[s_numStorageLayouts];
+    ezUInt32 numStorageLayouts;
+    GpuFlowBenchmark::Settings benchmark;
+
+    /// Defaults to the shader folder of terrainwatersim relative to the binary, like Application::SetupFileSystem.
+    const char* szShaderDir;
+    const char* szJsonFile;
+    /// Free text stored in the JSON file to tell runs apart, e.g. the machine name.
+    const char* szLabel;
+    /// Runs GpuFlowBenchmark::CheckSleepingLakeVolume instead of the benchmark.
+    bool sleepCheck;
+  };
+
+  void PrintUsage()
+  {
+    printf("Usage: simbench [options]\n"
+           "  --sizes <list>           Comma separated grid resolutions, multiples of 16 (default 256,512,1024,2048,4096,8192)\n"
+           "  --steps <count>          Measured simulation steps per size (default 100)\n"
+           "  --warmup <count>         Steps before the measurement (default 10)\n"
+           "  --seed <value>           Random seed for the heightmap (default 231656522)\n"
+           "  --water <meters>         Water added on top of every cell, keeps all tiles active (default 1)\n"
+           "  --storage <layout>       packed, packed16, planar, planar16 or all to compare them (default packed),\n"
+           "                           16 stores the outgoing flow with half precision\n"
+           "  --stepsperframe <count>  Steps between the merges of the planar layout (default 1)\n"
+           "  --shaderdir <path>       Folder with the simulation shaders (default ../../../terrainwatersim/shader next to the binary)\n"
+           "  --json <file>            Write the results to a JSON file\n"
+           "  --label <text>           Stored in the JSON file to tell runs apart\n"
+           "  --sleepcheck <0|1>       Check that the telemetry volume of a lake stays the same while its tiles fall asleep (default 0)\n");
+  }
+
+  ezResult ParseUInt(const char* szValue, ezUInt32& out)
+  {
+    ezInt32 value = 0;
+    if(ezConversionUtils::StringToInt(szValue, value) == EZ_FAILURE || value < 0)
+      return EZ_FAILURE;
+    out = static_cast<ezUInt32>(value);
+    return EZ_SUCCESS;
+  }
+
+  ezResult ParseFloat(const char* szValue, float& out)
+  {
+    double value = 0.0;
+    if(ezConversionUtils::StringToFloat(szValue, value) == EZ_FAILURE)
+      return EZ_FAILURE;
+    out = static_cast<float>(value);
+    return EZ_SUCCESS;
+  }
+
+  ezResult ParseSizes(const char* szValue, Settings& settings)
+  {
+    settings.numSizes = 0;
+    ezStringBuilder size;
+    for(const char* szChar = szValue; ; ++szChar)
+    {
+      if(*szChar != ',' && *szChar != '\0')
+      {
+        char digit[2] = { *szChar, '\0' };
+        size.Append(digit);
+        continue;
+      }
+      if(settings.numSizes == s_maxNumSizes || ParseUInt(size.GetData(), settings.gridResolutions[settings.numSizes]) == EZ_FAILURE)
+        return EZ_FAILURE;
+      ++settings.numSizes;
+      size.Clear();
+      if(*szChar == '\0')
+        return EZ_SUCCESS;
+    }
+  }
+
+  ezResult ParseStorage(const char* szValue, Settings& settings)
+  {
+    settings.numStorageLayouts = 0;
+    for(ezUInt32 i = 0; i < s_numStorageLayouts; ++i)
+    {
+      if(ezStringUtils::IsEqual(szValue, "all") || ezStringUtils::IsEqual(szValue, s_storageLayouts[i].szName))
+        settings.storageLayouts[settings.numStorageLayouts++] = i;
+    }
+    return settings.numStorageLayouts > 0 ? EZ_SUCCESS : EZ_FAILURE;
+  }
+
+  ezResult ParseCommandLine(int argc, char** argv, Settings& settings)
+  {
+    settings.storageLayouts[0] = 0;
+
+    const ezUInt32 defaultSizes[] = { 256, 512, 1024, 2048, 4096, 8192 };
+    for(ezUInt32 i = 0; i < EZ_ARRAY_SIZE(defaultSizes); ++i)
+      settings.gridResolutions[i] = defaultSizes[i];
+    settings.numSizes = EZ_ARRAY_SIZE(defaultSizes);
+
+    for(int i = 1; i < argc; ++i)
+    {
+      ezStringBuilder option(argv[i]);
+      if(option.IsEqual("--help"))
+        return EZ_FAILURE;
+      if(i + 1 >= argc)
+      {
+        ezLog::Error("Missing value for option \"%s\".", option.GetData());
+        return EZ_FAILURE;
+      }
+      const char* szValue = argv[++i];
+
+      ezResult result = EZ_FAILURE;
+      if(option.IsEqual("--sizes"))
+        result = ParseSizes(szValue, settings);
+      else if(option.IsEqual("--steps"))
+        result = ParseUInt(szValue, settings.benchmark.numSteps);
+      else if(option.IsEqual("--warmup"))
+        result = ParseUInt(szValue, settings.benchmark.numWarmupSteps);
+      else if(option.IsEqual("--seed"))
+        result = ParseUInt(szValue, settings.benchmark.randomSeed);
+      else if(option.IsEqual("--water"))
+        result = ParseFloat(szValue, settings.benchmark.waterHeight);
+      else if(option.IsEqual("--storage"))
+        result = ParseStorage(szValue, settings);
+      else if(option.IsEqual("--stepsperframe"))
+        result = ParseUInt(szValue, settings.benchmark.stepsPerFrame);
+      else if(option.IsEqual("--sleepcheck"))
+      {
+        ezUInt32 sleepCheck = 0;
+        result = ParseUInt(szValue, sleepCheck);
+        settings.sleepCheck = sleepCheck != 0;
+      }
+      else if(option.IsEqual("--shaderdir") || option.IsEqual("--json") || option.IsEqual("--label"))
+      {
+        const char** targets[] = { &settings.szShaderDir, &settings.szJsonFile, &settings.szLabel };
+        const char* names[] = { "--shaderdir", "--json", "--label" };
+        for(ezUInt32 name = 0; name < EZ_ARRAY_SIZE(names); ++name)
+        {
+          if(option.IsEqual(names[name]))
+            *targets[name] = szValue;
+        }
+        result = EZ_SUCCESS;
+      }
+      else
+        ezLog::Error("Unknown option \"%s\".", option.GetData());
+
+      if(result == EZ_FAILURE)
+      {
+        ezLog::Error("Invalid value \"%s\" for option \"%s\".", szValue, option.GetData());
+        return EZ_FAILURE;
+      }
+    }
+
+    if(settings.benchmark.numSteps == 0)
+    {
+      ezLog::Error("At least one step needs to be measured.");
+      return EZ_FAILURE;
+    }
+    if(settings.benchmark.stepsPerFrame == 0)
+    {
+      ezLog::Error("A frame needs at least one step.");
+      return EZ_FAILURE;
+    }
+
+    return EZ_SUCCESS;
+  }
+
+  void SetupFileSystem(const Settings& settings)
+  {
+    ezFileSystem::RegisterDataDirectoryFactory(ezDataDirectory::FolderType::Factory);
+
+    ezStringBuilder shaderDir;
+    if(settings.szShaderDir)
+      shaderDir = settings.szShaderDir;
+    else
+    {
+      shaderDir = ezOSFile::GetApplicationDirectory();
+      shaderDir.AppendPath("..", "..", "..", "terrainwatersim");
+      shaderDir.AppendPath("shader");
+    }
+    ezFileSystem::AddDataDirectory(shaderDir.GetData(), ezFileSystem::ReadOnly, "graphics", "");
+  }
+
+  void AppendJsonString(ezStringBuilder& json, const char* szString)
+  {
+    json.Append("\"");
+    for(const char* szChar = szString; *szChar; ++szChar)
+    {
+      // Appended as strings, single chars would be taken as code points.
+      char character[3] = { '\\', *szChar, '\0' };
+      json.Append(*szChar == '"' || *szChar == '\\' ? character : character + 1);
+    }
+    json.Append("\"");
+  }
+
+  /// A result with the index of its storage layout.
+  struct LayoutResult
+  {
+    ezUInt32 storageLayout;
+    GpuFlowBenchmark::Result result;
+  };
+
+  ezResult WriteJson(const Settings& settings, const OffscreenContext& context, const ezDynamicArray<LayoutResult>& results)
+  {
+    ezStringBuilder json;
+    json.Append("{\n  \"label\": ");
+    AppendJsonString(json, settings.szLabel);
+    json.Append(",\n  \"renderer\": ");
+    AppendJsonString(json, context.GetRendererName());
+    json.Append(",\n  \"version\": ");
+    AppendJsonString(json, context.GetVersionName());
+    json.AppendFormat(",\n  \"steps\": %u,\n  \"warmupSteps\": %u,\n  \"seed\": %u,\n  \"waterHeight\": %g,\n  \"stepsPerFrame\": %u,\n  \"results\": [",
+                      settings.benchmark.numSteps, settings.benchmark.numWarmupSteps, settings.benchmark.randomSeed, settings.benchmark.waterHeight,
+                      settings.benchmark.stepsPerFrame);
+
+    for(ezUInt32 i = 0; i < results.GetCount(); ++i)
+    {
+      const GpuFlowBenchmark::Result& result = results[i].result;
+      json.AppendFormat("%s\n    { \"storage\": \"%s\", \"gridResolution\": %u, \"bytesPerCellStep\": %g, \"wallMs\": %.6f, \"stepsPerSecond\": %.6f, "
+                        "\"cellsPerSecond\": %.6e, \"nsPerCell\": %.6f, \"GBPerSecond\": %.6f, \"activeTileFraction\": %.6f, \"passMsPerStep\": {",
+                        i == 0 ? "" : ",", s_storageLayouts[results[i].storageLayout].szName, result.gridResolution, result.memoryTrafficPerCell,
+                        result.wallDuration.GetMilliseconds(), result.GetStepsPerSecond(), result.GetCellsPerSecond(),
+                        result.GetNanosecondsPerCell(), result.GetBytesPerSecond() * 1e-9, result.activeTileFraction);
+      for(ezUInt32 pass = 0; pass < GpuFlowBenchmark::NUM_PASSES; ++pass)
+      {
+        json.AppendFormat("%s \"%s\": %.6f", pass == 0 ? "" : ",", GpuFlowBenchmark::GetPassName(static_cast<GpuFlowBenchmark::Pass>(pass)),
+                          result.passDurations[pass].GetMilliseconds() / result.numSteps);
+      }
+      json.Append(" } }");
+    }
+    json.Append("\n  ]\n}\n");
+
+    ezOSFile file;
+    if(file.Open(settings.szJsonFile, ezFileMode::Write) == EZ_FAILURE)
+    {
+      ezLog::Error("Failed to open \"%s\" for writing.", settings.szJsonFile);
+      return EZ_FAILURE;
+    }
+    file.Write(json.GetData(), json.GetElementCount());
+    file.Close();
+    return EZ_SUCCESS;
+  }
+
+  /// Speedup of every layout over the first one, per grid size.
+  void PrintStorageComparison(const Settings& settings, const ezDynamicArray<LayoutResult>& results)
+  {
+    printf("\nRelative to %s storage\n%10s %10s %12s %12s\n", s_storageLayouts[settings.storageLayouts[0]].szName, "grid", "storage", "traffic",
+           "steps/s");
+    for(ezUInt32 i = 0; i < results.GetCount(); ++i)
+    {
+      // Results of the first layout come first, sizes that failed for it have nothing to compare to.
+      const GpuFlowBenchmark::Result* reference = NULL;
+      for(ezUInt32 j = 0; j < results.GetCount() && results[j].storageLayout == settings.storageLayouts[0]; ++j)
+      {
+        if(results[j].result.gridResolution == results[i].result.gridResolution)
+          reference = &results[j].result;
+      }
+      if(reference == NULL || results[i].storageLayout == settings.storageLayouts[0])
+        continue;
+
+      ezStringBuilder grid;
+      grid.Format("%ux%u", results[i].result.gridResolution, results[i].result.gridResolution);
+      printf("%10s %10s %11.1f%% %11.1f%%\n", grid.GetData(), s_storageLayouts[results[i].storageLayout].szName,
+             (results[i].result.memoryTrafficPerCell / reference->memoryTrafficPerCell - 1.0) * 100.0,
+             (results[i].result.GetStepsPerSecond() / reference->GetStepsPerSecond() - 1.0) * 100.0);
+    }
+  }
+
+  ezResult RunBenchmark(const Settings& settings)
+  {
+    OffscreenContext context;
+    if(context.Create() == EZ_FAILURE)
+      return EZ_FAILURE;
+    printf("%s, %s\n", context.GetRendererName(), context.GetVersionName());
+
+    SetupFileSystem(settings);
+
+    ezDynamicArray<LayoutResult> results;
+    for(ezUInt32 layout = 0; layout < settings.numStorageLayouts; ++layout)
+    {
+      const StorageLayout& storageLayout = s_storageLayouts[settings.storageLayouts[layout]];
+      GpuFlowBenchmark::Settings benchmarkSettings = settings.benchmark;
+      benchmarkSettings.planarStorage = storageLayout.planarStorage;
+      benchmarkSettings.halfPrecisionFlow = storageLayout.halfPrecisionFlow;
+
+      GpuFlowBenchmark benchmark;
+      if(benchmark.Init(benchmarkSettings) == EZ_FAILURE)
+        return EZ_FAILURE;
+
+      printf("\n%s storage, %g bytes per cell and step\n", storageLayout.szName, GpuFlowBenchmark::EstimateMemoryTrafficPerCell(benchmarkSettings));
+      printf("%10s %12s %12s %10s %10s", "grid", "steps/s", "Mcells/s", "ns/cell", "GB/s");
+      for(ezUInt32 pass = 0; pass < GpuFlowBenchmark::NUM_PASSES; ++pass)
+        printf(" %10s", GpuFlowBenchmark::GetPassName(static_cast<GpuFlowBenchmark::Pass>(pass)));
+      printf("\n");
+
+      for(ezUInt32 i = 0; i < settings.numSizes; ++i)
+      {
+        LayoutResult layoutResult;
+        layoutResult.storageLayout = settings.storageLayouts[layout];
+        GpuFlowBenchmark::Result& result = layoutResult.result;
+        if(benchmark.Run(settings.gridResolutions[i], benchmarkSettings, result) == EZ_FAILURE)
+          continue;
+        results.PushBack(layoutResult);
+
+        ezStringBuilder grid;
+        grid.Format("%ux%u", result.gridResolution, result.gridResolution);
+        printf("%10s %12.2f %12.2f %10.3f %10.2f", grid.GetData(), result.GetStepsPerSecond(), result.GetCellsPerSecond() * 1e-6,
+               result.GetNanosecondsPerCell(), result.GetBytesPerSecond() * 1e-9);
+        // GPU time per step and pass
+        for(ezUInt32 pass = 0; pass < GpuFlowBenchmark::NUM_PASSES; ++pass)
+          printf(" %8.3fms", result.passDurations[pass].GetMilliseconds() / result.numSteps);
+        printf("\n");
+
+        if(result.activeTileFraction < 1.0f)
+          ezLog::Warning("Only %.1f %% of the tiles were active in the last step.", result.activeTileFraction * 100.0f);
+      }
+    }
+
+    if(settings.numStorageLayouts > 1)
+      PrintStorageComparison(settings, results);
+
+    if(settings.szJsonFile)
+      return WriteJson(settings, context, results);
+    return EZ_SUCCESS;
+  }
+
+  ezResult RunSleepCheck(const Settings& settings)
+  {
+    OffscreenContext context;
+    if(context.Create() == EZ_FAILURE)
+      return EZ_FAILURE;
+    printf("%s, %s\n", context.GetRendererName(), context.GetVersionName());
+
+    SetupFileSystem(settings);
+
+    // Unlike the benchmark every size has to pass, running out of memory included.
+    ezResult result = EZ_SUCCESS;
+    for(ezUInt32 layout = 0; layout < settings.numStorageLayouts; ++layout)
+    {
+      const StorageLayout& storageLayout = s_storageLayouts[settings.storageLayouts[layout]];
+      GpuFlowBenchmark::Settings benchmarkSettings = settings.benchmark;
+      benchmarkSettings.planarStorage = storageLayout.planarStorage;
+      benchmarkSettings.halfPrecisionFlow = storageLayout.halfPrecisionFlow;
+
+      GpuFlowBenchmark benchmark;
+      if(benchmark.Init(benchmarkSettings) == EZ_FAILURE)
+        return EZ_FAILURE;
+
+      printf("\n%s storage\n", storageLayout.szName);
+      for(ezUInt32 i = 0; i < settings.numSizes; ++i)
+      {
+        if(benchmark.CheckSleepingLakeVolume(settings.gridResolutions[i], benchmarkSettings) == EZ_FAILURE)
+          result = EZ_FAILURE;
+      }
+    }
+    return result;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  ezStartup::StartupCore();
+  ezGlobalLog::AddLogWriter(ezLogWriter::Console::LogMessageHandler);
+
+  int exitCode = 0;
+  Settings settings;
+  if(ParseCommandLine(argc, argv, settings) == EZ_SUCCESS)
+  {
+    if((settings.sleepCheck ? RunSleepCheck(settings) : RunBenchmark(settings)) == EZ_FAILURE)
+      exitCode = 1;
+  }
+  else
+  {
+    PrintUsage();
+    exitCode = 1;
+  }
+
+  ezGlobalLog::RemoveLogWriter(ezLogWriter::Console::LogMessageHandler);
+  ezStartup::ShutdownCore();
+  return exitCode;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Same foundation headers as the terrainwatersim PCH, but without any graphics dependencies.
+
+#include <memory>
+
+#include <Foundation/Basics.h>
+
+#include <Foundation/Logging/Log.h>
+#include <Foundation/Time/Time.h>
+#include <Foundation/Strings/String.h>
+#include <Foundation/Utilities/ConversionUtils.h>
+
+#include <Foundation/Math/Declarations.h>
+#include <Foundation/Math/Vec2.h>
+#include <Foundation/Math/Vec3.h>
+#include <Foundation/Math/Color.h>
@@ -0,0 +1,144 @@
+#include "PCH.h"
+#include "DistributedFlowSolver.h"
+
+ezUInt32 DistributedFlowSolver::GetNumRanksPerSide(ezUInt32 numRanks)
+{
+  ezUInt32 numRanksPerSide = static_cast<ezUInt32>(ezMath::Sqrt(static_cast<float>(numRanks)) + 0.5f);
+  return numRanksPerSide * numRanksPerSide == numRanks ? numRanksPerSide : 0;
+}
+
+ezResult DistributedFlowSolver::ValidateDecomposition(ezUInt32 gridResolution, ezUInt32 numRanks)
+{
+  ezUInt32 numRanksPerSide = GetNumRanksPerSide(numRanks);
+  if(numRanksPerSide == 0)
+  {
+    ezLog::Error("Number of processes needs to be a square number, got %u.", numRanks);
+    return EZ_FAILURE;
+  }
+  if(gridResolution % numRanksPerSide != 0 || gridResolution / numRanksPerSide < 2)
+  {
+    ezLog::Error("Grid resolution %u can't be split evenly into %ux%u sub-domains.", gridResolution, numRanksPerSide, numRanksPerSide);
+    return EZ_FAILURE;
+  }
+  return EZ_SUCCESS;
+}
+
+DistributedFlowSolver::DistributedFlowSolver(HaloTransport& transport, ezUInt32 gridResolution) :
+  m_transport(transport),
+  m_solver(gridResolution / GetNumRanksPerSide(transport.GetNumRanks())),
+  m_numSubDomainsPerSide(GetNumRanksPerSide(transport.GetNumRanks()))
+{
+  EZ_ASSERT(ValidateDecomposition(gridResolution, transport.GetNumRanks()) == EZ_SUCCESS, "Invalid domain decomposition.");
+
+  m_subDomainX = transport.GetRank() % m_numSubDomainsPerSide;
+  m_subDomainY = transport.GetRank() / m_numSubDomainsPerSide;
+
+  for(ezUInt32 side = 0; side < NUM_SIDES; ++side)
+  {
+    m_sendBuffers[side].SetCount(m_solver.GetGridResolution());
+    m_receiveBuffers[side].SetCount(m_solver.GetGridResolution());
+  }
+}
+
+ezResult DistributedFlowSolver::SetState(const ezColor* terrainData)
+{
+  m_solver.SetState(terrainData, NULL);
+
+  FlowGridView& grid = m_solver.GetGridView();
+  float* terrainPlanes[NUM_SIDES] = { grid.terrain, grid.terrain, grid.terrain, grid.terrain };
+  if(ExchangeHalo(terrainPlanes) == EZ_FAILURE)
+    return EZ_FAILURE;
+  float* waterPlanes[NUM_SIDES] = { grid.water, grid.water, grid.water, grid.water };
+  return ExchangeHalo(waterPlanes);
+}
+
+ezResult DistributedFlowSolver::PerformSimulationStep()
+{
+  FlowGridView& grid = m_solver.GetGridView();
+
+  // Flow update reads the water of all neighbours.
+  float* waterPlanes[NUM_SIDES] = { grid.water, grid.water, grid.water, grid.water };
+  if(ExchangeHalo(waterPlanes) == EZ_FAILURE)
+    return EZ_FAILURE;
+  m_solver.PerformFlowUpdatePass();
+
+  // Flow apply reads the flow of all neighbours towards the own cells.
+  float* flowPlanes[NUM_SIDES] = { grid.flow[SIDE_POS_X], grid.flow[SIDE_NEG_X], grid.flow[SIDE_POS_Y], grid.flow[SIDE_NEG_Y] };
+  if(ExchangeHalo(flowPlanes) == EZ_FAILURE)
+    return EZ_FAILURE;
+  m_solver.PerformFlowApplyPass();
+  return EZ_SUCCESS;
+}
+
+ezResult DistributedFlowSolver::PerformSimulationSteps(ezUInt32 numSteps)
+{
+  for(ezUInt32 step = 0; step < numSteps; ++step)
+  {
+    if(PerformSimulationStep() == EZ_FAILURE)
+      return EZ_FAILURE;
+  }
+  return EZ_SUCCESS;
+}
+
+ezResult DistributedFlowSolver::ExchangeHalo(float* const* sendPlanes)
+{
+  ezInt32 size = static_cast<ezInt32>(m_solver.GetGridResolution());
+
+  // Edge cells of each side, the border cells are one step further out.
+  const ezInt32 edgeStartX[NUM_SIDES] = { size - 1, 0, 0, 0 };
+  const ezInt32 edgeStartY[NUM_SIDES] = { 0, 0, size - 1, 0 };
+  const ezInt32 normalX[NUM_SIDES] = { 1, -1, 0, 0 };
+  const ezInt32 normalY[NUM_SIDES] = { 0, 0, 1, -1 };
+  const ezInt32 oppositeSide[NUM_SIDES] = { SIDE_NEG_X, SIDE_POS_X, SIDE_NEG_Y, SIDE_POS_Y };
+  ezInt32 edgeStep[NUM_SIDES] = { m_solver.GetGridView().rowPitch, m_solver.GetGridView().rowPitch, 1, 1 };
+
+  HaloMessage messages[NUM_SIDES];
+  ezUInt32 messageSides[NUM_SIDES];
+  ezUInt32 numMessages = 0;
+  for(ezUInt32 side = 0; side < NUM_SIDES; ++side)
+  {
+    // Sides at the edge of the whole grid keep their zero border.
+    ezInt32 neighbourX = static_cast<ezInt32>(m_subDomainX) + normalX[side];
+    ezInt32 neighbourY = static_cast<ezInt32>(m_subDomainY) + normalY[side];
+    if(neighbourX < 0 || neighbourY < 0 || neighbourX >= static_cast<ezInt32>(m_numSubDomainsPerSide) ||
+       neighbourY >= static_cast<ezInt32>(m_numSubDomainsPerSide))
+      continue;
+
+    float* sendBuffer = static_cast<ezArrayPtr<float>>(m_sendBuffers[side]).GetPtr();
+    ezInt32 edgeIndex = m_solver.GetCellIndex(edgeStartX[side], edgeStartY[side]);
+    for(ezInt32 i = 0; i < size; ++i)
+      sendBuffer[i] = sendPlanes[side][edgeIndex + i * edgeStep[side]];
+
+    messages[numMessages].rank = neighbourX + neighbourY * m_numSubDomainsPerSide;
+    messages[numMessages].sendData = sendBuffer;
+    messages[numMessages].receiveData = static_cast<ezArrayPtr<float>>(m_receiveBuffers[side]).GetPtr();
+    messages[numMessages].numFloats = size;
+    messageSides[numMessages] = side;
+    ++numMessages;
+  }
+
+  if(m_transport.ExchangeHalos(messages, numMessages) == EZ_FAILURE)
+    return EZ_FAILURE;
+
+  for(ezUInt32 i = 0; i < numMessages; ++i)
+  {
+    ezUInt32 side = messageSides[i];
+    float* targetPlane = sendPlanes[oppositeSide[side]];
+    ezInt32 borderIndex = m_solver.GetCellIndex(edgeStartX[side] + normalX[side], edgeStartY[side] + normalY[side]);
+    for(ezInt32 cell = 0; cell < size; ++cell)
+      targetPlane[borderIndex + cell * edgeStep[side]] = messages[i].receiveData[cell];
+  }
+  return EZ_SUCCESS;
+}
+
+ezResult DistributedFlowSolver::ComputeTotalWater(double& totalWater)
+{
+  const FlowGridView& grid = m_solver.GetGridView();
+  double localWater = 0.0;
+  for(ezUInt32 y = 0; y < m_solver.GetGridResolution(); ++y)
+  {
+    for(ezUInt32 x = 0; x < m_solver.GetGridResolution(); ++x)
+      localWater += grid.water[m_solver.GetCellIndex(x, y)];
+  }
+  return m_transport.AllReduceSum(localWater, totalWater);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "HaloTransport.h"
+#include "simulation/CpuFlowSolver.h"
+
+/// Virtual pipe model on a grid that is split over several processes.
+///
+/// The ranks form a square of numRanksPerSide² sub-domains. Every rank simulates its own sub-domain with a CpuFlowSolver whose border
+/// holds the edge cells of the neighbouring sub-domains. Each step exchanges water height before the flow update and the flow towards
+/// the neighbours before the flow apply pass. Given the same state, e.g. from TerrainGenerator::CreateHeightmapSectionFromNoise, the
+/// result is bitwise identical to a single CpuFlowSolver on the whole grid, see simtool's --verify.
+///
+/// Collective operations fail if the transport lost the connection to another rank.
+class DistributedFlowSolver
+{
+public:
+  /// Checks whether the grid can be split evenly for the given number of ranks.
+  static ezResult ValidateDecomposition(ezUInt32 gridResolution, ezUInt32 numRanks);
+
+  /// Number of sub-domains per side, 0 if numRanks is not a square number.
+  static ezUInt32 GetNumRanksPerSide(ezUInt32 numRanks);
+
+  /// The transport needs to be connected. Grid and rank count need to pass ValidateDecomposition.
+  DistributedFlowSolver(HaloTransport& transport, ezUInt32 gridResolution);
+
+  CpuFlowSolver& GetLocalSolver() { return m_solver; }
+
+  /// Position of the first cell of the own sub-domain in the whole grid.
+  ezUInt32 GetSubDomainOriginX() const { return m_subDomainX * m_solver.GetGridResolution(); }
+  ezUInt32 GetSubDomainOriginY() const { return m_subDomainY * m_solver.GetGridResolution(); }
+
+  /// Sets the state of the own sub-domain and exchanges it with the neighbours. Collective, see CpuFlowSolver::SetState.
+  ezResult SetState(const ezColor* terrainData);
+
+  /// Collective, all ranks need to perform the same number of steps.
+  ezResult PerformSimulationStep();
+  ezResult PerformSimulationSteps(ezUInt32 numSteps);
+
+  /// Sum of water heights over the whole grid. Collective.
+  ezResult ComputeTotalWater(double& totalWater);
+
+private:
+  /// Same order as FlowGridView::FlowDirection, the flow leaving the sub-domain on a side goes in the direction of the same index.
+  enum Side
+  {
+    SIDE_POS_X,
+    SIDE_NEG_X,
+    SIDE_POS_Y,
+    SIDE_NEG_Y,
+
+    NUM_SIDES
+  };
+
+  /// Sends the edge cells of sendPlanes[side] to the neighbour on each side. What arrives from the neighbour on a side is the edge of
+  /// its plane for the opposite side, so it is written to the border of sendPlanes[opposite side].
+  ezResult ExchangeHalo(float* const* sendPlanes);
+
+  HaloTransport& m_transport;
+  CpuFlowSolver m_solver;
+
+  ezUInt32 m_numSubDomainsPerSide;
+  ezUInt32 m_subDomainX;
+  ezUInt32 m_subDomainY;
+
+  ezDynamicArray<float> m_sendBuffers[NUM_SIDES];
+  ezDynamicArray<float> m_receiveBuffers[NUM_SIDES];
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+/// A message that is sent to a rank while a message of the same size is received from it.
+struct HaloMessage
+{
+  ezUInt32 rank;
+  const float* sendData;
+  float* receiveData;
+  ezUInt32 numFloats;
+};
+
+/// Communication between the processes of a distributed simulation.
+///
+/// Every process has a rank between 0 and GetNumRanks() - 1. All operations are collective in the sense that every rank that is
+/// addressed by a message has to take part in the same exchange, otherwise processes wait forever.
+/// Operations fail if the connection to another rank is lost. There is no way to recover from that, the process should stop.
+class HaloTransport
+{
+public:
+  HaloTransport(ezUInt32 rank, ezUInt32 numRanks) : m_rank(rank), m_numRanks(numRanks) {}
+  virtual ~HaloTransport() {}
+
+  ezUInt32 GetRank() const { return m_rank; }
+  ezUInt32 GetNumRanks() const { return m_numRanks; }
+
+  /// Establishes the connection to all other ranks. Needs to be called by all ranks before anything else.
+  virtual ezResult Connect() = 0;
+
+  /// Sends and receives all messages at once, returns when all messages were received. At most one message per rank.
+  virtual ezResult ExchangeHalos(const HaloMessage* messages, ezUInt32 numMessages) = 0;
+
+  /// Sums a value over all ranks, every rank gets the result.
+  virtual ezResult AllReduceSum(double value, double& sum) = 0;
+
+  /// Returns once all ranks called it.
+  ezResult Barrier()
+  {
+    double sum = 0.0;
+    return AllReduceSum(0.0, sum);
+  }
+
+protected:
+  const ezUInt32 m_rank;
+  const ezUInt32 m_numRanks;
+};
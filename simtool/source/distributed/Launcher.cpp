@@ -0,0 +1,118 @@
+#include "PCH.h"
+#include "Launcher.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+namespace Launcher
+{
+  ezResult RunProcesses(ezUInt32 numProcesses, const ezDynamicArray<const char*>& arguments)
+  {
+    ezResult result = EZ_SUCCESS;
+
+    // Unique per launch, so several runs on the same machine don't share their shared memory segment.
+    static ezUInt32 s_numLaunches = 0;
+    ezStringBuilder jobName;
+#if defined(_WIN32)
+    jobName.Format("simtool_%u_%u", static_cast<ezUInt32>(GetCurrentProcessId()), s_numLaunches++);
+#else
+    jobName.Format("simtool_%u_%u", static_cast<ezUInt32>(getpid()), s_numLaunches++);
+#endif
+
+#if defined(_WIN32)
+    char szExecutable[MAX_PATH];
+    GetModuleFileNameA(NULL, szExecutable, MAX_PATH);
+
+    ezDynamicArray<HANDLE> processes;
+    for(ezUInt32 rank = 0; rank < numProcesses; ++rank)
+    {
+      ezStringBuilder commandLine;
+      commandLine.Format("\"%s\"", szExecutable);
+      for(ezUInt32 i = 0; i < arguments.GetCount(); ++i)
+        commandLine.AppendFormat(" \"%s\"", arguments[i]);
+      commandLine.AppendFormat(" --job %s --rank %u", jobName.GetData(), rank);
+
+      // CreateProcess may modify the command line.
+      ezDynamicArray<char> commandLineBuffer;
+      commandLineBuffer.SetCount(commandLine.GetElementCount() + 1);
+      ezMemoryUtils::Copy(&commandLineBuffer[0], commandLine.GetData(), commandLine.GetElementCount() + 1);
+
+      STARTUPINFOA startupInfo;
+      ezMemoryUtils::ZeroFill(&startupInfo, 1);
+      startupInfo.cb = sizeof(startupInfo);
+      PROCESS_INFORMATION processInfo;
+      if(!CreateProcessA(szExecutable, &commandLineBuffer[0], NULL, NULL, FALSE, 0, NULL, NULL, &startupInfo, &processInfo))
+      {
+        ezLog::Error("Failed to start process for rank %u.", rank);
+        result = EZ_FAILURE;
+        break;
+      }
+      CloseHandle(processInfo.hThread);
+      processes.PushBack(processInfo.hProcess);
+    }
+
+    for(ezUInt32 i = 0; i < processes.GetCount(); ++i)
+    {
+      // Processes that are already running can't connect to the missing ones, don't wait for them.
+      if(result == EZ_FAILURE)
+        TerminateProcess(processes[i], 1);
+      WaitForSingleObject(processes[i], INFINITE);
+      DWORD exitCode = 0;
+      GetExitCodeProcess(processes[i], &exitCode);
+      if(exitCode != 0)
+        result = EZ_FAILURE;
+      CloseHandle(processes[i]);
+    }
+#else
+    ezDynamicArray<pid_t> processes;
+    for(ezUInt32 rank = 0; rank < numProcesses; ++rank)
+    {
+      ezStringBuilder rankString;
+      rankString.Format("%u", rank);
+
+      ezDynamicArray<char*> argv;
+      argv.PushBack(const_cast<char*>("simtool"));
+      for(ezUInt32 i = 0; i < arguments.GetCount(); ++i)
+        argv.PushBack(const_cast<char*>(arguments[i]));
+      argv.PushBack(const_cast<char*>("--job"));
+      argv.PushBack(const_cast<char*>(jobName.GetData()));
+      argv.PushBack(const_cast<char*>("--rank"));
+      argv.PushBack(const_cast<char*>(rankString.GetData()));
+      argv.PushBack(NULL);
+
+      pid_t process = fork();
+      if(process == 0)
+      {
+        execv("/proc/self/exe", &argv[0]);
+        _exit(127);
+      }
+      if(process < 0)
+      {
+        ezLog::Error("Failed to start process for rank %u.", rank);
+        result = EZ_FAILURE;
+        break;
+      }
+      processes.PushBack(process);
+    }
+
+    for(ezUInt32 i = 0; i < processes.GetCount(); ++i)
+    {
+      // Processes that are already running can't connect to the missing ones, don't wait for them.
+      if(result == EZ_FAILURE)
+        kill(processes[i], SIGTERM);
+      int status = 0;
+      waitpid(processes[i], &status, 0);
+      if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        result = EZ_FAILURE;
+    }
+#endif
+
+    return result;
+  }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+/// Starts the processes of a distributed run on the local machine.
+namespace Launcher
+{
+  /// Runs numProcesses instances of the current executable with the given arguments and "--job <name> --rank <index>" appended.
+  /// The job name is unique per call.
+  /// Returns once all processes exited, fails if any of them could not be started or returned a non-zero exit code.
+  ezResult RunProcesses(ezUInt32 numProcesses, const ezDynamicArray<const char*>& arguments);
+}
@@ -0,0 +1,200 @@
+#include "PCH.h"
+#include "SharedMemoryTransport.h"
+
+#include <atomic>
+#include <thread>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  const size_t s_cacheLineSize = 64;
+
+  size_t AlignToCacheLine(size_t size)
+  {
+    return (size + s_cacheLineSize - 1) / s_cacheLineSize * s_cacheLineSize;
+  }
+
+  /// Start of the segment. The segment is zero initialized by the OS, which is a valid state for all members.
+  struct ControlBlock
+  {
+    std::atomic<ezUInt32> numArrivedRanks;
+    std::atomic<ezUInt32> barrierGeneration;
+  };
+}
+
+/// Followed by the message data.
+struct SharedMemoryTransport::MessageSlot
+{
+  /// Incremented by the sender once a message is complete.
+  std::atomic<ezUInt32> writeSequence;
+  /// Incremented by the receiver once it copied the message, the slot may be reused afterwards.
+  std::atomic<ezUInt32> readSequence;
+  ezUInt32 targetRank;
+  ezUInt32 numFloats;
+
+  float* GetData() { return reinterpret_cast<float*>(this + 1); }
+};
+
+SharedMemoryTransport::SharedMemoryTransport(const char* szJobName, ezUInt32 rank, ezUInt32 numRanks, ezUInt32 maxMessageFloats) :
+  HaloTransport(rank, numRanks),
+  m_maxMessageFloats(maxMessageFloats),
+  m_segmentHandle(NULL),
+  m_segment(NULL)
+{
+#if defined(_WIN32)
+  m_segmentName.Format("Local\\%s", szJobName);
+#else
+  m_segmentName.Format("/%s", szJobName);
+#endif
+
+  // Control block, one reduction value per rank and the message slots of all ranks.
+  m_slotSize = AlignToCacheLine(sizeof(MessageSlot) + sizeof(float) * maxMessageFloats);
+  m_segmentSize = AlignToCacheLine(sizeof(ControlBlock)) + AlignToCacheLine(sizeof(double) * numRanks) + m_slotSize * s_maxMessagesPerExchange * numRanks;
+}
+
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+#if defined(_WIN32)
+  if(m_segment)
+    UnmapViewOfFile(m_segment);
+  if(m_segmentHandle)
+    CloseHandle(m_segmentHandle);
+#else
+  if(m_segment)
+    munmap(m_segment, m_segmentSize);
+#endif
+}
+
+ezResult SharedMemoryTransport::Connect()
+{
+  // All ranks try to create the segment, whoever comes first actually does.
+#if defined(_WIN32)
+  ezUInt64 segmentSize = m_segmentSize;
+  m_segmentHandle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, static_cast<DWORD>(segmentSize >> 32),
+                                       static_cast<DWORD>(segmentSize), m_segmentName.GetData());
+  if(!m_segmentHandle)
+  {
+    ezLog::Error("Failed to create shared memory segment \"%s\".", m_segmentName.GetData());
+    return EZ_FAILURE;
+  }
+  m_segment = static_cast<char*>(MapViewOfFile(m_segmentHandle, FILE_MAP_ALL_ACCESS, 0, 0, m_segmentSize));
+#else
+  int fileDescriptor = shm_open(m_segmentName.GetData(), O_CREAT | O_RDWR, 0600);
+  if(fileDescriptor < 0 || ftruncate(fileDescriptor, m_segmentSize) != 0)
+  {
+    ezLog::Error("Failed to create shared memory segment \"%s\".", m_segmentName.GetData());
+    if(fileDescriptor >= 0)
+      close(fileDescriptor);
+    return EZ_FAILURE;
+  }
+  void* segment = mmap(NULL, m_segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+  close(fileDescriptor);
+  m_segment = segment != MAP_FAILED ? static_cast<char*>(segment) : NULL;
+#endif
+  if(!m_segment)
+  {
+    ezLog::Error("Failed to map shared memory segment \"%s\".", m_segmentName.GetData());
+    return EZ_FAILURE;
+  }
+
+  WaitForAllRanks();
+
+#if !defined(_WIN32)
+  // Everybody has it mapped now, the name is no longer needed and the segment goes away with the last process.
+  if(m_rank == 0)
+    shm_unlink(m_segmentName.GetData());
+#endif
+
+  return EZ_SUCCESS;
+}
+
+SharedMemoryTransport::MessageSlot* SharedMemoryTransport::GetMessageSlot(ezUInt32 rank, ezUInt32 slotIndex)
+{
+  size_t slotsOffset = AlignToCacheLine(sizeof(ControlBlock)) + AlignToCacheLine(sizeof(double) * m_numRanks);
+  return reinterpret_cast<MessageSlot*>(m_segment + slotsOffset + m_slotSize * (rank * s_maxMessagesPerExchange + slotIndex));
+}
+
+void SharedMemoryTransport::WaitForAllRanks()
+{
+  ControlBlock* control = reinterpret_cast<ControlBlock*>(m_segment);
+
+  // The last rank to arrive starts a new generation, all others wait for it.
+  ezUInt32 generation = control->barrierGeneration.load();
+  if(control->numArrivedRanks.fetch_add(1) + 1 == m_numRanks)
+  {
+    control->numArrivedRanks.store(0);
+    control->barrierGeneration.fetch_add(1);
+  }
+  else
+  {
+    while(control->barrierGeneration.load() == generation)
+      std::this_thread::yield();
+  }
+}
+
+ezResult SharedMemoryTransport::ExchangeHalos(const HaloMessage* messages, ezUInt32 numMessages)
+{
+  EZ_ASSERT(numMessages <= s_maxMessagesPerExchange, "Too many messages for a single exchange.");
+
+  // Message i always goes to slot i. The previous message in the slot needs to be picked up before it can be overwritten.
+  for(ezUInt32 i = 0; i < numMessages; ++i)
+  {
+    EZ_ASSERT(messages[i].numFloats <= m_maxMessageFloats, "Message exceeds the maximum message size.");
+
+    MessageSlot* slot = GetMessageSlot(m_rank, i);
+    ezUInt32 sequence = slot->writeSequence.load();
+    while(slot->readSequence.load() != sequence)
+      std::this_thread::yield();
+
+    slot->targetRank = messages[i].rank;
+    slot->numFloats = messages[i].numFloats;
+    ezMemoryUtils::Copy(slot->GetData(), messages[i].sendData, messages[i].numFloats);
+    slot->writeSequence.store(sequence + 1);
+  }
+
+  for(ezUInt32 i = 0; i < numMessages; ++i)
+  {
+    // Look for a pending message to this rank in the slots of the sender.
+    MessageSlot* slot = NULL;
+    while(!slot)
+    {
+      for(ezUInt32 slotIndex = 0; slotIndex < s_maxMessagesPerExchange && !slot; ++slotIndex)
+      {
+        MessageSlot* candidate = GetMessageSlot(messages[i].rank, slotIndex);
+        if(candidate->writeSequence.load() != candidate->readSequence.load() && candidate->targetRank == m_rank)
+          slot = candidate;
+      }
+      if(!slot)
+        std::this_thread::yield();
+    }
+
+    EZ_ASSERT(slot->numFloats == messages[i].numFloats, "Sender and receiver disagree about the message size.");
+    ezMemoryUtils::Copy(messages[i].receiveData, slot->GetData(), messages[i].numFloats);
+    slot->readSequence.fetch_add(1);
+  }
+  return EZ_SUCCESS;
+}
+
+ezResult SharedMemoryTransport::AllReduceSum(double value, double& sum)
+{
+  double* values = reinterpret_cast<double*>(m_segment + AlignToCacheLine(sizeof(ControlBlock)));
+  values[m_rank] = value;
+  WaitForAllRanks();
+
+  // Same order on all ranks, so all get exactly the same result.
+  sum = 0.0;
+  for(ezUInt32 rank = 0; rank < m_numRanks; ++rank)
+    sum += values[rank];
+
+  // Nobody may overwrite its value before everybody is done reading.
+  WaitForAllRanks();
+  return EZ_SUCCESS;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "HaloTransport.h"
+
+/// Transport between processes on the same machine over a named shared memory segment.
+///
+/// Every rank has a few outgoing message slots in the segment. Senders copy a message into a slot and publish it by incrementing a
+/// sequence number, receivers copy it out and acknowledge it with a second sequence number. Waiting is done by spinning, which is the
+/// fastest option as long as there are no more processes than cores.
+class SharedMemoryTransport : public HaloTransport
+{
+public:
+  /// \param szJobName          Name that is unique for all processes of a single run.
+  /// \param maxMessageFloats   Largest message that will ever be sent.
+  SharedMemoryTransport(const char* szJobName, ezUInt32 rank, ezUInt32 numRanks, ezUInt32 maxMessageFloats);
+  ~SharedMemoryTransport();
+
+  /// Creates or opens the shared memory segment and waits for all other ranks.
+  virtual ezResult Connect() override;
+
+  virtual ezResult ExchangeHalos(const HaloMessage* messages, ezUInt32 numMessages) override;
+  virtual ezResult AllReduceSum(double value, double& sum) override;
+
+  /// A rank sends at most this many messages per exchange, one per neighbour of a 2D domain decomposition.
+  static const ezUInt32 s_maxMessagesPerExchange = 4;
+
+private:
+  struct MessageSlot;
+
+  MessageSlot* GetMessageSlot(ezUInt32 rank, ezUInt32 slotIndex);
+  void WaitForAllRanks();
+
+  ezStringBuilder m_segmentName;
+  ezUInt32 m_maxMessageFloats;
+  size_t m_slotSize;
+  size_t m_segmentSize;
+
+  void* m_segmentHandle;
+  char* m_segment;
+};
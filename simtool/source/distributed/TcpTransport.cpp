@@ -0,0 +1,319 @@
+#include "PCH.h"
+#include "TcpTransport.h"
+
+#include <thread>
+#include <chrono>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET SocketHandle;
+typedef int SocketLength;
+#define CLOSE_SOCKET closesocket
+static bool WouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+typedef int SocketHandle;
+typedef ssize_t SocketLength;
+#define INVALID_SOCKET (-1)
+#define CLOSE_SOCKET close
+static bool WouldBlock() { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+#endif
+
+namespace
+{
+  /// How long Connect waits for other processes to show up.
+  const ezTime s_connectTimeout = ezTime::Seconds(30.0);
+
+  SocketHandle ToSocket(ezUInt64 socket)
+  {
+    return static_cast<SocketHandle>(socket);
+  }
+
+  void SetSocketOptions(SocketHandle socket)
+  {
+    // Halos are small and latency bound, don't wait for more data.
+    int noDelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+
+#if defined(_WIN32)
+    u_long nonBlocking = 1;
+    ioctlsocket(socket, FIONBIO, &nonBlocking);
+#else
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+  }
+
+  /// Blocking write of a few bytes, only used while the socket is still in blocking mode.
+  bool SendBlocking(SocketHandle socket, const void* data, int size)
+  {
+    return send(socket, static_cast<const char*>(data), size, 0) == size;
+  }
+
+  bool ReceiveBlocking(SocketHandle socket, void* data, int size)
+  {
+    return recv(socket, static_cast<char*>(data), size, MSG_WAITALL) == size;
+  }
+
+  /// Connections are required for all further steps, there is no way to recover from a lost one.
+  ezResult ConnectionLost(ezUInt32 rank)
+  {
+    ezLog::Error("Lost connection to rank %u.", rank);
+    return EZ_FAILURE;
+  }
+}
+
+TcpTransport::TcpTransport(ezUInt32 rank, ezUInt32 numRanks, ezUInt16 basePort, const char* szHosts) :
+  HaloTransport(rank, numRanks),
+  m_basePort(basePort)
+{
+#if defined(_WIN32)
+  WSADATA wsaData;
+  WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+  // Split the host list at commas.
+  ezDynamicArray<char> hosts;
+  for(const char* szChar = szHosts ? szHosts : "127.0.0.1"; *szChar; ++szChar)
+    hosts.PushBack(*szChar == ',' ? '\0' : *szChar);
+  hosts.PushBack('\0');
+  for(ezUInt32 i = 0; i < hosts.GetCount(); i += ezStringBuilder(&hosts[i]).GetElementCount() + 1)
+    m_hosts.PushBack(ezStringBuilder(&hosts[i]));
+
+  m_sockets.SetCount(numRanks);
+  for(ezUInt32 i = 0; i < numRanks; ++i)
+    m_sockets[i] = static_cast<ezUInt64>(INVALID_SOCKET);
+}
+
+TcpTransport::~TcpTransport()
+{
+  for(ezUInt32 i = 0; i < m_sockets.GetCount(); ++i)
+  {
+    if(ToSocket(m_sockets[i]) != INVALID_SOCKET)
+      CLOSE_SOCKET(ToSocket(m_sockets[i]));
+  }
+
+#if defined(_WIN32)
+  WSACleanup();
+#endif
+}
+
+const char* TcpTransport::GetHost(ezUInt32 rank) const
+{
+  return m_hosts.GetCount() == 1 ? m_hosts[0].GetData() : m_hosts[rank].GetData();
+}
+
+ezResult TcpTransport::Connect()
+{
+  if(m_hosts.GetCount() != 1 && m_hosts.GetCount() != m_numRanks)
+  {
+    ezLog::Error("Expected a single host or one host per rank, got %u hosts for %u ranks.", m_hosts.GetCount(), m_numRanks);
+    return EZ_FAILURE;
+  }
+
+  // Listen first, so lower ranks never wait for higher ones.
+  SocketHandle listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  int reuseAddress = 1;
+  setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuseAddress), sizeof(reuseAddress));
+  sockaddr_in listenAddress;
+  ezMemoryUtils::ZeroFill(&listenAddress, 1);
+  listenAddress.sin_family = AF_INET;
+  listenAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+  listenAddress.sin_port = htons(static_cast<ezUInt16>(m_basePort + m_rank));
+  if(listenSocket == INVALID_SOCKET || bind(listenSocket, reinterpret_cast<sockaddr*>(&listenAddress), sizeof(listenAddress)) != 0 ||
+     listen(listenSocket, m_numRanks) != 0)
+  {
+    ezLog::Error("Rank %u failed to listen on port %u.", m_rank, m_basePort + m_rank);
+    if(listenSocket != INVALID_SOCKET)
+      CLOSE_SOCKET(listenSocket);
+    return EZ_FAILURE;
+  }
+
+  ezResult result = EZ_SUCCESS;
+  for(ezUInt32 rank = 0; rank < m_rank && result == EZ_SUCCESS; ++rank)
+  {
+    ezStringBuilder port;
+    port.Format("%u", m_basePort + rank);
+    addrinfo hints;
+    ezMemoryUtils::ZeroFill(&hints, 1);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* address = NULL;
+    if(getaddrinfo(GetHost(rank), port.GetData(), &hints, &address) != 0)
+    {
+      ezLog::Error("Failed to resolve host \"%s\".", GetHost(rank));
+      result = EZ_FAILURE;
+      break;
+    }
+
+    // The other process may not be listening yet.
+    SocketHandle connection = INVALID_SOCKET;
+    ezTime startTime = ezTime::Now();
+    while(connection == INVALID_SOCKET && ezTime::Now() - startTime < s_connectTimeout)
+    {
+      connection = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if(connect(connection, address->ai_addr, static_cast<int>(address->ai_addrlen)) != 0)
+      {
+        CLOSE_SOCKET(connection);
+        connection = INVALID_SOCKET;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+    }
+    freeaddrinfo(address);
+
+    if(connection == INVALID_SOCKET || !SendBlocking(connection, &m_rank, sizeof(m_rank)))
+    {
+      ezLog::Error("Rank %u failed to connect to rank %u at %s:%s.", m_rank, rank, GetHost(rank), port.GetData());
+      result = EZ_FAILURE;
+      break;
+    }
+    m_sockets[rank] = static_cast<ezUInt64>(connection);
+  }
+
+  // Higher ranks connect to us and introduce themselves.
+  for(ezUInt32 i = m_rank + 1; i < m_numRanks && result == EZ_SUCCESS; ++i)
+  {
+    SocketHandle connection = accept(listenSocket, NULL, NULL);
+    ezUInt32 rank = 0;
+    if(connection == INVALID_SOCKET || !ReceiveBlocking(connection, &rank, sizeof(rank)) || rank <= m_rank || rank >= m_numRanks)
+    {
+      ezLog::Error("Rank %u failed to accept a connection.", m_rank);
+      if(connection != INVALID_SOCKET)
+        CLOSE_SOCKET(connection);
+      result = EZ_FAILURE;
+      break;
+    }
+    m_sockets[rank] = static_cast<ezUInt64>(connection);
+  }
+  CLOSE_SOCKET(listenSocket);
+
+  for(ezUInt32 rank = 0; rank < m_numRanks && result == EZ_SUCCESS; ++rank)
+  {
+    if(rank != m_rank)
+      SetSocketOptions(ToSocket(m_sockets[rank]));
+  }
+  return result;
+}
+
+ezResult TcpTransport::PerformTransfers(Transfer* transfers, ezUInt32 numTransfers)
+{
+  for(;;)
+  {
+    fd_set readSet, writeSet;
+    FD_ZERO(&readSet);
+    FD_ZERO(&writeSet);
+    SocketHandle maxSocket = 0;
+    bool anyPending = false;
+    for(ezUInt32 i = 0; i < numTransfers; ++i)
+    {
+      SocketHandle socket = ToSocket(m_sockets[transfers[i].rank]);
+      if(transfers[i].sendSize > 0)
+        FD_SET(socket, &writeSet);
+      if(transfers[i].receiveSize > 0)
+        FD_SET(socket, &readSet);
+      anyPending |= transfers[i].sendSize > 0 || transfers[i].receiveSize > 0;
+      maxSocket = ezMath::Max(maxSocket, socket);
+    }
+    if(!anyPending)
+      return EZ_SUCCESS;
+
+    if(select(static_cast<int>(maxSocket + 1), &readSet, &writeSet, NULL, NULL) < 0 && !WouldBlock())
+    {
+      ezLog::Error("Waiting for the connections of rank %u failed.", m_rank);
+      return EZ_FAILURE;
+    }
+
+    // Move as much data as the socket buffers allow, the rest is picked up in the next round.
+    for(ezUInt32 i = 0; i < numTransfers; ++i)
+    {
+      Transfer& transfer = transfers[i];
+      SocketHandle socket = ToSocket(m_sockets[transfer.rank]);
+      if(transfer.sendSize > 0 && FD_ISSET(socket, &writeSet))
+      {
+        SocketLength numBytes = send(socket, transfer.sendData, static_cast<int>(transfer.sendSize), 0);
+        if(numBytes < 0 && !WouldBlock())
+          return ConnectionLost(transfer.rank);
+        if(numBytes > 0)
+        {
+          transfer.sendData += numBytes;
+          transfer.sendSize -= numBytes;
+        }
+      }
+      if(transfer.receiveSize > 0 && FD_ISSET(socket, &readSet))
+      {
+        SocketLength numBytes = recv(socket, transfer.receiveData, static_cast<int>(transfer.receiveSize), 0);
+        if(numBytes == 0 || (numBytes < 0 && !WouldBlock()))
+          return ConnectionLost(transfer.rank);
+        if(numBytes > 0)
+        {
+          transfer.receiveData += numBytes;
+          transfer.receiveSize -= numBytes;
+        }
+      }
+    }
+  }
+}
+
+ezResult TcpTransport::ExchangeHalos(const HaloMessage* messages, ezUInt32 numMessages)
+{
+  ezDynamicArray<Transfer> transfers;
+  transfers.SetCount(numMessages);
+  for(ezUInt32 i = 0; i < numMessages; ++i)
+  {
+    transfers[i].rank = messages[i].rank;
+    transfers[i].sendData = reinterpret_cast<const char*>(messages[i].sendData);
+    transfers[i].sendSize = sizeof(float) * messages[i].numFloats;
+    transfers[i].receiveData = reinterpret_cast<char*>(messages[i].receiveData);
+    transfers[i].receiveSize = sizeof(float) * messages[i].numFloats;
+  }
+  if(numMessages == 0)
+    return EZ_SUCCESS;
+  return PerformTransfers(&transfers[0], numMessages);
+}
+
+ezResult TcpTransport::AllReduceSum(double value, double& sum)
+{
+  if(m_numRanks == 1)
+  {
+    sum = value;
+    return EZ_SUCCESS;
+  }
+
+  // Rank 0 gathers all values, sums them and sends the result back.
+  if(m_rank != 0)
+  {
+    Transfer transfer = { 0, reinterpret_cast<const char*>(&value), sizeof(value), reinterpret_cast<char*>(&sum), sizeof(sum) };
+    return PerformTransfers(&transfer, 1);
+  }
+
+  ezDynamicArray<double> values;
+  ezDynamicArray<Transfer> transfers;
+  values.SetCount(m_numRanks);
+  transfers.SetCount(m_numRanks - 1);
+  for(ezUInt32 rank = 1; rank < m_numRanks; ++rank)
+  {
+    Transfer transfer = { rank, NULL, 0, reinterpret_cast<char*>(&values[rank]), sizeof(double) };
+    transfers[rank - 1] = transfer;
+  }
+  if(PerformTransfers(&transfers[0], transfers.GetCount()) == EZ_FAILURE)
+    return EZ_FAILURE;
+
+  sum = value;
+  for(ezUInt32 rank = 1; rank < m_numRanks; ++rank)
+    sum += values[rank];
+
+  for(ezUInt32 rank = 1; rank < m_numRanks; ++rank)
+  {
+    Transfer transfer = { rank, reinterpret_cast<const char*>(&sum), sizeof(sum), NULL, 0 };
+    transfers[rank - 1] = transfer;
+  }
+  return PerformTransfers(&transfers[0], transfers.GetCount());
+}
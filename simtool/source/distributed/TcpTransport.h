@@ -0,0 +1,45 @@
+#pragma once
+
+#include "HaloTransport.h"
+
+#include <Foundation/Containers/DynamicArray.h>
+
+/// Transport over TCP connections between all pairs of ranks, works across machines as well as over loopback.
+///
+/// Rank i listens on basePort + i of its host and connects to all ranks with a lower index. Halos are exchanged with non-blocking
+/// sockets, so large messages can't dead lock when both sides send at the same time.
+class TcpTransport : public HaloTransport
+{
+public:
+  /// \param szHosts   Comma separated host of every rank, or a single host for all ranks. NULL uses the loopback address.
+  TcpTransport(ezUInt32 rank, ezUInt32 numRanks, ezUInt16 basePort, const char* szHosts);
+  ~TcpTransport();
+
+  /// Connects to all other ranks, retries for a while until the other processes listen.
+  virtual ezResult Connect() override;
+
+  virtual ezResult ExchangeHalos(const HaloMessage* messages, ezUInt32 numMessages) override;
+  virtual ezResult AllReduceSum(double value, double& sum) override;
+
+private:
+  /// Pending send and receive on a single connection.
+  struct Transfer
+  {
+    ezUInt32 rank;
+    const char* sendData;
+    size_t sendSize;
+    char* receiveData;
+    size_t receiveSize;
+  };
+
+  /// Performs all transfers at once, waits until all data was sent and received. Fails if a connection was lost.
+  ezResult PerformTransfers(Transfer* transfers, ezUInt32 numTransfers);
+
+  const char* GetHost(ezUInt32 rank) const;
+
+  ezUInt16 m_basePort;
+  ezDynamicArray<ezStringBuilder> m_hosts;
+
+  /// Socket per rank, stored as 64 bit to cover both SOCKET and int. Entry of the own rank is unused.
+  ezDynamicArray<ezUInt64> m_sockets;
+};
@@ -0,0 +1,149 @@
+#include "PCH.h"
+#include "FlowEnsemble.h"
+
+#include "simulation/CpuFlowSolver.h"
+#include "simulation/TerrainGenerator.h"
+#include "math/Random.h"
+
+#include <Foundation/IO/OSFile.h>
+
+#include <omp.h>
+
+const float FlowEnsemble::s_minFlowSpeedDepth = 0.05f;
+const float FlowEnsemble::s_wetDepth = 0.01f;
+
+namespace
+{
+  /// Deeper water than this counts as diverged. Also catches NaN, which fails every comparison.
+  const float s_maxPlausibleDepth = 1.0e6f;
+}
+
+FlowEnsemble::FlowEnsemble(ezUInt32 gridResolution, float gridWorldSize, float heightScale) :
+  m_gridResolution(gridResolution),
+  m_gridWorldSize(gridWorldSize),
+  m_heightScale(heightScale)
+{
+}
+
+void FlowEnsemble::Run(ezTime simulatedTime, ezUInt32 tileSize, ezUInt32 numThreads)
+{
+  m_metrics.SetCount(m_members.GetCount());
+
+  // Members differ a lot in cost, e.g. by their number of steps, so they are handed out one by one.
+  int numMembers = static_cast<int>(m_members.GetCount());
+  int numUsedThreads = numThreads > 0 ? static_cast<int>(numThreads) : omp_get_max_threads();
+#pragma omp parallel for num_threads(numUsedThreads) schedule(dynamic, 1)
+  for(int member = 0; member < numMembers; ++member)
+    RunMember(static_cast<ezUInt32>(member), simulatedTime, tileSize);
+}
+
+void FlowEnsemble::RunMember(ezUInt32 index, ezTime simulatedTime, ezUInt32 tileSize)
+{
+  const Member& member = m_members[index];
+  Metrics& metrics = m_metrics[index];
+  ezTime startTime = ezTime::Now();
+
+  ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+  ezColor* terrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, numTexels);
+  // Random is a single global generator.
+#pragma omp critical(FlowEnsembleHeightmap)
+  {
+    Random::Init(member.randomSeed);
+    TerrainGenerator::CreateHeightmapFromNoise(terrainData, m_gridResolution, m_heightScale);
+  }
+
+  float cellDistance = m_gridWorldSize / m_gridResolution;
+  CpuFlowSolver solver(m_gridResolution);
+  solver.SetSimulationParameters(SimulationParameters::Compute(ezTime::Seconds(1.0f / member.simulationStepsPerSecond), member.flowDamping,
+                                                               member.flowAcceleration, cellDistance));
+  solver.SetNumThreads(1);
+  solver.SetTileSize(tileSize);
+  solver.SetState(terrainData, NULL);
+  EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData);
+
+  const FlowGridView& grid = solver.GetGridView();
+  double cellArea = static_cast<double>(cellDistance) * cellDistance;
+  double initialWater = 0.0;
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+      initialWater += grid.water[solver.GetCellIndex(x, y)];
+  }
+  metrics.initialWaterVolume = initialWater * cellArea;
+
+  // The last simulated second is simulated separately to see how much the water still changes.
+  metrics.numSteps = ezMath::Max(static_cast<ezUInt32>(simulatedTime.GetSeconds() * member.simulationStepsPerSecond + 0.5), 1u);
+  ezUInt32 numLastSecondSteps = ezMath::Clamp(static_cast<ezUInt32>(member.simulationStepsPerSecond + 0.5f), 1u, metrics.numSteps);
+  solver.PerformSimulationSteps(metrics.numSteps - numLastSecondSteps);
+
+  ezDynamicArray<float> previousWater;
+  previousWater.SetCount(numTexels);
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+      previousWater[x + y * m_gridResolution] = grid.water[solver.GetCellIndex(x, y)];
+  }
+  solver.PerformSimulationSteps(numLastSecondSteps);
+
+  double finalWater = 0.0;
+  float maxWaterDepth = 0.0f;
+  float maxFlowSpeed = 0.0f;
+  float maxWaterChange = 0.0f;
+  ezUInt32 numWetCells = 0;
+  bool diverged = false;
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 cell = solver.GetCellIndex(x, y);
+      float water = grid.water[cell];
+      if(!(water < s_maxPlausibleDepth))
+      {
+        diverged = true;
+        continue;
+      }
+      finalWater += water;
+      maxWaterDepth = ezMath::Max(maxWaterDepth, water);
+      maxWaterChange = ezMath::Max(maxWaterChange, ezMath::Abs(water - previousWater[x + y * m_gridResolution]));
+      if(water > s_wetDepth)
+        ++numWetCells;
+
+      float flowMapLength = ezVec2(grid.flowMapX[cell], grid.flowMapY[cell]).GetLength();
+      maxFlowSpeed = ezMath::Max(maxFlowSpeed, flowMapLength / ezMath::Max(water, s_minFlowSpeedDepth));
+    }
+  }
+
+  metrics.finalWaterVolume = finalWater * cellArea;
+  metrics.maxWaterDepth = maxWaterDepth;
+  metrics.maxFlowSpeed = maxFlowSpeed / cellDistance;
+  metrics.wetFraction = static_cast<float>(numWetCells) / numTexels;
+  metrics.maxWaterChangeRate = maxWaterChange * member.simulationStepsPerSecond / numLastSecondSteps;
+  metrics.diverged = diverged;
+  metrics.computeDuration = ezTime::Now() - startTime;
+}
+
+ezResult FlowEnsemble::WriteCsv(const char* szFilename) const
+{
+  ezOSFile file;
+  if(file.Open(szFilename, ezFileMode::Write) == EZ_FAILURE)
+  {
+    ezLog::Error("Failed to open \"%s\" for writing.", szFilename);
+    return EZ_FAILURE;
+  }
+
+  ezStringBuilder line("member,seed,steps_per_second,flow_damping,flow_acceleration,steps,initial_water_m3,final_water_m3,"
+                       "max_depth_m,max_flow_speed_mps,wet_fraction,max_water_change_mps,diverged,compute_ms\n");
+  file.Write(line.GetData(), line.GetElementCount());
+  for(ezUInt32 i = 0; i < m_members.GetCount(); ++i)
+  {
+    const Member& member = m_members[i];
+    const Metrics& metrics = m_metrics[i];
+    line.Format("%u,%u,%g,%g,%g,%u,%.3f,%.3f,%g,%g,%g,%g,%u,%.3f\n", i, member.randomSeed, member.simulationStepsPerSecond, member.flowDamping,
+                member.flowAcceleration, metrics.numSteps, metrics.initialWaterVolume, metrics.finalWaterVolume, metrics.maxWaterDepth,
+                metrics.maxFlowSpeed, metrics.wetFraction, metrics.maxWaterChangeRate, metrics.diverged ? 1 : 0,
+                metrics.computeDuration.GetMilliseconds());
+    file.Write(line.GetData(), line.GetElementCount());
+  }
+  file.Close();
+  return EZ_SUCCESS;
+}
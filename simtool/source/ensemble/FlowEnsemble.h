@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+/// Many small independent simulations with different parameters or heightmaps, e.g. to tune flow damping and acceleration.
+///
+/// Each member runs on a single thread with its own single threaded CpuFlowSolver, the members are distributed dynamically over all
+/// threads. The kernels already vectorize across the cells of a row, so packing members into SIMD lanes wouldn't gain anything; at
+/// 256² to 512² cells a member fits mostly in the cache of its core and needs no synchronization at all.
+class FlowEnsemble
+{
+public:
+  struct Member
+  {
+    /// Seed of the noise heightmap, members with the same seed start from the same terrain and water.
+    ezUInt32 randomSeed;
+    float simulationStepsPerSecond;
+    float flowDamping;
+    float flowAcceleration;
+  };
+
+  /// Summary of a member's run, volumes in m^3 and speeds in m/s.
+  struct Metrics
+  {
+    ezUInt32 numSteps;
+    double initialWaterVolume;
+    double finalWaterVolume;
+    float maxWaterDepth;
+    /// Maximum flow speed of the last step, water shallower than s_minFlowSpeedDepth counts as that deep like in flowApply.comp.
+    float maxFlowSpeed;
+    /// Share of cells with more than s_wetDepth of water.
+    float wetFraction;
+    /// Maximum change of water height over the last simulated second per second, how far the member is from a steady state.
+    float maxWaterChangeRate;
+    /// Water height became NaN, infinite or absurdly large. The other metrics are meaningless then.
+    bool diverged;
+    ezTime computeDuration;
+  };
+
+  /// All members share grid and heightmap settings, see TerrainGenerator::CreateHeightmapFromNoise.
+  FlowEnsemble(ezUInt32 gridResolution, float gridWorldSize, float heightScale);
+
+  void AddMember(const Member& member) { m_members.PushBack(member); }
+  ezUInt32 GetNumMembers() const { return m_members.GetCount(); }
+  const Member& GetMember(ezUInt32 index) const { return m_members[index]; }
+  /// Valid after Run.
+  const Metrics& GetMetrics(ezUInt32 index) const { return m_metrics[index]; }
+
+  ezUInt32 GetGridResolution() const { return m_gridResolution; }
+
+  /// Simulates every member for the same simulated time, i.e. members with more steps per second do more steps. Up to numThreads members
+  /// run at once, 0 uses all cores.
+  void Run(ezTime simulatedTime, ezUInt32 tileSize, ezUInt32 numThreads = 0);
+
+  /// One line per member with its parameters and metrics.
+  ezResult WriteCsv(const char* szFilename) const;
+
+  /// Same as MIN_FLOW_SPEED_DEPTH in simulationCommon.glsl.
+  static const float s_minFlowSpeedDepth;
+  static const float s_wetDepth;
+
+private:
+  void RunMember(ezUInt32 index, ezTime simulatedTime, ezUInt32 tileSize);
+
+  const ezUInt32 m_gridResolution;
+  const float m_gridWorldSize;
+  const float m_heightScale;
+
+  ezDynamicArray<Member> m_members;
+  ezDynamicArray<Metrics> m_metrics;
+};
@@ -0,0 +1,1193 @@
+#include "PCH.h"
+
+#include "simulation/CpuFlowSolver.h"
+#include "simulation/SemiImplicitFlowIntegrator.h"
+#include "simulation/NestedFlowSolver.h"
+#include "simulation/FixedPointFlowSolver.h"
+#include "simulation/SimulationCheckpoint.h"
+#include "simulation/OutOfCoreFlowSolver.h"
+#include "distributed/DistributedFlowSolver.h"
+#include "distributed/SharedMemoryTransport.h"
+#include "distributed/TcpTransport.h"
+#include "distributed/Launcher.h"
+#include "simulation/TerrainGenerator.h"
+#include "simulation/LakePrefill.h"
+#include "simulation/DrainageAnalysis.h"
+#include "ensemble/FlowEnsemble.h"
+#include "math/Random.h"
+
+#include <Foundation/Configuration/Startup.h>
+#include <Foundation/Logging/ConsoleWriter.h>
+#include <Foundation/IO/OSFile.h>
+
+#include <cstdio>
+
+// Headless runner for the CPU water simulation. Needs no graphics context at all.
+
+namespace
+{
+  /// Values swept by an ensemble run, count values evenly spaced from min to max. A count of 0 uses the single value of the settings.
+  struct ParameterRange
+  {
+    ParameterRange() : min(0.0f), max(0.0f), count(0) {}
+
+    float min;
+    float max;
+    ezUInt32 count;
+
+    float GetValue(ezUInt32 index) const { return count > 1 ? min + (max - min) * index / (count - 1) : min; }
+  };
+
+  struct Settings
+  {
+    Settings() :
+      gridResolution(1024),
+      gridWorldSize(1024.0f),
+      heightScale(300.0f),
+      numSteps(600),
+      randomSeed(231656522),
+      simulationStepsPerSecond(60.0f),
+      flowDamping(0.98f),
+      flowAcceleration(10.0f),
+      numThreads(0),
+      tileSize(64),
+      numFusedSteps(1),
+      szIntegrator("pipe"),
+      implicitStepFactor(20.0f),
+      prefillRainDepth(s_noPrefill),
+      prefillVolume(s_noPrefill),
+      szDrainagePrefix(NULL),
+      szEnsembleFile(NULL),
+      numEnsembleSeeds(1),
+      numLevels(1),
+      szArithmetic("float"),
+      szLoadCheckpoint(NULL),
+      szSaveCheckpoint(NULL),
+      szOutOfCoreFile(NULL),
+      memoryBudgetMB(256),
+      numProcesses(1),
+      rank(s_noRank),
+      szTransport("shm"),
+      basePort(41000),
+      szHosts(NULL),
+      szJobName("simtool"),
+      szScaling("none"),
+      szResultFile(NULL),
+      verify(false)
+    {}
+
+    ezUInt32 gridResolution;
+    float gridWorldSize;
+    float heightScale;
+    ezUInt32 numSteps;
+    ezUInt32 randomSeed;
+
+    float simulationStepsPerSecond;
+    float flowDamping;
+    float flowAcceleration;
+
+    ezUInt32 numThreads;
+    ezUInt32 tileSize;
+    ezUInt32 numFusedSteps;
+
+    /// "pipe", "implicit" or "compare". The latter runs both and compares speed and result, see RunIntegratorComparison.
+    const char* szIntegrator;
+    /// Step length of the semi-implicit integrator relative to 1 / simulationStepsPerSecond.
+    float implicitStepFactor;
+
+    /// Replace the analytic lake of a new heightmap with rain of this depth in meters or this volume in m^3 that settled in the basins,
+    /// see LakePrefill. The volume takes precedence.
+    float prefillRainDepth;
+    float prefillVolume;
+    static const float s_noPrefill;
+
+    /// Instead of simulating, analyzes the drainage of the terrain and writes the rasters with this path prefix, see DrainageAnalysis.
+    const char* szDrainagePrefix;
+
+    /// Instead of a single simulation, runs an ensemble of small simulations over all combinations of the ranges below and the seeds
+    /// randomSeed, randomSeed + 1, ... and writes the metrics of every member to this CSV file, see FlowEnsemble.
+    const char* szEnsembleFile;
+    ParameterRange stepsPerSecondRange;
+    ParameterRange dampingRange;
+    ParameterRange accelerationRange;
+    ezUInt32 numEnsembleSeeds;
+
+    /// Number of nested simulation levels. gridResolution and gridWorldSize describe the finest one, every further level has the same
+    /// resolution and twice the world size of the previous one.
+    ezUInt32 numLevels;
+
+    void GetLevelConfigs(SimulationLevelConfig* levels) const
+    {
+      for(ezUInt32 level = 0; level < numLevels; ++level)
+        levels[level] = SimulationLevelConfig(gridWorldSize * static_cast<float>(1 << level), gridResolution);
+    }
+
+    /// "float" or "fixed", the latter uses FixedPointFlowSolver for bitwise reproducible results.
+    const char* szArithmetic;
+
+    /// Checkpoint to start from instead of a new heightmap. Overrides grid and simulation parameters.
+    const char* szLoadCheckpoint;
+    /// Checkpoint that the final state is written to.
+    const char* szSaveCheckpoint;
+
+    /// Tile file for an out-of-core run, which keeps at most memoryBudgetMB of the grid in memory.
+    const char* szOutOfCoreFile;
+    ezUInt32 memoryBudgetMB;
+
+    // Distributed runs
+
+    ezUInt32 numProcesses;
+    /// Only set for processes that were started by the launcher.
+    ezUInt32 rank;
+    static const ezUInt32 s_noRank = 0xFFFFFFFF;
+    /// "shm" or "tcp"
+    const char* szTransport;
+    ezUInt32 basePort;
+    const char* szHosts;
+    const char* szJobName;
+    /// "none", "strong" or "weak"
+    const char* szScaling;
+    /// Rank 0 writes its steps per second there, used by the scaling benchmark.
+    const char* szResultFile;
+    /// Every process compares its sub-domain with a single solver on the whole grid, see VerifySubDomain.
+    bool verify;
+  };
+
+  const float Settings::s_noPrefill = -1.0f;
+  const ezUInt32 s_maxNumLevels = 8;
+
+  /// Options that select a mode or only apply to some modes, see ParseCommandLine.
+  enum Option
+  {
+    OPTION_PROCESSES,
+    OPTION_DRAINAGE,
+    OPTION_ENSEMBLE,
+    OPTION_LEVELS,
+    OPTION_FIXED,
+    OPTION_OUTOFCORE,
+    OPTION_COMPARE,
+    OPTION_IMPLICIT,
+    OPTION_LOAD,
+    OPTION_SAVE,
+    OPTION_PREFILL,
+    OPTION_ENSEMBLE_RANGES,
+    OPTION_VERIFY,
+    OPTION_NONE,
+
+    OPTION_COUNT = OPTION_NONE
+  };
+
+  const char* const s_optionNames[OPTION_COUNT] = {
+    "--processes, --rank or --scaling", "--drainage", "--ensemble", "--levels", "--arithmetic fixed", "--outofcore",
+    "--integrator compare", "--integrator implicit", "--load", "--save", "--prefillrain or --prefillvolume",
+    "Parameter ranges and --seeds", "--verify"
+  };
+
+  /// What runs depends on the first used option of this table, the remaining options are either allowed by that mode or rejected.
+  struct ModeOptions
+  {
+    const char* szName;
+    Option selectingOption;
+    ezUInt32 allowedOptions;
+  };
+
+  const ModeOptions s_modeOptions[] = {
+    { "distributed runs", OPTION_PROCESSES, 1 << OPTION_VERIFY },
+    { "the drainage analysis", OPTION_DRAINAGE, 1 << OPTION_LOAD },
+    { "ensembles", OPTION_ENSEMBLE, 1 << OPTION_ENSEMBLE_RANGES },
+    { "nested levels", OPTION_LEVELS, 0 },
+    { "fixed point arithmetic", OPTION_FIXED, 1 << OPTION_PREFILL },
+    { "out-of-core runs", OPTION_OUTOFCORE, 0 },
+    { "the integrator comparison", OPTION_COMPARE, 1 << OPTION_PREFILL },
+    { "the semi-implicit integrator", OPTION_IMPLICIT, (1 << OPTION_LOAD) | (1 << OPTION_SAVE) | (1 << OPTION_PREFILL) },
+    { "the pipe model", OPTION_NONE, (1 << OPTION_LOAD) | (1 << OPTION_SAVE) | (1 << OPTION_PREFILL) }
+  };
+
+  void PrintUsage()
+  {
+    printf("Usage: simtool [options]\n"
+           "  --size <cells>           Grid resolution per side (default 1024)\n"
+           "  --worldsize <meters>     World size of the grid (default 1024)\n"
+           "  --steps <count>          Number of simulation steps (default 600)\n"
+           "  --seed <value>           Random seed for the heightmap (default 231656522)\n"
+           "  --stepspersecond <value> Simulation steps per simulated second (default 60)\n"
+           "  --damping <value>        Flow damping (default 0.98)\n"
+           "  --acceleration <value>   Flow acceleration (default 10)\n"
+           "  --threads <count>        Number of worker threads, 0 uses all cores (default 0)\n"
+           "  --tilesize <cells>       Edge length of the tiles processed per task (default 64)\n"
+           "  --fuse <steps>           Simulation steps computed per tile before moving on (default 1)\n"
+           "  --integrator <pipe|implicit|compare> Explicit pipe model, semi-implicit integrator with longer steps or both with\n"
+           "                           a comparison of simulated time per wall clock time and the final water heights (default pipe)\n"
+           "  --stepfactor <value>     Step length of the semi-implicit integrator relative to the pipe model (default 20)\n"
+           "  --prefillrain <meters>   Start with this much rain settled in the basins instead of the analytic lake\n"
+           "  --prefillvolume <m^3>    Start with this volume of water settled in the basins instead of the analytic lake\n"
+           "  --drainage <prefix>      Write flow direction, flow accumulation and watershed rasters of the terrain instead of simulating\n"
+           "  --ensemble <file.csv>    Run many small simulations concurrently, one per thread, for every combination of the ranges and\n"
+           "                           seeds below, each for --steps steps at --stepspersecond, and write their metrics to the file\n"
+           "  --stepspersecondrange <min:max:count> Steps per second of the ensemble members (default --stepspersecond)\n"
+           "  --dampingrange <min:max:count> Flow damping of the ensemble members (default --damping)\n"
+           "  --accelerationrange <min:max:count> Flow acceleration of the ensemble members (default --acceleration)\n"
+           "  --seeds <count>          Heightmaps of the ensemble members, from --seed on (default 1)\n"
+           "  --levels <count>         Nested simulation levels, each doubles the world size of the previous one (default 1)\n"
+           "  --arithmetic <float|fixed> Fixed point gives bitwise identical results on all machines and prints a state hash (default float)\n"
+           "  --load <file>            Start from a checkpoint, its grid and simulation parameters override the options above\n"
+           "  --save <file>            Write the final state to a checkpoint\n"
+           "  --outofcore <file>       Keep the grid in a tile file of that name and only the tiles in use in memory\n"
+           "  --budget <MB>            Memory for resident tiles of an out-of-core run (default 256)\n"
+           "  --processes <count>      Split the grid over a square number of processes (default 1)\n"
+           "  --transport <shm|tcp>    Halo exchange between processes over shared memory or TCP (default shm)\n"
+           "  --port <value>           First TCP port, process i listens on port + i (default 41000)\n"
+           "  --hosts <list>           Comma separated host per process for TCP (default 127.0.0.1 for all)\n"
+           "  --scaling <strong|weak>  Runs 1, 4, 9, ... up to --processes processes with the same total grid size\n"
+           "                           or the same grid size per process and prints the parallel efficiency\n"
+           "  --rank <index>           Run only this process of a distributed run, to start processes on several machines by hand\n"
+           "  --verify <0|1>           Check that every process ends up bitwise identical to a single process on the whole grid\n");
+  }
+
+  ezResult ParseUInt(const char* szValue, ezUInt32& out)
+  {
+    ezInt32 value = 0;
+    if(ezConversionUtils::StringToInt(szValue, value) == EZ_FAILURE || value < 0)
+      return EZ_FAILURE;
+    out = static_cast<ezUInt32>(value);
+    return EZ_SUCCESS;
+  }
+
+  ezResult ParseFloat(const char* szValue, float& out)
+  {
+    double value = 0.0;
+    if(ezConversionUtils::StringToFloat(szValue, value) == EZ_FAILURE)
+      return EZ_FAILURE;
+    out = static_cast<float>(value);
+    return EZ_SUCCESS;
+  }
+
+  ezResult ParseRange(const char* szValue, ParameterRange& out)
+  {
+    if(sscanf(szValue, "%f:%f:%u", &out.min, &out.max, &out.count) != 3 || out.count == 0)
+      return EZ_FAILURE;
+    return EZ_SUCCESS;
+  }
+
+  ezResult ParseCommandLine(int argc, char** argv, Settings& settings)
+  {
+    for(int i = 1; i < argc; ++i)
+    {
+      ezStringBuilder option(argv[i]);
+      if(option.IsEqual("--help"))
+        return EZ_FAILURE;
+      if(i + 1 >= argc)
+      {
+        ezLog::Error("Missing value for option \"%s\".", option.GetData());
+        return EZ_FAILURE;
+      }
+      const char* szValue = argv[++i];
+
+      ezResult result = EZ_FAILURE;
+      if(option.IsEqual("--size"))
+        result = ParseUInt(szValue, settings.gridResolution);
+      else if(option.IsEqual("--worldsize"))
+        result = ParseFloat(szValue, settings.gridWorldSize);
+      else if(option.IsEqual("--steps"))
+        result = ParseUInt(szValue, settings.numSteps);
+      else if(option.IsEqual("--seed"))
+        result = ParseUInt(szValue, settings.randomSeed);
+      else if(option.IsEqual("--stepspersecond"))
+        result = ParseFloat(szValue, settings.simulationStepsPerSecond);
+      else if(option.IsEqual("--damping"))
+        result = ParseFloat(szValue, settings.flowDamping);
+      else if(option.IsEqual("--acceleration"))
+        result = ParseFloat(szValue, settings.flowAcceleration);
+      else if(option.IsEqual("--threads"))
+        result = ParseUInt(szValue, settings.numThreads);
+      else if(option.IsEqual("--tilesize"))
+        result = ParseUInt(szValue, settings.tileSize);
+      else if(option.IsEqual("--fuse"))
+        result = ParseUInt(szValue, settings.numFusedSteps);
+      else if(option.IsEqual("--stepfactor"))
+        result = ParseFloat(szValue, settings.implicitStepFactor);
+      else if(option.IsEqual("--prefillrain"))
+        result = ParseFloat(szValue, settings.prefillRainDepth);
+      else if(option.IsEqual("--prefillvolume"))
+        result = ParseFloat(szValue, settings.prefillVolume);
+      else if(option.IsEqual("--levels"))
+        result = ParseUInt(szValue, settings.numLevels);
+      else if(option.IsEqual("--processes"))
+        result = ParseUInt(szValue, settings.numProcesses);
+      else if(option.IsEqual("--port"))
+        result = ParseUInt(szValue, settings.basePort);
+      else if(option.IsEqual("--rank"))
+        result = ParseUInt(szValue, settings.rank);
+      else if(option.IsEqual("--budget"))
+        result = ParseUInt(szValue, settings.memoryBudgetMB);
+      else if(option.IsEqual("--stepspersecondrange"))
+        result = ParseRange(szValue, settings.stepsPerSecondRange);
+      else if(option.IsEqual("--dampingrange"))
+        result = ParseRange(szValue, settings.dampingRange);
+      else if(option.IsEqual("--accelerationrange"))
+        result = ParseRange(szValue, settings.accelerationRange);
+      else if(option.IsEqual("--seeds"))
+        result = ParseUInt(szValue, settings.numEnsembleSeeds);
+      else if(option.IsEqual("--verify"))
+      {
+        ezUInt32 verify = 0;
+        result = ParseUInt(szValue, verify);
+        settings.verify = verify != 0;
+      }
+      else if(option.IsEqual("--transport") || option.IsEqual("--hosts") || option.IsEqual("--job") || option.IsEqual("--scaling") ||
+              option.IsEqual("--resultfile") || option.IsEqual("--arithmetic") || option.IsEqual("--load") || option.IsEqual("--save") ||
+              option.IsEqual("--outofcore") || option.IsEqual("--integrator") || option.IsEqual("--drainage") ||
+              option.IsEqual("--ensemble"))
+      {
+        const char** targets[] = { &settings.szTransport, &settings.szHosts, &settings.szJobName, &settings.szScaling, &settings.szResultFile,
+                                   &settings.szArithmetic, &settings.szLoadCheckpoint, &settings.szSaveCheckpoint,
+                                   &settings.szOutOfCoreFile, &settings.szIntegrator, &settings.szDrainagePrefix,
+                                   &settings.szEnsembleFile };
+        const char* names[] = { "--transport", "--hosts", "--job", "--scaling", "--resultfile", "--arithmetic", "--load", "--save", "--outofcore",
+                                "--integrator", "--drainage", "--ensemble" };
+        for(ezUInt32 name = 0; name < EZ_ARRAY_SIZE(names); ++name)
+        {
+          if(option.IsEqual(names[name]))
+            *targets[name] = szValue;
+        }
+        result = EZ_SUCCESS;
+      }
+      else
+        ezLog::Error("Unknown option \"%s\".", option.GetData());
+
+      if(result == EZ_FAILURE)
+      {
+        ezLog::Error("Invalid value \"%s\" for option \"%s\".", szValue, option.GetData());
+        return EZ_FAILURE;
+      }
+    }
+
+    if(settings.gridResolution < 2)
+    {
+      ezLog::Error("Grid resolution needs to be at least 2.");
+      return EZ_FAILURE;
+    }
+    if(settings.tileSize == 0)
+    {
+      ezLog::Error("Tile size needs to be at least 1.");
+      return EZ_FAILURE;
+    }
+    if(settings.numFusedSteps == 0)
+    {
+      ezLog::Error("At least one step needs to be fused.");
+      return EZ_FAILURE;
+    }
+    if(settings.numLevels == 0 || settings.numLevels > s_maxNumLevels)
+    {
+      ezLog::Error("Number of levels needs to be between 1 and %u.", s_maxNumLevels);
+      return EZ_FAILURE;
+    }
+    SimulationLevelConfig levels[s_maxNumLevels];
+    settings.GetLevelConfigs(levels);
+    if(NestedFlowSolver::ValidateLevels(levels, settings.numLevels) == EZ_FAILURE)
+      return EZ_FAILURE;
+
+    ezStringBuilder transport(settings.szTransport);
+    ezStringBuilder scaling(settings.szScaling);
+    if(!transport.IsEqual("shm") && !transport.IsEqual("tcp"))
+    {
+      ezLog::Error("Unknown transport \"%s\".", settings.szTransport);
+      return EZ_FAILURE;
+    }
+    if(!scaling.IsEqual("none") && !scaling.IsEqual("strong") && !scaling.IsEqual("weak"))
+    {
+      ezLog::Error("Unknown scaling benchmark \"%s\".", settings.szScaling);
+      return EZ_FAILURE;
+    }
+    ezStringBuilder arithmetic(settings.szArithmetic);
+    if(!arithmetic.IsEqual("float") && !arithmetic.IsEqual("fixed"))
+    {
+      ezLog::Error("Unknown arithmetic \"%s\".", settings.szArithmetic);
+      return EZ_FAILURE;
+    }
+    ezStringBuilder integrator(settings.szIntegrator);
+    if(!integrator.IsEqual("pipe") && !integrator.IsEqual("implicit") && !integrator.IsEqual("compare"))
+    {
+      ezLog::Error("Unknown integrator \"%s\".", settings.szIntegrator);
+      return EZ_FAILURE;
+    }
+
+    bool distributed = settings.numProcesses > 1 || settings.rank != Settings::s_noRank || !scaling.IsEqual("none");
+    bool prefill = settings.prefillRainDepth != Settings::s_noPrefill || settings.prefillVolume != Settings::s_noPrefill;
+    bool ensembleRanges = settings.stepsPerSecondRange.count > 0 || settings.dampingRange.count > 0 || settings.accelerationRange.count > 0 ||
+                          settings.numEnsembleSeeds != 1;
+    bool usedOptions[OPTION_COUNT] = { distributed, settings.szDrainagePrefix != NULL, settings.szEnsembleFile != NULL, settings.numLevels > 1,
+                           arithmetic.IsEqual("fixed"), settings.szOutOfCoreFile != NULL, integrator.IsEqual("compare"),
+                           integrator.IsEqual("implicit"), settings.szLoadCheckpoint != NULL, settings.szSaveCheckpoint != NULL, prefill,
+                           ensembleRanges, settings.verify };
+
+    // The first mode whose option is used runs, in the same order as in main. All other used options need to be allowed by that mode.
+    const ModeOptions* pMode = &s_modeOptions[EZ_ARRAY_SIZE(s_modeOptions) - 1];
+    for(ezUInt32 mode = 0; mode + 1 < EZ_ARRAY_SIZE(s_modeOptions); ++mode)
+    {
+      if(usedOptions[s_modeOptions[mode].selectingOption])
+      {
+        pMode = &s_modeOptions[mode];
+        break;
+      }
+    }
+    for(ezUInt32 option = 0; option < OPTION_COUNT; ++option)
+    {
+      if(usedOptions[option] && option != pMode->selectingOption && (pMode->allowedOptions & (1 << option)) == 0)
+      {
+        ezLog::Error("%s can't be used with %s.", s_optionNames[option], pMode->szName);
+        return EZ_FAILURE;
+      }
+    }
+
+    // Values that only matter for some modes.
+    if(!integrator.IsEqual("pipe") && settings.implicitStepFactor < 1.0f)
+    {
+      ezLog::Error("The step factor needs to be at least 1.");
+      return EZ_FAILURE;
+    }
+    if(prefill)
+    {
+      if((settings.prefillRainDepth < 0.0f && settings.prefillRainDepth != Settings::s_noPrefill) ||
+         (settings.prefillVolume < 0.0f && settings.prefillVolume != Settings::s_noPrefill))
+      {
+        ezLog::Error("Prefill rain depth and volume can't be negative.");
+        return EZ_FAILURE;
+      }
+      if(settings.szLoadCheckpoint)
+      {
+        ezLog::Error("Lakes can only be prefilled for a new heightmap, not for a checkpoint.");
+        return EZ_FAILURE;
+      }
+    }
+    if(settings.szEnsembleFile)
+    {
+      if(settings.numEnsembleSeeds == 0)
+      {
+        ezLog::Error("An ensemble needs at least one seed.");
+        return EZ_FAILURE;
+      }
+      const ParameterRange& stepsPerSecondRange = settings.stepsPerSecondRange;
+      if(settings.simulationStepsPerSecond <= 0.0f ||
+         (stepsPerSecondRange.count > 0 && ezMath::Min(stepsPerSecondRange.min, stepsPerSecondRange.max) <= 0.0f))
+      {
+        ezLog::Error("Steps per second need to be positive.");
+        return EZ_FAILURE;
+      }
+    }
+    if(settings.szOutOfCoreFile && settings.gridResolution % settings.tileSize != 0)
+    {
+      ezLog::Error("Out-of-core runs need a grid resolution that is a multiple of the tile size.");
+      return EZ_FAILURE;
+    }
+    if(distributed)
+    {
+      if(settings.basePort + settings.numProcesses > 65535)
+      {
+        ezLog::Error("Port range exceeds 65535.");
+        return EZ_FAILURE;
+      }
+      // The scaling benchmark checks every process count on its own.
+      if(scaling.IsEqual("none") && DistributedFlowSolver::ValidateDecomposition(settings.gridResolution, settings.numProcesses) == EZ_FAILURE)
+        return EZ_FAILURE;
+    }
+
+    return EZ_SUCCESS;
+  }
+
+  float ComputeTotalWater(const CpuFlowSolver& solver)
+  {
+    const FlowGridView& grid = solver.GetGridView();
+    double totalWater = 0.0;
+    for(ezUInt32 y = 0; y < solver.GetGridResolution(); ++y)
+    {
+      for(ezUInt32 x = 0; x < solver.GetGridResolution(); ++x)
+        totalWater += grid.water[solver.GetCellIndex(x, y)];
+    }
+    return static_cast<float>(totalWater);
+  }
+
+  /// Replaces the analytic lake of a new heightmap with water that settled in the basins, if the command line asks for it.
+  void PrefillLakes(const Settings& settings, ezColor* terrainData)
+  {
+    if(settings.prefillRainDepth == Settings::s_noPrefill && settings.prefillVolume == Settings::s_noPrefill)
+      return;
+
+    ezTime startTime = ezTime::Now();
+    LakePrefill lakePrefill(terrainData, settings.gridResolution);
+    float cellDistance = settings.gridWorldSize / settings.gridResolution;
+    double cellArea = cellDistance * cellDistance;
+    double volume;
+    if(settings.prefillVolume != Settings::s_noPrefill)
+      volume = lakePrefill.FillToVolume(terrainData, settings.prefillVolume / cellArea);
+    else
+      volume = lakePrefill.FillFromRain(terrainData, settings.prefillRainDepth);
+    printf("prefilled %u basins with %.1f m^3 of %.1f m^3 capacity in %.3f ms\n", lakePrefill.GetNumBasins(), volume * cellArea,
+           lakePrefill.GetTotalCapacity() * cellArea, (ezTime::Now() - startTime).GetMilliseconds());
+  }
+
+  /// Analyzes the drainage of a new heightmap or the terrain of a checkpoint and writes the rasters.
+  ezResult RunDrainageAnalysis(const Settings& commandLineSettings)
+  {
+    Random::Init(commandLineSettings.randomSeed);
+
+    Settings settings = commandLineSettings;
+    SimulationCheckpointReader checkpoint;
+    if(settings.szLoadCheckpoint)
+    {
+      if(checkpoint.Open(settings.szLoadCheckpoint) == EZ_FAILURE)
+        return EZ_FAILURE;
+      settings.gridResolution = checkpoint.GetInfo().gridResolution;
+      settings.gridWorldSize = checkpoint.GetInfo().gridWorldSize;
+    }
+
+    ezUInt32 numTexels = settings.gridResolution * settings.gridResolution;
+    ezColor* terrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, numTexels);
+    if(settings.szLoadCheckpoint)
+    {
+      checkpoint.CopyState(terrainData, NULL, NULL);
+      checkpoint.Close();
+    }
+    else
+      TerrainGenerator::CreateHeightmapFromNoise(terrainData, settings.gridResolution, settings.heightScale);
+    ezDynamicArray<float> terrainHeights;
+    terrainHeights.SetCount(numTexels);
+    for(ezUInt32 i = 0; i < numTexels; ++i)
+      terrainHeights[i] = terrainData[i].r;
+    EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData);
+
+    ezTime startTime = ezTime::Now();
+    DrainageAnalysis analysis(static_cast<ezArrayPtr<float>>(terrainHeights).GetPtr(), settings.gridResolution, settings.numThreads);
+    ezTime duration = ezTime::Now() - startTime;
+    printf("grid %ux%u: %u watersheds, %u pits routed over their passes in %.3f ms\n", settings.gridResolution, settings.gridResolution,
+           analysis.GetNumWatersheds(), analysis.GetNumPits(), duration.GetMilliseconds());
+
+    startTime = ezTime::Now();
+    if(analysis.ExportRasters(settings.szDrainagePrefix, settings.gridWorldSize / settings.gridResolution) == EZ_FAILURE)
+      return EZ_FAILURE;
+    printf("wrote rasters %s_*.bil in %.3f ms\n", settings.szDrainagePrefix, (ezTime::Now() - startTime).GetMilliseconds());
+    return EZ_SUCCESS;
+  }
+
+  /// Runs one member per combination of the swept parameters and seeds, prints their metrics and writes them to the ensemble file.
+  ezResult RunEnsemble(const Settings& settings)
+  {
+    FlowEnsemble ensemble(settings.gridResolution, settings.gridWorldSize, settings.heightScale);
+    ParameterRange stepsPerSecondRange = settings.stepsPerSecondRange;
+    ParameterRange dampingRange = settings.dampingRange;
+    ParameterRange accelerationRange = settings.accelerationRange;
+    if(stepsPerSecondRange.count == 0)
+      stepsPerSecondRange.min = settings.simulationStepsPerSecond;
+    if(dampingRange.count == 0)
+      dampingRange.min = settings.flowDamping;
+    if(accelerationRange.count == 0)
+      accelerationRange.min = settings.flowAcceleration;
+
+    for(ezUInt32 seed = 0; seed < settings.numEnsembleSeeds; ++seed)
+    {
+      for(ezUInt32 stepsPerSecond = 0; stepsPerSecond < ezMath::Max(stepsPerSecondRange.count, 1u); ++stepsPerSecond)
+      {
+        for(ezUInt32 damping = 0; damping < ezMath::Max(dampingRange.count, 1u); ++damping)
+        {
+          for(ezUInt32 acceleration = 0; acceleration < ezMath::Max(accelerationRange.count, 1u); ++acceleration)
+          {
+            FlowEnsemble::Member member;
+            member.randomSeed = settings.randomSeed + seed;
+            member.simulationStepsPerSecond = stepsPerSecondRange.GetValue(stepsPerSecond);
+            member.flowDamping = dampingRange.GetValue(damping);
+            member.flowAcceleration = accelerationRange.GetValue(acceleration);
+            ensemble.AddMember(member);
+          }
+        }
+      }
+    }
+
+    // All members cover the simulated time of --steps at --stepspersecond.
+    ezTime simulatedTime = ezTime::Seconds(settings.numSteps / settings.simulationStepsPerSecond);
+    ezTime startTime = ezTime::Now();
+    ensemble.Run(simulatedTime, settings.tileSize, settings.numThreads);
+    ezTime duration = ezTime::Now() - startTime;
+
+    printf("member       seed  steps/s  damping    accel  steps  water m^3 start -> end   max depth  max m/s    wet  change m/s\n");
+    double numCellSteps = 0.0;
+    ezUInt32 numDiverged = 0;
+    for(ezUInt32 i = 0; i < ensemble.GetNumMembers(); ++i)
+    {
+      const FlowEnsemble::Member& member = ensemble.GetMember(i);
+      const FlowEnsemble::Metrics& metrics = ensemble.GetMetrics(i);
+      if(metrics.diverged)
+      {
+        printf("%6u %10u %8.2f %8.4f %8.3f %6u diverged\n", i, member.randomSeed, member.simulationStepsPerSecond, member.flowDamping,
+               member.flowAcceleration, metrics.numSteps);
+        ++numDiverged;
+      }
+      else
+      {
+        printf("%6u %10u %8.2f %8.4f %8.3f %6u %12.1f -> %-12.1f %9.3f %8.3f %6.3f %11.6f\n", i, member.randomSeed,
+               member.simulationStepsPerSecond, member.flowDamping, member.flowAcceleration, metrics.numSteps, metrics.initialWaterVolume,
+               metrics.finalWaterVolume, metrics.maxWaterDepth, metrics.maxFlowSpeed, metrics.wetFraction, metrics.maxWaterChangeRate);
+      }
+      numCellSteps += static_cast<double>(metrics.numSteps) * settings.gridResolution * settings.gridResolution;
+    }
+    printf("%u members of %ux%u cells over %.2f simulated seconds, %u diverged, in %.3f ms\n", ensemble.GetNumMembers(),
+           settings.gridResolution, settings.gridResolution, simulatedTime.GetSeconds(), numDiverged, duration.GetMilliseconds());
+    printf("%.2f members/s, %.2f Mcells/s\n", ensemble.GetNumMembers() / duration.GetSeconds(), numCellSteps / duration.GetSeconds() * 1e-6);
+
+    if(ensemble.WriteCsv(settings.szEnsembleFile) == EZ_FAILURE)
+      return EZ_FAILURE;
+    printf("wrote metrics to %s\n", settings.szEnsembleFile);
+    return EZ_SUCCESS;
+  }
+
+  ezResult RunSimulation(const Settings& commandLineSettings)
+  {
+    Random::Init(commandLineSettings.randomSeed);
+
+    Settings settings = commandLineSettings;
+    SimulationCheckpointReader checkpoint;
+    ezUInt32 firstStepIndex = 0;
+    if(settings.szLoadCheckpoint)
+    {
+      if(checkpoint.Open(settings.szLoadCheckpoint) == EZ_FAILURE)
+        return EZ_FAILURE;
+      const SimulationCheckpointInfo& info = checkpoint.GetInfo();
+      settings.gridResolution = info.gridResolution;
+      settings.gridWorldSize = info.gridWorldSize;
+      settings.heightScale = info.heightScale;
+      settings.simulationStepsPerSecond = 1.0f / info.simulationStepLengthSeconds;
+      settings.flowDamping = info.flowDamping;
+      settings.flowAcceleration = info.flowAcceleration;
+      firstStepIndex = info.simulationStepIndex;
+    }
+
+    // Steps of the semi-implicit integrator are longer, checkpoints still store the step length and step index of the pipe model.
+    bool implicit = ezStringBuilder(settings.szIntegrator).IsEqual("implicit");
+    ezTime pipeStepLength = ezTime::Seconds(1.0f / settings.simulationStepsPerSecond);
+    ezTime stepLength = implicit ? pipeStepLength * settings.implicitStepFactor : pipeStepLength;
+
+    CpuFlowSolver solver(settings.gridResolution);
+    float cellDistance = settings.gridWorldSize / settings.gridResolution;
+    solver.SetSimulationParameters(SimulationParameters::Compute(stepLength, settings.flowDamping, settings.flowAcceleration, cellDistance));
+    solver.SetNumThreads(settings.numThreads);
+    solver.SetTileSize(settings.tileSize);
+    solver.SetNumFusedSteps(settings.numFusedSteps);
+    if(implicit)
+      solver.SetIntegrator(CpuFlowSolver::Integrator::SEMI_IMPLICIT);
+
+    // Kept for the channels of the terrain data that the solver doesn't store.
+    ezUInt32 numTexels = settings.gridResolution * settings.gridResolution;
+    ezColor* terrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, numTexels);
+    if(settings.szLoadCheckpoint)
+    {
+      ezTime startTime = ezTime::Now();
+      ezColor* outgoingFlow = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, numTexels);
+      checkpoint.CopyState(terrainData, outgoingFlow, NULL);
+      solver.SetState(terrainData, outgoingFlow);
+      EZ_DEFAULT_DELETE_RAW_BUFFER(outgoingFlow);
+      checkpoint.Close();
+      printf("restored checkpoint at step %u in %.3f ms\n", firstStepIndex, (ezTime::Now() - startTime).GetMilliseconds());
+    }
+    else
+    {
+      TerrainGenerator::CreateHeightmapFromNoise(terrainData, settings.gridResolution, settings.heightScale);
+      PrefillLakes(settings, terrainData);
+      solver.SetState(terrainData, NULL);
+    }
+
+    float initialWater = ComputeTotalWater(solver);
+
+    ezTime startTime = ezTime::Now();
+    solver.PerformSimulationSteps(settings.numSteps);
+    ezTime duration = ezTime::Now() - startTime;
+
+    double numCells = static_cast<double>(settings.gridResolution) * settings.gridResolution;
+    double stepsPerSecond = settings.numSteps / duration.GetSeconds();
+    if(implicit)
+    {
+      printf("grid %ux%u, semi-implicit integrator, %.3f ms steps, %u threads\n", settings.gridResolution, settings.gridResolution,
+             stepLength.GetMilliseconds(), solver.GetNumThreads());
+    }
+    else
+    {
+      printf("grid %ux%u, tiles %ux%u, %u fused steps, %u threads\n", settings.gridResolution, settings.gridResolution, settings.tileSize,
+             settings.tileSize, settings.numFusedSteps, solver.GetNumThreads());
+    }
+    printf("%u steps in %.3f ms\n", settings.numSteps, duration.GetMilliseconds());
+    printf("%.2f steps/s, %.2f Mcells/s, %.2f GB/s estimated memory traffic\n", stepsPerSecond, numCells * stepsPerSecond * 1e-6,
+           solver.EstimateMemoryTrafficPerStep() * stepsPerSecond * 1e-9);
+    printf("%.2f simulated seconds per second\n", stepsPerSecond * stepLength.GetSeconds());
+    printf("total water %.3f -> %.3f\n", initialWater, ComputeTotalWater(solver));
+
+    if(settings.szSaveCheckpoint)
+    {
+      SimulationCheckpointInfo info;
+      info.gridResolution = settings.gridResolution;
+      info.gridWorldSize = settings.gridWorldSize;
+      info.heightScale = settings.heightScale;
+      info.simulationStepLengthSeconds = static_cast<float>(pipeStepLength.GetSeconds());
+      info.flowDamping = settings.flowDamping;
+      info.flowAcceleration = settings.flowAcceleration;
+      // Pipe model steps of the same simulated time, a fractional step factor must not round every implicit step.
+      double numPipeSteps = settings.numSteps * (stepLength.GetSeconds() / pipeStepLength.GetSeconds());
+      info.simulationStepIndex = firstStepIndex + static_cast<ezUInt32>(numPipeSteps + 0.5);
+
+      // The writer finishes before it is destroyed.
+      SimulationCheckpointWriter writer;
+      writer.BeginCheckpoint(info);
+      ezMemoryUtils::Copy(writer.GetTerrainData(), terrainData, numTexels);
+      solver.GetTerrainData(writer.GetTerrainData());
+      solver.GetOutgoingFlow(writer.GetOutgoingFlow());
+      solver.GetFlowMap(writer.GetFlowMap());
+      writer.WriteAsync(settings.szSaveCheckpoint);
+    }
+    EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData);
+
+    return EZ_SUCCESS;
+  }
+
+  /// Simulates the same time span with the pipe model and with the semi-implicit integrator at --stepfactor times longer steps, starting
+  /// from the same heightmap. Prints simulated seconds per wall clock second of both and how far the final water heights deviate.
+  void RunIntegratorComparison(const Settings& settings)
+  {
+    Random::Init(settings.randomSeed);
+
+    ezUInt32 numTexels = settings.gridResolution * settings.gridResolution;
+    ezColor* terrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, numTexels);
+    TerrainGenerator::CreateHeightmapFromNoise(terrainData, settings.gridResolution, settings.heightScale);
+    PrefillLakes(settings, terrainData);
+
+    float cellDistance = settings.gridWorldSize / settings.gridResolution;
+    ezTime pipeStepLength = ezTime::Seconds(1.0f / settings.simulationStepsPerSecond);
+    ezUInt32 numImplicitSteps = ezMath::Max(static_cast<ezUInt32>(settings.numSteps / settings.implicitStepFactor + 0.5f), 1u);
+    // Exactly the simulated time of the pipe model, even if the factor doesn't divide the number of steps.
+    ezTime implicitStepLength = pipeStepLength * (static_cast<double>(settings.numSteps) / numImplicitSteps);
+
+    CpuFlowSolver pipe(settings.gridResolution);
+    pipe.SetSimulationParameters(SimulationParameters::Compute(pipeStepLength, settings.flowDamping, settings.flowAcceleration, cellDistance));
+    pipe.SetNumThreads(settings.numThreads);
+    pipe.SetTileSize(settings.tileSize);
+    pipe.SetNumFusedSteps(settings.numFusedSteps);
+    pipe.SetState(terrainData, NULL);
+
+    CpuFlowSolver implicit(settings.gridResolution);
+    implicit.SetSimulationParameters(SimulationParameters::Compute(implicitStepLength, settings.flowDamping, settings.flowAcceleration, cellDistance));
+    implicit.SetNumThreads(settings.numThreads);
+    implicit.SetIntegrator(CpuFlowSolver::Integrator::SEMI_IMPLICIT);
+    implicit.SetState(terrainData, NULL);
+    EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData);
+
+    float initialWater = ComputeTotalWater(pipe);
+    double simulatedSeconds = pipeStepLength.GetSeconds() * settings.numSteps;
+
+    ezTime startTime = ezTime::Now();
+    pipe.PerformSimulationSteps(settings.numSteps);
+    ezTime pipeDuration = ezTime::Now() - startTime;
+
+    ezUInt32 numIterations = 0;
+    startTime = ezTime::Now();
+    for(ezUInt32 step = 0; step < numImplicitSteps; ++step)
+    {
+      implicit.PerformSimulationStep();
+      numIterations += implicit.GetSemiImplicitIntegrator()->GetLastNumIterations();
+    }
+    ezTime implicitDuration = ezTime::Now() - startTime;
+
+    double squaredDifferenceSum = 0.0;
+    float maxDifference = 0.0f;
+    for(ezUInt32 y = 0; y < settings.gridResolution; ++y)
+    {
+      for(ezUInt32 x = 0; x < settings.gridResolution; ++x)
+      {
+        float difference = ezMath::Abs(implicit.GetGridView().water[implicit.GetCellIndex(x, y)] - pipe.GetGridView().water[pipe.GetCellIndex(x, y)]);
+        squaredDifferenceSum += difference * difference;
+        maxDifference = ezMath::Max(maxDifference, difference);
+      }
+    }
+
+    double pipeRate = simulatedSeconds / pipeDuration.GetSeconds();
+    double implicitRate = simulatedSeconds / implicitDuration.GetSeconds();
+    printf("grid %ux%u, %.3f simulated seconds, %u threads\n", settings.gridResolution, settings.gridResolution, simulatedSeconds,
+           pipe.GetNumThreads());
+    printf("pipe:     %u steps of %.3f ms in %.3f ms, %.2f simulated seconds per second, total water %.3f -> %.3f\n", settings.numSteps,
+           pipeStepLength.GetMilliseconds(), pipeDuration.GetMilliseconds(), pipeRate, initialWater, ComputeTotalWater(pipe));
+    printf("implicit: %u steps of %.3f ms in %.3f ms, %.2f simulated seconds per second, total water %.3f -> %.3f\n", numImplicitSteps,
+           implicitStepLength.GetMilliseconds(), implicitDuration.GetMilliseconds(), implicitRate, initialWater, ComputeTotalWater(implicit));
+    printf("implicit: %.1f sweeps per step on average\n", static_cast<double>(numIterations) / numImplicitSteps);
+    printf("speedup %.2fx, water height difference rms %.4f max %.4f\n", implicitRate / pipeRate, ezMath::Sqrt(static_cast<float>(squaredDifferenceSum / numTexels)),
+           maxDifference);
+  }
+
+  /// Same as RunSimulation with FixedPointFlowSolver. The hash can be compared between machines, builds and thread counts.
+  void RunFixedPointSimulation(const Settings& settings)
+  {
+    Random::Init(settings.randomSeed);
+
+    FixedPointFlowSolver solver(settings.gridResolution);
+    float cellDistance = settings.gridWorldSize / settings.gridResolution;
+    solver.SetSimulationParameters(SimulationParameters::Compute(ezTime::Seconds(1.0f / settings.simulationStepsPerSecond),
+                                                                 settings.flowDamping, settings.flowAcceleration, cellDistance));
+    solver.SetNumThreads(settings.numThreads);
+
+    ezColor* terrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, settings.gridResolution * settings.gridResolution);
+    TerrainGenerator::CreateHeightmapFromNoise(terrainData, settings.gridResolution, settings.heightScale);
+    PrefillLakes(settings, terrainData);
+    solver.SetState(terrainData, NULL);
+    EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData);
+
+    ezInt64 initialWater = solver.ComputeTotalWater();
+
+    ezTime startTime = ezTime::Now();
+    solver.PerformSimulationSteps(settings.numSteps);
+    ezTime duration = ezTime::Now() - startTime;
+
+    double numCells = static_cast<double>(settings.gridResolution) * settings.gridResolution;
+    double stepsPerSecond = settings.numSteps / duration.GetSeconds();
+    double fixedPointScale = 1.0 / (1 << FixedPointFlowSolver::s_heightFractionBits);
+    printf("grid %ux%u, fixed point, %u threads\n", settings.gridResolution, settings.gridResolution, solver.GetNumThreads());
+    printf("%u steps in %.3f ms\n", settings.numSteps, duration.GetMilliseconds());
+    printf("%.2f steps/s, %.2f Mcells/s\n", stepsPerSecond, numCells * stepsPerSecond * 1e-6);
+    printf("total water %.3f -> %.3f (%lld -> %lld)\n", initialWater * fixedPointScale, solver.ComputeTotalWater() * fixedPointScale,
+           initialWater, solver.ComputeTotalWater());
+    printf("state hash %016llx\n", solver.ComputeStateHash());
+  }
+
+  /// Same as RunSimulation on a grid that is stored in a tile file. Only wet tiles and their neighbours are processed.
+  ezResult RunOutOfCoreSimulation(const Settings& settings)
+  {
+    OutOfCoreFlowSolver solver(settings.gridResolution, settings.tileSize, static_cast<ezUInt64>(settings.memoryBudgetMB) << 20);
+    float cellDistance = settings.gridWorldSize / settings.gridResolution;
+    solver.SetSimulationParameters(SimulationParameters::Compute(ezTime::Seconds(1.0f / settings.simulationStepsPerSecond),
+                                                                 settings.flowDamping, settings.flowAcceleration, cellDistance));
+    if(solver.CreateStore(settings.szOutOfCoreFile) == EZ_FAILURE)
+      return EZ_FAILURE;
+
+    // The heightmap is never held in memory as a whole. Like the processes of a distributed run, every tile reseeds to get the same noise.
+    ezTime startTime = ezTime::Now();
+    ezColor* terrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, settings.tileSize * settings.tileSize);
+    float regionSize = static_cast<float>(settings.tileSize) / settings.gridResolution;
+    for(ezUInt32 tileY = 0; tileY < solver.GetNumTilesPerSide(); ++tileY)
+    {
+      for(ezUInt32 tileX = 0; tileX < solver.GetNumTilesPerSide(); ++tileX)
+      {
+        Random::Init(settings.randomSeed);
+        TerrainGenerator::CreateHeightmapRegionFromNoise(terrainData, settings.tileSize, settings.heightScale,
+                                                         ezVec2(tileX * regionSize, tileY * regionSize), regionSize);
+        solver.SetTileState(tileX, tileY, terrainData);
+      }
+    }
+    EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData);
+    printf("created tile file in %.3f ms\n", (ezTime::Now() - startTime).GetMilliseconds());
+
+    // Keep the lake in the center resident, as the renderer would around the camera.
+    solver.SetFocus(ezVec2(settings.gridResolution * 0.5f), settings.gridResolution * 0.25f);
+
+    double initialWater = solver.ComputeTotalWater();
+
+    startTime = ezTime::Now();
+    solver.PerformSimulationSteps(settings.numSteps);
+    solver.Flush();
+    ezTime duration = ezTime::Now() - startTime;
+
+    double numCells = static_cast<double>(settings.gridResolution) * settings.gridResolution;
+    double stepsPerSecond = settings.numSteps / duration.GetSeconds();
+    ezUInt32 numTiles = solver.GetNumTilesPerSide() * solver.GetNumTilesPerSide();
+    TileCache::Stats stats = solver.GetTileCache().GetStats();
+    printf("grid %ux%u out-of-core, tiles %ux%u, %u MB budget\n", settings.gridResolution, settings.gridResolution, settings.tileSize,
+           settings.tileSize, settings.memoryBudgetMB);
+    printf("%u steps in %.3f ms\n", settings.numSteps, duration.GetMilliseconds());
+    printf("%.2f steps/s, %.2f Mcells/s\n", stepsPerSecond, numCells * stepsPerSecond * 1e-6);
+    printf("%u of %u tiles active, at most %u resident\n", solver.GetNumActiveTiles(), numTiles, stats.maxResidentTiles);
+    printf("%llu hits, %llu misses, %llu prefetched, %llu evicted, %.1f MB read, %.1f MB written\n", stats.numHits, stats.numMisses,
+           stats.numPrefetches, stats.numEvictions, stats.bytesRead / 1048576.0, stats.bytesWritten / 1048576.0);
+    printf("total water %.3f -> %.3f\n", initialWater, solver.ComputeTotalWater());
+
+    return EZ_SUCCESS;
+  }
+
+  void RunNestedSimulation(const Settings& settings)
+  {
+    Random::Init(settings.randomSeed);
+
+    SimulationLevelConfig levels[s_maxNumLevels];
+    settings.GetLevelConfigs(levels);
+    NestedFlowSolver solver(levels, settings.numLevels);
+    solver.SetSimulationParameters(ezTime::Seconds(1.0f / settings.simulationStepsPerSecond), settings.flowDamping, settings.flowAcceleration);
+
+    // The heightmap spans the coarsest level, finer levels sample the same noise at a higher resolution.
+    float totalWorldSize = levels[settings.numLevels - 1].gridWorldSize;
+    ezColor* terrainData[s_maxNumLevels];
+    for(ezUInt32 level = 0; level < settings.numLevels; ++level)
+    {
+      solver.GetLevelSolver(level).SetNumThreads(settings.numThreads);
+      solver.GetLevelSolver(level).SetTileSize(settings.tileSize);
+
+      float regionSize = levels[level].gridWorldSize / totalWorldSize;
+      terrainData[level] = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, settings.gridResolution * settings.gridResolution);
+      TerrainGenerator::CreateHeightmapRegionFromNoise(terrainData[level], settings.gridResolution, settings.heightScale,
+                                                       ezVec2(0.5f - regionSize * 0.5f), regionSize);
+    }
+    solver.SetState(terrainData);
+    for(ezUInt32 level = 0; level < settings.numLevels; ++level)
+      EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData[level]);
+
+    double initialWater = solver.ComputeTotalWaterVolume();
+
+    ezTime startTime = ezTime::Now();
+    solver.PerformSimulationSteps(settings.numSteps);
+    ezTime duration = ezTime::Now() - startTime;
+
+    double numCells = static_cast<double>(solver.GetNumCells());
+    double stepsPerSecond = settings.numSteps / duration.GetSeconds();
+    printf("%u levels of %ux%u cells, %.0f m to %.0f m, %u threads\n", settings.numLevels, settings.gridResolution, settings.gridResolution,
+           levels[0].gridWorldSize, totalWorldSize, solver.GetLevelSolver(0).GetNumThreads());
+    printf("%.0f cells instead of %.0f for a single grid\n", numCells,
+           static_cast<double>(totalWorldSize / levels[0].GetCellDistance()) * (totalWorldSize / levels[0].GetCellDistance()));
+    printf("%u steps in %.3f ms\n", settings.numSteps, duration.GetMilliseconds());
+    printf("%.2f steps/s, %.2f Mcells/s\n", stepsPerSecond, numCells * stepsPerSecond * 1e-6);
+    printf("total water volume %.3f -> %.3f\n", initialWater, solver.ComputeTotalWaterVolume());
+  }
+
+  /// Simulates the whole grid with a single CpuFlowSolver and checks that the sub-domain of the distributed solver is bitwise identical.
+  ezResult VerifySubDomain(const Settings& settings, DistributedFlowSolver& solver)
+  {
+    const CpuFlowSolver& localSolver = solver.GetLocalSolver();
+    CpuFlowSolver reference(settings.gridResolution);
+    reference.SetSimulationParameters(localSolver.GetSimulationParameters());
+    reference.SetNumThreads(localSolver.GetNumThreads());
+    reference.SetTileSize(settings.tileSize);
+
+    Random::Init(settings.randomSeed);
+    ezColor* terrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, settings.gridResolution * settings.gridResolution);
+    TerrainGenerator::CreateHeightmapFromNoise(terrainData, settings.gridResolution, settings.heightScale);
+    reference.SetState(terrainData, NULL);
+    EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData);
+    reference.PerformSimulationSteps(settings.numSteps);
+
+    const FlowGridView& local = localSolver.GetGridView();
+    const FlowGridView& whole = reference.GetGridView();
+    ezUInt32 numDifferentCells = 0;
+    for(ezUInt32 y = 0; y < localSolver.GetGridResolution(); ++y)
+    {
+      for(ezUInt32 x = 0; x < localSolver.GetGridResolution(); ++x)
+      {
+        ezInt32 localIndex = localSolver.GetCellIndex(x, y);
+        ezInt32 wholeIndex = reference.GetCellIndex(solver.GetSubDomainOriginX() + x, solver.GetSubDomainOriginY() + y);
+        bool identical = ezMemoryUtils::ByteCompare(&local.water[localIndex], &whole.water[wholeIndex]) == 0;
+        for(ezUInt32 direction = 0; direction < FlowGridView::NUM_FLOW_DIRECTIONS; ++direction)
+          identical &= ezMemoryUtils::ByteCompare(&local.flow[direction][localIndex], &whole.flow[direction][wholeIndex]) == 0;
+        if(!identical)
+          ++numDifferentCells;
+      }
+    }
+
+    if(numDifferentCells > 0)
+    {
+      ezLog::Error("Rank %u: %u cells differ from a single solver on the whole grid.", settings.rank, numDifferentCells);
+      return EZ_FAILURE;
+    }
+    printf("rank %u: sub-domain is bitwise identical to a single solver on the whole grid\n", settings.rank);
+    return EZ_SUCCESS;
+  }
+
+  /// Runs the own sub-domain of a distributed simulation, started by the launcher.
+  ezResult RunDistributedProcess(const Settings& settings)
+  {
+    ezUInt32 subDomainResolution = settings.gridResolution / DistributedFlowSolver::GetNumRanksPerSide(settings.numProcesses);
+    HaloTransport* transport = NULL;
+    if(ezStringBuilder(settings.szTransport).IsEqual("tcp"))
+      transport = EZ_DEFAULT_NEW(TcpTransport)(settings.rank, settings.numProcesses, static_cast<ezUInt16>(settings.basePort), settings.szHosts);
+    else
+      transport = EZ_DEFAULT_NEW(SharedMemoryTransport)(settings.szJobName, settings.rank, settings.numProcesses, subDomainResolution);
+    if(transport->Connect() == EZ_FAILURE)
+    {
+      EZ_DEFAULT_DELETE(transport);
+      return EZ_FAILURE;
+    }
+
+    ezResult result = EZ_SUCCESS;
+    {
+      DistributedFlowSolver solver(*transport, settings.gridResolution);
+      CpuFlowSolver& localSolver = solver.GetLocalSolver();
+      float cellDistance = settings.gridWorldSize / settings.gridResolution;
+      localSolver.SetSimulationParameters(SimulationParameters::Compute(ezTime::Seconds(1.0f / settings.simulationStepsPerSecond),
+                                                                        settings.flowDamping, settings.flowAcceleration, cellDistance));
+      localSolver.SetTileSize(settings.tileSize);
+      // By default all processes together use all cores.
+      if(settings.numThreads > 0)
+        localSolver.SetNumThreads(settings.numThreads);
+      else
+        localSolver.SetNumThreads(ezMath::Max(localSolver.GetNumThreads() / settings.numProcesses, 1u));
+
+      // Every process creates only its own part of the same heightmap as a single process would.
+      Random::Init(settings.randomSeed);
+      ezColor* terrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, subDomainResolution * subDomainResolution);
+      TerrainGenerator::CreateHeightmapSectionFromNoise(terrainData, settings.gridResolution, settings.heightScale, solver.GetSubDomainOriginX(),
+                                                        solver.GetSubDomainOriginY(), subDomainResolution);
+      result = solver.SetState(terrainData);
+      EZ_DEFAULT_DELETE_RAW_BUFFER(terrainData);
+
+      double initialWater = 0.0;
+      double finalWater = 0.0;
+      ezTime duration;
+      if(result == EZ_SUCCESS)
+        result = solver.ComputeTotalWater(initialWater);
+      if(result == EZ_SUCCESS)
+        result = transport->Barrier();
+      if(result == EZ_SUCCESS)
+      {
+        ezTime startTime = ezTime::Now();
+        result = solver.PerformSimulationSteps(settings.numSteps);
+        if(result == EZ_SUCCESS)
+          result = transport->Barrier();
+        duration = ezTime::Now() - startTime;
+      }
+      if(result == EZ_SUCCESS)
+        result = solver.ComputeTotalWater(finalWater);
+
+      if(result == EZ_FAILURE)
+        ezLog::Error("Rank %u stopped, the other processes are gone.", settings.rank);
+      else if(settings.rank == 0)
+      {
+        double numCells = static_cast<double>(settings.gridResolution) * settings.gridResolution;
+        double stepsPerSecond = settings.numSteps / duration.GetSeconds();
+        printf("grid %ux%u over %u processes (%s), sub-domains %ux%u, %u threads each\n", settings.gridResolution, settings.gridResolution,
+               settings.numProcesses, settings.szTransport, subDomainResolution, subDomainResolution, localSolver.GetNumThreads());
+        printf("%u steps in %.3f ms\n", settings.numSteps, duration.GetMilliseconds());
+        printf("%.2f steps/s, %.2f Mcells/s\n", stepsPerSecond, numCells * stepsPerSecond * 1e-6);
+        printf("total water %.3f -> %.3f\n", initialWater, finalWater);
+
+        ezOSFile resultFile;
+        if(settings.szResultFile && resultFile.Open(settings.szResultFile, ezFileMode::Write) == EZ_SUCCESS)
+        {
+          ezStringBuilder stepsPerSecondString;
+          stepsPerSecondString.Format("%.17g", stepsPerSecond);
+          resultFile.Write(stepsPerSecondString.GetData(), stepsPerSecondString.GetElementCount());
+          resultFile.Close();
+        }
+      }
+
+      if(result == EZ_SUCCESS && settings.verify)
+        result = VerifySubDomain(settings, solver);
+    }
+
+    EZ_DEFAULT_DELETE(transport);
+    return result;
+  }
+
+  /// Forwards the own command line to the processes, followed by the given extra arguments. Later options override earlier ones.
+  ezResult LaunchProcesses(int argc, char** argv, ezUInt32 numProcesses, const ezDynamicArray<ezStringBuilder>& extraArguments)
+  {
+    ezDynamicArray<const char*> arguments;
+    for(int i = 1; i < argc; ++i)
+      arguments.PushBack(argv[i]);
+    for(ezUInt32 i = 0; i < extraArguments.GetCount(); ++i)
+      arguments.PushBack(extraArguments[i].GetData());
+    return Launcher::RunProcesses(numProcesses, arguments);
+  }
+
+  /// Runs the distributed simulation with 1, 4, 9, ... processes.
+  ///
+  /// Strong scaling keeps the total grid size, ideally steps/s grow with the number of processes. Weak scaling keeps the grid size per
+  /// process, ideally steps/s stay the same.
+  ezResult RunScalingBenchmark(int argc, char** argv, const Settings& settings)
+  {
+    bool weakScaling = ezStringBuilder(settings.szScaling).IsEqual("weak");
+    const char* szResultFile = "simtool_scaling_result.tmp";
+
+    printf("%s scaling, %u steps, %s transport\n", settings.szScaling, settings.numSteps, settings.szTransport);
+    printf("processes        grid     steps/s    Mcells/s  efficiency\n");
+    double baseStepsPerSecond = 0.0;
+    for(ezUInt32 numProcessesPerSide = 1; numProcessesPerSide * numProcessesPerSide <= settings.numProcesses; ++numProcessesPerSide)
+    {
+      ezUInt32 numProcesses = numProcessesPerSide * numProcessesPerSide;
+      ezUInt32 gridResolution = weakScaling ? settings.gridResolution * numProcessesPerSide : settings.gridResolution;
+      if(DistributedFlowSolver::ValidateDecomposition(gridResolution, numProcesses) == EZ_FAILURE)
+        continue;
+
+      ezDynamicArray<ezStringBuilder> extraArguments;
+      extraArguments.SetCount(10);
+      extraArguments[0] = "--scaling";
+      extraArguments[1] = "none";
+      extraArguments[2] = "--processes";
+      extraArguments[3].Format("%u", numProcesses);
+      extraArguments[4] = "--size";
+      extraArguments[5].Format("%u", gridResolution);
+      extraArguments[6] = "--worldsize";
+      extraArguments[7].Format("%f", settings.gridWorldSize * gridResolution / settings.gridResolution);
+      extraArguments[8] = "--resultfile";
+      extraArguments[9] = szResultFile;
+      ezOSFile::DeleteFile(szResultFile);
+      if(LaunchProcesses(argc, argv, numProcesses, extraArguments) == EZ_FAILURE)
+        return EZ_FAILURE;
+
+      ezOSFile resultFile;
+      char szResult[64] = {};
+      if(resultFile.Open(szResultFile, ezFileMode::Read) == EZ_SUCCESS)
+      {
+        resultFile.Read(szResult, sizeof(szResult) - 1);
+        resultFile.Close();
+      }
+      ezOSFile::DeleteFile(szResultFile);
+      double stepsPerSecond = 0.0;
+      if(ezConversionUtils::StringToFloat(szResult, stepsPerSecond) == EZ_FAILURE)
+      {
+        ezLog::Error("No result for %u processes.", numProcesses);
+        return EZ_FAILURE;
+      }
+
+      if(baseStepsPerSecond == 0.0)
+        baseStepsPerSecond = stepsPerSecond;
+      double speedup = stepsPerSecond / baseStepsPerSecond;
+      double efficiency = weakScaling ? speedup : speedup / numProcesses;
+      double numCells = static_cast<double>(gridResolution) * gridResolution;
+      printf("%9u %5ux%-5u %11.2f %11.2f %10.1f%%\n", numProcesses, gridResolution, gridResolution, stepsPerSecond,
+             numCells * stepsPerSecond * 1e-6, efficiency * 100.0);
+    }
+    return EZ_SUCCESS;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  ezStartup::StartupCore();
+  ezGlobalLog::AddLogWriter(ezLogWriter::Console::LogMessageHandler);
+
+  int exitCode = 0;
+  Settings settings;
+  if(ParseCommandLine(argc, argv, settings) == EZ_SUCCESS)
+  {
+    ezResult result = EZ_SUCCESS;
+    if(settings.rank != Settings::s_noRank)
+      result = RunDistributedProcess(settings);
+    else if(!ezStringBuilder(settings.szScaling).IsEqual("none"))
+      result = RunScalingBenchmark(argc, argv, settings);
+    else if(settings.numProcesses > 1)
+      result = LaunchProcesses(argc, argv, settings.numProcesses, ezDynamicArray<ezStringBuilder>());
+    else if(settings.szDrainagePrefix)
+      result = RunDrainageAnalysis(settings);
+    else if(settings.szEnsembleFile)
+      result = RunEnsemble(settings);
+    else if(settings.numLevels > 1)
+      RunNestedSimulation(settings);
+    else if(ezStringBuilder(settings.szArithmetic).IsEqual("fixed"))
+      RunFixedPointSimulation(settings);
+    else if(settings.szOutOfCoreFile)
+      result = RunOutOfCoreSimulation(settings);
+    else if(ezStringBuilder(settings.szIntegrator).IsEqual("compare"))
+      RunIntegratorComparison(settings);
+    else
+      result = RunSimulation(settings);
+
+    if(result == EZ_FAILURE)
+      exitCode = 1;
+  }
+  else
+  {
+    PrintUsage();
+    exitCode = 1;
+  }
+
+  ezGlobalLog::RemoveLogWriter(ezLogWriter::Console::LogMessageHandler);
+  ezStartup::ShutdownCore();
+  return exitCode;
+}
@@ -0,0 +1,106 @@
+// Sparse simulation: Only tiles that contain water or outgoing flow and their direct neighbours are simulated.
+// A tile is the 16x16 block of cells processed by a single workgroup of flowUpdate.comp/flowApply.comp.
+//
+// Steady state detection: If enabled (TileSleepSteps in simulationCommon.glsl), tiles whose water and flow hardly changed for a number
+// of steps fall asleep and are treated like dry ones. Faces between simulated and skipped tiles are closed, so a sleeping tile keeps its
+// water until an awake neighbour or a brush changes it enough to wake it up.
+
+#define SIMULATION_TILE_SIZE 16
+
+// Non-zero for every tile that contains water or outgoing flow after the last simulation step (or got water from a brush) and is awake.
+layout(binding = 0, std430) restrict buffer TileWetFlags
+{
+	uint TileWet[];
+};
+
+// Flags for the result of the current step. Cleared by flowActiveTiles.comp, written by flowApply.comp.
+layout(binding = 1, std430) restrict buffer TileWetFlagsNext
+{
+	uint TileWetNext[];
+};
+
+// Indirect dispatch arguments followed by all tiles that need to be simulated in this step.
+layout(binding = 2, std430) restrict buffer ActiveTileList
+{
+	uint NumActiveTiles;
+	uint DispatchY;
+	uint DispatchZ;
+	uint ActiveTiles[];
+};
+
+// Steady state detection, one entry per tile.
+struct TileActivityInfo
+{
+	// Simulated steps in a row in which the tile had water and nothing changed by more than TileSleepThreshold_perStep, up to
+	// TileSleepSteps. The tile sleeps once it reached TileSleepSteps. Reset by brushes.
+	uint QuietSteps;
+	// Largest change of an outgoing flow in the last step as float bits. Written by flowUpdate.comp, read by flowApply.comp.
+	uint MaxFlowChangeBits;
+	// Sum of the water heights after the last simulated step in TELEMETRY_WATER_SCALE fixed point. A sleeping tile isn't simulated but
+	// still holds this water, flowActiveTiles.comp adds it to the telemetry instead.
+	uint WaterSum;
+};
+layout(binding = 9, std430) restrict buffer TileActivityBuffer
+{
+	TileActivityInfo TileActivity[];
+};
+
+// Multi-rate simulation: A tile is only simulated every 2^TileRateShift steps and uses a correspondingly longer time step.
+layout(binding = 6, std430) restrict readonly buffer TileRates
+{
+	uint TileRateShift[];
+};
+
+uint PackTile(ivec2 tile)
+{
+	return uint(tile.x) | (uint(tile.y) << 16);
+}
+
+ivec2 UnpackTile(uint packedTile)
+{
+	return ivec2(packedTile & 0xFFFF, packedTile >> 16);
+}
+
+uint GetTileIndex(ivec2 tile, int numTilesPerSide)
+{
+	return uint(tile.x + tile.y * numTilesPerSide);
+}
+
+// Water moves at most one cell per step, so only tiles that are wet themselves or have a wet direct neighbour can change.
+// Ignores the simulation rate of the tile.
+bool IsTileActive(ivec2 tile, int numTilesPerSide)
+{
+	uint tileIndex = GetTileIndex(tile, numTilesPerSide);
+	bool tileActive = TileWet[tileIndex] != 0;
+	tileActive = tileActive || (tile.x > 0 && TileWet[tileIndex - 1] != 0);
+	tileActive = tileActive || (tile.x < numTilesPerSide - 1 && TileWet[tileIndex + 1] != 0);
+	tileActive = tileActive || (tile.y > 0 && TileWet[tileIndex - numTilesPerSide] != 0);
+	tileActive = tileActive || (tile.y < numTilesPerSide - 1 && TileWet[tileIndex + numTilesPerSide] != 0);
+	return tileActive;
+}
+
+// Bit mask of the active direct neighbours, in the order of the outgoing flow (+x, -x, +y, -y). Neighbours outside the grid count as
+// active, water that flows over the grid border leaves the simulation as before.
+uint GetActiveNeighbourTiles(ivec2 tile, int numTilesPerSide)
+{
+	uint mask = 0;
+	mask |= tile.x == numTilesPerSide - 1 || IsTileActive(tile + ivec2(1, 0), numTilesPerSide) ? 1u : 0u;
+	mask |= tile.x == 0 || IsTileActive(tile - ivec2(1, 0), numTilesPerSide) ? 2u : 0u;
+	mask |= tile.y == numTilesPerSide - 1 || IsTileActive(tile + ivec2(0, 1), numTilesPerSide) ? 4u : 0u;
+	mask |= tile.y == 0 || IsTileActive(tile - ivec2(0, 1), numTilesPerSide) ? 8u : 0u;
+	return mask;
+}
+
+// Faces of a cell that lead into a tile which is not simulated in this step, in the order of the outgoing flow.
+bvec4 GetClosedFaces(ivec2 cellInTile, uint activeNeighbourTiles)
+{
+	return bvec4(cellInTile.x == SIMULATION_TILE_SIZE - 1 && (activeNeighbourTiles & 1u) == 0,
+				cellInTile.x == 0 && (activeNeighbourTiles & 2u) == 0,
+				cellInTile.y == SIMULATION_TILE_SIZE - 1 && (activeNeighbourTiles & 4u) == 0,
+				cellInTile.y == 0 && (activeNeighbourTiles & 8u) == 0);
+}
+
+bool IsTileSimulatedInStep(uint tileIndex, uint stepIndex)
+{
+	return (stepIndex & ((1u << TileRateShift[tileIndex]) - 1u)) == 0;
+}
\ No newline at end of file
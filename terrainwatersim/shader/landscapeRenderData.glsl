@@ -7,6 +7,9 @@ layout(binding = 5, shared) uniform GlobalLandscapeInfo
 
 	// Determines how many triangles per Clip Space unit the shader tries to generate
 	float TrianglesPerClipSpaceUnit;
+
+	// Quiet steps after which a simulation tile sleeps, for the overlay of tileSleepOverlay.glsl. 0 disables the overlay.
+	uint TileSleepOverlaySteps;
 };
 
 layout(binding = 0) uniform sampler2D TerrainInfo;
\ No newline at end of file
@@ -10,4 +10,65 @@ layout(binding = 5, shared) uniform SimulationParameters
 
 	// To be accurate: TimeStep / CellDistance²
 	float CellAreaInv_timeScaled;
-};
\ No newline at end of file
+
+	// Running index of the current step, set by Terrain before every step. Needed for multi-rate simulation.
+	uint SimulationStepIndex;
+
+	// Entry of SimulationStats.Steps that the current step writes its telemetry to, TELEMETRY_DISABLED if none is recorded.
+	uint TelemetrySlot;
+
+	// Steady state detection, see activeTiles.glsl: Quiet steps after which a tile falls asleep, 0 if disabled.
+	uint TileSleepSteps;
+	// Largest change of a water height (or of the height an outgoing flow moves) within a step that still counts as quiet.
+	float TileSleepThreshold_perStep;
+
+	// Asynchronous CPU simulation only: Weight of the newest state when its water heights are interpolated, see simulationPlanes.comp.
+	float AsyncWaterInterpolation;
+};
+
+#define TELEMETRY_DISABLED 0xFFFFFFFFu
+
+// Water heights are summed up in fixed point with this many steps per meter, floats can't be added atomically.
+// A workgroup adds at most 16*16 cells, so this leaves room for an average depth of 4096m before its sum overflows 32 bit.
+#define TELEMETRY_WATER_SCALE 4096.0
+
+// Conservation and stability measures of a single step, only written if telemetry is enabled.
+struct StepTelemetry
+{
+	// Sum of all water heights in TELEMETRY_WATER_SCALE fixed point, split into two words since there are no 64 bit atomics.
+	uint TotalWaterLow;
+	uint TotalWaterHigh;
+	// Deepest water, float bits.
+	uint MaxDepthBits;
+	// Largest outgoing flow of a cell in a single direction, float bits.
+	uint MaxOutgoingFlowBits;
+	// Wet cells whose outgoing flow had to be scaled down to not take more water than there is.
+	uint NumClampedCells;
+};
+
+// Reductions over all simulated cells of a frame. Read back by the CPU a few frames later.
+layout(binding = 5, std430) restrict buffer SimulationStats
+{
+	// Maximum of |flow| / water depth. Stored as float bits, for non-negative floats they have the same order.
+	uint MaxFlowSpeedBits;
+	// Deepest water, float bits. Limits the wave speed for adaptive timesteps.
+	uint MaxWaterDepthBits;
+	// Summed over all steps of the frame.
+	uint NumSimulatedTiles;
+	uint NumSleepingTiles;
+
+	// One entry per step of the frame, see TelemetrySlot.
+	StepTelemetry Steps[];
+};
+
+// Adds summed water heights in TELEMETRY_WATER_SCALE fixed point to the total of the current step.
+void AddTelemetryWater(uint water)
+{
+	// 64 bit fixed point addition, carry into the high word if the low word overflowed.
+	uint previousWaterLow = atomicAdd(Steps[TelemetrySlot].TotalWaterLow, water);
+	if(previousWaterLow + water < previousWaterLow)
+		atomicAdd(Steps[TelemetrySlot].TotalWaterHigh, 1u);
+}
+
+// Lower bound for the water depth when deriving flow speed, avoids extreme speeds for very thin water films.
+#define MIN_FLOW_SPEED_DEPTH 0.05
\ No newline at end of file
@@ -0,0 +1,22 @@
+// Storage layout of the simulation state, Terrain passes both defines when it compiles the simulation shaders.
+//
+// By default terrain and water height are .r and .a of the TerrainData image that rendering reads as well, so every step rewrites the
+// static terrain height along with the water. With SIMULATION_PLANAR_STORAGE the simulation works on two R32F planes instead:
+// TerrainHeight only changes when the terrain is replaced, WaterHeight is the only one written per step. simulationPlanes.comp
+// splits TerrainData into the planes and merges the water back once per frame.
+//
+// SIMULATION_FLOW_FORMAT is the image format of the outgoing flow, rgba16f halves its traffic.
+
+#ifndef SIMULATION_PLANAR_STORAGE
+	#define SIMULATION_PLANAR_STORAGE 0
+#endif
+#ifndef SIMULATION_FLOW_FORMAT
+	#define SIMULATION_FLOW_FORMAT rgba32f
+#endif
+
+// Image that determines the grid size, bound in both layouts.
+#if SIMULATION_PLANAR_STORAGE
+	#define SIMULATION_GRID_IMAGE WaterHeight
+#else
+	#define SIMULATION_GRID_IMAGE TerrainData
+#endif
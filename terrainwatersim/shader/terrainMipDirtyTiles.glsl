@@ -0,0 +1,24 @@
+// Incremental mip generation of the terrain data: Passes that change terrain data mark the tiles they wrote, terrainMips.comp only
+// rebuilds the mips of marked tiles. A tile is appended to the list once per frame, the flag is cleared again by terrainMips.comp.
+
+// Non-zero for every tile that is already in DirtyTiles.
+layout(binding = 7, std430) restrict buffer MipDirtyTileFlags
+{
+	uint TileDirty[];
+};
+
+// Indirect dispatch arguments followed by all tiles whose mips need to be rebuilt.
+layout(binding = 8, std430) restrict buffer MipDirtyTileList
+{
+	uint NumDirtyTiles;
+	uint DirtyDispatchY;
+	uint DirtyDispatchZ;
+	uint DirtyTiles[];
+};
+
+void MarkTileDirty(ivec2 tile, uint tileIndex)
+{
+	// Testing before the atomic avoids most of them, tiles stay dirty for all steps of a frame.
+	if(TileDirty[tileIndex] == 0 && atomicExchange(TileDirty[tileIndex], 1) == 0)
+		DirtyTiles[atomicAdd(NumDirtyTiles, 1)] = PackTile(tile);
+}
@@ -3,6 +3,7 @@
 #include "constantbuffers.glsl"
 #include "landscapeRenderData.glsl"
 #include "helper.glsl"
+#include "tileSleepOverlay.glsl"
 
 layout(location = 0) in vec3 inWorldPos;
 layout(location = 1) in vec2 inHeightmapCoord;
@@ -116,5 +117,6 @@ void main()
 
 	// clever fog http://www.iquilezles.org/www/articles/fog/fog.htm
 	FragColor.xyz = ApplyFog(FragColor.xyz, CameraPosition, cameraDistance, toCamera);
+	FragColor.xyz = ApplyTileSleepOverlay(FragColor.xyz, inHeightmapCoord);
 	FragColor.a = 1.0;
 }
\ No newline at end of file
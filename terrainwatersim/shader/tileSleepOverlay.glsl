@@ -0,0 +1,34 @@
+// Debug overlay of the steady state detection (see activeTiles.glsl): Awake tiles are tinted red, sleeping ones blue.
+// Terrain binds the wet flags of the last step and the tile activity only while the overlay is enabled.
+
+layout(binding = 0, std430) restrict readonly buffer TileWetFlags
+{
+	uint TileWet[];
+};
+
+// Same layout as in activeTiles.glsl.
+struct TileActivityInfo
+{
+	uint QuietSteps;
+	uint MaxFlowChangeBits;
+	uint WaterSum;
+};
+layout(binding = 9, std430) restrict readonly buffer TileActivityBuffer
+{
+	TileActivityInfo TileActivity[];
+};
+
+vec3 ApplyTileSleepOverlay(vec3 color, vec2 heightmapCoord)
+{
+	if(TileSleepOverlaySteps == 0)
+		return color;
+
+	int numTilesPerSide = textureSize(TerrainInfo, 0).x / 16;
+	ivec2 tile = clamp(ivec2(heightmapCoord * numTilesPerSide), ivec2(0), ivec2(numTilesPerSide - 1));
+	int tileIndex = tile.x + tile.y * numTilesPerSide;
+	if(TileActivity[tileIndex].QuietSteps >= TileSleepOverlaySteps)
+		return mix(color, vec3(0.1, 0.3, 1.0), 0.5);
+	if(TileWet[tileIndex] != 0)
+		return mix(color, vec3(1.0, 0.2, 0.1), 0.5);
+	return color;
+}
\ No newline at end of file
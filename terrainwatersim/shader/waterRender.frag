@@ -3,6 +3,7 @@
 #include "constantbuffers.glsl"
 #include "landscapeRenderData.glsl"
 #include "helper.glsl"
+#include "tileSleepOverlay.glsl"
 
 layout(location = 0) in vec3 inWorldPos;
 layout(location = 1) in vec2 inHeightmapCoord;
@@ -349,6 +350,6 @@ void main()
 	color = ApplyFog(color, CameraPosition, cameraDistance, toCamera);
 
 	// Color output
-	FragColor.rgb = vec3(color);
+	FragColor.rgb = ApplyTileSleepOverlay(vec3(color), inHeightmapCoord);
 	FragColor.a = 1.0;
 }
\ No newline at end of file
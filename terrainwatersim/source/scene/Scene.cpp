@@ -56,6 +56,34 @@ namespace SceneConfig
     ezCVarFloat g_simulationStepsPerSecond("Simulation steps per second", 60, ezCVarFlags::Save, "group='Simulation' min=30 max=300");
     ezCVarFloat g_flowDamping("Flow Damping", 0.98f, ezCVarFlags::Save, "group='Simulation' min=0.0 max=1.0 step=0.01");
     ezCVarFloat g_flowAcceleration("Flow Acceleration", 10.0f, ezCVarFlags::Save, "group='Simulation' min=0.5 max=100.0 step=0.1");
+    ezCVarBool g_adaptiveTimestep("Adaptive Timestep", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarFloat g_courantNumber("Courant Number", 0.5f, ezCVarFlags::Save, "group='Simulation' min=0.05 max=1.0 step=0.05");
+    ezCVarBool g_multiRateZones("Multi-Rate Zones", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarFloat g_fullRateZoneSize("Full Rate Zone Size", 128.0f, ezCVarFlags::Save, "group='Simulation' min=16.0 max=1024.0 step=16.0");
+    ezCVarBool g_tileSleeping("Tile Sleeping", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarInt g_tileSleepSteps("Tile Sleep Steps", 120, ezCVarFlags::Save, "group='Simulation' min=1 max=1200");
+    ezCVarFloat g_tileSleepThreshold("Tile Sleep Threshold", 0.001f, ezCVarFlags::Save, "group='Simulation' min=0.0 max=0.05 step=0.0005");
+    ezCVarBool g_showTileSleep("Show Tile Sleep", false, ezCVarFlags::None, "group='Simulation'");
+    ezCVarBool g_asyncCpuSimulation("Async CPU Simulation", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarBool g_implicitIntegrator("Implicit Integrator", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarFloat g_implicitStepFactor("Implicit Step Factor", 20.0f, ezCVarFlags::Save, "group='Simulation' min=1.0 max=50.0 step=1.0");
+    ezCVarBool g_planarSimulationStorage("Planar Simulation Storage", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarBool g_halfPrecisionFlow("Half Precision Flow", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarBool g_prefillLakes("Prefill Lakes", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarFloat g_prefillRainDepth("Prefill Rain Depth", 5.0f, ezCVarFlags::Save, "group='Simulation' min=0.0 max=100.0 step=0.5");
+    ezCVarBool g_simulationPaused("Pause Simulation", false, ezCVarFlags::None, "group='Simulation'");
+    ezCVarBool g_recordHistory("Record History", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarInt g_historyInterval("History Interval Steps", 30, ezCVarFlags::Save, "group='Simulation' min=1 max=600");
+    ezCVarInt g_historyBudget("History Budget MB", 256, ezCVarFlags::Save, "group='Simulation' min=16 max=4096");
+    ezCVarBool g_recordTelemetry("Record Telemetry", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarBool g_telemetryLog("Write Telemetry Log", false, ezCVarFlags::None, "group='Simulation'");
+    ezCVarBool g_waterQueries("Water Queries", false, ezCVarFlags::Save, "group='Simulation'");
+    ezCVarFloat g_riverSourceCatchment("River Source Catchment", 50000.0f, ezCVarFlags::Save, "group='Simulation' min=1000.0 max=1000000.0 step=1000.0");
+    ezCVarFloat g_riverSourceRate("River Source Rate", 0.5f, ezCVarFlags::Save, "group='Simulation' min=0.0 max=10.0 step=0.05");
+
+    const char* g_checkpointFilename = "simulation.checkpoint";
+    const char* g_telemetryLogFilename = "simulation_telemetry.csv";
+    const char* g_drainageRasterPrefix = "drainage";
   }
 
   namespace PostPro
@@ -218,7 +246,69 @@ void Scene::InitConfig()
   CreateCVarInterfaceEntry(SceneConfig::Simulation::g_simulationStepsPerSecond, ezDelegate<void(float)>(&Terrain::SetSimulationStepsPerSecond, m_terrain));
   CreateCVarInterfaceEntry(SceneConfig::Simulation::g_flowDamping, ezDelegate<void(float)>(&Terrain::SetFlowDamping, m_terrain));
   CreateCVarInterfaceEntry(SceneConfig::Simulation::g_flowAcceleration, ezDelegate<void(float)>(&Terrain::SetFlowAcceleration, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_adaptiveTimestep, ezDelegate<void(bool)>(&Terrain::SetAdaptiveTimestep, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_courantNumber, ezDelegate<void(float)>(&Terrain::SetCourantNumber, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_multiRateZones, ezDelegate<void(bool)>(&Terrain::SetMultiRateZones, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_fullRateZoneSize, ezDelegate<void(float)>(&Terrain::SetFullRateZoneSize, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_tileSleeping, ezDelegate<void(bool)>(&Terrain::SetTileSleeping, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_tileSleepSteps, [&](int numSteps) { m_terrain->SetTileSleepSteps(static_cast<ezUInt32>(numSteps)); });
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_tileSleepThreshold, ezDelegate<void(float)>(&Terrain::SetTileSleepThreshold, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_showTileSleep, ezDelegate<void(bool)>(&Terrain::SetShowTileSleep, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_asyncCpuSimulation, ezDelegate<void(bool)>(&Terrain::SetAsyncCpuSimulation, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_implicitIntegrator, ezDelegate<void(bool)>(&Terrain::SetImplicitIntegrator, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_implicitStepFactor, ezDelegate<void(float)>(&Terrain::SetImplicitStepFactor, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_planarSimulationStorage, ezDelegate<void(bool)>(&Terrain::SetPlanarSimulationStorage, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_halfPrecisionFlow, ezDelegate<void(bool)>(&Terrain::SetHalfPrecisionFlow, m_terrain));
+  CreateStatInterfaceEntry("CPU Simulation Load", "group='Simulation'");
+  CreateStatInterfaceEntry("Simulation Steps", "group='Simulation'");
+  CreateStatInterfaceEntry("Simulation Step Length", "group='Simulation'");
+  CreateStatInterfaceEntry("Dropped Simulation Time", "group='Simulation'");
+  CreateStatInterfaceEntry("Max Flow Speed", "group='Simulation'");
+  CreateStatInterfaceEntry("Simulated Tiles", "group='Simulation'");
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_prefillLakes, ezDelegate<void(bool)>(&Terrain::SetPrefillLakes, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_prefillRainDepth, ezDelegate<void(float)>(&Terrain::SetPrefillRainDepth, m_terrain));
   m_pUserInterface->AddButton("Reset Simulation", ezDelegate<void()>([&]() { m_terrain->CreateHeightmapFromNoiseAndResetSim(); }), "group='Simulation'");
+  m_pUserInterface->AddButton("Save Checkpoint", ezDelegate<void()>([&]() { m_terrain->SaveCheckpoint(SceneConfig::Simulation::g_checkpointFilename); }), "group='Simulation'");
+  m_pUserInterface->AddButton("Load Checkpoint", ezDelegate<void()>([&]()
+  {
+    // The checkpoint brings its own simulation parameters, show them in the interface.
+    if(m_terrain->LoadCheckpoint(SceneConfig::Simulation::g_checkpointFilename) == EZ_SUCCESS)
+    {
+      SceneConfig::Simulation::g_simulationStepsPerSecond = m_terrain->GetSimulationStepsPerSecond();
+      SceneConfig::Simulation::g_flowDamping = m_terrain->GetFlowDamping();
+      SceneConfig::Simulation::g_flowAcceleration = m_terrain->GetFlowAcceleration();
+    }
+  }), "group='Simulation'");
+  m_pUserInterface->AddSeperator("Rewind", "group='Simulation'");
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_simulationPaused, ezDelegate<void(bool)>(&Terrain::SetSimulationPaused, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_recordHistory, ezDelegate<void(bool)>(&Terrain::SetRecordHistory, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_historyInterval, [&](int numSteps) { m_terrain->SetHistoryInterval(static_cast<ezUInt32>(numSteps)); });
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_historyBudget, [&](int megabytes) { m_terrain->SetHistoryMemoryBudget(static_cast<ezUInt32>(megabytes)); });
+  CreateStatInterfaceEntry("Simulation History", "group='Simulation'");
+  m_pUserInterface->AddButton("Rewind", ezDelegate<void()>([&]() { m_terrain->ScrubHistory(-1); }), "group='Simulation'");
+  m_pUserInterface->AddButton("Forward", ezDelegate<void()>([&]() { m_terrain->ScrubHistory(1); }), "group='Simulation'");
+  m_pUserInterface->AddSeperator("Telemetry", "group='Simulation'");
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_recordTelemetry, ezDelegate<void(bool)>(&Terrain::SetRecordTelemetry, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_telemetryLog, [&](bool writeLog)
+  {
+    m_terrain->SetTelemetryLog(writeLog ? SceneConfig::Simulation::g_telemetryLogFilename : NULL);
+  });
+  CreateStatInterfaceEntry("Water Volume", "group='Simulation'");
+  CreateStatInterfaceEntry("Water Volume Drift", "group='Simulation'");
+  CreateStatInterfaceEntry("Max Water Depth", "group='Simulation'");
+  CreateStatInterfaceEntry("Max Outgoing Flow", "group='Simulation'");
+  CreateStatInterfaceEntry("Clamped Cells", "group='Simulation'");
+  m_pUserInterface->AddSeperator("Queries", "group='Simulation'");
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_waterQueries, ezDelegate<void(bool)>(&Terrain::SetWaterQueriesEnabled, m_terrain));
+  CreateStatInterfaceEntry("Water Below Camera", "group='Simulation'");
+  m_pUserInterface->AddSeperator("Drainage", "group='Simulation'");
+  m_pUserInterface->AddButton("Analyze Drainage", ezDelegate<void()>([&]() { m_terrain->AnalyzeDrainage(); }), "group='Simulation'");
+  CreateStatInterfaceEntry("Drainage", "group='Simulation'");
+  m_pUserInterface->AddButton("Export Drainage Rasters", ezDelegate<void()>([&]() { m_terrain->ExportDrainageRasters(SceneConfig::Simulation::g_drainageRasterPrefix); }), "group='Simulation'");
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_riverSourceCatchment, ezDelegate<void(float)>(&Terrain::SetRiverSourceCatchment, m_terrain));
+  CreateCVarInterfaceEntry(SceneConfig::Simulation::g_riverSourceRate, ezDelegate<void(float)>(&Terrain::SetRiverSourceRate, m_terrain));
+  m_pUserInterface->AddButton("Place River Sources", ezDelegate<void()>([&]() { m_terrain->PlaceRiverSources(); }), "group='Simulation'");
+  m_pUserInterface->AddButton("Clear River Sources", ezDelegate<void()>([&]() { m_terrain->ClearRiverSources(); }), "group='Simulation'");
 
 
   // post processing
@@ -366,6 +456,16 @@ ezResult Scene::Update(ezTime lastFrameDuration)
   // visibility
   m_terrain->UpdateVisibilty(m_pCamera->GetPosition());
 
+  // Water below the camera, mostly to see the water queries at work.
+  ezVec2 cameraPositionXZ(m_pCamera->GetPosition().x, m_pCamera->GetPosition().z);
+  float surfaceHeight, depth;
+  ezVec2 velocity;
+  if(m_terrain->QueryWater(&cameraPositionXZ, 1, &surfaceHeight, &depth, &velocity) == EZ_SUCCESS)
+    statString.Format("%.2f m deep, %.2f m/s", depth, velocity.GetLength());
+  else
+    statString = "-";
+  ezStats::SetStat("Water Below Camera", statString.GetData());
+
 
   //ezAngle angle = ezAngle::Radian(ezSystemTime::Now().GetSeconds() / 4);
   //m_GlobalSceneInfo["GlobalDirLightDirection"].Set(ezVec3((float)ezMath::Sin(angle), ezMath::Abs(ezMath::Cos(angle)), 0.0f).GetNormalized());
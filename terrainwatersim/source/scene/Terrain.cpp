@@ -1,7 +1,16 @@
 #include "PCH.h"
 #include "Terrain.h"
 
-#include "math/NoiseGenerator.h"
+#include "simulation/TerrainGenerator.h"
+#include "simulation/SimulationParameters.h"
+#include "simulation/SimulationCheckpoint.h"
+#include "simulation/SimulationHistory.h"
+#include "simulation/AsyncFlowSimulation.h"
+#include "simulation/SimulationTelemetry.h"
+#include "simulation/WaterSurfaceQueries.h"
+#include "simulation/HeightBoundsPyramid.h"
+#include "simulation/LakePrefill.h"
+#include "simulation/DrainageAnalysis.h"
 
 #include "InstancedGeomClipMapping.h"
 
@@ -15,30 +24,94 @@
 #include "..\config\GlobalCVar.h"
 #include <Foundation\Math\Rect.h>
 #include <Foundation\Time\Time.h>
+#include <Foundation\Utilities\Stats.h>
 
 const float Terrain::m_maxTesselationFactor = 64.0f;
+const float Terrain::s_minAdaptiveWaveDepth = 0.05f;
 
 Terrain::Terrain(const ezSizeU32& screenSize) :
   m_gridWorldSize(1024.0f),
   m_gridResolution(1024),
   m_minPatchSizeWorld(16.0f),
   m_heightScale(300.0f),
+  m_prefillLakes(false),
+  m_prefillRainDepth(5.0f),
   m_anisotropicFiltering(false),
+  m_showTileSleep(false),
 
   m_simulationStepLength(ezTime::Seconds(1.0f / 60.0f)),
   m_flowDamping(0.98f),
   m_flowAcceleration(10.0f),
+  m_adaptiveTimestep(false),
+  m_courantNumber(0.5f),
+  m_currentSimulationStepLength(ezTime::Seconds(1.0f / 60.0f)),
+  m_maxFlowSpeed(0.0f),
+  m_maxWaterDepth(0.0f),
+  m_multiRateZones(false),
+  m_fullRateZoneSize(128.0f),
+  m_tileSleeping(false),
+  m_tileSleepSteps(120),
+  m_lastTileSleepSteps(0),
+  m_tileSleepThreshold(0.001f),
+  m_planarSimulationStorage(false),
+  m_halfPrecisionFlow(false),
+  m_simulationStepIndex(0),
+  m_lastCameraPosition(0.0f),
 
   m_terrainRenderShader("terrainRender"),
   m_waterRenderShader("waterRender"),
+  m_activeTilesShader("activeTiles"),
   m_applyFlowShader("applyFlow"),
   m_updateFlowShader("updateFlow"),
   m_copyShader("copyRefraction"),
   m_waterBrushShader("waterBrush"),
+  m_terrainMipsShader("terrainMips"),
+  m_heightBoundsShader("heightBounds"),
+  m_splitSimulationPlanesShader("splitSimulationPlanes"),
+  m_mergeSimulationPlanesShader("mergeSimulationPlanes"),
+  m_interpolateAsyncWaterShader("interpolateAsyncWater"),
 
   m_terrainData(NULL),
   m_waterOutgoingFlow(NULL),
   m_waterFlowMap(NULL),
+  m_simulationTerrainHeight(NULL),
+  m_simulationWaterHeight(NULL),
+  m_currentTileWetBuffer(0),
+  m_currentSimulationStatsBuffer(0),
+  m_heightBounds(NULL),
+  m_currentHeightBoundsReadbackBuffer(0),
+  m_drainageAnalysis(NULL),
+  m_telemetry(NULL),
+  m_recordTelemetry(false),
+  m_telemetryBrushPending(false),
+  m_anyReducedRateTile(false),
+  m_checkpointWriter(NULL),
+  m_history(NULL),
+  m_historyMemoryBudget(256 << 20),
+  m_recordHistory(false),
+  m_historyInterval(30),
+  m_simulationPaused(false),
+  m_historyPosition(s_liveHistoryPosition),
+  m_lastHistoryStepIndex(0),
+  m_historyReadbackBuffer(0),
+  m_historyReadbackFence(NULL),
+  m_historyReadbackStepIndex(0),
+  m_waterQueries(NULL),
+  m_waterQueriesEnabled(false),
+  m_waterQueriesOutdated(false),
+  m_waterQueryReadbackBuffer(0),
+  m_waterQueryReadbackFence(NULL),
+  m_waterQueryReadbackStepIndex(0),
+  m_asyncSimulation(NULL),
+  m_asyncCpuSimulation(false),
+  m_asyncTerrainData(NULL),
+  m_asyncPreviousWaterHeight(NULL),
+  m_asyncWaterHeight(NULL),
+  m_asyncInterpolationDone(true),
+  m_implicitIntegrator(false),
+  m_implicitStepFactor(20.0f),
+  m_riverSourceCatchment(50000.0f),
+  m_riverSourceRate(0.5f),
 
   m_textureGrassDiffuseSpec(NULL),
   m_textureStoneDiffuseSpec(NULL),
@@ -51,6 +124,7 @@ Terrain::Terrain(const ezSizeU32& screenSize) :
   EZ_LOG_BLOCK("Terrain");
 
   m_geomClipMaps = EZ_DEFAULT_NEW(InstancedGeomClipMapping)(m_minPatchSizeWorld, 8, 5);
+  m_checkpointWriter = EZ_DEFAULT_NEW(SimulationCheckpointWriter)();
 
   // shader init
   m_terrainRenderShader.AddShaderFromFile(gl::ShaderObject::ShaderType::VERTEX, "terrainRender.vert");
@@ -65,13 +139,20 @@ Terrain::Terrain(const ezSizeU32& screenSize) :
   m_waterRenderShader.AddShaderFromFile(gl::ShaderObject::ShaderType::FRAGMENT, "waterRender.frag");
   m_waterRenderShader.CreateProgram();
   
-  m_applyFlowShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "flowApply.comp");
-  m_applyFlowShader.CreateProgram();
-  m_updateFlowShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "flowUpdate.comp");
-  m_updateFlowShader.CreateProgram();
-
-  m_waterBrushShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "waterBrush.comp");
-  m_waterBrushShader.CreateProgram();
+  LoadSimulationShaders();
+  m_activeTilesShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "flowActiveTiles.comp");
+  m_activeTilesShader.CreateProgram();
+
+  m_terrainMipsShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "terrainMips.comp");
+  m_terrainMipsShader.CreateProgram();
+  m_heightBoundsShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "heightBounds.comp");
+  m_heightBoundsShader.CreateProgram();
+  m_splitSimulationPlanesShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "simulationPlanes.comp", { "SIMULATION_PLANES_SPLIT" });
+  m_splitSimulationPlanesShader.CreateProgram();
+  m_mergeSimulationPlanesShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "simulationPlanes.comp");
+  m_mergeSimulationPlanesShader.CreateProgram();
+  m_interpolateAsyncWaterShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "simulationPlanes.comp", { "SIMULATION_PLANES_INTERPOLATE" });
+  m_interpolateAsyncWaterShader.CreateProgram();
   
   m_copyShader.AddShaderFromFile(gl::ShaderObject::ShaderType::VERTEX, "screenTri.vert");
   m_copyShader.AddShaderFromFile(gl::ShaderObject::ShaderType::FRAGMENT, "textureOutput.frag");
@@ -79,10 +160,9 @@ Terrain::Terrain(const ezSizeU32& screenSize) :
 
   // UBO init
   m_landscapeInfoUBO.Init({ &m_terrainRenderShader, &m_waterRenderShader }, "GlobalLandscapeInfo");
-  m_simulationParametersUBO.Init({ &m_applyFlowShader, &m_updateFlowShader }, "SimulationParameters");
+  m_simulationParametersUBO.Init({ &m_applyFlowShader, &m_updateFlowShader, &m_activeTilesShader }, "SimulationParameters");
   m_waterRenderingUBO.Init({ &m_waterRenderShader }, "WaterRendering");
   m_terrainRenderingUBO.Init({ &m_terrainRenderShader }, "TerrainRendering");
-  m_brushUBO.Init({ &m_waterBrushShader }, "BrushInfo");
 
 
   // set some default values
@@ -117,6 +197,99 @@ Terrain::Terrain(const ezSizeU32& screenSize) :
     gl::SamplerObject::Desc(gl::SamplerObject::Filter::NEAREST, gl::SamplerObject::Filter::NEAREST, gl::SamplerObject::Filter::NEAREST, gl::SamplerObject::Border::REPEAT, 1));
 
 
+  // Sparse simulation buffers
+  ezUInt32 numSimulationTiles = GetNumSimulationTilesPerSide() * GetNumSimulationTilesPerSide();
+  glGenBuffers(2, m_tileWetBuffer);
+  for(int i = 0; i < 2; ++i)
+  {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileWetBuffer[i]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ezUInt32) * numSimulationTiles, NULL, GL_DYNAMIC_COPY);
+  }
+  ezUInt32 dispatchArguments[3] = { 0, 1, 1 };
+  glGenBuffers(1, &m_activeTileListBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_activeTileListBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(dispatchArguments) + sizeof(ezUInt32) * numSimulationTiles, NULL, GL_DYNAMIC_COPY);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(dispatchArguments), dispatchArguments);
+  glGenBuffers(1, &m_tileActivityBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileActivityBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, 3 * sizeof(ezUInt32) * numSimulationTiles, NULL, GL_DYNAMIC_COPY);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  gl::Utils::CheckError("sparse simulation buffers");
+
+  // Dirty blocks for incremental mips. The blocks of the first pass are the simulation tiles, each further pass has 16x16 times fewer.
+  ezUInt32 numMipLevels = 1;
+  while((m_gridResolution >> numMipLevels) > 0)
+    ++numMipLevels;
+  m_numTerrainMipPasses = (numMipLevels - 1 + 3) / 4;
+  EZ_ASSERT(m_numTerrainMipPasses <= s_maxTerrainMipPasses, "Too many mip levels for incremental mip generation.");
+  glGenBuffers(m_numTerrainMipPasses, m_mipDirtyBlockListBuffer);
+  glGenBuffers(m_numTerrainMipPasses, m_mipDirtyBlockFlagBuffer);
+  ezUInt32 numBlocksPerSide = GetNumSimulationTilesPerSide();
+  ezUInt32 notDirty = 0;
+  for(ezUInt32 pass = 0; pass < m_numTerrainMipPasses; ++pass)
+  {
+    ezUInt32 numBlocks = numBlocksPerSide * numBlocksPerSide;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_mipDirtyBlockListBuffer[pass]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(dispatchArguments) + sizeof(ezUInt32) * numBlocks, NULL, GL_DYNAMIC_COPY);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(dispatchArguments), dispatchArguments);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_mipDirtyBlockFlagBuffer[pass]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ezUInt32) * numBlocks, NULL, GL_DYNAMIC_COPY);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &notDirty);
+    numBlocksPerSide = ezMath::Max(numBlocksPerSide / 16, 1u);
+  }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  gl::Utils::CheckError("terrain mip buffers");
+
+  // Height bounds, read back with a copy of the first dirty list.
+  m_heightBounds = EZ_DEFAULT_NEW(HeightBoundsPyramid)(GetNumSimulationTilesPerSide(), m_gridWorldSize / GetNumSimulationTilesPerSide());
+  glGenBuffers(1, &m_dirtyTileBoundsBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_dirtyTileBoundsBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(HeightBoundsPyramid::Bounds) * numSimulationTiles, NULL, GL_DYNAMIC_COPY);
+  glGenBuffers(s_numHeightBoundsReadbackBuffers, m_heightBoundsReadbackBuffer);
+  for(ezUInt32 i = 0; i < s_numHeightBoundsReadbackBuffers; ++i)
+  {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, m_heightBoundsReadbackBuffer[i]);
+    glBufferData(GL_COPY_WRITE_BUFFER, sizeof(dispatchArguments) + (sizeof(ezUInt32) + sizeof(HeightBoundsPyramid::Bounds)) * numSimulationTiles,
+                 NULL, GL_STREAM_READ);
+    m_heightBoundsReadbackFence[i] = NULL;
+  }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  gl::Utils::CheckError("height bounds buffers");
+
+  // Multi-rate simulation, everything at full rate until the first update.
+  m_tileRateShifts.SetCount(numSimulationTiles);
+  m_tileFullRateUntilStep.SetCount(numSimulationTiles);
+  for(ezUInt32 i = 0; i < numSimulationTiles; ++i)
+  {
+    m_tileRateShifts[i] = 0;
+    m_tileFullRateUntilStep[i] = 0;
+  }
+  glGenBuffers(1, &m_tileRateBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileRateBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ezUInt32) * numSimulationTiles, &m_tileRateShifts[0], GL_DYNAMIC_DRAW);
+
+  // Simulation stats
+  glGenBuffers(s_numSimulationStatsBuffers, m_simulationStatsBuffer);
+  for(ezUInt32 i = 0; i < s_numSimulationStatsBuffers; ++i)
+  {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_simulationStatsBuffer[i]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(SimulationStatsHeader) + sizeof(StepTelemetry) * s_maxSimulationStepsPerFrame, NULL, GL_DYNAMIC_READ);
+    m_simulationStatsFence[i] = NULL;
+    m_simulationStatsNumSteps[i] = 0;
+    m_telemetrySteps[i].numSteps = 0;
+  }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  // Ten seconds at the default step rate.
+  m_telemetry = EZ_DEFAULT_NEW(SimulationTelemetry)(600);
+
+  // Brush buffers, filled on demand
+  glGenBuffers(1, &m_brushStampBuffer);
+  glGenBuffers(1, &m_brushTileBuffer);
+  m_brushTileMarks.SetCount(numSimulationTiles);
+  for(ezUInt32 i = 0; i < numSimulationTiles; ++i)
+    m_brushTileMarks[i] = false;
+
   // Create heightmap
   CreateHeightmapFromNoiseAndResetSim();
 
@@ -133,10 +306,57 @@ Terrain::Terrain(const ezSizeU32& screenSize) :
 
 Terrain::~Terrain()
 {
+  // Stops the simulation thread.
+  if(m_asyncSimulation != NULL)
+    EZ_DEFAULT_DELETE(m_asyncSimulation);
+  if(m_asyncTerrainData != NULL)
+    EZ_DEFAULT_DELETE_RAW_BUFFER(m_asyncTerrainData);
+  if(m_asyncPreviousWaterHeight != NULL)
+    EZ_DEFAULT_DELETE(m_asyncPreviousWaterHeight);
+  if(m_asyncWaterHeight != NULL)
+    EZ_DEFAULT_DELETE(m_asyncWaterHeight);
+  SetWaterQueriesEnabled(false);
+
   EZ_DEFAULT_DELETE(m_terrainData);
   EZ_DEFAULT_DELETE(m_waterOutgoingFlow);
   EZ_DEFAULT_DELETE(m_waterFlowMap);
+  if(m_simulationTerrainHeight != NULL)
+    EZ_DEFAULT_DELETE(m_simulationTerrainHeight);
+  if(m_simulationWaterHeight != NULL)
+    EZ_DEFAULT_DELETE(m_simulationWaterHeight);
   EZ_DEFAULT_DELETE(m_geomClipMaps);
+  EZ_DEFAULT_DELETE(m_checkpointWriter);
+  if(m_history != NULL)
+    EZ_DEFAULT_DELETE(m_history);
+  EZ_DEFAULT_DELETE(m_telemetry);
+  EZ_DEFAULT_DELETE(m_heightBounds);
+  if(m_drainageAnalysis != NULL)
+    EZ_DEFAULT_DELETE(m_drainageAnalysis);
+
+  glDeleteBuffers(2, m_tileWetBuffer);
+  glDeleteBuffers(1, &m_activeTileListBuffer);
+  glDeleteBuffers(1, &m_tileActivityBuffer);
+  glDeleteBuffers(m_numTerrainMipPasses, m_mipDirtyBlockListBuffer);
+  glDeleteBuffers(m_numTerrainMipPasses, m_mipDirtyBlockFlagBuffer);
+  glDeleteBuffers(1, &m_dirtyTileBoundsBuffer);
+  glDeleteBuffers(s_numHeightBoundsReadbackBuffers, m_heightBoundsReadbackBuffer);
+  for(ezUInt32 i = 0; i < s_numHeightBoundsReadbackBuffers; ++i)
+  {
+    if(m_heightBoundsReadbackFence[i] != NULL)
+      glDeleteSync(m_heightBoundsReadbackFence[i]);
+  }
+  glDeleteBuffers(1, &m_tileRateBuffer);
+  glDeleteBuffers(1, &m_brushStampBuffer);
+  glDeleteBuffers(s_numSimulationStatsBuffers, m_simulationStatsBuffer);
+  for(ezUInt32 i = 0; i < s_numSimulationStatsBuffers; ++i)
+  {
+    if(m_simulationStatsFence[i] != NULL)
+      glDeleteSync(m_simulationStatsFence[i]);
+  }
+  glDeleteBuffers(1, &m_brushTileBuffer);
+  glDeleteBuffers(1, &m_historyReadbackBuffer);
+  if(m_historyReadbackFence != NULL)
+    glDeleteSync(m_historyReadbackFence);
 
   EZ_DEFAULT_DELETE(m_textureGrassDiffuseSpec);
   EZ_DEFAULT_DELETE(m_textureStoneDiffuseSpec);
@@ -147,24 +367,103 @@ Terrain::~Terrain()
   EZ_DEFAULT_DELETE(m_foamTexture);
 }
 
-void Terrain::ApplyRadialWaterBrush(ezVec2 worldPositionXZ, float strength)
+void Terrain::QueueWaterBrush(ezVec2 worldPositionXZ, float radius, float strength, BrushShape shape)
 {
   worldPositionXZ /= m_gridWorldSize;
   worldPositionXZ.x = ezMath::Fraction(worldPositionXZ.x);
   worldPositionXZ.y = ezMath::Fraction(worldPositionXZ.y);
   worldPositionXZ *= static_cast<float>(m_gridResolution);
 
-  m_brushUBO["BrushPositionTexelCor"].Set(worldPositionXZ);
-  m_brushUBO["BrushIntensity"].Set(strength);
-  m_brushUBO["BrushSizeSq"].Set(32.0f);
+  BrushStamp stamp;
+  stamp.positionTexelCor = worldPositionXZ;
+  stamp.radiusTexel = radius / m_gridWorldSize * m_gridResolution;
+  stamp.strength = strength;
+  stamp.shape = shape;
+  stamp.padding = 0;
+  m_queuedBrushStamps.PushBack(stamp);
+}
 
-  m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F);
-  m_waterOutgoingFlow->BindImage(1, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
+void Terrain::ApplyRadialWaterBrush(ezVec2 worldPositionXZ, float strength)
+{
+  // Radius of sqrt(32) texels.
+  float radius = ezMath::Sqrt(32.0f) * m_gridWorldSize / m_gridResolution;
+  QueueWaterBrush(worldPositionXZ, radius, strength, BrushShape::RADIAL);
+}
+
+void Terrain::QueueRiverSources(ezTime duration)
+{
+  // A few cells wide, so that the source doesn't pile up a column of water before it finds its way downhill.
+  float radius = 2.0f * m_gridWorldSize / m_gridResolution;
+  float strength = m_riverSourceRate * static_cast<float>(duration.GetSeconds());
+  for(ezUInt32 i = 0; i < m_riverSources.GetCount(); ++i)
+    QueueWaterBrush(m_riverSources[i], radius, strength, BrushShape::CIRCLE);
+}
+
+void Terrain::ApplyQueuedWaterBrushes()
+{
+  if(m_queuedBrushStamps.IsEmpty())
+    return;
 
-  m_brushUBO.BindBuffer(7);
+  // Gather all tiles within the bounding rectangles of the stamps.
+  ezInt32 maxTile = static_cast<ezInt32>(GetNumSimulationTilesPerSide()) - 1;
+  m_brushTiles.Clear();
+  for(ezUInt32 i = 0; i < m_queuedBrushStamps.GetCount(); ++i)
+  {
+    const BrushStamp& stamp = m_queuedBrushStamps[i];
+    ezVec2 extent(stamp.radiusTexel);
+    ezVec2 rectMin = stamp.positionTexelCor - extent;
+    ezVec2 rectMax = stamp.positionTexelCor + extent;
+    ezInt32 tileMinX = ezMath::Clamp(static_cast<ezInt32>(ezMath::Floor(rectMin.x / 16.0f)), 0, maxTile);
+    ezInt32 tileMinY = ezMath::Clamp(static_cast<ezInt32>(ezMath::Floor(rectMin.y / 16.0f)), 0, maxTile);
+    ezInt32 tileMaxX = ezMath::Clamp(static_cast<ezInt32>(ezMath::Floor(rectMax.x / 16.0f)), 0, maxTile);
+    ezInt32 tileMaxY = ezMath::Clamp(static_cast<ezInt32>(ezMath::Floor(rectMax.y / 16.0f)), 0, maxTile);
+
+    // Water spreads from here, keep the surrounding tiles at full rate for a while.
+    for(ezInt32 y = ezMath::Max(tileMinY - 1, 0); y <= ezMath::Min(tileMaxY + 1, maxTile); ++y)
+    {
+      for(ezInt32 x = ezMath::Max(tileMinX - 1, 0); x <= ezMath::Min(tileMaxX + 1, maxTile); ++x)
+        m_tileFullRateUntilStep[x + y * GetNumSimulationTilesPerSide()] = m_simulationStepIndex + s_brushFullRateSteps;
+    }
+
+    for(ezInt32 y = tileMinY; y <= tileMaxY; ++y)
+    {
+      for(ezInt32 x = tileMinX; x <= tileMaxX; ++x)
+      {
+        ezUInt32 tileIndex = x + y * GetNumSimulationTilesPerSide();
+        if(!m_brushTileMarks[tileIndex])
+        {
+          m_brushTileMarks[tileIndex] = true;
+          m_brushTiles.PushBack(x | (y << 16));
+        }
+      }
+    }
+  }
+  for(ezUInt32 i = 0; i < m_brushTiles.GetCount(); ++i)
+    m_brushTileMarks[(m_brushTiles[i] & 0xFFFF) + (m_brushTiles[i] >> 16) * GetNumSimulationTilesPerSide()] = false;
+
+  // Upload stamps and tiles.
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_brushStampBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(BrushStamp) * m_queuedBrushStamps.GetCount(), &m_queuedBrushStamps[0], GL_STREAM_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_brushTileBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ezUInt32) * m_brushTiles.GetCount(), &m_brushTiles[0], GL_STREAM_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  if(m_planarSimulationStorage)
+    m_simulationWaterHeight->BindImage(3, gl::Texture::ImageAccess::READ_WRITE, GL_R32F);
+  else
+    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_tileWetBuffer[m_currentTileWetBuffer]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_brushStampBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, m_brushTileBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_mipDirtyBlockFlagBuffer[0]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, m_mipDirtyBlockListBuffer[0]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_tileActivityBuffer);
 
   m_waterBrushShader.Activate();
-  glDispatchCompute(m_gridResolution / 32, m_gridResolution / 32, 1);
+  glDispatchCompute(m_brushTiles.GetCount(), 1, 1);
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+  m_queuedBrushStamps.Clear();
 }
 
 void Terrain::SetPixelPerTriangle(float pixelPerTriangle)
@@ -175,59 +474,323 @@ void Terrain::SetPixelPerTriangle(float pixelPerTriangle)
 void Terrain::SetSimulationStepsPerSecond(float simulationStepsPerSecond)
 {
   m_simulationStepLength = ezTime::Seconds(1.0f / simulationStepsPerSecond);
+  if(!m_adaptiveTimestep)
+    m_currentSimulationStepLength = m_simulationStepLength;
 
   // Reset all timescaled values.
-  SetFlowDamping(m_flowDamping);
-  SetFlowAcceleration(m_flowAcceleration);
+  UpdateSimulationParameters();
+}
 
-  float cellDistance = m_gridWorldSize / m_gridResolution;
-  m_simulationParametersUBO["CellAreaInv_timeScaled"].Set(static_cast<float>(m_simulationStepLength.GetSeconds() / (cellDistance * cellDistance)));
+void Terrain::SetAdaptiveTimestep(bool adaptiveTimestep)
+{
+  m_adaptiveTimestep = adaptiveTimestep;
+  m_currentSimulationStepLength = m_simulationStepLength;
+  UpdateSimulationParameters();
 }
 
 void Terrain::SetFlowDamping(float flowDamping)
 {
   m_flowDamping = flowDamping;
-  m_simulationParametersUBO["FlowFriction_perStep"].Set(ezMath::Pow(m_flowDamping, static_cast<float>(m_simulationStepLength.GetSeconds())));
+  UpdateSimulationParameters();
 }
 
 void Terrain::SetFlowAcceleration(float flowAcceleration)
 {
   m_flowAcceleration = flowAcceleration;
+  UpdateSimulationParameters();
+}
+
+void Terrain::UpdateSimulationParameters()
+{
   float cellDistance = m_gridWorldSize / m_gridResolution;
-  m_simulationParametersUBO["WaterAcceleration_perStep"].Set(static_cast<float>(m_simulationStepLength.GetSeconds() * m_flowAcceleration * cellDistance));
+  SimulationParameters parameters = SimulationParameters::Compute(m_currentSimulationStepLength, m_flowDamping, m_flowAcceleration, cellDistance);
+
+  m_simulationParametersUBO["FlowFriction_perStep"].Set(parameters.flowFriction_perStep);
+  m_simulationParametersUBO["WaterAcceleration_perStep"].Set(parameters.waterAcceleration_perStep);
+  m_simulationParametersUBO["CellAreaInv_timeScaled"].Set(parameters.cellAreaInv_timeScaled);
+  m_simulationParametersUBO["TileSleepThreshold_perStep"].Set(m_tileSleepThreshold * static_cast<float>(m_currentSimulationStepLength.GetSeconds()));
+
+  // The asynchronous simulation always runs at the fixed rate.
+  if(m_asyncSimulation != NULL)
+  {
+    ezTime asyncStepLength = GetAsyncSimulationStepLength();
+    m_asyncSimulation->SetSimulationParameters(SimulationParameters::Compute(asyncStepLength, m_flowDamping, m_flowAcceleration, cellDistance),
+                                               asyncStepLength, m_implicitIntegrator ? CpuFlowSolver::Integrator::SEMI_IMPLICIT : CpuFlowSolver::Integrator::PIPE);
+  }
+}
+
+ezTime Terrain::GetAsyncSimulationStepLength() const
+{
+  return m_implicitIntegrator ? m_simulationStepLength * m_implicitStepFactor : m_simulationStepLength;
+}
+
+void Terrain::SetTileSleepThreshold(float tileSleepThreshold)
+{
+  m_tileSleepThreshold = tileSleepThreshold;
+  UpdateSimulationParameters();
+}
+
+void Terrain::SetImplicitIntegrator(bool implicitIntegrator)
+{
+  m_implicitIntegrator = implicitIntegrator;
+  UpdateSimulationParameters();
+}
+
+void Terrain::SetImplicitStepFactor(float implicitStepFactor)
+{
+  m_implicitStepFactor = ezMath::Max(implicitStepFactor, 1.0f);
+  UpdateSimulationParameters();
+}
+
+void Terrain::SetPlanarSimulationStorage(bool planarSimulationStorage)
+{
+  if(m_planarSimulationStorage == planarSimulationStorage)
+    return;
+
+  // The terrain data is complete at the end of every frame, the planes are simply derived from it again.
+  m_planarSimulationStorage = planarSimulationStorage;
+  LoadSimulationShaders();
+  CreateSimulationPlanes();
+  if(m_planarSimulationStorage)
+    SplitSimulationPlanes();
+}
+
+void Terrain::SetHalfPrecisionFlow(bool halfPrecisionFlow)
+{
+  if(m_halfPrecisionFlow == halfPrecisionFlow)
+    return;
+  m_halfPrecisionFlow = halfPrecisionFlow;
+  LoadSimulationShaders();
+
+  // Keep the current flow, it is converted on the way through the CPU.
+  ezDynamicArray<ezColor> outgoingFlow;
+  outgoingFlow.SetCount(m_gridResolution * m_gridResolution);
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+  m_waterOutgoingFlow->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, static_cast<ezArrayPtr<ezColor>>(outgoingFlow).GetPtr());
+
+  EZ_DEFAULT_DELETE(m_waterOutgoingFlow);
+  m_waterOutgoingFlow = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GetFlowFormat(), 1);
+  m_waterOutgoingFlow->SetData(0, static_cast<ezArrayPtr<ezColor>>(outgoingFlow).GetPtr());
+}
+
+void Terrain::SetSimulationPaused(bool simulationPaused)
+{
+  m_simulationPaused = simulationPaused;
+  if(m_asyncSimulation != NULL)
+    m_asyncSimulation->SetPaused(simulationPaused);
+}
+
+void Terrain::SetAsyncCpuSimulation(bool asyncCpuSimulation)
+{
+  if(asyncCpuSimulation == m_asyncCpuSimulation)
+    return;
+  m_asyncCpuSimulation = asyncCpuSimulation;
+
+  if(m_asyncCpuSimulation)
+  {
+    // The solver with its states takes about 80 MB at 1024², it only exists while the mode is used.
+    ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+    m_asyncSimulation = EZ_DEFAULT_NEW(AsyncFlowSimulation)(m_gridResolution);
+    m_asyncTerrainData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, numTexels);
+    m_asyncPreviousWaterHeight = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_R32F, 1);
+    m_asyncWaterHeight = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_R32F, 1);
+    UpdateSimulationParameters();
+    m_asyncSimulation->SetPaused(m_simulationPaused);
+    StartAsyncSimulation();
+  }
+  else
+  {
+    StopAsyncSimulation();
+    EZ_DEFAULT_DELETE(m_asyncSimulation);
+    m_asyncSimulation = NULL;
+    EZ_DEFAULT_DELETE_RAW_BUFFER(m_asyncTerrainData);
+    m_asyncTerrainData = NULL;
+    EZ_DEFAULT_DELETE(m_asyncPreviousWaterHeight);
+    m_asyncPreviousWaterHeight = NULL;
+    EZ_DEFAULT_DELETE(m_asyncWaterHeight);
+    m_asyncWaterHeight = NULL;
+    m_asyncChangedTiles.Clear();
+  }
+}
+
+void Terrain::StartAsyncSimulation()
+{
+  // Keeps all channels of the terrain data, only water heights are replaced while the simulation runs.
+  ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+  ezDynamicArray<ezColor> outgoingFlow;
+  outgoingFlow.SetCount(numTexels);
+
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+  m_terrainData->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, m_asyncTerrainData);
+  m_waterOutgoingFlow->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, static_cast<ezArrayPtr<ezColor>>(outgoingFlow).GetPtr());
+  gl::Utils::CheckError("async simulation read back");
+
+  m_asyncSimulation->Start(m_asyncTerrainData, static_cast<ezArrayPtr<ezColor>>(outgoingFlow).GetPtr(), m_simulationStepIndex);
+
+  // Both states start out as the current one, the terrain data already has these water heights.
+  const float* waterHeights = &m_asyncSimulation->GetFrontState().waterHeights[0];
+  m_asyncPreviousWaterHeight->Bind(0);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_gridResolution, m_gridResolution, GL_RED, GL_FLOAT, waterHeights);
+  m_asyncWaterHeight->Bind(0);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_gridResolution, m_gridResolution, GL_RED, GL_FLOAT, waterHeights);
+  gl::Utils::CheckError("async water height upload");
+  m_asyncChangedTiles.Clear();
+  m_asyncInterpolationDone = true;
+}
+
+void Terrain::StopAsyncSimulation()
+{
+  m_asyncSimulation->Stop();
+
+  ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+  ezDynamicArray<ezColor> outgoingFlow;
+  outgoingFlow.SetCount(numTexels);
+  m_asyncSimulation->GetTerrainData(m_asyncTerrainData);
+  m_asyncSimulation->GetOutgoingFlow(static_cast<ezArrayPtr<ezColor>>(outgoingFlow).GetPtr());
+
+  m_terrainData->SetData(0, m_asyncTerrainData);
+  m_waterOutgoingFlow->SetData(0, static_cast<ezArrayPtr<ezColor>>(outgoingFlow).GetPtr());
+
+  // The GPU simulation doesn't know which tiles the CPU simulation wetted.
+  m_simulationStepIndex = m_asyncSimulation->GetSimulationStepIndex();
+  m_timeSinceLastSimulationStep = ezTime();
+  ResetSimulationTiles();
+}
+
+void Terrain::UpdateAsyncSimulation()
+{
+  for(ezUInt32 i = 0; i < m_queuedBrushStamps.GetCount(); ++i)
+  {
+    AsyncFlowSimulation::BrushStamp stamp;
+    stamp.positionTexelCor = m_queuedBrushStamps[i].positionTexelCor;
+    stamp.radiusTexel = m_queuedBrushStamps[i].radiusTexel;
+    stamp.strength = m_queuedBrushStamps[i].strength;
+    stamp.shape = static_cast<ezUInt32>(m_queuedBrushStamps[i].shape);
+    m_asyncSimulation->QueueBrushStamp(stamp);
+  }
+  m_queuedBrushStamps.Clear();
+
+  // Tiles that are still on their way to the previous state jump there, they change one last time.
+  ezDynamicArray<ezUInt32> dirtyTiles;
+  if(!m_asyncInterpolationDone)
+  {
+    for(ezUInt32 i = 0; i < m_asyncChangedTiles.GetCount(); ++i)
+      dirtyTiles.PushBack(m_asyncChangedTiles[i]);
+  }
+
+  // The flow map is only needed for rendering and not interpolated.
+  ezTime asyncStepLength = GetAsyncSimulationStepLength();
+  bool newState = m_asyncSimulation->UpdateFrontState(16, m_asyncChangedTiles);
+  const AsyncFlowSimulation::State& state = m_asyncSimulation->GetFrontState();
+  if(newState)
+  {
+    m_waterFlowMap->Bind(0);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_gridResolution, m_gridResolution, GL_RG, GL_FLOAT, &state.flowMap[0]);
+    m_simulationStepIndex = state.simulationStepIndex;
+
+    // The newest state becomes the previous one on the GPU, only tiles that changed since have to be uploaded.
+    glCopyImageSubData(m_asyncWaterHeight->GetInternHandle(), GL_TEXTURE_2D, 0, 0, 0, 0,
+                       m_asyncPreviousWaterHeight->GetInternHandle(), GL_TEXTURE_2D, 0, 0, 0, 0, m_gridResolution, m_gridResolution, 1);
+    UploadAsyncWaterHeights(&state.waterHeights[0], m_asyncChangedTiles);
+    m_asyncInterpolationDone = m_asyncChangedTiles.IsEmpty();
+
+    ezStringBuilder statString;
+    statString.Format("%.0f %%", 100.0 * state.computeDuration.GetSeconds() / (asyncStepLength.GetSeconds() * state.numSteps));
+    ezStats::SetStat("CPU Simulation Load", statString.GetData());
+  }
+
+  // Showing the simulation one step late leaves a state to interpolate towards, unless the simulation thread falls behind.
+  if(!m_asyncInterpolationDone)
+  {
+    float interpolation = m_asyncSimulation->GetInterpolationFactor(ezTime::Now() - asyncStepLength);
+    m_asyncInterpolationDone = interpolation >= 1.0f;
+    m_simulationParametersUBO["AsyncWaterInterpolation"].Set(interpolation);
+    for(ezUInt32 i = 0; i < m_asyncChangedTiles.GetCount(); ++i)
+      dirtyTiles.PushBack(m_asyncChangedTiles[i]);
+  }
+  // Water at rest is neither uploaded nor interpolated, its mips are still up to date.
+  if(!dirtyTiles.IsEmpty())
+  {
+    m_simulationParametersUBO.BindBuffer(5);
+    MarkTerrainTilesDirty(dirtyTiles);
+    UpdateTerrainDataMips();
+  }
+
+  // The state is already on the CPU, no need for a read back.
+  if(m_waterQueriesEnabled && newState)
+  {
+    ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+    for(ezUInt32 i = 0; i < numTexels; ++i)
+      m_asyncTerrainData[i].a = state.waterHeights[i];
+    m_waterQueries->SetState(m_asyncTerrainData, &state.flowMap[0], state.simulationStepIndex);
+  }
+
+  m_currentSimulationStepLength = asyncStepLength;
+  SetSimulationStepStats(newState ? state.numSteps : 0, newState ? asyncStepLength * state.numDroppedSteps : ezTime());
+}
+
+void Terrain::UploadAsyncWaterHeights(const float* waterHeights, const ezDynamicArray<ezUInt32>& tiles)
+{
+  ezUInt32 numTilesPerSide = GetNumSimulationTilesPerSide();
+  m_asyncWaterHeight->Bind(0);
+  // One upload is cheaper than many small ones once most of the water moves.
+  if(tiles.GetCount() * 2 > numTilesPerSide * numTilesPerSide)
+  {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_gridResolution, m_gridResolution, GL_RED, GL_FLOAT, waterHeights);
+  }
+  else
+  {
+    ezUInt32 tileSize = m_gridResolution / numTilesPerSide;
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, m_gridResolution);
+    for(ezUInt32 i = 0; i < tiles.GetCount(); ++i)
+    {
+      ezUInt32 x = (tiles[i] & 0xFFFF) * tileSize;
+      ezUInt32 y = (tiles[i] >> 16) * tileSize;
+      glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, tileSize, tileSize, GL_RED, GL_FLOAT, waterHeights + x + y * m_gridResolution);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  }
+  gl::Utils::CheckError("async water height upload");
 }
 
 void Terrain::CreateHeightmapFromNoiseAndResetSim()
 {
+  // The asynchronous simulation restarts from the new state.
+  if(m_asyncCpuSimulation)
+    m_asyncSimulation->Stop();
+
   if(m_terrainData != NULL)
     EZ_DEFAULT_DELETE(m_terrainData);
+  // Drainage and river sources belong to the old terrain.
+  if(m_drainageAnalysis != NULL)
+    EZ_DEFAULT_DELETE(m_drainageAnalysis);
+  m_riverSources.Clear();
 
   m_terrainData = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_RGBA32F, -1);
   ezColor* volumeData = EZ_DEFAULT_NEW_RAW_BUFFER(ezColor, m_gridResolution*m_gridResolution);
-
-  NoiseGenerator noiseGen;
-  float mulitplier = 1.0f / static_cast<float>(m_gridResolution - 1);
-
-#pragma omp parallel for // OpenMP parallel for loop.
-  for(ezInt32 y = 0; y < static_cast<ezInt32>(m_gridResolution); ++y) // Needs to be signed for OpenMP.
+  TerrainGenerator::CreateHeightmapFromNoise(volumeData, m_gridResolution, m_heightScale);
+  if(m_prefillLakes)
   {
-    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
-    {
-      volumeData[x + y * m_gridResolution].r = (noiseGen.GetValueNoise(ezVec3(mulitplier*x, mulitplier*y, 0.0f), 2, 10, 0.43f, true, NULL) * 0.5f + 0.5f) * m_heightScale;
-      volumeData[x + y * m_gridResolution].g = 0.3f;
-      volumeData[x + y * m_gridResolution].b = 0.3f;
-      volumeData[x + y * m_gridResolution].a = std::max(0.0f, (0.45f - pow(ezVec2(x * mulitplier - 0.5f, y * mulitplier - 0.5f).GetLengthSquared(), 2.0f)*800.0f) *m_heightScale
-        - volumeData[x + y * m_gridResolution].r);
-    }
+    ezTime startTime = ezTime::Now();
+    LakePrefill lakePrefill(volumeData, m_gridResolution);
+    double volume = lakePrefill.FillFromRain(volumeData, m_prefillRainDepth);
+    float cellDistance = m_gridWorldSize / m_gridResolution;
+    ezLog::Success("Prefilled %u basins with %.0f m^3 of water in %.0f ms.", lakePrefill.GetNumBasins(), volume * cellDistance * cellDistance,
+                   (ezTime::Now() - startTime).GetMilliseconds());
   }
   m_terrainData->SetData(0, volumeData);
+  // Available right away, the read back of the tiles marked by ResetSimulationTiles arrives a few frames later.
+  m_heightBounds->Build(volumeData, m_gridResolution);
 
   EZ_DEFAULT_DELETE_RAW_BUFFER(volumeData);
 
   // Create flow textures
   if(m_waterOutgoingFlow != NULL)
     EZ_DEFAULT_DELETE(m_waterOutgoingFlow);
-  m_waterOutgoingFlow = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_RGBA32F, 1);
+  m_waterOutgoingFlow = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GetFlowFormat(), 1);
   ezArrayPtr<ezColor> pEmptyBuffer = EZ_DEFAULT_NEW_ARRAY(ezColor, m_gridResolution*m_gridResolution);
   ezMemoryUtils::ZeroFill(pEmptyBuffer.GetPtr(), pEmptyBuffer.GetCount());
   m_waterOutgoingFlow->SetData(0, pEmptyBuffer.GetPtr());
@@ -235,33 +798,1069 @@ void Terrain::CreateHeightmapFromNoiseAndResetSim()
 
   if(m_waterFlowMap == NULL)
     m_waterFlowMap = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_RG16F, 1);
+
+  ResetSimulationTiles();
+
+  // The new state doesn't continue any recorded one.
+  if(m_history != NULL)
+    m_history->Clear();
+  m_historyPosition = s_liveHistoryPosition;
+  m_lastHistoryStepIndex = m_simulationStepIndex;
+
+  if(m_asyncCpuSimulation)
+    StartAsyncSimulation();
 }
 
-void Terrain::PerformSimulationStep(ezTime lastFrameDuration)
+void Terrain::LoadSimulationShaders()
+{
+  ezString storageDefine = m_planarSimulationStorage ? "SIMULATION_PLANAR_STORAGE 1" : "SIMULATION_PLANAR_STORAGE 0";
+  ezString flowFormatDefine = m_halfPrecisionFlow ? "SIMULATION_FLOW_FORMAT rgba16f" : "SIMULATION_FLOW_FORMAT rgba32f";
+
+  m_applyFlowShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "flowApply.comp", { storageDefine, flowFormatDefine });
+  m_applyFlowShader.CreateProgram();
+  m_updateFlowShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "flowUpdate.comp", { storageDefine, flowFormatDefine });
+  m_updateFlowShader.CreateProgram();
+  m_waterBrushShader.AddShaderFromFile(gl::ShaderObject::ShaderType::COMPUTE, "waterBrush.comp", { storageDefine });
+  m_waterBrushShader.CreateProgram();
+}
+
+void Terrain::CreateSimulationPlanes()
+{
+  if(m_simulationTerrainHeight != NULL)
+    EZ_DEFAULT_DELETE(m_simulationTerrainHeight);
+  if(m_simulationWaterHeight != NULL)
+    EZ_DEFAULT_DELETE(m_simulationWaterHeight);
+
+  if(m_planarSimulationStorage)
+  {
+    m_simulationTerrainHeight = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_R32F, 1);
+    m_simulationWaterHeight = EZ_DEFAULT_NEW(gl::Texture2D)(m_gridResolution, m_gridResolution, GL_R32F, 1);
+  }
+}
+
+void Terrain::SplitSimulationPlanes()
+{
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+  m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F);
+  m_simulationTerrainHeight->BindImage(1, gl::Texture::ImageAccess::WRITE, GL_R32F);
+  m_simulationWaterHeight->BindImage(3, gl::Texture::ImageAccess::WRITE, GL_R32F);
+  m_splitSimulationPlanesShader.Activate();
+  glDispatchCompute(GetNumSimulationTilesPerSide(), GetNumSimulationTilesPerSide(), 1);
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
+
+void Terrain::ResetSimulationTiles()
+{
+  // The time series doesn't continue across a replaced state.
+  m_telemetry->Clear();
+  m_waterQueriesOutdated = true;
+
+  for(ezUInt32 i = 0; i < m_tileFullRateUntilStep.GetCount(); ++i)
+    m_tileFullRateUntilStep[i] = 0;
+
+  // Mark all tiles as wet, the first simulation step will sort out the dry ones.
+  ezUInt32 allWet = 1;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileWetBuffer[m_currentTileWetBuffer]);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &allWet);
+  // Everything is awake again.
+  ezUInt32 noActivity = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileActivityBuffer);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &noActivity);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  // The terrain data was replaced as a whole.
+  if(m_planarSimulationStorage)
+    SplitSimulationPlanes();
+  MarkAllTerrainTilesDirty();
+  UpdateTerrainDataMips();
+}
+
+void Terrain::MarkAllTerrainTilesDirty()
+{
+  ezUInt32 numTilesPerSide = GetNumSimulationTilesPerSide();
+  ezDynamicArray<ezUInt32> tiles;
+  tiles.Reserve(numTilesPerSide * numTilesPerSide);
+  for(ezUInt32 y = 0; y < numTilesPerSide; ++y)
+  {
+    for(ezUInt32 x = 0; x < numTilesPerSide; ++x)
+      tiles.PushBack(x | (y << 16));
+  }
+  MarkTerrainTilesDirty(tiles);
+}
+
+void Terrain::MarkTerrainTilesDirty(const ezDynamicArray<ezUInt32>& tiles)
+{
+  // terrainMips.comp only clears the flags of listed tiles, so flags and list are replaced together.
+  ezUInt32 numTilesPerSide = GetNumSimulationTilesPerSide();
+  ezDynamicArray<ezUInt32> dirtyTileFlags;
+  dirtyTileFlags.SetCount(numTilesPerSide * numTilesPerSide);
+  ezMemoryUtils::ZeroFill(&dirtyTileFlags[0], dirtyTileFlags.GetCount());
+  ezDynamicArray<ezUInt32> dirtyTileList;
+  dirtyTileList.Reserve(3 + tiles.GetCount());
+  dirtyTileList.PushBack(0);
+  dirtyTileList.PushBack(1);
+  dirtyTileList.PushBack(1);
+  for(ezUInt32 i = 0; i < tiles.GetCount(); ++i)
+  {
+    ezUInt32 tileIndex = (tiles[i] & 0xFFFF) + (tiles[i] >> 16) * numTilesPerSide;
+    if(dirtyTileFlags[tileIndex] != 0)
+      continue;
+    dirtyTileFlags[tileIndex] = 1;
+    dirtyTileList.PushBack(tiles[i]);
+  }
+  dirtyTileList[0] = dirtyTileList.GetCount() - 3;
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_mipDirtyBlockListBuffer[0]);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ezUInt32) * dirtyTileList.GetCount(), &dirtyTileList[0]);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_mipDirtyBlockFlagBuffer[0]);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ezUInt32) * dirtyTileFlags.GetCount(), &dirtyTileFlags[0]);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void Terrain::UpdateTerrainDataMips()
+{
+  // Terrain data and the first list were written by simulation and brush passes.
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_mipDirtyBlockFlagBuffer[0]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, m_mipDirtyBlockListBuffer[0]);
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, m_mipDirtyBlockListBuffer[0]);
+
+  // The planar storage brings the water heights of all changed tiles back into the terrain data, the asynchronous simulation its
+  // interpolated ones. While it is stopped for a restart, the terrain data was replaced as a whole.
+  if(m_asyncCpuSimulation && m_asyncSimulation->IsRunning())
+  {
+    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
+    m_asyncPreviousWaterHeight->BindImage(2, gl::Texture::ImageAccess::READ, GL_R32F);
+    m_asyncWaterHeight->BindImage(3, gl::Texture::ImageAccess::READ, GL_R32F);
+    m_interpolateAsyncWaterShader.Activate();
+    glDispatchComputeIndirect(0);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+  }
+  else if(m_planarSimulationStorage && !m_asyncCpuSimulation)
+  {
+    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
+    m_simulationWaterHeight->BindImage(3, gl::Texture::ImageAccess::READ, GL_R32F);
+    m_mergeSimulationPlanesShader.Activate();
+    glDispatchComputeIndirect(0);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+  }
+
+  // Height bounds of the dirty tiles, before the first pass clears their flags.
+  m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, m_dirtyTileBoundsBuffer);
+  m_heightBoundsShader.Activate();
+  glDispatchComputeIndirect(0);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  // The list is copied along, it tells which tiles the bounds belong to.
+  if(m_heightBoundsReadbackFence[m_currentHeightBoundsReadbackBuffer] != NULL)
+    ReadBackHeightBounds(true);
+  ezUInt32 numTiles = GetNumSimulationTilesPerSide() * GetNumSimulationTilesPerSide();
+  GLsizeiptr listSize = sizeof(ezUInt32) * (3 + numTiles);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, m_heightBoundsReadbackBuffer[m_currentHeightBoundsReadbackBuffer]);
+  glBindBuffer(GL_COPY_READ_BUFFER, m_mipDirtyBlockListBuffer[0]);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, listSize);
+  glBindBuffer(GL_COPY_READ_BUFFER, m_dirtyTileBoundsBuffer);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, listSize, sizeof(HeightBoundsPyramid::Bounds) * numTiles);
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  m_heightBoundsReadbackFence[m_currentHeightBoundsReadbackBuffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  m_currentHeightBoundsReadbackBuffer = (m_currentHeightBoundsReadbackBuffer + 1) % s_numHeightBoundsReadbackBuffers;
+
+  // Each pass reads one level and writes the next four, levels past the end of the chain are bound but never written.
+  ezUInt32 lastLevel = m_terrainData->GetNumMipLevels() - 1;
+  m_terrainMipsShader.Activate();
+  for(ezUInt32 pass = 0; pass < m_numTerrainMipPasses; ++pass)
+  {
+    ezUInt32 sourceLevel = pass * 4;
+    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F, sourceLevel);
+    for(ezUInt32 i = 1; i <= 4; ++i)
+      m_terrainData->BindImage(i, gl::Texture::ImageAccess::WRITE, GL_RGBA32F, ezMath::Min(sourceLevel + i, lastLevel));
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_mipDirtyBlockListBuffer[pass]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, m_mipDirtyBlockFlagBuffer[pass]);
+    if(pass + 1 < m_numTerrainMipPasses)
+    {
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_mipDirtyBlockFlagBuffer[pass + 1]);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, m_mipDirtyBlockListBuffer[pass + 1]);
+    }
+
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, m_mipDirtyBlockListBuffer[pass]);
+    glDispatchComputeIndirect(0);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+  }
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+
+  // All lists are consumed, the flags were already reset by terrainMips.comp.
+  ezUInt32 numDirtyBlocks = 0;
+  for(ezUInt32 pass = 0; pass < m_numTerrainMipPasses; ++pass)
+  {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_mipDirtyBlockListBuffer[pass]);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, sizeof(ezUInt32), GL_RED_INTEGER, GL_UNSIGNED_INT, &numDirtyBlocks);
+  }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  for(ezUInt32 i = 0; i <= 4; ++i)
+    gl::Texture::ResetImageBinding(i);
+}
+
+void Terrain::ReadBackHeightBounds(bool waitForCurrentBuffer)
+{
+  // The buffer that is reused next holds the oldest read back, the others follow in the order they were started.
+  ezUInt32 numTiles = GetNumSimulationTilesPerSide() * GetNumSimulationTilesPerSide();
+  GLsizeiptr listSize = sizeof(ezUInt32) * (3 + numTiles);
+  for(ezUInt32 i = 0; i < s_numHeightBoundsReadbackBuffers; ++i)
+  {
+    ezUInt32 buffer = (m_currentHeightBoundsReadbackBuffer + i) % s_numHeightBoundsReadbackBuffers;
+    GLsync& fence = m_heightBoundsReadbackFence[buffer];
+    if(fence == NULL)
+      continue;
+
+    GLenum waitResult = glClientWaitSync(fence, 0, 0);
+    if(waitResult == GL_TIMEOUT_EXPIRED && i == 0 && waitForCurrentBuffer)
+      waitResult = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    // Younger read backs may not overtake this one.
+    if(waitResult == GL_TIMEOUT_EXPIRED)
+      break;
+
+    if(waitResult == GL_ALREADY_SIGNALED || waitResult == GL_CONDITION_SATISFIED)
+    {
+      glBindBuffer(GL_COPY_READ_BUFFER, m_heightBoundsReadbackBuffer[buffer]);
+      const ezUInt8* readbackData = static_cast<const ezUInt8*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0,
+                                      listSize + sizeof(HeightBoundsPyramid::Bounds) * numTiles, GL_MAP_READ_BIT));
+      if(readbackData != NULL)
+      {
+        const ezUInt32* dirtyTileList = reinterpret_cast<const ezUInt32*>(readbackData);
+        const HeightBoundsPyramid::Bounds* tileBounds = reinterpret_cast<const HeightBoundsPyramid::Bounds*>(readbackData + listSize);
+        // Tiles are packed as in activeTiles.glsl.
+        for(ezUInt32 tile = 0; tile < dirtyTileList[0]; ++tile)
+          m_heightBounds->SetTileBounds(dirtyTileList[3 + tile] & 0xFFFF, dirtyTileList[3 + tile] >> 16, tileBounds[tile]);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+      }
+      glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+
+    glDeleteSync(fence);
+    fence = NULL;
+  }
+
+  m_heightBounds->UpdateInnerNodes();
+}
+
+void Terrain::AnalyzeDrainage()
+{
+  ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+  ezDynamicArray<ezColor> terrainData;
+  terrainData.SetCount(numTexels);
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+  m_terrainData->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, static_cast<ezArrayPtr<ezColor>>(terrainData).GetPtr());
+  gl::Utils::CheckError("drainage analysis read back");
+
+  ezDynamicArray<float> terrainHeights;
+  terrainHeights.SetCount(numTexels);
+  for(ezUInt32 i = 0; i < numTexels; ++i)
+    terrainHeights[i] = terrainData[i].r;
+
+  ezTime startTime = ezTime::Now();
+  if(m_drainageAnalysis != NULL)
+    EZ_DEFAULT_DELETE(m_drainageAnalysis);
+  m_drainageAnalysis = EZ_DEFAULT_NEW(DrainageAnalysis)(static_cast<ezArrayPtr<float>>(terrainHeights).GetPtr(), m_gridResolution);
+
+  ezStringBuilder statString;
+  statString.Format("%u watersheds, %u pits, %.0f ms", m_drainageAnalysis->GetNumWatersheds(), m_drainageAnalysis->GetNumPits(),
+                    (ezTime::Now() - startTime).GetMilliseconds());
+  ezStats::SetStat("Drainage", statString.GetData());
+}
+
+ezResult Terrain::ExportDrainageRasters(const char* szPathPrefix)
+{
+  if(m_drainageAnalysis == NULL)
+  {
+    ezLog::Error("There is no drainage analysis to export.");
+    return EZ_FAILURE;
+  }
+  return m_drainageAnalysis->ExportRasters(szPathPrefix, m_gridWorldSize / m_gridResolution);
+}
+
+ezResult Terrain::PlaceRiverSources()
+{
+  if(m_drainageAnalysis == NULL)
+  {
+    ezLog::Error("River sources need a drainage analysis.");
+    return EZ_FAILURE;
+  }
+
+  float cellSize = m_gridWorldSize / m_gridResolution;
+  ezUInt32 minAccumulation = ezMath::Max(static_cast<ezUInt32>(m_riverSourceCatchment / (cellSize * cellSize)), 1u);
+  ezDynamicArray<ezUInt32> channelHeads;
+  m_drainageAnalysis->FindChannelHeads(minAccumulation, channelHeads);
+
+  // Channel heads are in row order, evenly spaced ones are spread over the whole terrain.
+  m_riverSources.Clear();
+  ezUInt32 numSources = ezMath::Min(channelHeads.GetCount(), s_maxRiverSources);
+  for(ezUInt32 i = 0; i < numSources; ++i)
+  {
+    ezUInt32 cell = channelHeads[static_cast<ezUInt32>(static_cast<ezUInt64>(i) * channelHeads.GetCount() / numSources)];
+    m_riverSources.PushBack(ezVec2((cell % m_gridResolution + 0.5f) * cellSize, (cell / m_gridResolution + 0.5f) * cellSize));
+  }
+  ezLog::Success("Placed %u river sources at %u channel heads.", numSources, channelHeads.GetCount());
+  return EZ_SUCCESS;
+}
+
+ezResult Terrain::SaveCheckpoint(const char* szFilename)
+{
+  if(m_checkpointWriter->IsWriting())
+  {
+    ezLog::Error("The last checkpoint is still being written.");
+    return EZ_FAILURE;
+  }
+
+  // The checkpoint is read back from the GPU.
+  if(m_asyncCpuSimulation)
+    StopAsyncSimulation();
+
+  SimulationCheckpointInfo info;
+  info.gridResolution = m_gridResolution;
+  info.gridWorldSize = m_gridWorldSize;
+  info.heightScale = m_heightScale;
+  info.simulationStepLengthSeconds = static_cast<float>(m_simulationStepLength.GetSeconds());
+  info.flowDamping = m_flowDamping;
+  info.flowAcceleration = m_flowAcceleration;
+  info.simulationStepIndex = m_simulationStepIndex;
+  m_checkpointWriter->BeginCheckpoint(info);
+
+  // Only the read back stalls, tiling and writing happen on the writer thread.
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+  m_terrainData->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, m_checkpointWriter->GetTerrainData());
+  m_waterOutgoingFlow->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, m_checkpointWriter->GetOutgoingFlow());
+  m_waterFlowMap->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_FLOAT, m_checkpointWriter->GetFlowMap());
+  gl::Utils::CheckError("checkpoint read back");
+
+  if(m_asyncCpuSimulation)
+    StartAsyncSimulation();
+
+  m_checkpointWriter->WriteAsync(szFilename);
+  return EZ_SUCCESS;
+}
+
+ezResult Terrain::LoadCheckpoint(const char* szFilename)
+{
+  SimulationCheckpointReader checkpoint;
+  if(checkpoint.Open(szFilename) == EZ_FAILURE)
+    return EZ_FAILURE;
+
+  const SimulationCheckpointInfo& info = checkpoint.GetInfo();
+  if(info.gridResolution != m_gridResolution || info.gridWorldSize != m_gridWorldSize)
+  {
+    ezLog::Error("Checkpoint \"%s\" has a %ux%u grid over %.0f m, expected %ux%u over %.0f m.", szFilename, info.gridResolution,
+                 info.gridResolution, info.gridWorldSize, m_gridResolution, m_gridResolution, m_gridWorldSize);
+    return EZ_FAILURE;
+  }
+
+  // The asynchronous simulation restarts from the loaded state.
+  if(m_asyncCpuSimulation)
+    m_asyncSimulation->Stop();
+
+  // Upload directly from the mapping, tile by tile. Each tile is contiguous in the file, so the OS only has to load the pages of the
+  // tile that is currently uploaded while the next one is already prefetched.
+  ezUInt32 tileSize = checkpoint.GetTileSize();
+  ezUInt32 numTilesPerSide = checkpoint.GetNumTilesPerSide();
+  for(ezUInt32 tileY = 0; tileY < numTilesPerSide; ++tileY)
+  {
+    for(ezUInt32 tileX = 0; tileX < numTilesPerSide; ++tileX)
+    {
+      ezUInt32 nextTile = tileX + 1 + tileY * numTilesPerSide;
+      if(nextTile < numTilesPerSide * numTilesPerSide)
+        checkpoint.PrefetchTile(nextTile % numTilesPerSide, nextTile / numTilesPerSide);
+
+      m_terrainData->Bind(0);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, tileX * tileSize, tileY * tileSize, tileSize, tileSize, GL_RGBA, GL_FLOAT,
+                      checkpoint.GetTileTerrainData(tileX, tileY));
+      m_waterOutgoingFlow->Bind(0);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, tileX * tileSize, tileY * tileSize, tileSize, tileSize, GL_RGBA, GL_FLOAT,
+                      checkpoint.GetTileOutgoingFlow(tileX, tileY));
+      m_waterFlowMap->Bind(0);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, tileX * tileSize, tileY * tileSize, tileSize, tileSize, GL_RG, GL_FLOAT,
+                      checkpoint.GetTileFlowMap(tileX, tileY));
+    }
+  }
+  gl::Utils::CheckError("checkpoint upload");
+
+  // The checkpoint may come from another terrain.
+  if(m_drainageAnalysis != NULL)
+    EZ_DEFAULT_DELETE(m_drainageAnalysis);
+  m_riverSources.Clear();
+
+  m_simulationStepLength = ezTime::Seconds(info.simulationStepLengthSeconds);
+  m_currentSimulationStepLength = m_simulationStepLength;
+  m_flowDamping = info.flowDamping;
+  m_flowAcceleration = info.flowAcceleration;
+  UpdateSimulationParameters();
+
+  // Continue with the same step index, so that multi-rate windows stay aligned.
+  m_simulationStepIndex = info.simulationStepIndex;
+  m_timeSinceLastSimulationStep = ezTime();
+  ResetSimulationTiles();
+
+  if(m_history != NULL)
+    m_history->Clear();
+  m_historyPosition = s_liveHistoryPosition;
+  m_lastHistoryStepIndex = m_simulationStepIndex;
+
+  if(m_asyncCpuSimulation)
+    StartAsyncSimulation();
+
+  return EZ_SUCCESS;
+}
+
+void Terrain::SetRecordHistory(bool recordHistory)
+{
+  if(m_recordHistory == recordHistory)
+    return;
+  m_recordHistory = recordHistory;
+
+  if(recordHistory)
+  {
+    if(m_history == NULL)
+      m_history = EZ_DEFAULT_NEW(SimulationHistory)(m_gridResolution, m_historyMemoryBudget);
+    glGenBuffers(1, &m_historyReadbackBuffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_historyReadbackBuffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, 2 * sizeof(ezColor) * m_gridResolution * m_gridResolution, NULL, GL_STREAM_READ);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+  else
+  {
+    // A snapshot that is still being read back is dropped, the recorded ones stay for rewinding.
+    if(m_historyReadbackFence != NULL)
+      glDeleteSync(m_historyReadbackFence);
+    m_historyReadbackFence = NULL;
+    glDeleteBuffers(1, &m_historyReadbackBuffer);
+    m_historyReadbackBuffer = 0;
+  }
+}
+
+void Terrain::SetHistoryMemoryBudget(ezUInt32 megabytes)
+{
+  m_historyMemoryBudget = static_cast<ezUInt64>(megabytes) << 20;
+  if(m_history != NULL)
+    m_history->SetMemoryBudget(m_historyMemoryBudget);
+}
+
+void Terrain::UpdateHistoryRecording()
+{
+  if(m_history == NULL)
+    return;
+
+  if(m_historyReadbackFence != NULL)
+  {
+    // Unlike the simulation stats, a snapshot is never discarded. It is picked up in a later frame instead.
+    GLenum waitResult = glClientWaitSync(m_historyReadbackFence, 0, 0);
+    if(waitResult != GL_ALREADY_SIGNALED && waitResult != GL_CONDITION_SATISFIED)
+      return;
+    glDeleteSync(m_historyReadbackFence);
+    m_historyReadbackFence = NULL;
+
+    ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_historyReadbackBuffer);
+    const ezColor* readbackData = static_cast<const ezColor*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 2 * sizeof(ezColor) * numTexels, GL_MAP_READ_BIT));
+    if(readbackData)
+    {
+      ezMemoryUtils::Copy(m_history->GetTerrainDataStaging(), readbackData, numTexels);
+      ezMemoryUtils::Copy(m_history->GetOutgoingFlowStaging(), readbackData + numTexels, numTexels);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      m_history->AddSnapshotAsync(m_historyReadbackStepIndex);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return;
+  }
+
+  // The staging buffers are in use until the last snapshot is encoded.
+  if(m_history->IsEncoding())
+    return;
+
+  ezStringBuilder statString;
+  statString.Format("%u, %.1f MB", m_history->GetNumSnapshots(), m_history->GetMemoryUsage() / (1024.0 * 1024.0));
+  ezStats::SetStat("Simulation History", statString.GetData());
+
+  if(!m_recordHistory || m_historyPosition != s_liveHistoryPosition)
+    return;
+  if(m_history->GetNumSnapshots() > 0 && m_simulationStepIndex < m_lastHistoryStepIndex + m_historyInterval)
+    return;
+
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, m_historyReadbackBuffer);
+  m_terrainData->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, NULL);
+  m_waterOutgoingFlow->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, reinterpret_cast<void*>(sizeof(ezColor) * m_gridResolution * m_gridResolution));
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  gl::Utils::CheckError("history read back");
+
+  m_historyReadbackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  m_historyReadbackStepIndex = m_simulationStepIndex;
+  m_lastHistoryStepIndex = m_simulationStepIndex;
+}
+
+void Terrain::SetWaterQueriesEnabled(bool enabled)
+{
+  if(m_waterQueriesEnabled == enabled)
+    return;
+  m_waterQueriesEnabled = enabled;
+
+  if(enabled)
+  {
+    m_waterQueries = EZ_DEFAULT_NEW(WaterSurfaceQueries)(m_gridResolution, m_gridWorldSize);
+    glGenBuffers(1, &m_waterQueryReadbackBuffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_waterQueryReadbackBuffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (sizeof(ezColor) + sizeof(ezVec2)) * m_gridResolution * m_gridResolution, NULL, GL_STREAM_READ);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    m_waterQueriesOutdated = true;
+  }
+  else
+  {
+    EZ_DEFAULT_DELETE(m_waterQueries);
+    m_waterQueries = NULL;
+    if(m_waterQueryReadbackFence != NULL)
+      glDeleteSync(m_waterQueryReadbackFence);
+    m_waterQueryReadbackFence = NULL;
+    glDeleteBuffers(1, &m_waterQueryReadbackBuffer);
+    m_waterQueryReadbackBuffer = 0;
+  }
+}
+
+ezResult Terrain::QueryWater(const ezVec2* positionsXZ, ezUInt32 numQueries, float* surfaceHeights, float* depths, ezVec2* velocities)
+{
+  if(!m_waterQueriesEnabled)
+    return EZ_FAILURE;
+  return m_waterQueries->Query(positionsXZ, numQueries, surfaceHeights, depths, velocities);
+}
+
+void Terrain::UpdateWaterQueries()
+{
+  if(!m_waterQueriesEnabled)
+    return;
+
+  ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+  if(m_waterQueryReadbackFence != NULL)
+  {
+    // Like the history, a read back is picked up in a later frame instead of waiting for it.
+    GLenum waitResult = glClientWaitSync(m_waterQueryReadbackFence, 0, 0);
+    if(waitResult != GL_ALREADY_SIGNALED && waitResult != GL_CONDITION_SATISFIED)
+      return;
+    glDeleteSync(m_waterQueryReadbackFence);
+    m_waterQueryReadbackFence = NULL;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_waterQueryReadbackBuffer);
+    const ezColor* readbackData = static_cast<const ezColor*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (sizeof(ezColor) + sizeof(ezVec2)) * numTexels, GL_MAP_READ_BIT));
+    if(readbackData)
+    {
+      m_waterQueries->SetState(readbackData, reinterpret_cast<const ezVec2*>(readbackData + numTexels), m_waterQueryReadbackStepIndex);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  // The next read back starts right away, so the copy is at most one read back behind.
+  if(!m_waterQueriesOutdated)
+    return;
+
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, m_waterQueryReadbackBuffer);
+  m_terrainData->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, NULL);
+  m_waterFlowMap->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_FLOAT, reinterpret_cast<void*>(sizeof(ezColor) * numTexels));
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  gl::Utils::CheckError("water query read back");
+
+  m_waterQueryReadbackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  m_waterQueryReadbackStepIndex = m_simulationStepIndex;
+  m_waterQueriesOutdated = false;
+}
+
+void Terrain::ScrubHistory(ezInt32 numSnapshots)
+{
+  // A snapshot that is still being read back would end up after the restored one.
+  if(m_historyReadbackFence != NULL)
+  {
+    glDeleteSync(m_historyReadbackFence);
+    m_historyReadbackFence = NULL;
+  }
+
+  ezUInt32 numRecordedSnapshots = m_history != NULL ? m_history->GetNumSnapshots() : 0;
+  if(numRecordedSnapshots == 0)
+  {
+    ezLog::Warning("There is no recorded history to rewind.");
+    return;
+  }
+
+  // The snapshot is restored on the GPU.
+  if(m_asyncCpuSimulation)
+    m_asyncSimulation->Stop();
+
+  ezInt32 position = m_historyPosition == s_liveHistoryPosition ? static_cast<ezInt32>(numRecordedSnapshots) : static_cast<ezInt32>(m_historyPosition);
+  position = ezMath::Clamp(position + numSnapshots, 0, static_cast<ezInt32>(numRecordedSnapshots) - 1);
+  RestoreHistorySnapshot(static_cast<ezUInt32>(position));
+
+  if(m_asyncCpuSimulation)
+    StartAsyncSimulation();
+}
+
+void Terrain::RestoreHistorySnapshot(ezUInt32 snapshot)
+{
+  // Only water height and outgoing flow are restored. The history quantizes the terrain height as well, restoring it would shift the
+  // terrain a little with every rewind. The remaining channels of the terrain data aren't recorded at all.
+  ezUInt32 numTexels = m_gridResolution * m_gridResolution;
+  ezDynamicArray<ezColor> terrainData;
+  terrainData.SetCount(numTexels);
+  m_terrainData->Bind(0);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, static_cast<ezArrayPtr<ezColor>>(terrainData).GetPtr());
+
+  // Tiles are decoded independently, each from its own short chain of blocks.
+  ezUInt32 tileSize = m_history->GetTileSize();
+  ezDynamicArray<ezColor> tileTerrainData;
+  ezDynamicArray<ezColor> tileOutgoingFlow;
+  tileTerrainData.SetCount(tileSize * tileSize);
+  tileOutgoingFlow.SetCount(tileSize * tileSize);
+  for(ezUInt32 tileY = 0; tileY < m_history->GetNumTilesPerSide(); ++tileY)
+  {
+    for(ezUInt32 tileX = 0; tileX < m_history->GetNumTilesPerSide(); ++tileX)
+    {
+      for(ezUInt32 y = 0; y < tileSize; ++y)
+      {
+        ezMemoryUtils::Copy(&tileTerrainData[y * tileSize], &terrainData[tileX * tileSize + (tileY * tileSize + y) * m_gridResolution], tileSize);
+      }
+      m_history->DecodeTile(snapshot, tileX, tileY, &tileTerrainData[0], &tileOutgoingFlow[0]);
+      for(ezUInt32 y = 0; y < tileSize; ++y)
+      {
+        for(ezUInt32 x = 0; x < tileSize; ++x)
+          tileTerrainData[x + y * tileSize].r = terrainData[tileX * tileSize + x + (tileY * tileSize + y) * m_gridResolution].r;
+      }
+
+      m_terrainData->Bind(0);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, tileX * tileSize, tileY * tileSize, tileSize, tileSize, GL_RGBA, GL_FLOAT, &tileTerrainData[0]);
+      m_waterOutgoingFlow->Bind(0);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, tileX * tileSize, tileY * tileSize, tileSize, tileSize, GL_RGBA, GL_FLOAT, &tileOutgoingFlow[0]);
+    }
+  }
+  gl::Utils::CheckError("history upload");
+
+  // The flow map is not recorded, it catches up with the next simulation step.
+  m_simulationStepIndex = m_history->GetSnapshotStepIndex(snapshot);
+  m_timeSinceLastSimulationStep = ezTime();
+  ResetSimulationTiles();
+
+  m_historyPosition = snapshot;
+  m_lastHistoryStepIndex = m_simulationStepIndex;
+}
+
+ezUInt32 Terrain::ComputeFixedSimulationSteps()
 {
-  m_timeSinceLastSimulationStep += lastFrameDuration;
   ezUInt32 numSimulationSteps = static_cast<ezUInt32>(m_timeSinceLastSimulationStep.GetSeconds() / m_simulationStepLength.GetSeconds());
   m_timeSinceLastSimulationStep -= m_simulationStepLength * numSimulationSteps;
 
   // clamp simulation step count, otherwise we could get stuck here under certain circumstances.
-  numSimulationSteps = ezMath::Min(numSimulationSteps, (ezUInt32)10);
+  ezTime droppedTime;
+  if(numSimulationSteps > s_maxSimulationStepsPerFrame)
+  {
+    droppedTime = m_simulationStepLength * (numSimulationSteps - s_maxSimulationStepsPerFrame);
+    numSimulationSteps = s_maxSimulationStepsPerFrame;
+  }
+
+  SetSimulationStepStats(numSimulationSteps, droppedTime);
+  return numSimulationSteps;
+}
+
+ezUInt32 Terrain::ComputeAdaptiveSimulationSteps()
+{
+  float cellDistance = m_gridWorldSize / m_gridResolution;
+
+  // Shallow water waves travel at sqrt(g * depth), the step may not carry them further than a cell: TimeStep <= CellDistance / (waveSpeed +
+  // flowSpeed), with the flow acceleration as g and the deepest water and fastest flow of the last stats that were read back. These lag
+  // a few frames behind, the courant number needs to leave some room for that.
+  float waveSpeed = ezMath::Sqrt(m_flowAcceleration * ezMath::Max(m_maxWaterDepth, s_minAdaptiveWaveDepth));
+  float flowSpeed = m_maxFlowSpeed / cellDistance;
+  ezTime stableStepLength = ezTime::Seconds(m_courantNumber * cellDistance / (waveSpeed + flowSpeed));
+
+  // Wait for more time to accumulate, but never longer than a fixed step.
+  if(m_timeSinceLastSimulationStep < ezMath::Min(stableStepLength, m_simulationStepLength))
+  {
+    SetSimulationStepStats(0, ezTime());
+    return 0;
+  }
+
+  // Cover all accumulated time with as few equally long steps as possible.
+  ezUInt32 numSimulationSteps = static_cast<ezUInt32>(ezMath::Ceil(m_timeSinceLastSimulationStep.GetSeconds() / stableStepLength.GetSeconds()));
+  ezTime droppedTime;
+  // The step length may only change between multi-rate windows, otherwise tiles with different rates would exchange different
+  // amounts of water. Frames therefore end on window boundaries.
+  if(numSimulationSteps > s_maxSimulationStepsPerFrame)
+  {
+    numSimulationSteps = s_maxSimulationStepsPerFrame;
+    if(m_multiRateZones)
+      numSimulationSteps -= (m_simulationStepIndex + numSimulationSteps) % s_multiRateWindowSteps;
+    m_currentSimulationStepLength = stableStepLength;
+    droppedTime = m_timeSinceLastSimulationStep - stableStepLength * numSimulationSteps;
+    m_timeSinceLastSimulationStep = ezTime();
+  }
+  else
+  {
+    ezUInt32 numAlignedSteps = numSimulationSteps;
+    if(m_multiRateZones)
+      numAlignedSteps += (s_multiRateWindowSteps - (m_simulationStepIndex + numSimulationSteps) % s_multiRateWindowSteps) % s_multiRateWindowSteps;
+    if(numAlignedSteps <= s_maxSimulationStepsPerFrame)
+    {
+      numSimulationSteps = numAlignedSteps;
+      m_currentSimulationStepLength = ezTime::Seconds(m_timeSinceLastSimulationStep.GetSeconds() / numSimulationSteps);
+      m_timeSinceLastSimulationStep = ezTime();
+    }
+    else
+    {
+      // Rounding up would exceed the limit. Ending on the previous boundary instead leaves time that is simulated next frame.
+      numSimulationSteps -= (m_simulationStepIndex + numSimulationSteps) % s_multiRateWindowSteps;
+      m_currentSimulationStepLength = stableStepLength;
+      m_timeSinceLastSimulationStep -= stableStepLength * numSimulationSteps;
+    }
+  }
+
+  UpdateSimulationParameters();
+  SetSimulationStepStats(numSimulationSteps, droppedTime);
+  return numSimulationSteps;
+}
+
+void Terrain::SetSimulationStepStats(ezUInt32 numSimulationSteps, ezTime droppedTime)
+{
+  ezStringBuilder statString;
+  statString.Format("%u", numSimulationSteps);
+  ezStats::SetStat("Simulation Steps", statString.GetData());
+  statString.Format("%.3f ms", m_currentSimulationStepLength.GetMilliseconds());
+  ezStats::SetStat("Simulation Step Length", statString.GetData());
+  statString.Format("%.3f ms", droppedTime.GetMilliseconds());
+  ezStats::SetStat("Dropped Simulation Time", statString.GetData());
+  statString.Format("%.3f m/s", m_maxFlowSpeed / (m_gridWorldSize / m_gridResolution));
+  ezStats::SetStat("Max Flow Speed", statString.GetData());
+}
+
+void Terrain::UpdateSimulationTileRates()
+{
+  ezUInt32 numTilesPerSide = GetNumSimulationTilesPerSide();
+  float tileWorldSize = m_gridWorldSize / numTilesPerSide;
+  m_anyReducedRateTile = false;
+
+  // snap to tiles, so rates only change when the camera moves to another tile
+  float cameraTileX = ezMath::Floor(m_lastCameraPosition.x / tileWorldSize);
+  float cameraTileY = ezMath::Floor(m_lastCameraPosition.z / tileWorldSize);
+  float fullRateZoneTiles = m_fullRateZoneSize / tileWorldSize;
+
+  for(ezUInt32 y = 0; y < numTilesPerSide; ++y)
+  {
+    for(ezUInt32 x = 0; x < numTilesPerSide; ++x)
+    {
+      ezUInt32 tileIndex = x + y * numTilesPerSide;
+      ezUInt32 rateShift = 0;
+      if(m_multiRateZones && m_tileFullRateUntilStep[tileIndex] <= m_simulationStepIndex)
+      {
+        // Zones are square rings that double their size, like the rings of the geometry clipmap.
+        float distance = ezMath::Max(ezMath::Abs(x - cameraTileX), ezMath::Abs(y - cameraTileY));
+        for(float zoneSize = fullRateZoneTiles; distance > zoneSize && rateShift < s_maxTileRateShift; zoneSize *= 2.0f)
+          ++rateShift;
+      }
+      m_tileRateShifts[tileIndex] = rateShift;
+      m_anyReducedRateTile |= rateShift > 0;
+    }
+  }
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileRateBuffer);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ezUInt32) * m_tileRateShifts.GetCount(), &m_tileRateShifts[0]);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void Terrain::ReadBackSimulationStats()
+{
+  // Oldest entry of the ring, will be reused in this frame. If the GPU is not done with it yet, it is discarded instead of stalling.
+  // Telemetry waits instead, a gap in its time series would hide exactly the steps that were expensive.
+  GLsync& fence = m_simulationStatsFence[m_currentSimulationStatsBuffer];
+  if(fence == NULL)
+    return;
+
+  TelemetrySteps& telemetrySteps = m_telemetrySteps[m_currentSimulationStatsBuffer];
+  GLenum waitResult = glClientWaitSync(fence, 0, 0);
+  if(waitResult == GL_TIMEOUT_EXPIRED && telemetrySteps.numSteps > 0)
+    waitResult = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+
+  if(waitResult == GL_ALREADY_SIGNALED || waitResult == GL_CONDITION_SATISFIED)
+  {
+    SimulationStatsHeader header;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_simulationStatsBuffer[m_currentSimulationStatsBuffer]);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(header), &header);
+    // Stored as float bits.
+    m_maxFlowSpeed = *reinterpret_cast<const float*>(&header.maxFlowSpeedBits);
+    m_maxWaterDepth = *reinterpret_cast<const float*>(&header.maxWaterDepthBits);
+    SetTileSleepStats(header.numSimulatedTiles, header.numSleepingTiles, m_simulationStatsNumSteps[m_currentSimulationStatsBuffer]);
+
+    if(telemetrySteps.numSteps > 0)
+    {
+      StepTelemetry steps[s_maxSimulationStepsPerFrame];
+      glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(SimulationStatsHeader), sizeof(StepTelemetry) * telemetrySteps.numSteps, steps);
+
+      float cellDistance = m_gridWorldSize / m_gridResolution;
+      for(ezUInt32 i = 0; i < telemetrySteps.numSteps; ++i)
+      {
+        // Water heights are summed up in fixed point, see TELEMETRY_WATER_SCALE.
+        ezUInt64 totalWaterHeight = (static_cast<ezUInt64>(steps[i].totalWaterHigh) << 32) | steps[i].totalWaterLow;
+
+        SimulationTelemetry::Sample sample;
+        sample.simulationStepIndex = telemetrySteps.firstStepIndex + i;
+        sample.complete = (telemetrySteps.completeStepMask & (1 << i)) != 0;
+        sample.brushApplied = telemetrySteps.brushApplied && i == 0;
+        sample.totalWaterVolume = static_cast<double>(totalWaterHeight) / s_telemetryWaterScale * cellDistance * cellDistance;
+        sample.maxDepth = *reinterpret_cast<const float*>(&steps[i].maxDepthBits);
+        sample.maxOutgoingFlow = *reinterpret_cast<const float*>(&steps[i].maxOutgoingFlowBits);
+        sample.numClampedCells = steps[i].numClampedCells;
+        m_telemetry->AddSample(sample);
+      }
+      m_telemetry->FlushLog();
+      SetTelemetryStats();
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  glDeleteSync(fence);
+  fence = NULL;
+  telemetrySteps.numSteps = 0;
+}
+
+void Terrain::SetTileSleepStats(ezUInt32 numSimulatedTiles, ezUInt32 numSleepingTiles, ezUInt32 numSteps)
+{
+  ezStringBuilder statString;
+  if(numSteps == 0)
+    statString = "-";
+  else if(!m_tileSleeping || m_multiRateZones)
+    statString.Format("%.1f", static_cast<float>(numSimulatedTiles) / numSteps);
+  else
+    statString.Format("%.1f (%.1f sleeping)", static_cast<float>(numSimulatedTiles) / numSteps, static_cast<float>(numSleepingTiles) / numSteps);
+  ezStats::SetStat("Simulated Tiles", statString.GetData());
+}
+
+void Terrain::SetTelemetryStats()
+{
+  ezStringBuilder statString;
+  ezUInt32 numSamples = m_telemetry->GetNumSamples();
+  if(!m_recordTelemetry || numSamples == 0)
+  {
+    ezStats::SetStat("Water Volume", "-");
+    ezStats::SetStat("Water Volume Drift", "-");
+    ezStats::SetStat("Max Water Depth", "-");
+    ezStats::SetStat("Max Outgoing Flow", "-");
+    ezStats::SetStat("Clamped Cells", "-");
+    return;
+  }
+
+  // Depth, flow and clamping are shown for the newest step and as maximum over all kept ones, so that short spikes don't go unnoticed.
+  const SimulationTelemetry::Sample& newest = m_telemetry->GetSample(numSamples - 1);
+  float windowMaxDepth = 0.0f;
+  float windowMaxOutgoingFlow = 0.0f;
+  ezUInt32 windowMaxClampedCells = 0;
+  const SimulationTelemetry::Sample* newestComplete = NULL;
+  for(ezUInt32 i = 0; i < numSamples; ++i)
+  {
+    const SimulationTelemetry::Sample& sample = m_telemetry->GetSample(i);
+    windowMaxDepth = ezMath::Max(windowMaxDepth, sample.maxDepth);
+    windowMaxOutgoingFlow = ezMath::Max(windowMaxOutgoingFlow, sample.maxOutgoingFlow);
+    windowMaxClampedCells = ezMath::Max(windowMaxClampedCells, sample.numClampedCells);
+    if(sample.complete)
+      newestComplete = &sample;
+  }
+
+  if(newestComplete != NULL)
+    statString.Format("%.1f m^3", newestComplete->totalWaterVolume);
+  else
+    statString = "-";
+  ezStats::SetStat("Water Volume", statString.GetData());
+
+  double relativeDrift = 0.0;
+  ezUInt32 numDriftSteps = 0;
+  if(m_telemetry->ComputeVolumeDrift(relativeDrift, numDriftSteps) == EZ_SUCCESS)
+    statString.Format("%+.4f%% in %i steps", relativeDrift * 100.0, numDriftSteps);
+  else
+    statString = "-";
+  ezStats::SetStat("Water Volume Drift", statString.GetData());
+
+  statString.Format("%.2f m (max %.2f m)", newest.maxDepth, windowMaxDepth);
+  ezStats::SetStat("Max Water Depth", statString.GetData());
+  statString.Format("%.2f m^3/s (max %.2f m^3/s)", newest.maxOutgoingFlow, windowMaxOutgoingFlow);
+  ezStats::SetStat("Max Outgoing Flow", statString.GetData());
+  statString.Format("%i (max %i)", newest.numClampedCells, windowMaxClampedCells);
+  ezStats::SetStat("Clamped Cells", statString.GetData());
+}
+
+void Terrain::SetRecordTelemetry(bool recordTelemetry)
+{
+  if(m_recordTelemetry == recordTelemetry)
+    return;
+
+  // Steps in flight are still read back, but a series with a gap in it is of no use.
+  m_recordTelemetry = recordTelemetry;
+  m_telemetry->Clear();
+  SetTelemetryStats();
+}
+
+ezResult Terrain::SetTelemetryLog(const char* szFilename)
+{
+  if(szFilename == NULL)
+  {
+    m_telemetry->CloseLog();
+    return EZ_SUCCESS;
+  }
+  return m_telemetry->OpenLog(szFilename);
+}
+
+void Terrain::PerformSimulationStep(ezTime lastFrameDuration)
+{
+  ReadBackHeightBounds(false);
+  if(!m_simulationPaused)
+    QueueRiverSources(lastFrameDuration);
+
+  if(m_asyncCpuSimulation)
+  {
+    UpdateAsyncSimulation();
+    return;
+  }
+
+  bool anyBrushStamp = !m_queuedBrushStamps.IsEmpty();
+  if(anyBrushStamp)
+  {
+    m_telemetryBrushPending = true;
+    m_waterQueriesOutdated = true;
+  }
+  ApplyQueuedWaterBrushes();
+  ReadBackSimulationStats();
+
+  // Without accumulated time, no steps are computed.
+  if(!m_simulationPaused)
+    m_timeSinceLastSimulationStep += lastFrameDuration;
+  ezUInt32 numSimulationSteps = m_adaptiveTimestep ? ComputeAdaptiveSimulationSteps() : ComputeFixedSimulationSteps();
 
   bool anySimStep = numSimulationSteps > 0;
+  if(anySimStep && m_historyPosition != s_liveHistoryPosition)
+  {
+    // Continuing from a restored snapshot starts a new timeline.
+    m_history->DiscardSnapshotsAfter(m_historyPosition);
+    m_historyPosition = s_liveHistoryPosition;
+  }
   if(anySimStep)
-    m_simulationParametersUBO.BindBuffer(5);
+  {
+    // Reset reductions.
+    ezUInt32 zero = 0;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, m_simulationStatsBuffer[m_currentSimulationStatsBuffer]);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    m_simulationStatsNumSteps[m_currentSimulationStatsBuffer] = numSimulationSteps;
+
+    TelemetrySteps& telemetrySteps = m_telemetrySteps[m_currentSimulationStatsBuffer];
+    telemetrySteps.firstStepIndex = m_simulationStepIndex;
+    telemetrySteps.numSteps = 0;
+    telemetrySteps.completeStepMask = 0;
+    telemetrySteps.brushApplied = m_telemetryBrushPending;
+    m_telemetryBrushPending = false;
+  }
 
+  bool tileRatesUpdated = false;
   for(; numSimulationSteps > 0; --numSimulationSteps)
   {
+    // Rates may only change when all tiles are synchronized, once per frame is enough.
+    if(m_simulationStepIndex % s_multiRateWindowSteps == 0 && !tileRatesUpdated)
+    {
+      UpdateSimulationTileRates();
+      tileRatesUpdated = true;
+    }
+    m_simulationParametersUBO["SimulationStepIndex"].Set(m_simulationStepIndex);
+    if(m_recordTelemetry)
+    {
+      // Reduced rate tiles are skipped in most steps, only the total of a step that simulates everything is comparable.
+      TelemetrySteps& telemetrySteps = m_telemetrySteps[m_currentSimulationStatsBuffer];
+      EZ_ASSERT(telemetrySteps.numSteps < s_maxSimulationStepsPerFrame, "More simulation steps in a frame than the stats buffer holds.");
+      if(m_simulationStepIndex % s_multiRateWindowSteps == 0 || !m_anyReducedRateTile)
+        telemetrySteps.completeStepMask |= 1 << telemetrySteps.numSteps;
+      m_simulationParametersUBO["TelemetrySlot"].Set(telemetrySteps.numSteps);
+      ++telemetrySteps.numSteps;
+    }
+    else
+      m_simulationParametersUBO["TelemetrySlot"].Set(s_telemetryDisabled);
+    // Flow windows of reduced rate tiles rely on their neighbours being simulated at a fixed rate.
+    ezUInt32 tileSleepSteps = m_tileSleeping && !m_multiRateZones ? m_tileSleepSteps : 0u;
+    if(tileSleepSteps != 0 && m_lastTileSleepSteps == 0)
+    {
+      // Quiet steps and water sums went stale while nothing could fall asleep.
+      ezUInt32 noActivity = 0;
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tileActivityBuffer);
+      glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &noActivity);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+    m_lastTileSleepSteps = tileSleepSteps;
+    m_simulationParametersUBO["TileSleepSteps"].Set(tileSleepSteps);
+    m_simulationParametersUBO.BindBuffer(5);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, m_tileRateBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_mipDirtyBlockFlagBuffer[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, m_mipDirtyBlockListBuffer[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_tileActivityBuffer);
+
+    // Gather all tiles that are wet or have a wet neighbour.
+    ezUInt32 numActiveTiles = 0;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_tileWetBuffer[m_currentTileWetBuffer]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_tileWetBuffer[1 - m_currentTileWetBuffer]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_activeTileListBuffer);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, sizeof(ezUInt32), GL_RED_INTEGER, GL_UNSIGNED_INT, &numActiveTiles);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
     m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F);
-    m_waterOutgoingFlow->BindImage(1, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
-    m_updateFlowShader.Activate();
-    glDispatchCompute(m_gridResolution / 16, m_gridResolution / 16, 1);
+    m_activeTilesShader.Activate();
+    glDispatchCompute((GetNumSimulationTilesPerSide() + 7) / 8, (GetNumSimulationTilesPerSide() + 7) / 8, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
 
-    m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
-    m_waterOutgoingFlow->BindImage(1, gl::Texture::ImageAccess::READ, GL_RGBA32F);
+    // Simulate only active tiles, one workgroup each.
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, m_activeTileListBuffer);
+
+    if(m_planarSimulationStorage)
+    {
+      m_simulationTerrainHeight->BindImage(0, gl::Texture::ImageAccess::READ, GL_R32F);
+      m_simulationWaterHeight->BindImage(3, gl::Texture::ImageAccess::READ, GL_R32F);
+    }
+    else
+      m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ, GL_RGBA32F);
+    m_waterOutgoingFlow->BindImage(1, gl::Texture::ImageAccess::READ_WRITE, m_waterOutgoingFlow->GetFormat());
+    m_updateFlowShader.Activate();
+    glDispatchComputeIndirect(0);
+    // Apply reads the outgoing flow image and the flow changes of each tile.
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    if(m_planarSimulationStorage)
+      m_simulationWaterHeight->BindImage(3, gl::Texture::ImageAccess::READ_WRITE, GL_R32F);
+    else
+      m_terrainData->BindImage(0, gl::Texture::ImageAccess::READ_WRITE, GL_RGBA32F);
+    m_waterOutgoingFlow->BindImage(1, gl::Texture::ImageAccess::READ, m_waterOutgoingFlow->GetFormat());
     m_waterFlowMap->BindImage(2, gl::Texture::ImageAccess::WRITE, GL_RG16F);
     m_applyFlowShader.Activate();
-    glDispatchCompute(m_gridResolution / 16, m_gridResolution / 16, 1);
+    glDispatchComputeIndirect(0);
+    // The next step reads the water heights and wet flags written by apply.
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+
+    // Wet flags written by this step are the input for the next one.
+    m_currentTileWetBuffer = 1 - m_currentTileWetBuffer;
+    ++m_simulationStepIndex;
+  }
+
+  if(anySimStep)
+  {
+    m_simulationStatsFence[m_currentSimulationStatsBuffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    m_currentSimulationStatsBuffer = (m_currentSimulationStatsBuffer + 1) % s_numSimulationStatsBuffers;
   }
 
   // Unbind to be assure the gpu that no more reads will happen
@@ -270,17 +1869,35 @@ void Terrain::PerformSimulationStep(ezTime lastFrameDuration)
   gl::Texture::ResetImageBinding(2);
 
   // Update mip and max maps
-  if (anySimStep)
-  {
-    m_terrainData->GenMipMaps();
-  }
+  if(anySimStep || anyBrushStamp)
+    UpdateTerrainDataMips();
+  if(anySimStep)
+    m_waterQueriesOutdated = true;
+
+  UpdateHistoryRecording();
+  UpdateWaterQueries();
 }
 
 void Terrain::UpdateVisibilty(const ezVec3& cameraPosition)
 {
+  m_lastCameraPosition = cameraPosition;
   m_geomClipMaps->UpdateInstanceData(cameraPosition);
 }
 
+void Terrain::BindTileSleepOverlay()
+{
+  // Without sleeping the overlay still shows which tiles are simulated.
+  ezUInt32 overlaySteps = 0;
+  if(m_showTileSleep && !m_asyncCpuSimulation)
+    overlaySteps = m_tileSleeping && !m_multiRateZones ? m_tileSleepSteps : 0xFFFFFFFF;
+  m_landscapeInfoUBO["TileSleepOverlaySteps"].Set(overlaySteps);
+  if(overlaySteps == 0)
+    return;
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_tileWetBuffer[m_currentTileWetBuffer]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_tileActivityBuffer);
+}
+
 void Terrain::DrawTerrain()
 {
   const gl::SamplerObject* pTextureFilter = m_anisotropicFiltering ? m_texturingSamplerObjectAnisotropic : m_texturingSamplerObjectTrilinear;
@@ -297,6 +1914,7 @@ void Terrain::DrawTerrain()
   pTextureFilter->BindSampler(3); // GrassNormal
   pTextureFilter->BindSampler(4); // StoneNormal
 
+  BindTileSleepOverlay();
   m_landscapeInfoUBO.BindBuffer(5);
   m_terrainRenderingUBO.BindBuffer(6);
 
@@ -338,6 +1956,7 @@ void Terrain::DrawWater(gl::Texture2D& lowresSceneCopy, gl::Texture2D& depthBuff
   glEnable(GL_DEPTH_TEST);
   glDepthMask(GL_TRUE);
 
+  BindTileSleepOverlay();
   m_landscapeInfoUBO.BindBuffer(5);
   m_waterRenderingUBO.BindBuffer(6);
 
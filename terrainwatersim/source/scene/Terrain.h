@@ -32,9 +32,148 @@ public:
   /// Creates heightmap from noise and resets flow.
   void CreateHeightmapFromNoiseAndResetSim();
 
+  /// If enabled, CreateHeightmapFromNoiseAndResetSim replaces the analytic lake with rain that already settled in the basins, see
+  /// LakePrefill. The simulation then starts at rest instead of spending thousands of steps on filling them.
+  bool GetPrefillLakes() const { return m_prefillLakes; }
+  void SetPrefillLakes(bool prefillLakes) { m_prefillLakes = prefillLakes; }
+
+  /// Depth in meters of the rain that is spread over the whole terrain for the lake prefill. Whatever doesn't fit into the basins leaves
+  /// over the grid edges.
+  float GetPrefillRainDepth() const { return m_prefillRainDepth; }
+  void SetPrefillRainDepth(float prefillRainDepth) { m_prefillRainDepth = ezMath::Max(prefillRainDepth, 0.0f); }
+
+  /// Reads back the simulation state and writes it to a checkpoint in the background, see SimulationCheckpoint.
+  /// Fails if the last checkpoint is still being written.
+  ezResult SaveCheckpoint(const char* szFilename);
+
+  /// Replaces the simulation state and parameters with those of a checkpoint. Grid resolution and world size need to match.
+  ezResult LoadCheckpoint(const char* szFilename);
+
+  // Rewind
+
+  /// If enabled, the simulation state is recorded every GetHistoryInterval() steps into a compressed history, see SimulationHistory.
+  /// The history is created when recording starts for the first time and kept for rewinding after it stopped.
+  bool GetRecordHistory() const { return m_recordHistory; }
+  void SetRecordHistory(bool recordHistory);
+
+  /// Number of simulation steps between two recorded snapshots.
+  ezUInt32 GetHistoryInterval() const { return m_historyInterval; }
+  void SetHistoryInterval(ezUInt32 numSteps) { m_historyInterval = ezMath::Max(numSteps, 1u); }
+
+  /// The oldest snapshots are dropped once the compressed history exceeds this size.
+  void SetHistoryMemoryBudget(ezUInt32 megabytes);
+
+  /// While paused no simulation steps are performed, brushes still change the water.
+  bool GetSimulationPaused() const { return m_simulationPaused; }
+  void SetSimulationPaused(bool simulationPaused);
+
+  /// Restores a recorded snapshot relative to the one that is currently shown, negative values go back in time.
+  /// Going back from the running simulation starts with the newest snapshot. As soon as the simulation continues from a restored
+  /// snapshot, all younger snapshots are discarded.
+  void ScrubHistory(ezInt32 numSnapshots);
+
+  // Asynchronous CPU simulation
+
+  /// If enabled, the simulation runs on CPU worker threads at the fixed simulation rate instead of on the GPU within the frame, see
+  /// AsyncFlowSimulation. PerformSimulationStep then only uploads the water heights of tiles that changed in the newest finished state,
+  /// they are interpolated between the last two states on the GPU. Adaptive time steps, multi-rate zones and history recording are not
+  /// available in this mode. The simulation and its buffers only exist while the mode is enabled.
+  bool GetAsyncCpuSimulation() const { return m_asyncCpuSimulation; }
+  void SetAsyncCpuSimulation(bool asyncCpuSimulation);
+
+  /// If enabled, the asynchronous CPU simulation uses the semi-implicit integrator with steps GetImplicitStepFactor() times longer than
+  /// the fixed step length, see SemiImplicitFlowIntegrator. Has no effect on the GPU simulation.
+  bool GetImplicitIntegrator() const { return m_implicitIntegrator; }
+  void SetImplicitIntegrator(bool implicitIntegrator);
+
+  /// Step length of the semi-implicit integrator relative to the fixed step length, stable up to about 50.
+  float GetImplicitStepFactor() const { return m_implicitStepFactor; }
+  void SetImplicitStepFactor(float implicitStepFactor);
+
+  // Simulation storage
+
+  /// If enabled, the GPU simulation keeps terrain and water height in two single channel textures instead of the RGBA32F terrain data,
+  /// so that steps neither read nor rewrite the other channels. Water heights are copied back into the terrain data once per frame,
+  /// only for the tiles that changed, so this pays off with several steps per frame. See simulationStorage.glsl.
+  bool GetPlanarSimulationStorage() const { return m_planarSimulationStorage; }
+  void SetPlanarSimulationStorage(bool planarSimulationStorage);
+
+  /// If enabled, the outgoing flow of the GPU simulation is stored with half precision, which halves its share of the memory traffic.
+  bool GetHalfPrecisionFlow() const { return m_halfPrecisionFlow; }
+  void SetHalfPrecisionFlow(bool halfPrecisionFlow);
+
+  // Telemetry
+
+  /// If enabled, every GPU simulation step records total water volume, deepest water, largest outgoing flow and the number of clamped
+  /// cells, see SimulationTelemetry. The values are reduced within the simulation passes and read back with the other simulation stats.
+  /// Not available for the asynchronous CPU simulation.
+  bool GetRecordTelemetry() const { return m_recordTelemetry; }
+  void SetRecordTelemetry(bool recordTelemetry);
+
+  /// Writes all further telemetry samples to a CSV file, or JSON if the name ends with .json. NULL stops writing.
+  ezResult SetTelemetryLog(const char* szFilename);
+
+  // Water queries
+
+  /// Keeps a CPU copy of the water surface up to date for QueryWater. It is read back without stalling and thus lags a few frames
+  /// behind the rendered state.
+  bool GetWaterQueriesEnabled() const { return m_waterQueriesEnabled; }
+  void SetWaterQueriesEnabled(bool enabled);
+
+  /// Bilinearly filtered surface height, water depth and flow velocity at world XZ positions, see WaterSurfaceQueries::Query.
+  /// Fails if water queries are disabled or no state has arrived yet.
+  ezResult QueryWater(const ezVec2* positionsXZ, ezUInt32 numQueries, float* surfaceHeights, float* depths, ezVec2* velocities);
+
+  // Height bounds
+
+  /// Min/max quadtree of terrain and water surface height per simulation tile, for culling and ray queries. Maintained from the tiles
+  /// that simulation and brushes changed and read back without stalling, so it lags a few frames behind the rendered state.
+  const class HeightBoundsPyramid& GetHeightBounds() const { return *m_heightBounds; }
+
+  // Drainage analysis
+
+  /// Computes flow directions, flow accumulation and watersheds of the current terrain on all cores, see DrainageAnalysis.
+  /// Terrain heights don't change while simulating, so this works in every simulation mode.
+  void AnalyzeDrainage();
+  /// Result of the last AnalyzeDrainage, NULL if there was none since the terrain was created.
+  const class DrainageAnalysis* GetDrainageAnalysis() const { return m_drainageAnalysis; }
+
+  /// Writes the rasters of the last drainage analysis, see DrainageAnalysis::ExportRasters. Fails if there is none.
+  ezResult ExportDrainageRasters(const char* szPathPrefix);
+
+  /// Catchment area in square meters that a channel needs for PlaceRiverSources to put a source at its head.
+  float GetRiverSourceCatchment() const { return m_riverSourceCatchment; }
+  void SetRiverSourceCatchment(float catchmentArea) { m_riverSourceCatchment = ezMath::Max(catchmentArea, 0.0f); }
+
+  /// Water height in meters per second that every river source adds within its radius while the simulation runs.
+  float GetRiverSourceRate() const { return m_riverSourceRate; }
+  void SetRiverSourceRate(float rate) { m_riverSourceRate = rate; }
+
+  /// Replaces all river sources with ones at the channel heads of the last drainage analysis, at most s_maxRiverSources spread evenly
+  /// over them. Fails if there is no analysis.
+  ezResult PlaceRiverSources();
+  void ClearRiverSources() { m_riverSources.Clear(); }
+  ezUInt32 GetNumRiverSources() const { return m_riverSources.GetCount(); }
+
+  static const ezUInt32 s_maxRiverSources = 64;
+
   // Brush functions
 
-  /// Adds water at a given position with a radial falloff.
+  enum class BrushShape : ezUInt32
+  {
+    RADIAL,   ///< Quadratic falloff from the center.
+    CIRCLE,   ///< Constant within the radius.
+    SQUARE    ///< Constant within a square with half edge length radius.
+  };
+
+  /// Queues a brush stamp that adds water at the given position.
+  /// All stamps queued until the next PerformSimulationStep are applied together in a single pass that only touches the simulation
+  /// tiles within their bounding rectangles.
+  /// \param radius     Brush radius in world units.
+  /// \param strength   Water height added at full brush intensity, negative values remove water.
+  void QueueWaterBrush(ezVec2 worldPositionXZ, float radius, float strength, BrushShape shape);
+
+  /// Queues a radial brush stamp with a radius of sqrt(32) cells.
   /// \param strength   Intensity scaler to the brush.
   void ApplyRadialWaterBrush(ezVec2 worldPositionXZ, float strength);
 
@@ -82,9 +221,110 @@ public:
   float GetFlowAcceleration() const { return m_flowAcceleration; }
   void SetFlowAcceleration(float flowAcceleration);
 
+  /// If enabled, step length is chosen per frame as long as stability allows instead of using the fixed steps per second.
+  /// The fixed step length then only serves as an upper bound for the time between two steps.
+  bool GetAdaptiveTimestep() const { return m_adaptiveTimestep; }
+  void SetAdaptiveTimestep(bool adaptiveTimestep);
+
+  /// Fraction of the maximum stable step length used in adaptive mode.
+  float GetCourantNumber() const { return m_courantNumber; }
+  void SetCourantNumber(float courantNumber) { m_courantNumber = courantNumber; }
+
+  /// If enabled, tiles farther away from the camera are simulated at a lower rate (every 2nd/4th step) with longer time steps.
+  /// Zones are square rings around the camera that double in size, similar to the rings of the geometry clipmap.
+  /// Tiles touched by a brush are simulated at full rate for a while regardless of their distance.
+  bool GetMultiRateZones() const { return m_multiRateZones; }
+  void SetMultiRateZones(bool multiRateZones) { m_multiRateZones = multiRateZones; }
+
+  /// Half edge length in world units of the innermost zone that is simulated at full rate.
+  float GetFullRateZoneSize() const { return m_fullRateZoneSize; }
+  void SetFullRateZoneSize(float fullRateZoneSize) { m_fullRateZoneSize = fullRateZoneSize; }
+
+  /// If enabled, tiles in which water and flow hardly changed for a while are no longer simulated until a brush or a neighbour that is
+  /// still simulated wakes them up, see activeTiles.glsl. Has no effect while multi-rate zones are enabled.
+  bool GetTileSleeping() const { return m_tileSleeping; }
+  void SetTileSleeping(bool tileSleeping) { m_tileSleeping = tileSleeping; }
+
+  /// Number of quiet steps in a row after which a tile falls asleep.
+  ezUInt32 GetTileSleepSteps() const { return m_tileSleepSteps; }
+  void SetTileSleepSteps(ezUInt32 tileSleepSteps) { m_tileSleepSteps = ezMath::Max(tileSleepSteps, 1u); }
+
+  /// Largest change of water height in m/s at which a step still counts as quiet. Flow changes are compared as the height change they
+  /// would cause in a cell.
+  float GetTileSleepThreshold() const { return m_tileSleepThreshold; }
+  void SetTileSleepThreshold(float tileSleepThreshold);
+
+  /// Tints sleeping tiles blue and simulated ones red.
+  bool GetShowTileSleep() const { return m_showTileSleep; }
+  void SetShowTileSleep(bool showTileSleep) { m_showTileSleep = showTileSleep; }
+
 
 private:
+  /// Updates the time scaled simulation values in the UBO for m_currentSimulationStepLength.
   void UpdateSimulationParameters();
+  /// Step length of the asynchronous CPU simulation, longer than the fixed one with the semi-implicit integrator.
+  ezTime GetAsyncSimulationStepLength() const;
+
+  /// (Re)compiles the simulation shaders that depend on the storage layout.
+  void LoadSimulationShaders();
+  /// Creates or deletes the planes of the planar simulation storage.
+  void CreateSimulationPlanes();
+  /// Copies terrain and water heights of the whole terrain data into the planes, needed whenever the terrain data was replaced.
+  void SplitSimulationPlanes();
+  GLenum GetFlowFormat() const { return m_halfPrecisionFlow ? GL_RGBA16F : GL_RGBA32F; }
+
+  /// Decides how many steps are needed for the accumulated simulation time with fixed step length.
+  ezUInt32 ComputeFixedSimulationSteps();
+  /// Decides how many steps are needed for the accumulated simulation time and sets the longest stable step length.
+  ezUInt32 ComputeAdaptiveSimulationSteps();
+  /// Reads back the oldest simulation stats if they are available without stalling. Telemetry waits for them instead, so that no step is
+  /// missing in its time series.
+  void ReadBackSimulationStats();
+  void SetSimulationStepStats(ezUInt32 numSimulationSteps, ezTime droppedTime);
+  void SetTelemetryStats();
+  /// Tiles simulated and sleeping per step, averaged over the steps of a simulation stats buffer.
+  void SetTileSleepStats(ezUInt32 numSimulatedTiles, ezUInt32 numSleepingTiles, ezUInt32 numSteps);
+  /// Sets up the landscape UBO and buffers for tileSleepOverlay.glsl.
+  void BindTileSleepOverlay();
+  /// Chooses the simulation rate of every tile from camera distance and recent brushes and uploads them.
+  void UpdateSimulationTileRates();
+
+  /// Applies and clears all brush stamps queued with QueueWaterBrush.
+  void ApplyQueuedWaterBrushes();
+  /// Queues a brush stamp for every river source with the water it adds within the given time.
+  void QueueRiverSources(ezTime duration);
+
+  /// Marks all tiles as wet and resets their rates, needed whenever the whole simulation state was replaced.
+  void ResetSimulationTiles();
+
+  /// Rebuilds the terrain data mips and height bounds of all tiles that simulation steps and brushes marked as dirty since the last call.
+  /// Changes that were not made by these passes need MarkAllTerrainTilesDirty first.
+  void UpdateTerrainDataMips();
+  /// Puts every tile into the dirty list of the first mip pass.
+  void MarkAllTerrainTilesDirty();
+  /// Replaces the dirty list of the first mip pass, tiles packed as x | y << 16. Tiles may appear more than once.
+  void MarkTerrainTilesDirty(const ezDynamicArray<ezUInt32>& tiles);
+  /// Applies all finished height bounds read backs to the pyramid, in the order they were started.
+  /// \param waitForCurrentBuffer   Waits for the read back in the buffer that is reused next if it did not finish yet.
+  void ReadBackHeightBounds(bool waitForCurrentBuffer);
+
+  /// Hands a finished read back to the history and starts a new one if a snapshot is due.
+  void UpdateHistoryRecording();
+  /// Hands a finished read back to the water queries and starts a new one if the state changed since.
+  void UpdateWaterQueries();
+  void RestoreHistorySnapshot(ezUInt32 snapshot);
+
+  /// Hands the GPU state to the asynchronous simulation and starts it.
+  void StartAsyncSimulation();
+  /// Stops the asynchronous simulation and uploads its complete state, so that the GPU simulation or a checkpoint can continue from it.
+  void StopAsyncSimulation();
+  /// Forwards queued brushes and uploads the newest state of the asynchronous simulation.
+  void UpdateAsyncSimulation();
+  /// Uploads the water heights of the given tiles into m_asyncWaterHeight.
+  void UploadAsyncWaterHeights(const float* waterHeights, const ezDynamicArray<ezUInt32>& tiles);
+
+  /// Number of simulation tiles per side, one tile is processed by a single workgroup.
+  ezUInt32 GetNumSimulationTilesPerSide() const { return m_gridResolution / 16; }
 
   // Settings
 
@@ -93,21 +333,53 @@ private:
   float m_minPatchSizeWorld;
   float m_heightScale;
   ezUInt32 m_gridResolution;
+  bool m_prefillLakes;
+  float m_prefillRainDepth;
 
   // simulation
   ezTime m_simulationStepLength;
   float m_flowDamping;
   float m_flowAcceleration;
+  bool m_adaptiveTimestep;
+  float m_courantNumber;
+  /// Water depth the adaptive timestep assumes at least, keeps steps bounded on dry terrain and before the first stats are read back.
+  static const float s_minAdaptiveWaveDepth;
+  /// Upper limit of simulation steps per frame, otherwise we could get stuck under certain circumstances.
+  static const ezUInt32 s_maxSimulationStepsPerFrame = 10;
+  bool m_multiRateZones;
+  float m_fullRateZoneSize;
+  /// Lowest rate is every 2^s_maxTileRateShift-th step. All rates are synchronized at multiples of this many steps.
+  static const ezUInt32 s_maxTileRateShift = 2;
+  static const ezUInt32 s_multiRateWindowSteps = 1 << s_maxTileRateShift;
+  /// Number of steps tiles stay at full rate after they were touched by a brush.
+  static const ezUInt32 s_brushFullRateSteps = 300;
+  bool m_tileSleeping;
+  ezUInt32 m_tileSleepSteps;
+  /// TileSleepSteps of the last simulated step. The tile activity is only kept up to date while it isn't 0.
+  ezUInt32 m_lastTileSleepSteps;
+  float m_tileSleepThreshold;
+  bool m_planarSimulationStorage;
+  bool m_halfPrecisionFlow;
 
   // rendering
   float m_pixelPerTriangle;
   static const float m_maxTesselationFactor;
   bool m_anisotropicFiltering;
+  bool m_showTileSleep;
     // Waterflow
   ezTime m_waterDistortionLayerBlendInterval;
 
   // State
   ezTime m_timeSinceLastSimulationStep;
+  ezTime m_currentSimulationStepLength;
+  /// Maximum of |flow| / depth of the last simulation stats that were read back.
+  float m_maxFlowSpeed;
+  /// Deepest water of the last simulation stats that were read back.
+  float m_maxWaterDepth;
+  /// Running step index, passed to the shaders for multi-rate simulation.
+  ezUInt32 m_simulationStepIndex;
+  /// Camera position of the last UpdateVisibilty call, used to choose simulation rates.
+  ezVec3 m_lastCameraPosition;
 
 
   // Graphics resources.
@@ -116,21 +388,182 @@ private:
   gl::Texture2D* m_terrainData;
   gl::Texture2D* m_waterOutgoingFlow;
   gl::Texture2D* m_waterFlowMap;
+  /// Terrain and water height of the planar simulation storage, NULL with the packed one.
+  gl::Texture2D* m_simulationTerrainHeight;
+  gl::Texture2D* m_simulationWaterHeight;
+
+    // Sparse simulation, see activeTiles.glsl
+  /// Per tile flags whether there is water or flow in a tile. Ping-pong between the state before and after a simulation step.
+  gl::BufferId m_tileWetBuffer[2];
+  ezUInt32 m_currentTileWetBuffer;
+  /// Indirect dispatch arguments followed by the list of tiles that are processed in the current step.
+  gl::BufferId m_activeTileListBuffer;
+  /// Quiet steps, largest flow change and water sum per tile for the steady state detection, see TileActivityInfo.
+  gl::BufferId m_tileActivityBuffer;
+
+    // Incremental terrain data mips, see terrainMipDirtyTiles.glsl
+  /// Each pass of terrainMips.comp rebuilds four levels.
+  static const ezUInt32 s_maxTerrainMipPasses = 4;
+  ezUInt32 m_numTerrainMipPasses;
+  /// Per pass indirect dispatch arguments followed by the dirty blocks of its source level. Simulation and brushes fill the list of the
+  /// first pass, every pass the one of the next.
+  gl::BufferId m_mipDirtyBlockListBuffer[s_maxTerrainMipPasses];
+  /// Per pass flag for each block of its source level whether it is already in the list.
+  gl::BufferId m_mipDirtyBlockFlagBuffer[s_maxTerrainMipPasses];
+
+    // Height bounds, see heightBounds.comp
+  class HeightBoundsPyramid* m_heightBounds;
+
+    // Drainage analysis
+  class DrainageAnalysis* m_drainageAnalysis;
+  /// Bounds of the tiles in the first dirty list, in list order.
+  gl::BufferId m_dirtyTileBoundsBuffer;
+  /// Ring of copies of the first dirty list followed by the bounds. Unlike the simulation stats, a read back can never be skipped since
+  /// the pyramid only gets the tiles that changed.
+  static const ezUInt32 s_numHeightBoundsReadbackBuffers = 3;
+  gl::BufferId m_heightBoundsReadbackBuffer[s_numHeightBoundsReadbackBuffers];
+  GLsync m_heightBoundsReadbackFence[s_numHeightBoundsReadbackBuffers];
+  ezUInt32 m_currentHeightBoundsReadbackBuffer;
+
+    // Multi-rate simulation, see TileRates in activeTiles.glsl
+  ezDynamicArray<ezUInt32> m_tileRateShifts;
+  /// Step index until which a tile is kept at full rate.
+  ezDynamicArray<ezUInt32> m_tileFullRateUntilStep;
+  gl::BufferId m_tileRateBuffer;
+
+    // Simulation stats, see SimulationStats in simulationCommon.glsl
+  /// Ring of buffers, so that reading back never has to wait for the GPU.
+  static const ezUInt32 s_numSimulationStatsBuffers = 3;
+  gl::BufferId m_simulationStatsBuffer[s_numSimulationStatsBuffers];
+  GLsync m_simulationStatsFence[s_numSimulationStatsBuffers];
+  /// Steps whose tile counts a simulation stats buffer sums up.
+  ezUInt32 m_simulationStatsNumSteps[s_numSimulationStatsBuffers];
+  ezUInt32 m_currentSimulationStatsBuffer;
+  /// Reductions over all steps of a frame, followed by the telemetry of each step.
+  struct SimulationStatsHeader
+  {
+    ezUInt32 maxFlowSpeedBits;
+    ezUInt32 maxWaterDepthBits;
+    ezUInt32 numSimulatedTiles;
+    ezUInt32 numSleepingTiles;
+  };
+
+    // Telemetry, see StepTelemetry in simulationCommon.glsl
+  struct StepTelemetry
+  {
+    ezUInt32 totalWaterLow;
+    ezUInt32 totalWaterHigh;
+    ezUInt32 maxDepthBits;
+    ezUInt32 maxOutgoingFlowBits;
+    ezUInt32 numClampedCells;
+  };
+  /// Steps whose telemetry a simulation stats buffer holds.
+  struct TelemetrySteps
+  {
+    ezUInt32 firstStepIndex;
+    /// 0 if no telemetry was recorded.
+    ezUInt32 numSteps;
+    /// Bit per step, set if all tiles were simulated in it.
+    ezUInt32 completeStepMask;
+    bool brushApplied;
+  };
+  static const ezUInt32 s_telemetryDisabled = 0xFFFFFFFF;
+  /// Fixed point scale of the summed water heights, see TELEMETRY_WATER_SCALE.
+  static const ezUInt32 s_telemetryWaterScale = 4096;
+  TelemetrySteps m_telemetrySteps[s_numSimulationStatsBuffers];
+  class SimulationTelemetry* m_telemetry;
+  bool m_recordTelemetry;
+  /// A brush was applied since the last step.
+  bool m_telemetryBrushPending;
+  /// Whether any tile is currently simulated at a reduced rate.
+  bool m_anyReducedRateTile;
+
+    // Checkpoints
+  class SimulationCheckpointWriter* m_checkpointWriter;
+
+    // Rewind
+  /// NULL until recording starts.
+  class SimulationHistory* m_history;
+  ezUInt64 m_historyMemoryBudget;
+  bool m_recordHistory;
+  ezUInt32 m_historyInterval;
+  bool m_simulationPaused;
+  /// Snapshot that was restored last, s_liveHistoryPosition while the simulation runs ahead of all snapshots.
+  ezUInt32 m_historyPosition;
+  static const ezUInt32 s_liveHistoryPosition = 0xFFFFFFFF;
+  /// Step index of the last snapshot that was recorded or restored.
+  ezUInt32 m_lastHistoryStepIndex;
+  /// Pixel pack buffer with terrain data followed by outgoing flow, so that recording never waits for the GPU. Only exists while recording.
+  gl::BufferId m_historyReadbackBuffer;
+  GLsync m_historyReadbackFence;
+  ezUInt32 m_historyReadbackStepIndex;
+
+    // Water queries
+  class WaterSurfaceQueries* m_waterQueries;
+  bool m_waterQueriesEnabled;
+  /// Set whenever the water changed after the last read back was started.
+  bool m_waterQueriesOutdated;
+  /// Pixel pack buffer with terrain data followed by the flow map.
+  gl::BufferId m_waterQueryReadbackBuffer;
+  GLsync m_waterQueryReadbackFence;
+  ezUInt32 m_waterQueryReadbackStepIndex;
+
+    // Asynchronous CPU simulation
+  class AsyncFlowSimulation* m_asyncSimulation;
+  bool m_asyncCpuSimulation;
+  bool m_implicitIntegrator;
+  float m_implicitStepFactor;
+  /// Terrain data of the front state for the water queries, with the water heights of the newest state.
+  ezColor* m_asyncTerrainData;
+  /// Water heights of the previous and the newest state, simulationPlanes.comp interpolates them into the terrain data.
+  gl::Texture2D* m_asyncPreviousWaterHeight;
+  gl::Texture2D* m_asyncWaterHeight;
+  /// Tiles whose water heights differ between the two states.
+  ezDynamicArray<ezUInt32> m_asyncChangedTiles;
+  /// The interpolation reached the newest state, the changed tiles stay as they are until the next one.
+  bool m_asyncInterpolationDone;
+
+    // Brushes
+  /// Brush stamp as it is read by waterBrush.comp.
+  struct BrushStamp
+  {
+    ezVec2 positionTexelCor;
+    float radiusTexel;
+    float strength;
+    BrushShape shape;
+    ezUInt32 padding;
+  };
+  ezDynamicArray<BrushStamp> m_queuedBrushStamps;
+  /// World XZ positions of the river sources, which are stamped every frame.
+  ezDynamicArray<ezVec2> m_riverSources;
+  float m_riverSourceCatchment;
+  float m_riverSourceRate;
+  /// Tiles touched by the queued stamps, packed as in activeTiles.glsl.
+  ezDynamicArray<ezUInt32> m_brushTiles;
+  /// Per tile flag to avoid duplicates in m_brushTiles.
+  ezDynamicArray<bool> m_brushTileMarks;
+  gl::BufferId m_brushStampBuffer;
+  gl::BufferId m_brushTileBuffer;
 
     // Shader
+  gl::ShaderObject m_activeTilesShader;
   gl::ShaderObject m_updateFlowShader;
   gl::ShaderObject m_applyFlowShader;
   gl::ShaderObject m_waterRenderShader;
   gl::ShaderObject m_terrainRenderShader;
   gl::ShaderObject m_copyShader;
   gl::ShaderObject m_waterBrushShader;
+  gl::ShaderObject m_terrainMipsShader;
+  gl::ShaderObject m_heightBoundsShader;
+  gl::ShaderObject m_splitSimulationPlanesShader;
+  gl::ShaderObject m_mergeSimulationPlanesShader;
+  gl::ShaderObject m_interpolateAsyncWaterShader;
 
     // UBO
   gl::UniformBuffer m_landscapeInfoUBO;
   gl::UniformBuffer m_simulationParametersUBO;
   gl::UniformBuffer m_terrainRenderingUBO;
   gl::UniformBuffer m_waterRenderingUBO;
-  gl::UniformBuffer m_brushUBO;
 
     // Samplers
   const gl::SamplerObject* m_texturingSamplerObjectAnisotropic;
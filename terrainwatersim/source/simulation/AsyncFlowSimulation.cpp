@@ -0,0 +1,314 @@
+#include "PCH.h"
+#include "AsyncFlowSimulation.h"
+
+#include <chrono>
+
+AsyncFlowSimulation::AsyncFlowSimulation(ezUInt32 gridResolution) :
+  m_solver(gridResolution),
+  m_simulationStepIndex(0),
+  m_stopRequested(false),
+  m_paused(false),
+  m_parametersChanged(false),
+  m_stepLength(ezTime::Seconds(1.0f / 60.0f)),
+  m_integrator(CpuFlowSolver::Integrator::PIPE),
+  m_middleState(1),
+  m_backState(2),
+  m_frontState(0)
+{
+  m_parameters = m_solver.GetSimulationParameters();
+  SetNumThreads(ezMath::Max(std::thread::hardware_concurrency(), 2u) - 1);
+
+  ezUInt32 numCells = gridResolution * gridResolution;
+  for(ezUInt32 i = 0; i < 3; ++i)
+  {
+    m_states[i].simulationStepIndex = 0;
+    m_states[i].numSteps = 0;
+    m_states[i].numDroppedSteps = 0;
+    m_states[i].waterHeights.SetCount(numCells);
+    m_states[i].flowMap.SetCount(numCells);
+  }
+  m_previousWaterHeights.SetCount(numCells);
+  m_brushWater.SetCount(numCells);
+}
+
+AsyncFlowSimulation::~AsyncFlowSimulation()
+{
+  if(IsRunning())
+    Stop();
+}
+
+void AsyncFlowSimulation::SetNumThreads(ezUInt32 numThreads)
+{
+  EZ_ASSERT(!IsRunning(), "The thread count can't be changed while the simulation is running.");
+  m_solver.SetNumThreads(numThreads);
+}
+
+void AsyncFlowSimulation::SetSimulationParameters(const SimulationParameters& parameters, ezTime stepLength, CpuFlowSolver::Integrator integrator)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_parameters = parameters;
+  m_stepLength = stepLength;
+  m_integrator = integrator;
+  m_parametersChanged = true;
+  m_wakeUp.notify_one();
+}
+
+void AsyncFlowSimulation::SetPaused(bool paused)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_paused = paused;
+  m_wakeUp.notify_one();
+}
+
+void AsyncFlowSimulation::Start(const ezColor* terrainData, const ezColor* outgoingFlow, ezUInt32 simulationStepIndex)
+{
+  EZ_ASSERT(!IsRunning(), "The simulation is already running.");
+
+  m_solver.SetState(terrainData, outgoingFlow);
+  m_solver.SetSimulationParameters(m_parameters);
+  m_solver.SetIntegrator(m_integrator);
+  m_simulationStepIndex = simulationStepIndex;
+
+  // The render thread starts with the initial state, nothing is published yet.
+  m_middleState = (m_frontState + 1) % 3;
+  m_backState = (m_frontState + 2) % 3;
+  State& frontState = m_states[m_frontState];
+  CopySolverState(frontState);
+  frontState.time = ezTime::Now();
+  frontState.numSteps = 0;
+  frontState.numDroppedSteps = 0;
+  frontState.computeDuration = ezTime();
+  ezMemoryUtils::Copy(&m_previousWaterHeights[0], &frontState.waterHeights[0], frontState.waterHeights.GetCount());
+  m_previousStateTime = frontState.time;
+
+  m_stopRequested = false;
+  m_parametersChanged = false;
+  m_thread = std::thread([this]() { Run(); });
+}
+
+void AsyncFlowSimulation::Stop()
+{
+  EZ_ASSERT(IsRunning(), "The simulation is not running.");
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopRequested = true;
+    m_wakeUp.notify_one();
+  }
+  m_thread.join();
+
+  // Nobody else touches the solver anymore.
+  m_solver.SetSimulationParameters(m_parameters);
+  m_solver.SetIntegrator(m_integrator);
+  ApplyBrushStamps(m_queuedBrushStamps);
+  m_queuedBrushStamps.Clear();
+}
+
+void AsyncFlowSimulation::GetTerrainData(ezColor* terrainData) const
+{
+  EZ_ASSERT(!IsRunning(), "The complete state is only available while the simulation is stopped.");
+  m_solver.GetTerrainData(terrainData);
+}
+
+void AsyncFlowSimulation::GetOutgoingFlow(ezColor* outgoingFlow) const
+{
+  EZ_ASSERT(!IsRunning(), "The complete state is only available while the simulation is stopped.");
+  m_solver.GetOutgoingFlow(outgoingFlow);
+}
+
+ezUInt32 AsyncFlowSimulation::GetSimulationStepIndex() const
+{
+  EZ_ASSERT(!IsRunning(), "The step index is only available while the simulation is stopped, use the front state instead.");
+  return m_simulationStepIndex;
+}
+
+void AsyncFlowSimulation::QueueBrushStamp(const BrushStamp& stamp)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_queuedBrushStamps.PushBack(stamp);
+}
+
+void AsyncFlowSimulation::Run()
+{
+  // Steps are due at clockBase + stepLength * n, for all n > numStepsSinceClockBase.
+  ezTime clockBase = ezTime::Now();
+  ezUInt64 numStepsSinceClockBase = 0;
+  ezTime stepLength;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  stepLength = m_stepLength;
+  while(!m_stopRequested)
+  {
+    if(m_parametersChanged)
+    {
+      m_solver.SetSimulationParameters(m_parameters);
+      m_solver.SetIntegrator(m_integrator);
+      if(m_stepLength != stepLength)
+      {
+        stepLength = m_stepLength;
+        clockBase = ezTime::Now();
+        numStepsSinceClockBase = 0;
+      }
+      m_parametersChanged = false;
+    }
+    if(m_paused)
+    {
+      m_wakeUp.wait(lock);
+      clockBase = ezTime::Now();
+      numStepsSinceClockBase = 0;
+      continue;
+    }
+
+    ezUInt64 numElapsedSteps = static_cast<ezUInt64>((ezTime::Now() - clockBase).GetSeconds() / stepLength.GetSeconds());
+    if(numElapsedSteps <= numStepsSinceClockBase)
+    {
+      double secondsUntilNextStep = (clockBase + stepLength * static_cast<double>(numStepsSinceClockBase + 1) - ezTime::Now()).GetSeconds();
+      m_wakeUp.wait_for(lock, std::chrono::duration<double>(secondsUntilNextStep));
+      continue;
+    }
+
+    ezUInt64 numDueSteps = numElapsedSteps - numStepsSinceClockBase;
+    ezUInt64 numDroppedSteps = 0;
+    if(numDueSteps > s_maxStepsPerBatch)
+    {
+      numDroppedSteps = numDueSteps - s_maxStepsPerBatch;
+      numStepsSinceClockBase += numDroppedSteps;
+      numDueSteps = s_maxStepsPerBatch;
+    }
+    m_pendingBrushStamps = m_queuedBrushStamps;
+    m_queuedBrushStamps.Clear();
+    lock.unlock();
+
+    ezTime computeStart = ezTime::Now();
+    ApplyBrushStamps(m_pendingBrushStamps);
+    m_solver.PerformSimulationSteps(static_cast<ezUInt32>(numDueSteps));
+    m_simulationStepIndex += static_cast<ezUInt32>(numDueSteps);
+    numStepsSinceClockBase += numDueSteps;
+    PublishState(clockBase + stepLength * static_cast<double>(numStepsSinceClockBase), static_cast<ezUInt32>(numDueSteps),
+                 static_cast<ezUInt32>(numDroppedSteps), ezTime::Now() - computeStart);
+
+    lock.lock();
+  }
+}
+
+void AsyncFlowSimulation::ApplyBrushStamps(const ezDynamicArray<BrushStamp>& stamps)
+{
+  if(stamps.IsEmpty())
+    return;
+
+  // Sum up all stamps within their bounding rectangle, then clamp once per cell.
+  ezInt32 maxCell = static_cast<ezInt32>(GetGridResolution()) - 1;
+  ezInt32 rectMinX = maxCell, rectMinY = maxCell, rectMaxX = 0, rectMaxY = 0;
+  for(ezUInt32 i = 0; i < stamps.GetCount(); ++i)
+  {
+    const BrushStamp& stamp = stamps[i];
+    ezInt32 minX = ezMath::Clamp(static_cast<ezInt32>(ezMath::Floor(stamp.positionTexelCor.x - stamp.radiusTexel)), 0, maxCell);
+    ezInt32 minY = ezMath::Clamp(static_cast<ezInt32>(ezMath::Floor(stamp.positionTexelCor.y - stamp.radiusTexel)), 0, maxCell);
+    ezInt32 maxX = ezMath::Clamp(static_cast<ezInt32>(ezMath::Ceil(stamp.positionTexelCor.x + stamp.radiusTexel)), 0, maxCell);
+    ezInt32 maxY = ezMath::Clamp(static_cast<ezInt32>(ezMath::Ceil(stamp.positionTexelCor.y + stamp.radiusTexel)), 0, maxCell);
+    rectMinX = ezMath::Min(rectMinX, minX);
+    rectMinY = ezMath::Min(rectMinY, minY);
+    rectMaxX = ezMath::Max(rectMaxX, maxX);
+    rectMaxY = ezMath::Max(rectMaxY, maxY);
+
+    for(ezInt32 y = minY; y <= maxY; ++y)
+    {
+      for(ezInt32 x = minX; x <= maxX; ++x)
+      {
+        ezVec2 toBrush = (stamp.positionTexelCor - ezVec2(static_cast<float>(x), static_cast<float>(y))) / stamp.radiusTexel;
+        float brushDistSq = toBrush.GetLengthSquared();
+
+        float intensity;
+        if(stamp.shape == 0)
+          intensity = ezMath::Clamp(1.0f - brushDistSq, 0.0f, 1.0f);
+        else if(stamp.shape == 1)
+          intensity = brushDistSq <= 1.0f ? 1.0f : 0.0f;
+        else
+          intensity = ezMath::Abs(toBrush.x) <= 1.0f && ezMath::Abs(toBrush.y) <= 1.0f ? 1.0f : 0.0f;
+
+        m_brushWater[x + y * GetGridResolution()] += intensity * stamp.strength;
+      }
+    }
+  }
+
+  // Add water, negative strength removes it.
+  FlowGridView& gridView = m_solver.GetGridView();
+  for(ezInt32 y = rectMinY; y <= rectMaxY; ++y)
+  {
+    for(ezInt32 x = rectMinX; x <= rectMaxX; ++x)
+    {
+      float& addedWater = m_brushWater[x + y * GetGridResolution()];
+      if(addedWater != 0.0f)
+      {
+        float& water = gridView.water[m_solver.GetCellIndex(x, y)];
+        water = ezMath::Max(0.0f, water + addedWater);
+        addedWater = 0.0f;
+      }
+    }
+  }
+}
+
+void AsyncFlowSimulation::CopySolverState(State& state) const
+{
+  const FlowGridView& gridView = m_solver.GetGridView();
+  ezUInt32 gridResolution = GetGridResolution();
+  for(ezUInt32 y = 0; y < gridResolution; ++y)
+    ezMemoryUtils::Copy(&state.waterHeights[y * gridResolution], &gridView.water[m_solver.GetCellIndex(0, y)], gridResolution);
+  m_solver.GetFlowMap(&state.flowMap[0]);
+  state.simulationStepIndex = m_simulationStepIndex;
+}
+
+void AsyncFlowSimulation::PublishState(ezTime time, ezUInt32 numSteps, ezUInt32 numDroppedSteps, ezTime computeDuration)
+{
+  State& backState = m_states[m_backState];
+  CopySolverState(backState);
+  backState.time = time;
+  backState.numSteps = numSteps;
+  backState.numDroppedSteps = numDroppedSteps;
+  backState.computeDuration = computeDuration;
+
+  // The previous middle state becomes the new back state. If the render thread didn't pick it up, it is overwritten next time.
+  m_backState = m_middleState.exchange(m_backState | s_newStateFlag) & ~s_newStateFlag;
+}
+
+bool AsyncFlowSimulation::UpdateFrontState(ezUInt32 tileSize, ezDynamicArray<ezUInt32>& changedTiles)
+{
+  if((m_middleState.load() & s_newStateFlag) == 0)
+    return false;
+
+  m_previousStateTime = m_states[m_frontState].time;
+  m_frontState = m_middleState.exchange(m_frontState) & ~s_newStateFlag;
+
+  // The previous water heights are only compared and updated where they differ, most of a lake is usually at rest.
+  const State& frontState = m_states[m_frontState];
+  ezUInt32 gridResolution = GetGridResolution();
+  ezUInt32 numTilesPerSide = (gridResolution + tileSize - 1) / tileSize;
+  changedTiles.Clear();
+  for(ezUInt32 tileY = 0; tileY < numTilesPerSide; ++tileY)
+  {
+    ezUInt32 maxY = ezMath::Min((tileY + 1) * tileSize, gridResolution);
+    for(ezUInt32 tileX = 0; tileX < numTilesPerSide; ++tileX)
+    {
+      ezUInt32 minX = tileX * tileSize;
+      ezUInt32 width = ezMath::Min(tileSize, gridResolution - minX);
+      bool changed = false;
+      for(ezUInt32 y = tileY * tileSize; y < maxY; ++y)
+      {
+        ezUInt32 rowStart = minX + y * gridResolution;
+        if(!changed && ezMemoryUtils::ByteCompare(&m_previousWaterHeights[rowStart], &frontState.waterHeights[rowStart], width) == 0)
+          continue;
+        changed = true;
+        ezMemoryUtils::Copy(&m_previousWaterHeights[rowStart], &frontState.waterHeights[rowStart], width);
+      }
+      if(changed)
+        changedTiles.PushBack(tileX | (tileY << 16));
+    }
+  }
+  return true;
+}
+
+float AsyncFlowSimulation::GetInterpolationFactor(ezTime time) const
+{
+  double stateInterval = (m_states[m_frontState].time - m_previousStateTime).GetSeconds();
+  float factor = stateInterval > 0.0 ? static_cast<float>((time - m_previousStateTime).GetSeconds() / stateInterval) : 1.0f;
+  return ezMath::Clamp(factor, 0.0f, 1.0f);
+}
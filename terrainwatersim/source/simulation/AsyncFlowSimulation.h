@@ -0,0 +1,142 @@
+#pragma once
+
+#include "CpuFlowSolver.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/// Runs CpuFlowSolver on a background thread at a fixed simulation rate, decoupled from the render loop.
+///
+/// The simulation thread keeps its own clock: it performs all steps that are due, publishes the result and sleeps until the next step.
+/// If it falls behind by more than s_maxStepsPerBatch steps, the remaining time is dropped, like Terrain does per frame.
+///
+/// Finished states are handed to the render thread through a lock-free triple buffer. The simulation thread always owns a back state
+/// to write to, the render thread always owns a front state to read from and the third state holds the newest finished one. Neither
+/// side ever waits for the other, if the render thread is slower intermediate states are skipped.
+///
+/// Brush stamps and parameter changes go the other way under a lock and are picked up before the next batch of steps.
+class AsyncFlowSimulation
+{
+public:
+  /// Water brush stamp, same meaning as in waterBrush.comp.
+  struct BrushStamp
+  {
+    ezVec2 positionTexelCor;
+    float radiusTexel;
+    float strength;
+    /// 0 radial, 1 circle, 2 square, see Terrain::BrushShape.
+    ezUInt32 shape;
+  };
+
+  /// Published simulation state. Terrain heights never change while the simulation runs and are not part of it.
+  struct State
+  {
+    ezUInt32 simulationStepIndex;
+    /// Point in time (ezTime::Now) the state belongs to according to the simulation clock.
+    ezTime time;
+    /// Steps performed since the previous published state.
+    ezUInt32 numSteps;
+    /// Steps dropped before these because the simulation thread fell behind.
+    ezUInt32 numDroppedSteps;
+    /// Time the simulation thread spent on these steps.
+    ezTime computeDuration;
+
+    ezDynamicArray<float> waterHeights;
+    ezDynamicArray<ezVec2> flowMap;
+  };
+
+  AsyncFlowSimulation(ezUInt32 gridResolution);
+  /// Stops the simulation thread.
+  ~AsyncFlowSimulation();
+
+  ezUInt32 GetGridResolution() const { return m_solver.GetGridResolution(); }
+
+  /// Number of threads the solver uses per pass, may only be changed while stopped. Defaults to all but one logical core, which is left
+  /// to the render thread.
+  void SetNumThreads(ezUInt32 numThreads);
+
+  /// Thread safe, takes effect before the next batch of steps. A new step length restarts the simulation clock.
+  /// The semi-implicit integrator is meant for step lengths the pipe model can't handle, see CpuFlowSolver::SetIntegrator.
+  void SetSimulationParameters(const SimulationParameters& parameters, ezTime stepLength, CpuFlowSolver::Integrator integrator);
+  /// Thread safe, the simulation clock doesn't advance while paused.
+  void SetPaused(bool paused);
+
+  // Simulation thread control
+
+  /// Takes over the state in the layout of the corresponding textures and starts the simulation thread.
+  /// \param outgoingFlow   May be NULL to start without any flow.
+  void Start(const ezColor* terrainData, const ezColor* outgoingFlow, ezUInt32 simulationStepIndex);
+  /// Stops the simulation thread. Brush stamps that were queued in the meantime are still applied.
+  void Stop();
+  bool IsRunning() const { return m_thread.joinable(); }
+
+  /// Complete state, only available while stopped. See CpuFlowSolver.
+  void GetTerrainData(ezColor* terrainData) const;
+  void GetOutgoingFlow(ezColor* outgoingFlow) const;
+  ezUInt32 GetSimulationStepIndex() const;
+
+  /// Thread safe, applied before the next batch of steps.
+  void QueueBrushStamp(const BrushStamp& stamp);
+
+  // Render thread
+
+  /// Switches the front state to the newest published one, if there is any. Returns whether the front state changed.
+  /// \param changedTiles   Receives all tiles of tileSize x tileSize cells whose water heights differ from the previous front state, packed
+  ///                       as x | y << 16 like PackTile in activeTiles.glsl. Left alone if there is no new state.
+  bool UpdateFrontState(ezUInt32 tileSize, ezDynamicArray<ezUInt32>& changedTiles);
+  const State& GetFrontState() const { return m_states[m_frontState]; }
+
+  /// Weight of the front state when interpolating the water heights at the given point in time between the previous and the current
+  /// front state. Times outside are clamped, so the render thread should ask for a time at least one step in the past.
+  float GetInterpolationFactor(ezTime time) const;
+
+  /// Most steps the simulation thread performs at once before it publishes a state.
+  static const ezUInt32 s_maxStepsPerBatch = 8;
+
+private:
+  void Run();
+  void ApplyBrushStamps(const ezDynamicArray<BrushStamp>& stamps);
+  /// Copies the current solver state into the back state and swaps it with the middle one.
+  void PublishState(ezTime time, ezUInt32 numSteps, ezUInt32 numDroppedSteps, ezTime computeDuration);
+  void CopySolverState(State& state) const;
+
+  CpuFlowSolver m_solver;
+  ezUInt32 m_simulationStepIndex;
+
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_wakeUp;
+
+  // Shared with the render thread, protected by m_mutex.
+
+  bool m_stopRequested;
+  bool m_paused;
+  bool m_parametersChanged;
+  SimulationParameters m_parameters;
+  ezTime m_stepLength;
+  CpuFlowSolver::Integrator m_integrator;
+  ezDynamicArray<BrushStamp> m_queuedBrushStamps;
+
+  // Simulation thread
+
+  ezDynamicArray<BrushStamp> m_pendingBrushStamps;
+  /// Water added by the stamps of one batch, summed up before clamping like in waterBrush.comp.
+  ezDynamicArray<float> m_brushWater;
+
+  // Triple buffer
+
+  State m_states[3];
+  /// Set in m_middleState if it holds a state the render thread hasn't seen yet.
+  static const ezUInt32 s_newStateFlag = 4;
+  /// Index of the state owned by neither thread, possibly with s_newStateFlag.
+  std::atomic<ezUInt32> m_middleState;
+  /// Owned by the simulation thread.
+  ezUInt32 m_backState;
+  /// Owned by the render thread.
+  ezUInt32 m_frontState;
+  /// Water heights of the front state before the last switch, to find the changed tiles.
+  ezDynamicArray<float> m_previousWaterHeights;
+  ezTime m_previousStateTime;
+};
@@ -0,0 +1,365 @@
+#include "PCH.h"
+#include "CpuFlowSolver.h"
+#include "SemiImplicitFlowIntegrator.h"
+
+#include <omp.h>
+
+CpuFlowSolver::CpuFlowSolver(ezUInt32 gridResolution) :
+  m_gridResolution(gridResolution),
+  m_numThreads(0),
+  m_integrator(Integrator::PIPE),
+  m_semiImplicitIntegrator(NULL),
+  m_numFusedSteps(1),
+  m_backData(NULL),
+  m_tileDataRowPitch(0),
+  m_tileDataPlaneSize(0)
+{
+  ezInt32 rowPitch = m_gridResolution + 2;
+  m_planeSize = rowPitch * (m_gridResolution + 2);
+  m_data = EZ_DEFAULT_NEW_RAW_BUFFER(float, m_planeSize * NUM_PLANES);
+  ezMemoryUtils::ZeroFill(m_data, m_planeSize * NUM_PLANES);
+  InitGridView(m_gridView, m_data, rowPitch, m_planeSize);
+
+  m_parameters = SimulationParameters::Compute(ezTime::Seconds(1.0f / 60.0f), 0.98f, 10.0f, 1.0f);
+
+  // 64x64 cells are 128kb over all planes, which fits into L2 on all current desktop CPUs.
+  SetTileSize(64);
+}
+
+CpuFlowSolver::~CpuFlowSolver()
+{
+  EZ_DEFAULT_DELETE_RAW_BUFFER(m_data);
+  if(m_backData)
+    EZ_DEFAULT_DELETE_RAW_BUFFER(m_backData);
+  if(m_semiImplicitIntegrator)
+    EZ_DEFAULT_DELETE(m_semiImplicitIntegrator);
+}
+
+void CpuFlowSolver::InitGridView(FlowGridView& gridView, float* data, ezInt32 rowPitch, ezUInt32 planeSize)
+{
+  // Pointers skip the first border row and column.
+  float* firstCell = data + rowPitch + 1;
+  gridView.rowPitch = rowPitch;
+  gridView.terrain = firstCell + PLANE_TERRAIN * planeSize;
+  gridView.water = firstCell + PLANE_WATER * planeSize;
+  for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+    gridView.flow[dir] = firstCell + (PLANE_FLOW_POS_X + dir) * planeSize;
+  gridView.flowMapX = firstCell + PLANE_FLOWMAP_X * planeSize;
+  gridView.flowMapY = firstCell + PLANE_FLOWMAP_Y * planeSize;
+}
+
+void CpuFlowSolver::SetTileSize(ezUInt32 tileSize)
+{
+  EZ_ASSERT(tileSize > 0, "Tile size needs to be at least one cell.");
+  m_tileSize = tileSize;
+  m_numTilesPerSide = (m_gridResolution + m_tileSize - 1) / m_tileSize;
+}
+
+void CpuFlowSolver::SetNumFusedSteps(ezUInt32 numFusedSteps)
+{
+  EZ_ASSERT(numFusedSteps > 0, "At least one step needs to be performed per tile.");
+  m_numFusedSteps = numFusedSteps;
+}
+
+void CpuFlowSolver::SetIntegrator(Integrator integrator)
+{
+  m_integrator = integrator;
+  if(m_integrator == Integrator::SEMI_IMPLICIT && !m_semiImplicitIntegrator)
+    m_semiImplicitIntegrator = EZ_DEFAULT_NEW(SemiImplicitFlowIntegrator)(m_gridResolution, m_gridView.rowPitch);
+}
+
+ezUInt32 CpuFlowSolver::GetNumThreads() const
+{
+  return m_numThreads > 0 ? m_numThreads : static_cast<ezUInt32>(omp_get_max_threads());
+}
+
+void CpuFlowSolver::GetTileRect(ezUInt32 tileIndex, ezUInt32& startX, ezUInt32& startY, ezUInt32& width, ezUInt32& height) const
+{
+  startX = (tileIndex % m_numTilesPerSide) * m_tileSize;
+  startY = (tileIndex / m_numTilesPerSide) * m_tileSize;
+  width = ezMath::Min(m_tileSize, m_gridResolution - startX);
+  height = ezMath::Min(m_tileSize, m_gridResolution - startY);
+}
+
+void CpuFlowSolver::UpdateFlowTile(ezUInt32 tileIndex)
+{
+  ezUInt32 startX, startY, width, height;
+  GetTileRect(tileIndex, startX, startY, width, height);
+  for(ezUInt32 y = startY; y < startY + height; ++y)
+    FlowKernels::UpdateFlow(m_gridView, GetCellIndex(startX, y), width, m_parameters);
+}
+
+void CpuFlowSolver::ApplyFlowTile(ezUInt32 tileIndex)
+{
+  ezUInt32 startX, startY, width, height;
+  GetTileRect(tileIndex, startX, startY, width, height);
+  for(ezUInt32 y = startY; y < startY + height; ++y)
+    FlowKernels::ApplyFlow(m_gridView, GetCellIndex(startX, y), width, m_parameters);
+}
+
+void CpuFlowSolver::PerformSimulationStep()
+{
+  if(m_integrator == Integrator::SEMI_IMPLICIT)
+  {
+    m_semiImplicitIntegrator->PerformSimulationStep(m_gridView, m_parameters, GetNumThreads());
+    return;
+  }
+
+  ezInt32 numTiles = static_cast<ezInt32>(m_numTilesPerSide * m_numTilesPerSide);
+
+#pragma omp parallel num_threads(GetNumThreads())
+  {
+#pragma omp for schedule(dynamic, 1)
+    for(ezInt32 tile = 0; tile < numTiles; ++tile)
+      UpdateFlowTile(tile);
+
+    // Implicit barrier: applying reads the outgoing flow of all neighbouring tiles.
+
+#pragma omp for schedule(dynamic, 1)
+    for(ezInt32 tile = 0; tile < numTiles; ++tile)
+      ApplyFlowTile(tile);
+  }
+}
+
+void CpuFlowSolver::PerformFlowUpdatePass()
+{
+  ezInt32 numTiles = static_cast<ezInt32>(m_numTilesPerSide * m_numTilesPerSide);
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(GetNumThreads())
+  for(ezInt32 tile = 0; tile < numTiles; ++tile)
+    UpdateFlowTile(tile);
+}
+
+void CpuFlowSolver::PerformFlowApplyPass()
+{
+  ezInt32 numTiles = static_cast<ezInt32>(m_numTilesPerSide * m_numTilesPerSide);
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(GetNumThreads())
+  for(ezInt32 tile = 0; tile < numTiles; ++tile)
+    ApplyFlowTile(tile);
+}
+
+void CpuFlowSolver::PerformSimulationSteps(ezUInt32 numSteps)
+{
+  while(numSteps > 0)
+  {
+    ezUInt32 numFusedSteps = m_integrator == Integrator::PIPE ? ezMath::Min(numSteps, m_numFusedSteps) : 1;
+    if(numFusedSteps == 1)
+      PerformSimulationStep();
+    else
+      PerformFusedSimulationSteps(numFusedSteps);
+    numSteps -= numFusedSteps;
+  }
+}
+
+double CpuFlowSolver::EstimateMemoryTrafficPerStep() const
+{
+  double numCells = static_cast<double>(m_gridResolution) * m_gridResolution;
+  if(m_integrator == Integrator::SEMI_IMPLICIT)
+  {
+    // Fixed passes move about 37 planes, every sweep reads conductances, surface heights and right hand side and writes surface heights.
+    ezUInt32 numIterations = ezMath::Max(m_semiImplicitIntegrator->GetLastNumIterations(), 1u);
+    return numCells * sizeof(float) * (37 + 5 * numIterations);
+  }
+  if(m_numFusedSteps == 1)
+  {
+    // Update reads terrain, water and flow and writes flow. Apply reads water and flow and writes water and flow map.
+    return numCells * sizeof(float) * (6 + 4 + 5 + 3);
+  }
+
+  // Every tile reads terrain, water and flow including its halo and writes water, flow and flow map once per block of fused steps.
+  double tileSizeWithHalo = static_cast<double>(ezMath::Min(m_tileSize + 4 * m_numFusedSteps, m_gridResolution));
+  double haloOverhead = (tileSizeWithHalo * tileSizeWithHalo) / (static_cast<double>(m_tileSize) * m_tileSize);
+  return numCells * sizeof(float) * (6 * haloOverhead + 7) / m_numFusedSteps;
+}
+
+void CpuFlowSolver::PrepareFusedBuffers()
+{
+  if(!m_backData)
+  {
+    m_backData = EZ_DEFAULT_NEW_RAW_BUFFER(float, m_planeSize * NUM_PLANES);
+    ezMemoryUtils::ZeroFill(m_backData, m_planeSize * NUM_PLANES);
+    InitGridView(m_backGridView, m_backData, m_gridView.rowPitch, m_planeSize);
+  }
+  m_backGridView.terrain = m_gridView.terrain;
+
+  ezUInt32 tileSizeWithHalo = ezMath::Min(m_tileSize + 4 * m_numFusedSteps, m_gridResolution);
+  m_tileDataRowPitch = tileSizeWithHalo + 2;
+  m_tileDataPlaneSize = m_tileDataRowPitch * m_tileDataRowPitch;
+
+  m_threadTileData.SetCount(GetNumThreads());
+  for(ezUInt32 i = 0; i < m_threadTileData.GetCount(); ++i)
+    m_threadTileData[i].SetCount(m_tileDataPlaneSize * NUM_PLANES);
+}
+
+void CpuFlowSolver::PerformFusedSimulationSteps(ezUInt32 numSteps)
+{
+  PrepareFusedBuffers();
+
+  ezInt32 numTiles = static_cast<ezInt32>(m_numTilesPerSide * m_numTilesPerSide);
+
+#pragma omp parallel num_threads(GetNumThreads())
+  {
+    float* tileData = static_cast<ezArrayPtr<float>>(m_threadTileData[omp_get_thread_num()]).GetPtr();
+
+#pragma omp for schedule(dynamic, 1)
+    for(ezInt32 tile = 0; tile < numTiles; ++tile)
+      PerformFusedSimulationStepsOnTile(tile, numSteps, tileData);
+  }
+
+  ezMath::Swap(m_data, m_backData);
+  ezMath::Swap(m_gridView, m_backGridView);
+
+  // The back buffer doesn't know about changes to the border since the last swap.
+  CopyBorder(m_backGridView, m_gridView);
+}
+
+void CpuFlowSolver::CopyBorder(const FlowGridView& source, const FlowGridView& target) const
+{
+  const float* sourcePlanes[] = { source.water, source.flow[0], source.flow[1], source.flow[2], source.flow[3] };
+  float* targetPlanes[] = { target.water, target.flow[0], target.flow[1], target.flow[2], target.flow[3] };
+  ezInt32 size = static_cast<ezInt32>(m_gridResolution);
+  for(ezUInt32 plane = 0; plane < EZ_ARRAY_SIZE(sourcePlanes); ++plane)
+  {
+    // Top and bottom row including the corners, then left and right column.
+    ezMemoryUtils::Copy(targetPlanes[plane] + GetCellIndex(-1, -1), sourcePlanes[plane] + GetCellIndex(-1, -1), size + 2);
+    ezMemoryUtils::Copy(targetPlanes[plane] + GetCellIndex(-1, size), sourcePlanes[plane] + GetCellIndex(-1, size), size + 2);
+    for(ezInt32 y = 0; y < size; ++y)
+    {
+      targetPlanes[plane][GetCellIndex(-1, y)] = sourcePlanes[plane][GetCellIndex(-1, y)];
+      targetPlanes[plane][GetCellIndex(size, y)] = sourcePlanes[plane][GetCellIndex(size, y)];
+    }
+  }
+}
+
+void CpuFlowSolver::PerformFusedSimulationStepsOnTile(ezUInt32 tileIndex, ezUInt32 numSteps, float* tileData)
+{
+  ezUInt32 startX, startY, width, height;
+  GetTileRect(tileIndex, startX, startY, width, height);
+
+  // After n steps, the water of a cell depends on all cells up to 2n cells away, since both passes read direct neighbours.
+  ezInt32 halo = 2 * numSteps;
+  ezInt32 regionMinX = ezMath::Max(static_cast<ezInt32>(startX) - halo, 0);
+  ezInt32 regionMinY = ezMath::Max(static_cast<ezInt32>(startY) - halo, 0);
+  ezInt32 regionMaxX = ezMath::Min(static_cast<ezInt32>(startX + width) + halo, static_cast<ezInt32>(m_gridResolution));
+  ezInt32 regionMaxY = ezMath::Min(static_cast<ezInt32>(startY + height) + halo, static_cast<ezInt32>(m_gridResolution));
+  ezInt32 regionWidth = regionMaxX - regionMinX;
+  ezInt32 regionHeight = regionMaxY - regionMinY;
+
+  FlowGridView tile;
+  InitGridView(tile, tileData, m_tileDataRowPitch, m_tileDataPlaneSize);
+
+  // Copy the region together with its one cell border, which is the zero border of the grid at grid edges.
+  const float* sourcePlanes[] = { m_gridView.terrain, m_gridView.water, m_gridView.flow[0], m_gridView.flow[1], m_gridView.flow[2], m_gridView.flow[3] };
+  float* tilePlanes[] = { tile.terrain, tile.water, tile.flow[0], tile.flow[1], tile.flow[2], tile.flow[3] };
+  for(ezInt32 y = -1; y <= regionHeight; ++y)
+  {
+    ezInt32 sourceIndex = GetCellIndex(regionMinX - 1, regionMinY + y);
+    ezInt32 localIndex = y * tile.rowPitch - 1;
+    for(ezUInt32 plane = 0; plane < EZ_ARRAY_SIZE(sourcePlanes); ++plane)
+      ezMemoryUtils::Copy(tilePlanes[plane] + localIndex, sourcePlanes[plane] + sourceIndex, regionWidth + 2);
+  }
+
+  // Cells at the edge of the region lack up to date neighbours, so the valid area shrinks by one cell per pass.
+  // This does not apply to sides at the grid edge, there the border is just as valid as it is for the whole grid.
+  ezInt32 shrinkMinX = regionMinX > 0 ? 1 : 0;
+  ezInt32 shrinkMinY = regionMinY > 0 ? 1 : 0;
+  ezInt32 shrinkMaxX = regionMaxX < static_cast<ezInt32>(m_gridResolution) ? 1 : 0;
+  ezInt32 shrinkMaxY = regionMaxY < static_cast<ezInt32>(m_gridResolution) ? 1 : 0;
+  for(ezInt32 pass = 0; pass < halo; ++pass)
+  {
+    ezInt32 minX = shrinkMinX * (pass + 1);
+    ezInt32 minY = shrinkMinY * (pass + 1);
+    ezInt32 maxX = regionWidth - shrinkMaxX * (pass + 1);
+    ezInt32 maxY = regionHeight - shrinkMaxY * (pass + 1);
+
+    for(ezInt32 y = minY; y < maxY; ++y)
+    {
+      if(pass % 2 == 0)
+        FlowKernels::UpdateFlow(tile, minX + y * tile.rowPitch, maxX - minX, m_parameters);
+      else
+        FlowKernels::ApplyFlow(tile, minX + y * tile.rowPitch, maxX - minX, m_parameters);
+    }
+  }
+
+  // What is left is exactly the tile.
+  const float* resultPlanes[] = { tile.water, tile.flow[0], tile.flow[1], tile.flow[2], tile.flow[3], tile.flowMapX, tile.flowMapY };
+  float* targetPlanes[] = { m_backGridView.water, m_backGridView.flow[0], m_backGridView.flow[1], m_backGridView.flow[2], m_backGridView.flow[3],
+                            m_backGridView.flowMapX, m_backGridView.flowMapY };
+  for(ezUInt32 y = 0; y < height; ++y)
+  {
+    ezInt32 localIndex = (startX - regionMinX) + (startY - regionMinY + y) * tile.rowPitch;
+    ezInt32 targetIndex = GetCellIndex(startX, startY + y);
+    for(ezUInt32 plane = 0; plane < EZ_ARRAY_SIZE(resultPlanes); ++plane)
+      ezMemoryUtils::Copy(targetPlanes[plane] + targetIndex, resultPlanes[plane] + localIndex, width);
+  }
+}
+
+void CpuFlowSolver::SetState(const ezColor* terrainData, const ezColor* outgoingFlow)
+{
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 cellIndex = GetCellIndex(x, y);
+      ezUInt32 texelIndex = x + y * m_gridResolution;
+
+      m_gridView.terrain[cellIndex] = terrainData[texelIndex].r;
+      m_gridView.water[cellIndex] = terrainData[texelIndex].a;
+
+      if(outgoingFlow)
+      {
+        m_gridView.flow[FlowGridView::FLOW_POS_X][cellIndex] = outgoingFlow[texelIndex].r;
+        m_gridView.flow[FlowGridView::FLOW_NEG_X][cellIndex] = outgoingFlow[texelIndex].g;
+        m_gridView.flow[FlowGridView::FLOW_POS_Y][cellIndex] = outgoingFlow[texelIndex].b;
+        m_gridView.flow[FlowGridView::FLOW_NEG_Y][cellIndex] = outgoingFlow[texelIndex].a;
+      }
+      else
+      {
+        for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+          m_gridView.flow[dir][cellIndex] = 0.0f;
+      }
+
+      m_gridView.flowMapX[cellIndex] = 0.0f;
+      m_gridView.flowMapY[cellIndex] = 0.0f;
+    }
+  }
+}
+
+void CpuFlowSolver::GetTerrainData(ezColor* terrainData) const
+{
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 cellIndex = GetCellIndex(x, y);
+      terrainData[x + y * m_gridResolution].r = m_gridView.terrain[cellIndex];
+      terrainData[x + y * m_gridResolution].a = m_gridView.water[cellIndex];
+    }
+  }
+}
+
+void CpuFlowSolver::GetOutgoingFlow(ezColor* outgoingFlow) const
+{
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 cellIndex = GetCellIndex(x, y);
+      outgoingFlow[x + y * m_gridResolution] = ezColor(m_gridView.flow[FlowGridView::FLOW_POS_X][cellIndex], m_gridView.flow[FlowGridView::FLOW_NEG_X][cellIndex],
+                                                       m_gridView.flow[FlowGridView::FLOW_POS_Y][cellIndex], m_gridView.flow[FlowGridView::FLOW_NEG_Y][cellIndex]);
+    }
+  }
+}
+
+void CpuFlowSolver::GetFlowMap(ezVec2* flowMap) const
+{
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 cellIndex = GetCellIndex(x, y);
+      flowMap[x + y * m_gridResolution] = ezVec2(m_gridView.flowMapX[cellIndex], m_gridView.flowMapY[cellIndex]);
+    }
+  }
+}
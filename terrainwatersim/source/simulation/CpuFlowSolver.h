@@ -0,0 +1,165 @@
+#pragma once
+
+#include "FlowKernels.h"
+
+#include <Foundation/Containers/DynamicArray.h>
+
+class SemiImplicitFlowIntegrator;
+
+/// CPU implementation of the virtual pipe model that is otherwise only available as flowUpdate.comp and flowApply.comp.
+///
+/// Does not need any graphics context, so it can be used for headless batch runs. State is kept as structure of arrays with a
+/// one cell border around the grid that is zero unless set otherwise. This reproduces the out-of-bounds behavior of imageLoad in the
+/// shaders and lets the SIMD kernels read neighbours without any bounds checks.
+///
+/// Like the compute shaders, every pass is split into square tiles. Tiles are distributed dynamically over all threads, so idle
+/// threads pick up remaining tiles instead of waiting for a static partition. Tile halos are read directly from the neighbouring
+/// tiles, the only synchronization is the barrier between the update and the apply pass.
+class CpuFlowSolver
+{
+public:
+  /// Creates a square grid with the given number of cells per side. All cells start flat, dry and without flow.
+  CpuFlowSolver(ezUInt32 gridResolution);
+  ~CpuFlowSolver();
+
+  ezUInt32 GetGridResolution() const { return m_gridResolution; }
+
+  void SetSimulationParameters(const SimulationParameters& parameters) { m_parameters = parameters; }
+  const SimulationParameters& GetSimulationParameters() const { return m_parameters; }
+
+  /// Sets the edge length of the tiles the grid is split into for processing. Should be chosen so that the planes of a tile fit into
+  /// L1 or L2 cache; multiples of the SIMD width avoid scalar remainders.
+  void SetTileSize(ezUInt32 tileSize);
+  ezUInt32 GetTileSize() const { return m_tileSize; }
+
+  /// Sets the number of threads used per pass. 0 uses the OpenMP default, which is usually the number of logical cores.
+  void SetNumThreads(ezUInt32 numThreads) { m_numThreads = numThreads; }
+  /// Number of threads that will actually be used by PerformSimulationStep.
+  ezUInt32 GetNumThreads() const;
+
+  /// Sets how many simulation steps PerformSimulationSteps computes on a tile before it moves on to the next one.
+  ///
+  /// With more than one fused step, every tile is copied together with a halo of two cells per step into a thread local buffer and
+  /// advanced there while it is still in cache. Halo cells are computed redundantly by all tiles that need them and results are written
+  /// to a second set of planes. This cuts memory traffic roughly by the number of fused steps at the cost of some extra computation.
+  void SetNumFusedSteps(ezUInt32 numFusedSteps);
+  ezUInt32 GetNumFusedSteps() const { return m_numFusedSteps; }
+
+  enum class Integrator
+  {
+    /// Explicit virtual pipe model, identical to the compute shaders.
+    PIPE,
+    /// SemiImplicitFlowIntegrator, stable at 10-50 times longer steps.
+    SEMI_IMPLICIT
+  };
+
+  /// Selects how PerformSimulationStep(s) advances the grid. Fused steps and the single passes only exist for the pipe model, the
+  /// semi-implicit integrator ignores GetNumFusedSteps().
+  void SetIntegrator(Integrator integrator);
+  Integrator GetIntegrator() const { return m_integrator; }
+  /// Created on first use of the semi-implicit integrator, NULL before. May be used to tune its iteration.
+  SemiImplicitFlowIntegrator* GetSemiImplicitIntegrator() { return m_semiImplicitIntegrator; }
+  const SemiImplicitFlowIntegrator* GetSemiImplicitIntegrator() const { return m_semiImplicitIntegrator; }
+
+  /// Performs a flow update and a flow apply pass over the whole grid, equivalent to one iteration of Terrain::PerformSimulationStep.
+  void PerformSimulationStep();
+
+  /// Performs numSteps simulation steps, fusing up to GetNumFusedSteps() steps per tile. Results are identical to calling
+  /// PerformSimulationStep numSteps times.
+  void PerformSimulationSteps(ezUInt32 numSteps);
+
+  /// Single passes of PerformSimulationStep with the pipe model, for callers that need to change the border in between, e.g. to exchange
+  /// halos with neighbouring sub-domains. Calling both in a row is equivalent to PerformSimulationStep.
+  void PerformFlowUpdatePass();
+  void PerformFlowApplyPass();
+
+  /// Estimated number of bytes that go to or come from main memory per simulation step with the current settings.
+  /// Assumes that all data of a tile stays in cache while it is processed, which holds as long as the tile size is chosen accordingly.
+  double EstimateMemoryTrafficPerStep() const;
+
+  // Import/Export in the layout of the corresponding textures.
+
+  /// Reads terrain height from .r and water height from .a of gridResolution² texels.
+  /// \param outgoingFlow   Outgoing flow in xyzw like the Flow image. May be NULL to start without any flow.
+  void SetState(const ezColor* terrainData, const ezColor* outgoingFlow);
+
+  /// Writes terrain height to .r and water height to .a, other channels are left untouched.
+  void GetTerrainData(ezColor* terrainData) const;
+  void GetOutgoingFlow(ezColor* outgoingFlow) const;
+  /// Writes the flow map of the last simulation step, same content as the RG16F FlowMap image.
+  void GetFlowMap(ezVec2* flowMap) const;
+
+  // Direct data access
+
+  /// View whose pointers address grid cell (0,0).
+  const FlowGridView& GetGridView() const { return m_gridView; }
+
+  /// Writable view, may only be used between simulation steps.
+  ///
+  /// Besides the grid cells, terrain, water and the flow towards the grid of border cells may be written to couple the grid to
+  /// surrounding data, e.g. a coarser grid. The solver never changes the border; all steps of a single PerformSimulationSteps call
+  /// see the same border.
+  FlowGridView& GetGridView() { return m_gridView; }
+
+  /// Index of a grid cell relative to the pointers in GetGridView().
+  ezInt32 GetCellIndex(ezInt32 x, ezInt32 y) const { return x + y * m_gridView.rowPitch; }
+
+private:
+  /// Sets up pointers for planes with the given layout. The first row and column of each plane are the border.
+  static void InitGridView(FlowGridView& gridView, float* data, ezInt32 rowPitch, ezUInt32 planeSize);
+
+  void UpdateFlowTile(ezUInt32 tileIndex);
+  void ApplyFlowTile(ezUInt32 tileIndex);
+  /// Computes the cell rectangle covered by a tile; tiles at the right and bottom edge may be smaller than the tile size.
+  void GetTileRect(ezUInt32 tileIndex, ezUInt32& startX, ezUInt32& startY, ezUInt32& width, ezUInt32& height) const;
+
+  /// Allocates back buffer and per thread tile buffers for the current tile size, fused step count and number of threads.
+  void PrepareFusedBuffers();
+  void PerformFusedSimulationSteps(ezUInt32 numSteps);
+  void PerformFusedSimulationStepsOnTile(ezUInt32 tileIndex, ezUInt32 numSteps, float* tileData);
+  /// Copies the border of all planes that are swapped with the back buffer.
+  void CopyBorder(const FlowGridView& source, const FlowGridView& target) const;
+
+  enum Plane
+  {
+    PLANE_TERRAIN,
+    PLANE_WATER,
+    PLANE_FLOW_POS_X,
+    PLANE_FLOW_NEG_X,
+    PLANE_FLOW_POS_Y,
+    PLANE_FLOW_NEG_Y,
+    PLANE_FLOWMAP_X,
+    PLANE_FLOWMAP_Y,
+
+    NUM_PLANES
+  };
+
+  const ezUInt32 m_gridResolution;
+
+  /// Number of floats per plane including the border.
+  ezUInt32 m_planeSize;
+  /// All planes in a single allocation.
+  float* m_data;
+
+  FlowGridView m_gridView;
+
+  SimulationParameters m_parameters;
+
+  ezUInt32 m_tileSize;
+  ezUInt32 m_numTilesPerSide;
+  ezUInt32 m_numThreads;
+
+  Integrator m_integrator;
+  SemiImplicitFlowIntegrator* m_semiImplicitIntegrator;
+
+  // Temporal blocking
+
+  ezUInt32 m_numFusedSteps;
+  /// Receives the results of fused steps, swapped with m_data afterwards. Terrain is shared with m_gridView since it never changes.
+  float* m_backData;
+  FlowGridView m_backGridView;
+  /// Layout of the per thread copies of a tile including halo and border.
+  ezInt32 m_tileDataRowPitch;
+  ezUInt32 m_tileDataPlaneSize;
+  ezDynamicArray<ezDynamicArray<float>> m_threadTileData;
+};
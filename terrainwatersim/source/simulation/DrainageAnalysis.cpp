@@ -0,0 +1,609 @@
+#include "PCH.h"
+#include "DrainageAnalysis.h"
+
+#include <Foundation/IO/OSFile.h>
+
+#include <functional>
+#include <omp.h>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+  /// D8 neighbours in the order of the ESRI direction codes 1, 2, 4, ..., 128.
+  const ezInt32 s_neighbourOffsetsX[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+  const ezInt32 s_neighbourOffsetsY[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+  const float s_neighbourDistancesInv[8] = { 1.0f, 0.70710678f, 1.0f, 0.70710678f, 1.0f, 0.70710678f, 1.0f, 0.70710678f };
+
+  /// Lowest connection between two watersheds, cells[0] lies in the one with the lower index.
+  struct Pass
+  {
+    float height;
+    ezUInt32 cells[2];
+  };
+
+  struct PassEdge
+  {
+    ezUInt32 watershed;
+    float height;
+    /// Cell on the own side of the pass.
+    ezUInt32 cell;
+  };
+
+  struct FloodWatershed
+  {
+    FloodWatershed(float level, ezUInt32 watershed, ezUInt32 target) : level(level), watershed(watershed), target(target) {}
+
+    /// Ties are broken by index, so that the result doesn't depend on the queue implementation.
+    bool operator > (const FloodWatershed& other) const
+    {
+      return level > other.level || (level == other.level && watershed > other.watershed);
+    }
+
+    float level;
+    ezUInt32 watershed;
+    /// Cell the pit of the watershed drains to.
+    ezUInt32 target;
+  };
+
+  ezResult WriteRaster(const char* szPathPrefix, const char* szName, const void* data, ezUInt32 bitsPerCell, ezUInt32 gridResolution, float cellSize)
+  {
+    ezStringBuilder path;
+    path.Format("%s_%s.hdr", szPathPrefix, szName);
+    ezStringBuilder header;
+    header.Format("BYTEORDER I\nLAYOUT BIL\nNROWS %u\nNCOLS %u\nNBANDS 1\nNBITS %u\nPIXELTYPE UNSIGNEDINT\nULXMAP %g\nULYMAP %g\nXDIM %g\nYDIM %g\n",
+                  gridResolution, gridResolution, bitsPerCell, cellSize * 0.5f, -cellSize * 0.5f, cellSize, cellSize);
+
+    ezOSFile file;
+    if(file.Open(path.GetData(), ezFileMode::Write) == EZ_FAILURE)
+    {
+      ezLog::Error("Failed to open \"%s\" for writing.", path.GetData());
+      return EZ_FAILURE;
+    }
+    file.Write(header.GetData(), header.GetElementCount());
+    file.Close();
+
+    path.Format("%s_%s.bil", szPathPrefix, szName);
+    if(file.Open(path.GetData(), ezFileMode::Write) == EZ_FAILURE)
+    {
+      ezLog::Error("Failed to open \"%s\" for writing.", path.GetData());
+      return EZ_FAILURE;
+    }
+    file.Write(data, static_cast<ezUInt64>(gridResolution) * gridResolution * bitsPerCell / 8);
+    file.Close();
+    return EZ_SUCCESS;
+  }
+}
+
+DrainageAnalysis::DrainageAnalysis(const float* terrainHeights, ezUInt32 gridResolution, ezUInt32 numThreads) :
+  m_gridResolution(gridResolution),
+  m_numTilesPerSide((gridResolution + s_tileSize - 1) / s_tileSize),
+  m_numThreads(numThreads > 0 ? numThreads : static_cast<ezUInt32>(omp_get_max_threads())),
+  m_numWatersheds(0),
+  m_numPits(0)
+{
+  EZ_ASSERT(gridResolution >= 2, "Drainage analysis needs a grid of at least 2x2 cells.");
+
+  ezUInt32 numCells = gridResolution * gridResolution;
+  m_receivers.SetCount(numCells);
+  m_accumulation.SetCount(numCells);
+  m_watersheds.SetCount(numCells);
+  m_tileEndpoints.SetCount(m_numTilesPerSide * m_numTilesPerSide);
+  m_tileInflows.SetCount(m_numTilesPerSide * m_numTilesPerSide);
+  m_tileEndpointOffsets.SetCount(m_numTilesPerSide * m_numTilesPerSide);
+
+  ComputeReceivers(terrainHeights);
+
+  // Watersheds of all local minima, then again after the pits were routed over their passes.
+  ezDynamicArray<ezUInt32> terminalCells;
+  ComputeWatersheds(false, terminalCells);
+  RoutePits(terrainHeights, terminalCells);
+  ComputeWatersheds(true, terminalCells);
+}
+
+ezUInt8 DrainageAnalysis::GetFlowDirection(ezUInt32 x, ezUInt32 y) const
+{
+  ezUInt32 receiver = m_receivers[x + y * m_gridResolution];
+  if(receiver == s_offGrid)
+    return 0;
+
+  ezInt32 offsetX = static_cast<ezInt32>(receiver % m_gridResolution) - static_cast<ezInt32>(x);
+  ezInt32 offsetY = static_cast<ezInt32>(receiver / m_gridResolution) - static_cast<ezInt32>(y);
+  for(ezUInt32 direction = 0; direction < 8; ++direction)
+  {
+    if(s_neighbourOffsetsX[direction] == offsetX && s_neighbourOffsetsY[direction] == offsetY)
+      return static_cast<ezUInt8>(1 << direction);
+  }
+  // Pit that drains over its pass.
+  return 0;
+}
+
+void DrainageAnalysis::FindChannelHeads(ezUInt32 minAccumulation, ezDynamicArray<ezUInt32>& channelHeadCells) const
+{
+  ezDynamicArray<ezUInt8> isChannelHead;
+  isChannelHead.SetCount(m_gridResolution * m_gridResolution);
+  ezInt32 gridResolution = static_cast<ezInt32>(m_gridResolution);
+
+#pragma omp parallel for num_threads(m_numThreads) schedule(static)
+  for(ezInt32 y = 0; y < gridResolution; ++y)
+  {
+    for(ezInt32 x = 0; x < gridResolution; ++x)
+    {
+      ezUInt32 cell = x + y * gridResolution;
+      bool channelHead = m_accumulation[cell] >= minAccumulation;
+      for(ezUInt32 direction = 0; direction < 8 && channelHead; ++direction)
+      {
+        ezInt32 neighbourX = x + s_neighbourOffsetsX[direction];
+        ezInt32 neighbourY = y + s_neighbourOffsetsY[direction];
+        if(neighbourX < 0 || neighbourY < 0 || neighbourX >= gridResolution || neighbourY >= gridResolution)
+          continue;
+        ezUInt32 neighbour = neighbourX + neighbourY * gridResolution;
+        channelHead = m_receivers[neighbour] != cell || m_accumulation[neighbour] < minAccumulation;
+      }
+      isChannelHead[cell] = channelHead ? 1 : 0;
+    }
+  }
+
+  channelHeadCells.Clear();
+  for(ezUInt32 cell = 0; cell < isChannelHead.GetCount(); ++cell)
+  {
+    if(isChannelHead[cell])
+      channelHeadCells.PushBack(cell);
+  }
+}
+
+ezResult DrainageAnalysis::ExportRasters(const char* szPathPrefix, float cellSize) const
+{
+  ezDynamicArray<ezUInt8> flowDirections;
+  flowDirections.SetCount(m_gridResolution * m_gridResolution);
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+      flowDirections[x + y * m_gridResolution] = GetFlowDirection(x, y);
+  }
+
+  // Raw data is written as is, the headers declare little endian.
+  if(WriteRaster(szPathPrefix, "flowdir", &flowDirections[0], 8, m_gridResolution, cellSize) == EZ_FAILURE ||
+     WriteRaster(szPathPrefix, "accumulation", &m_accumulation[0], 32, m_gridResolution, cellSize) == EZ_FAILURE ||
+     WriteRaster(szPathPrefix, "watersheds", &m_watersheds[0], 32, m_gridResolution, cellSize) == EZ_FAILURE)
+    return EZ_FAILURE;
+  return EZ_SUCCESS;
+}
+
+void DrainageAnalysis::ComputeReceivers(const float* terrainHeights)
+{
+  ezInt32 gridResolution = static_cast<ezInt32>(m_gridResolution);
+
+#pragma omp parallel for num_threads(m_numThreads) schedule(static)
+  for(ezInt32 y = 0; y < gridResolution; ++y)
+  {
+    for(ezInt32 x = 0; x < gridResolution; ++x)
+    {
+      ezUInt32 cell = x + y * gridResolution;
+      float height = terrainHeights[cell];
+      float maxSlope = 0.0f;
+      ezUInt32 receiver = s_offGrid;
+      bool edge = x == 0 || y == 0 || x == gridResolution - 1 || y == gridResolution - 1;
+      for(ezUInt32 direction = 0; direction < 8; ++direction)
+      {
+        ezInt32 neighbourX = x + s_neighbourOffsetsX[direction];
+        ezInt32 neighbourY = y + s_neighbourOffsetsY[direction];
+        if(edge && (neighbourX < 0 || neighbourY < 0 || neighbourX >= gridResolution || neighbourY >= gridResolution))
+          continue;
+        ezUInt32 neighbour = neighbourX + neighbourY * gridResolution;
+        float slope = (height - terrainHeights[neighbour]) * s_neighbourDistancesInv[direction];
+        if(slope > maxSlope)
+        {
+          maxSlope = slope;
+          receiver = neighbour;
+        }
+      }
+      m_receivers[cell] = receiver;
+    }
+  }
+}
+
+ezUInt32 DrainageAnalysis::GetTileIndex(ezUInt32 cell) const
+{
+  return (cell % m_gridResolution) / s_tileSize + (cell / m_gridResolution) / s_tileSize * m_numTilesPerSide;
+}
+
+void DrainageAnalysis::GetTileRect(ezUInt32 tileIndex, ezUInt32& minX, ezUInt32& minY, ezUInt32& maxX, ezUInt32& maxY) const
+{
+  minX = tileIndex % m_numTilesPerSide * s_tileSize;
+  minY = tileIndex / m_numTilesPerSide * s_tileSize;
+  maxX = ezMath::Min(minX + s_tileSize, m_gridResolution);
+  maxY = ezMath::Min(minY + s_tileSize, m_gridResolution);
+}
+
+void DrainageAnalysis::SortTile(ezUInt32 tileIndex, TileScratch& scratch) const
+{
+  ezUInt32 maxX, maxY;
+  GetTileRect(tileIndex, scratch.minX, scratch.minY, maxX, maxY);
+  scratch.width = maxX - scratch.minX;
+  ezUInt32 numTileCells = scratch.width * (maxY - scratch.minY);
+  scratch.receivers.SetCount(numTileCells);
+  scratch.numDonors.SetCount(numTileCells);
+  scratch.accumulation.SetCount(numTileCells);
+  scratch.endpoints.SetCount(numTileCells);
+
+  // Tile cell indices from here on, only receivers within the tile are kept.
+  for(ezUInt32 y = scratch.minY; y < maxY; ++y)
+  {
+    for(ezUInt32 x = scratch.minX; x < maxX; ++x)
+    {
+      ezUInt32 receiver = m_receivers[x + y * m_gridResolution];
+      ezUInt32 tileReceiver = s_offGrid;
+      if(receiver != s_offGrid)
+      {
+        ezUInt32 receiverX = receiver % m_gridResolution - scratch.minX;
+        ezUInt32 receiverY = receiver / m_gridResolution - scratch.minY;
+        if(receiverX < scratch.width && receiverY < maxY - scratch.minY)
+          tileReceiver = receiverX + receiverY * scratch.width;
+      }
+      scratch.receivers[x - scratch.minX + (y - scratch.minY) * scratch.width] = tileReceiver;
+    }
+  }
+
+  // Kahn's algorithm on the tile's part of the drainage forest.
+  ezMemoryUtils::ZeroFill(&scratch.numDonors[0], numTileCells);
+  for(ezUInt32 i = 0; i < numTileCells; ++i)
+  {
+    if(scratch.receivers[i] != s_offGrid)
+      ++scratch.numDonors[scratch.receivers[i]];
+  }
+
+  scratch.order.Clear();
+  scratch.order.Reserve(numTileCells);
+  for(ezUInt32 i = 0; i < numTileCells; ++i)
+  {
+    if(scratch.numDonors[i] == 0)
+      scratch.order.PushBack(i);
+  }
+  for(ezUInt32 i = 0; i < scratch.order.GetCount(); ++i)
+  {
+    ezUInt32 receiver = scratch.receivers[scratch.order[i]];
+    if(receiver != s_offGrid && --scratch.numDonors[receiver] == 0)
+      scratch.order.PushBack(receiver);
+  }
+  EZ_ASSERT(scratch.order.GetCount() == numTileCells, "Drainage of tile %u contains a cycle.", tileIndex);
+}
+
+void DrainageAnalysis::AccumulateTile(ezUInt32 tileIndex, TileScratch& scratch)
+{
+  ezUInt32 numTileCells = scratch.order.GetCount();
+  for(ezUInt32 i = 0; i < numTileCells; ++i)
+    scratch.accumulation[i] = 1;
+
+  const ezDynamicArray<Inflow>& inflows = m_tileInflows[tileIndex];
+  for(ezUInt32 i = 0; i < inflows.GetCount(); ++i)
+  {
+    ezUInt32 x = inflows[i].cell % m_gridResolution - scratch.minX;
+    ezUInt32 y = inflows[i].cell / m_gridResolution - scratch.minY;
+    scratch.accumulation[x + y * scratch.width] += inflows[i].accumulation;
+  }
+
+  for(ezUInt32 i = 0; i < numTileCells; ++i)
+  {
+    ezUInt32 cell = scratch.order[i];
+    if(scratch.receivers[cell] != s_offGrid)
+      scratch.accumulation[scratch.receivers[cell]] += scratch.accumulation[cell];
+  }
+
+  ezUInt32 tileHeight = numTileCells / scratch.width;
+  for(ezUInt32 y = 0; y < tileHeight; ++y)
+  {
+    ezMemoryUtils::Copy(&m_accumulation[scratch.minX + (scratch.minY + y) * m_gridResolution], &scratch.accumulation[y * scratch.width],
+                        scratch.width);
+  }
+}
+
+void DrainageAnalysis::FindTileEndpoints(ezUInt32 tileIndex, TileScratch& scratch)
+{
+  // Downstream first, so every receiver within the tile knows its endpoint already.
+  ezDynamicArray<Endpoint>& endpoints = m_tileEndpoints[tileIndex];
+  endpoints.Clear();
+  for(ezUInt32 i = scratch.order.GetCount(); i-- > 0;)
+  {
+    ezUInt32 cell = scratch.order[i];
+    if(scratch.receivers[cell] != s_offGrid)
+      scratch.endpoints[cell] = scratch.endpoints[scratch.receivers[cell]];
+    else
+    {
+      scratch.endpoints[cell] = endpoints.GetCount();
+      Endpoint endpoint;
+      endpoint.cell = scratch.minX + cell % scratch.width + (scratch.minY + cell / scratch.width) * m_gridResolution;
+      endpoint.accumulation = scratch.accumulation[cell];
+      endpoints.PushBack(endpoint);
+    }
+  }
+
+  ezUInt32 tileHeight = scratch.order.GetCount() / scratch.width;
+  for(ezUInt32 y = 0; y < tileHeight; ++y)
+  {
+    ezMemoryUtils::Copy(&m_watersheds[scratch.minX + (scratch.minY + y) * m_gridResolution], &scratch.endpoints[y * scratch.width],
+                        scratch.width);
+  }
+}
+
+void DrainageAnalysis::LabelTile(ezUInt32 tileIndex)
+{
+  ezUInt32 minX, minY, maxX, maxY;
+  GetTileRect(tileIndex, minX, minY, maxX, maxY);
+  ezUInt32 endpointOffset = m_tileEndpointOffsets[tileIndex];
+  for(ezUInt32 y = minY; y < maxY; ++y)
+  {
+    for(ezUInt32 i = minX + y * m_gridResolution; i < maxX + y * m_gridResolution; ++i)
+      m_watersheds[i] = m_endpointWatersheds[endpointOffset + m_watersheds[i]];
+  }
+}
+
+void DrainageAnalysis::ComputeWatersheds(bool accumulate, ezDynamicArray<ezUInt32>& terminalCells)
+{
+  ezInt32 numTiles = static_cast<ezInt32>(m_tileEndpoints.GetCount());
+  for(ezInt32 tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+    m_tileInflows[tileIndex].Clear();
+
+#pragma omp parallel num_threads(m_numThreads)
+  {
+    TileScratch scratch;
+#pragma omp for schedule(dynamic)
+    for(ezInt32 tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+    {
+      SortTile(tileIndex, scratch);
+      AccumulateTile(tileIndex, scratch);
+      FindTileEndpoints(tileIndex, scratch);
+    }
+  }
+
+  // Merge: Every endpoint either is a terminal or drains into a cell of another tile, whose endpoint is next downstream.
+  ezUInt32 numEndpoints = 0;
+  for(ezInt32 tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+  {
+    m_tileEndpointOffsets[tileIndex] = numEndpoints;
+    numEndpoints += m_tileEndpoints[tileIndex].GetCount();
+  }
+
+  ezDynamicArray<ezUInt32> endpointCells;
+  endpointCells.SetCount(numEndpoints);
+  ezDynamicArray<ezUInt32> downstreamEndpoints;
+  downstreamEndpoints.SetCount(numEndpoints);
+  ezDynamicArray<ezUInt32> totalAccumulation;
+  totalAccumulation.SetCount(numEndpoints);
+  ezDynamicArray<ezUInt32> numUpstreamEndpoints;
+  numUpstreamEndpoints.SetCount(numEndpoints);
+  ezMemoryUtils::ZeroFill(&numUpstreamEndpoints[0], numEndpoints);
+  for(ezInt32 tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+  {
+    const ezDynamicArray<Endpoint>& endpoints = m_tileEndpoints[tileIndex];
+    for(ezUInt32 i = 0; i < endpoints.GetCount(); ++i)
+    {
+      ezUInt32 endpoint = m_tileEndpointOffsets[tileIndex] + i;
+      ezUInt32 receiver = m_receivers[endpoints[i].cell];
+      endpointCells[endpoint] = endpoints[i].cell;
+      totalAccumulation[endpoint] = endpoints[i].accumulation;
+      if(receiver == s_offGrid)
+        downstreamEndpoints[endpoint] = s_offGrid;
+      else
+      {
+        downstreamEndpoints[endpoint] = m_tileEndpointOffsets[GetTileIndex(receiver)] + m_watersheds[receiver];
+        ++numUpstreamEndpoints[downstreamEndpoints[endpoint]];
+      }
+    }
+  }
+
+  // Upstream first for the accumulation, downstream first for the watersheds.
+  ezDynamicArray<ezUInt32> endpointOrder;
+  endpointOrder.Reserve(numEndpoints);
+  for(ezUInt32 endpoint = 0; endpoint < numEndpoints; ++endpoint)
+  {
+    if(numUpstreamEndpoints[endpoint] == 0)
+      endpointOrder.PushBack(endpoint);
+  }
+  for(ezUInt32 i = 0; i < endpointOrder.GetCount(); ++i)
+  {
+    ezUInt32 endpoint = endpointOrder[i];
+    ezUInt32 downstreamEndpoint = downstreamEndpoints[endpoint];
+    if(downstreamEndpoint == s_offGrid)
+      continue;
+
+    totalAccumulation[downstreamEndpoint] += totalAccumulation[endpoint];
+    if(--numUpstreamEndpoints[downstreamEndpoint] == 0)
+      endpointOrder.PushBack(downstreamEndpoint);
+
+    // Everything upstream of the endpoint enters the tile of its receiver there.
+    Inflow inflow;
+    inflow.cell = m_receivers[endpointCells[endpoint]];
+    inflow.accumulation = totalAccumulation[endpoint];
+    m_tileInflows[GetTileIndex(inflow.cell)].PushBack(inflow);
+  }
+  EZ_ASSERT(endpointOrder.GetCount() == numEndpoints, "Drainage across tiles contains a cycle.");
+
+  terminalCells.Clear();
+  m_endpointWatersheds.SetCount(numEndpoints);
+  for(ezUInt32 i = numEndpoints; i-- > 0;)
+  {
+    ezUInt32 endpoint = endpointOrder[i];
+    ezUInt32 downstreamEndpoint = downstreamEndpoints[endpoint];
+    if(downstreamEndpoint != s_offGrid)
+      m_endpointWatersheds[endpoint] = m_endpointWatersheds[downstreamEndpoint];
+    else
+    {
+      m_endpointWatersheds[endpoint] = terminalCells.GetCount();
+      terminalCells.PushBack(endpointCells[endpoint]);
+    }
+  }
+  m_numWatersheds = terminalCells.GetCount();
+
+  // Second pass over the tiles with the flow from the other tiles.
+#pragma omp parallel num_threads(m_numThreads)
+  {
+    TileScratch scratch;
+#pragma omp for schedule(dynamic)
+    for(ezInt32 tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+    {
+      if(accumulate)
+      {
+        SortTile(tileIndex, scratch);
+        AccumulateTile(tileIndex, scratch);
+      }
+      LabelTile(tileIndex);
+    }
+  }
+}
+
+void DrainageAnalysis::RoutePits(const float* terrainHeights, const ezDynamicArray<ezUInt32>& terminalCells)
+{
+  ezInt32 gridResolution = static_cast<ezInt32>(m_gridResolution);
+
+  // Lowest pass between each pair of adjacent watersheds, over all 8 neighbours as water flows in D8.
+  std::vector<std::unordered_map<ezUInt64, Pass>> threadPasses(m_numThreads);
+#pragma omp parallel num_threads(m_numThreads)
+  {
+    std::unordered_map<ezUInt64, Pass>& passes = threadPasses[omp_get_thread_num()];
+    ezUInt64 lastKey = 0;
+    Pass* lastPass = NULL;
+#pragma omp for schedule(static)
+    for(ezInt32 y = 0; y < gridResolution; ++y)
+    {
+      for(ezInt32 x = 0; x < gridResolution; ++x)
+      {
+        ezUInt32 cell = x + y * gridResolution;
+        ezUInt32 watershed = m_watersheds[cell];
+        // Half of the neighbours covers every adjacent pair once.
+        for(ezUInt32 direction = 0; direction < 4; ++direction)
+        {
+          ezInt32 neighbourX = x + s_neighbourOffsetsX[direction];
+          ezInt32 neighbourY = y + s_neighbourOffsetsY[direction];
+          if(neighbourX < 0 || neighbourY >= gridResolution || neighbourX >= gridResolution)
+            continue;
+          ezUInt32 neighbour = neighbourX + neighbourY * gridResolution;
+          ezUInt32 neighbourWatershed = m_watersheds[neighbour];
+          if(neighbourWatershed == watershed)
+            continue;
+
+          float height = ezMath::Max(terrainHeights[cell], terrainHeights[neighbour]);
+          bool lowerFirst = watershed < neighbourWatershed;
+          ezUInt64 key = lowerFirst ? (static_cast<ezUInt64>(watershed) << 32 | neighbourWatershed) :
+                                      (static_cast<ezUInt64>(neighbourWatershed) << 32 | watershed);
+          // Boundaries between watersheds are lines, the pair of the last boundary cell most likely comes again.
+          bool isNew = false;
+          if(key != lastKey)
+          {
+            std::pair<std::unordered_map<ezUInt64, Pass>::iterator, bool> inserted = passes.insert(std::make_pair(key, Pass()));
+            isNew = inserted.second;
+            lastKey = key;
+            lastPass = &inserted.first->second;
+          }
+          if(isNew || height < lastPass->height)
+          {
+            lastPass->height = height;
+            lastPass->cells[0] = lowerFirst ? cell : neighbour;
+            lastPass->cells[1] = lowerFirst ? neighbour : cell;
+          }
+        }
+      }
+    }
+  }
+  for(ezUInt32 thread = 1; thread < m_numThreads; ++thread)
+  {
+    for(std::unordered_map<ezUInt64, Pass>::const_iterator it = threadPasses[thread].begin(); it != threadPasses[thread].end(); ++it)
+    {
+      std::pair<std::unordered_map<ezUInt64, Pass>::iterator, bool> inserted = threadPasses[0].insert(*it);
+      if(!inserted.second && it->second.height < inserted.first->second.height)
+        inserted.first->second = it->second;
+    }
+    std::unordered_map<ezUInt64, Pass>().swap(threadPasses[thread]);
+  }
+
+  // Passes of each watershed in one array.
+  const std::unordered_map<ezUInt64, Pass>& passes = threadPasses[0];
+  ezDynamicArray<ezUInt32> firstPassEdges;
+  firstPassEdges.SetCount(m_numWatersheds + 1);
+  ezMemoryUtils::ZeroFill(&firstPassEdges[0], m_numWatersheds + 1);
+  for(std::unordered_map<ezUInt64, Pass>::const_iterator it = passes.begin(); it != passes.end(); ++it)
+  {
+    ++firstPassEdges[static_cast<ezUInt32>(it->first >> 32) + 1];
+    ++firstPassEdges[static_cast<ezUInt32>(it->first) + 1];
+  }
+  for(ezUInt32 watershed = 0; watershed < m_numWatersheds; ++watershed)
+    firstPassEdges[watershed + 1] += firstPassEdges[watershed];
+  ezDynamicArray<PassEdge> passEdges;
+  passEdges.SetCount(firstPassEdges[m_numWatersheds]);
+  ezDynamicArray<ezUInt32> numPassEdges;
+  numPassEdges.SetCount(m_numWatersheds);
+  ezMemoryUtils::ZeroFill(&numPassEdges[0], m_numWatersheds);
+  for(std::unordered_map<ezUInt64, Pass>::const_iterator it = passes.begin(); it != passes.end(); ++it)
+  {
+    ezUInt32 watersheds[2] = { static_cast<ezUInt32>(it->first >> 32), static_cast<ezUInt32>(it->first) };
+    for(ezUInt32 side = 0; side < 2; ++side)
+    {
+      PassEdge& passEdge = passEdges[firstPassEdges[watersheds[side]] + numPassEdges[watersheds[side]]++];
+      passEdge.watershed = watersheds[1 - side];
+      passEdge.height = it->second.height;
+      passEdge.cell = it->second.cells[side];
+    }
+  }
+
+  // Priority-flood over the watersheds from the grid edges. Watersheds of edge cells drain off the grid already, pits of others that
+  // reach the edge spill over their lowest edge cell.
+  std::priority_queue<FloodWatershed, std::vector<FloodWatershed>, std::greater<FloodWatershed>> floodQueue;
+  ezDynamicArray<float> edgeHeights;
+  edgeHeights.SetCount(m_numWatersheds);
+  ezDynamicArray<bool> reachesEdge;
+  reachesEdge.SetCount(m_numWatersheds);
+  for(ezUInt32 watershed = 0; watershed < m_numWatersheds; ++watershed)
+    reachesEdge[watershed] = false;
+  for(ezInt32 y = 0; y < gridResolution; ++y)
+  {
+    ezInt32 step = (y == 0 || y == gridResolution - 1) ? 1 : gridResolution - 1;
+    for(ezInt32 x = 0; x < gridResolution; x += step)
+    {
+      ezUInt32 cell = x + y * gridResolution;
+      ezUInt32 watershed = m_watersheds[cell];
+      edgeHeights[watershed] = reachesEdge[watershed] ? ezMath::Min(edgeHeights[watershed], terrainHeights[cell]) : terrainHeights[cell];
+      reachesEdge[watershed] = true;
+    }
+  }
+
+  ezDynamicArray<bool> isPit;
+  isPit.SetCount(m_numWatersheds);
+  for(ezUInt32 watershed = 0; watershed < m_numWatersheds; ++watershed)
+  {
+    ezUInt32 terminalX = terminalCells[watershed] % m_gridResolution;
+    ezUInt32 terminalY = terminalCells[watershed] / m_gridResolution;
+    isPit[watershed] = terminalX != 0 && terminalY != 0 && terminalX != m_gridResolution - 1 && terminalY != m_gridResolution - 1;
+    if(!isPit[watershed])
+      floodQueue.push(FloodWatershed(terrainHeights[terminalCells[watershed]], watershed, s_offGrid));
+    else if(reachesEdge[watershed])
+      floodQueue.push(FloodWatershed(edgeHeights[watershed], watershed, s_offGrid));
+  }
+
+  ezDynamicArray<bool> flooded;
+  flooded.SetCount(m_numWatersheds);
+  for(ezUInt32 watershed = 0; watershed < m_numWatersheds; ++watershed)
+    flooded[watershed] = false;
+  m_numPits = 0;
+  while(!floodQueue.empty())
+  {
+    FloodWatershed current = floodQueue.top();
+    floodQueue.pop();
+    if(flooded[current.watershed])
+      continue;
+    flooded[current.watershed] = true;
+
+    if(isPit[current.watershed])
+    {
+      m_receivers[terminalCells[current.watershed]] = current.target;
+      ++m_numPits;
+    }
+
+    for(ezUInt32 i = firstPassEdges[current.watershed]; i < firstPassEdges[current.watershed + 1]; ++i)
+    {
+      const PassEdge& passEdge = passEdges[i];
+      if(!flooded[passEdge.watershed])
+        floodQueue.push(FloodWatershed(ezMath::Max(current.level, passEdge.height), passEdge.watershed, passEdge.cell));
+    }
+  }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+/// D8 drainage network of a heightfield: flow direction, flow accumulation and watershed of every cell.
+///
+/// Every cell drains to the neighbour of its 8 with the steepest descent. Cells without a lower neighbour are local minima. Edge cells
+/// among them drain off the grid, the others are pits: Their watersheds are flooded from the grid edges over the graph of lowest passes
+/// between watersheds, like LakePrefill does over cells, and each pit drains to the cell beyond the pass of its watershed.
+///
+/// All per cell work is done on tiles in parallel. Each tile is sorted topologically on its own, which gives the accumulation within the
+/// tile and the cell each tile cell drains to within the tile, either a terminal or a cell draining into another tile. Only these
+/// endpoints are merged over the whole grid, serially but few, before a second pass over the tiles adds the flow that enters from other
+/// tiles.
+class DrainageAnalysis
+{
+public:
+  /// Analyzes row major terrain heights. Tiles are processed with up to numThreads threads, 0 uses all cores.
+  DrainageAnalysis(const float* terrainHeights, ezUInt32 gridResolution, ezUInt32 numThreads = 0);
+
+  ezUInt32 GetGridResolution() const { return m_gridResolution; }
+
+  /// Cell a cell drains to, s_offGrid if its water leaves the grid. Usually a neighbour, for pits the cell beyond the pass.
+  ezUInt32 GetReceiver(ezUInt32 x, ezUInt32 y) const { return m_receivers[x + y * m_gridResolution]; }
+  /// ESRI D8 code of the flow direction with y pointing down (1 = +x, 2 = +x+y, 4 = +y, ..., 128 = +x-y), 0 for pits and outlets.
+  ezUInt8 GetFlowDirection(ezUInt32 x, ezUInt32 y) const;
+  /// Number of cells that drain through a cell, including itself.
+  ezUInt32 GetAccumulation(ezUInt32 x, ezUInt32 y) const { return m_accumulation[x + y * m_gridResolution]; }
+  /// Watershed index below GetNumWatersheds(), one per cell at which water leaves the grid.
+  ezUInt32 GetWatershed(ezUInt32 x, ezUInt32 y) const { return m_watersheds[x + y * m_gridResolution]; }
+
+  ezUInt32 GetNumWatersheds() const { return m_numWatersheds; }
+  /// Number of local minima that were routed over a pass.
+  ezUInt32 GetNumPits() const { return m_numPits; }
+
+  /// Cells with at least minAccumulation where a channel starts, i.e. no neighbour that drains into them reaches minAccumulation.
+  void FindChannelHeads(ezUInt32 minAccumulation, ezDynamicArray<ezUInt32>& channelHeadCells) const;
+
+  /// Writes flow directions, accumulation and watersheds as ESRI BIL rasters with header (<prefix>_flowdir.bil/.hdr, ...), which GIS
+  /// tools read directly. Map y is -z, so the rasters aren't mirrored.
+  ezResult ExportRasters(const char* szPathPrefix, float cellSize) const;
+
+  static const ezUInt32 s_offGrid = 0xFFFFFFFF;
+
+private:
+  /// Edge length of the tiles that are processed in parallel.
+  static const ezUInt32 s_tileSize = 256;
+
+  /// Cell that a tile cell drains to within the tile.
+  struct Endpoint
+  {
+    ezUInt32 cell;
+    ezUInt32 accumulation;
+  };
+  /// Flow from another tile into a cell.
+  struct Inflow
+  {
+    ezUInt32 cell;
+    ezUInt32 accumulation;
+  };
+  /// Per thread storage for a tile, indexed by cell within the tile.
+  struct TileScratch
+  {
+    ezUInt32 minX;
+    ezUInt32 minY;
+    ezUInt32 width;
+    /// Receiver within the tile, s_offGrid for cells that drain out of the tile.
+    ezDynamicArray<ezUInt32> receivers;
+    ezDynamicArray<ezUInt32> numDonors;
+    ezDynamicArray<ezUInt32> order;
+    ezDynamicArray<ezUInt32> accumulation;
+    ezDynamicArray<ezUInt32> endpoints;
+  };
+
+  void ComputeReceivers(const float* terrainHeights);
+
+  ezUInt32 GetTileIndex(ezUInt32 cell) const;
+  void GetTileRect(ezUInt32 tileIndex, ezUInt32& minX, ezUInt32& minY, ezUInt32& maxX, ezUInt32& maxY) const;
+
+  /// Orders the cells of a tile so that every cell comes before the one it drains to.
+  void SortTile(ezUInt32 tileIndex, TileScratch& scratch) const;
+  /// Accumulation within a sorted tile, including the flow entering it that is known so far.
+  void AccumulateTile(ezUInt32 tileIndex, TileScratch& scratch);
+  /// Endpoint of every cell of a sorted tile, stored as index into the tile's endpoints in m_watersheds until LabelTile.
+  void FindTileEndpoints(ezUInt32 tileIndex, TileScratch& scratch);
+  void LabelTile(ezUInt32 tileIndex);
+
+  /// First pass over all tiles, then merges the endpoints of all tiles. Every terminal gets a watershed, every endpoint that leaves its
+  /// tile the total flow of its upstream cells on all tiles, which is passed on as inflow to the tile it enters. The second pass over the
+  /// tiles labels the watersheds and, if requested, accumulates again with these inflows.
+  void ComputeWatersheds(bool accumulate, ezDynamicArray<ezUInt32>& terminalCells);
+  /// Floods all watersheds from the grid edges and lets every pit drain over the lowest pass of its watershed.
+  void RoutePits(const float* terrainHeights, const ezDynamicArray<ezUInt32>& terminalCells);
+
+  const ezUInt32 m_gridResolution;
+  const ezUInt32 m_numTilesPerSide;
+  ezUInt32 m_numThreads;
+
+  ezDynamicArray<ezUInt32> m_receivers;
+  ezDynamicArray<ezUInt32> m_accumulation;
+  ezDynamicArray<ezUInt32> m_watersheds;
+  ezUInt32 m_numWatersheds;
+  ezUInt32 m_numPits;
+
+  ezDynamicArray<ezDynamicArray<Endpoint>> m_tileEndpoints;
+  ezDynamicArray<ezDynamicArray<Inflow>> m_tileInflows;
+  /// Watershed of every endpoint, all endpoints of a tile are stored after those of the previous tiles.
+  ezDynamicArray<ezUInt32> m_endpointWatersheds;
+  ezDynamicArray<ezUInt32> m_tileEndpointOffsets;
+};
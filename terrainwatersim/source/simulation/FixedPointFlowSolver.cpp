@@ -0,0 +1,235 @@
+#include "PCH.h"
+#include "FixedPointFlowSolver.h"
+
+#include <omp.h>
+
+namespace
+{
+  const ezInt64 s_maxFlow = 0x7FFFFFFF;
+
+  ezInt64 RoundToInt64(double value)
+  {
+    return static_cast<ezInt64>(value < 0.0 ? value - 0.5 : value + 0.5);
+  }
+}
+
+FixedPointFlowSolver::FixedPointFlowSolver(ezUInt32 gridResolution) :
+  m_gridResolution(gridResolution),
+  m_numThreads(0)
+{
+  m_rowPitch = m_gridResolution + 2;
+  m_planeSize = m_rowPitch * (m_gridResolution + 2);
+  m_data = EZ_DEFAULT_NEW_RAW_BUFFER(ezInt32, m_planeSize * NUM_PLANES);
+  ezMemoryUtils::ZeroFill(m_data, m_planeSize * NUM_PLANES);
+  for(ezUInt32 plane = 0; plane < NUM_PLANES; ++plane)
+    m_planes[plane] = m_data + plane * m_planeSize + m_rowPitch + 1;
+
+  SetSimulationParameters(SimulationParameters::Compute(ezTime::Seconds(1.0f / 60.0f), 0.98f, 10.0f, 1.0f));
+}
+
+FixedPointFlowSolver::~FixedPointFlowSolver()
+{
+  EZ_DEFAULT_DELETE_RAW_BUFFER(m_data);
+}
+
+ezInt32 FixedPointFlowSolver::ToFixedPoint(float height)
+{
+  return static_cast<ezInt32>(RoundToInt64(static_cast<double>(height) * (1 << s_heightFractionBits)));
+}
+
+float FixedPointFlowSolver::ToFloat(ezInt32 height)
+{
+  return static_cast<float>(static_cast<double>(height) / (1 << s_heightFractionBits));
+}
+
+float FixedPointFlowSolver::FlowToFloat(ezInt32 flow) const
+{
+  return static_cast<float>(static_cast<double>(ToFloat(flow)) / m_parameters.cellAreaInv_timeScaled);
+}
+
+ezInt32 FixedPointFlowSolver::FlowToFixedPoint(float flow) const
+{
+  return ToFixedPoint(flow * m_parameters.cellAreaInv_timeScaled);
+}
+
+void FixedPointFlowSolver::SetSimulationParameters(const SimulationParameters& parameters)
+{
+  m_parameters = parameters;
+
+  // The float solvers keep flow in volume per time and scale it with cellAreaInv_timeScaled when moving water. Here, flow is already
+  // stored as height per step, so the scale moves to the acceleration.
+  double flowAcceleration = static_cast<double>(parameters.waterAcceleration_perStep) * parameters.cellAreaInv_timeScaled;
+  EZ_ASSERT(flowAcceleration < 1.0, "Time step is too long for a stable simulation.");
+  m_flowFriction = RoundToInt64(static_cast<double>(parameters.flowFriction_perStep) * (1 << s_factorFractionBits));
+  m_flowAcceleration = RoundToInt64(flowAcceleration * (1 << s_factorFractionBits));
+}
+
+ezUInt32 FixedPointFlowSolver::GetNumThreads() const
+{
+  return m_numThreads > 0 ? m_numThreads : static_cast<ezUInt32>(omp_get_max_threads());
+}
+
+void FixedPointFlowSolver::UpdateFlowRow(ezInt32 y)
+{
+  const ezInt32* terrain = m_planes[PLANE_TERRAIN];
+  const ezInt32* water = m_planes[PLANE_WATER];
+  const ezInt32 neighbourOffsets[] = { 1, -1, m_rowPitch, -m_rowPitch };
+  const ezInt64 rounding = static_cast<ezInt64>(1) << (s_factorFractionBits - 1);
+
+  for(ezInt32 i = GetCellIndex(0, y), end = GetCellIndex(m_gridResolution, y); i < end; ++i)
+  {
+    ezInt64 ownWaterHeight = static_cast<ezInt64>(water[i]) + terrain[i];
+
+    ezInt64 newFlowOut[4];
+    ezInt64 totalOutgoingFlow = 0;
+    for(ezUInt32 dir = 0; dir < 4; ++dir)
+    {
+      ezInt32 neighbour = i + neighbourOffsets[dir];
+      ezInt64 heightDifference = ownWaterHeight - (static_cast<ezInt64>(water[neighbour]) + terrain[neighbour]);
+      ezInt64 flow = (m_planes[PLANE_FLOW_POS_X + dir][i] * m_flowFriction + heightDifference * m_flowAcceleration + rounding) >> s_factorFractionBits;
+      newFlowOut[dir] = ezMath::Clamp(flow, static_cast<ezInt64>(0), s_maxFlow);
+      totalOutgoingFlow += newFlowOut[dir];
+    }
+
+    // scale newFlowOut down, so that water height won't be below zero in the next step!
+    // Rounding down makes sure that the sum never exceeds the available water.
+    if(totalOutgoingFlow > water[i])
+    {
+      for(ezUInt32 dir = 0; dir < 4; ++dir)
+        newFlowOut[dir] = newFlowOut[dir] * water[i] / totalOutgoingFlow;
+    }
+
+    for(ezUInt32 dir = 0; dir < 4; ++dir)
+      m_planes[PLANE_FLOW_POS_X + dir][i] = static_cast<ezInt32>(newFlowOut[dir]);
+  }
+}
+
+void FixedPointFlowSolver::ApplyFlowRow(ezInt32 y)
+{
+  ezInt32* water = m_planes[PLANE_WATER];
+  const ezInt32* flowPosX = m_planes[PLANE_FLOW_POS_X];
+  const ezInt32* flowNegX = m_planes[PLANE_FLOW_NEG_X];
+  const ezInt32* flowPosY = m_planes[PLANE_FLOW_POS_Y];
+  const ezInt32* flowNegY = m_planes[PLANE_FLOW_NEG_Y];
+
+  for(ezInt32 i = GetCellIndex(0, y), end = GetCellIndex(m_gridResolution, y); i < end; ++i)
+  {
+    ezInt64 ingoingFlow = static_cast<ezInt64>(flowNegX[i + 1]) + flowPosX[i - 1] + flowNegY[i + m_rowPitch] + flowPosY[i - m_rowPitch];
+    ezInt64 outgoingFlow = static_cast<ezInt64>(flowPosX[i]) + flowNegX[i] + flowPosY[i] + flowNegY[i];
+    water[i] = static_cast<ezInt32>(water[i] + ingoingFlow - outgoingFlow);
+  }
+}
+
+void FixedPointFlowSolver::PerformSimulationStep()
+{
+  ezInt32 numRows = static_cast<ezInt32>(m_gridResolution);
+
+#pragma omp parallel num_threads(GetNumThreads())
+  {
+#pragma omp for schedule(static)
+    for(ezInt32 y = 0; y < numRows; ++y)
+      UpdateFlowRow(y);
+
+#pragma omp for schedule(static)
+    for(ezInt32 y = 0; y < numRows; ++y)
+      ApplyFlowRow(y);
+  }
+}
+
+void FixedPointFlowSolver::PerformSimulationSteps(ezUInt32 numSteps)
+{
+  for(ezUInt32 step = 0; step < numSteps; ++step)
+    PerformSimulationStep();
+}
+
+void FixedPointFlowSolver::SetState(const ezColor* terrainData, const ezColor* outgoingFlow)
+{
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 cellIndex = GetCellIndex(x, y);
+      ezUInt32 texelIndex = x + y * m_gridResolution;
+
+      m_planes[PLANE_TERRAIN][cellIndex] = ToFixedPoint(terrainData[texelIndex].r);
+      m_planes[PLANE_WATER][cellIndex] = ToFixedPoint(terrainData[texelIndex].a);
+
+      const float flow[] = { outgoingFlow ? outgoingFlow[texelIndex].r : 0.0f, outgoingFlow ? outgoingFlow[texelIndex].g : 0.0f,
+                             outgoingFlow ? outgoingFlow[texelIndex].b : 0.0f, outgoingFlow ? outgoingFlow[texelIndex].a : 0.0f };
+      for(ezUInt32 dir = 0; dir < 4; ++dir)
+        m_planes[PLANE_FLOW_POS_X + dir][cellIndex] = FlowToFixedPoint(flow[dir]);
+    }
+  }
+}
+
+void FixedPointFlowSolver::GetTerrainData(ezColor* terrainData) const
+{
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 cellIndex = GetCellIndex(x, y);
+      terrainData[x + y * m_gridResolution].r = ToFloat(m_planes[PLANE_TERRAIN][cellIndex]);
+      terrainData[x + y * m_gridResolution].a = ToFloat(m_planes[PLANE_WATER][cellIndex]);
+    }
+  }
+}
+
+void FixedPointFlowSolver::GetOutgoingFlow(ezColor* outgoingFlow) const
+{
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 cellIndex = GetCellIndex(x, y);
+      outgoingFlow[x + y * m_gridResolution] = ezColor(FlowToFloat(m_planes[PLANE_FLOW_POS_X][cellIndex]), FlowToFloat(m_planes[PLANE_FLOW_NEG_X][cellIndex]),
+                                                       FlowToFloat(m_planes[PLANE_FLOW_POS_Y][cellIndex]), FlowToFloat(m_planes[PLANE_FLOW_NEG_Y][cellIndex]));
+    }
+  }
+}
+
+void FixedPointFlowSolver::GetFlowMap(ezVec2* flowMap) const
+{
+  const ezInt32* flowPosX = m_planes[PLANE_FLOW_POS_X];
+  const ezInt32* flowNegX = m_planes[PLANE_FLOW_NEG_X];
+  const ezInt32* flowPosY = m_planes[PLANE_FLOW_POS_Y];
+  const ezInt32* flowNegY = m_planes[PLANE_FLOW_NEG_Y];
+
+  // Same as in flowApply.comp.
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+    {
+      ezInt32 i = GetCellIndex(x, y);
+      flowMap[x + y * m_gridResolution] = ezVec2(FlowToFloat((flowNegX[i + 1] - flowPosX[i]) - (flowPosX[i - 1] - flowNegX[i])),
+                                                 FlowToFloat((flowNegY[i + m_rowPitch] - flowPosY[i]) - (flowPosY[i - m_rowPitch] - flowNegY[i])));
+    }
+  }
+}
+
+ezInt64 FixedPointFlowSolver::ComputeTotalWater() const
+{
+  ezInt64 totalWater = 0;
+  for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_gridResolution; ++x)
+      totalWater += m_planes[PLANE_WATER][GetCellIndex(x, y)];
+  }
+  return totalWater;
+}
+
+ezUInt64 FixedPointFlowSolver::ComputeStateHash() const
+{
+  // FNV-1a over all bytes of the changing planes.
+  ezUInt64 hash = 14695981039346656037ull;
+  for(ezUInt32 plane = PLANE_WATER; plane < NUM_PLANES; ++plane)
+  {
+    for(ezUInt32 y = 0; y < m_gridResolution; ++y)
+    {
+      const ezUInt8* bytes = reinterpret_cast<const ezUInt8*>(m_planes[plane] + GetCellIndex(0, y));
+      for(ezUInt32 i = 0; i < m_gridResolution * sizeof(ezInt32); ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+  }
+  return hash;
+}
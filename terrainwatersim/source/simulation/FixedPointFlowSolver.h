@@ -0,0 +1,93 @@
+#pragma once
+
+#include "SimulationParameters.h"
+
+/// Variant of CpuFlowSolver that computes the virtual pipe model entirely in integer arithmetic.
+///
+/// Heights are stored as signed 16.16 fixed point meters. Outgoing flow is stored as the water height it removes from a cell per step,
+/// in the same format. Friction and acceleration are converted from SimulationParameters to 2.30 fixed point factors, every product is
+/// computed in 64 bit and rounded to nearest. Since integer operations are exact, results are bitwise identical on all machines and
+/// independent of thread count, vectorization and processing order. Water moves between cells as integers as well, so apart from
+/// the outflow at the grid edges the total amount of water never changes, not even by rounding.
+///
+/// The flow map is not stored, it is derived from the outgoing flow on export. This takes 24 bytes per cell instead of 32 for the
+/// float solvers. Flows below the fixed point resolution are lost, which lets very shallow slopes come to rest a little earlier.
+class FixedPointFlowSolver
+{
+public:
+  /// Creates a square grid with the given number of cells per side. All cells start flat, dry and without flow.
+  FixedPointFlowSolver(ezUInt32 gridResolution);
+  ~FixedPointFlowSolver();
+
+  ezUInt32 GetGridResolution() const { return m_gridResolution; }
+
+  /// Converts the float parameters to fixed point. Does not change the stored flow, see SetState.
+  void SetSimulationParameters(const SimulationParameters& parameters);
+  const SimulationParameters& GetSimulationParameters() const { return m_parameters; }
+
+  /// Sets the number of threads used per pass. 0 uses the OpenMP default. Has no influence on the results.
+  void SetNumThreads(ezUInt32 numThreads) { m_numThreads = numThreads; }
+  ezUInt32 GetNumThreads() const;
+
+  void PerformSimulationStep();
+  void PerformSimulationSteps(ezUInt32 numSteps);
+
+  // Import/Export in the layout of the corresponding textures, see CpuFlowSolver.
+  // Flow is converted with the current simulation parameters, so these should be set first.
+
+  void SetState(const ezColor* terrainData, const ezColor* outgoingFlow);
+  void GetTerrainData(ezColor* terrainData) const;
+  void GetOutgoingFlow(ezColor* outgoingFlow) const;
+  void GetFlowMap(ezVec2* flowMap) const;
+
+  /// Exact sum of all water heights in fixed point.
+  ezInt64 ComputeTotalWater() const;
+
+  /// Hash over water and outgoing flow of all cells, equal hashes mean equal states for all practical purposes.
+  ezUInt64 ComputeStateHash() const;
+
+  static const ezUInt32 s_heightFractionBits = 16;
+  static const ezUInt32 s_factorFractionBits = 30;
+
+  static ezInt32 ToFixedPoint(float height);
+  static float ToFloat(ezInt32 height);
+
+private:
+  void UpdateFlowRow(ezInt32 y);
+  void ApplyFlowRow(ezInt32 y);
+
+  ezInt32 GetCellIndex(ezInt32 x, ezInt32 y) const { return x + y * m_rowPitch; }
+
+  /// Converts the outgoing flow that is stored per cell to the flow of the pipe model in the float solvers and back.
+  float FlowToFloat(ezInt32 flow) const;
+  ezInt32 FlowToFixedPoint(float flow) const;
+
+  enum Plane
+  {
+    PLANE_TERRAIN,
+    PLANE_WATER,
+    PLANE_FLOW_POS_X,
+    PLANE_FLOW_NEG_X,
+    PLANE_FLOW_POS_Y,
+    PLANE_FLOW_NEG_Y,
+
+    NUM_PLANES
+  };
+
+  const ezUInt32 m_gridResolution;
+
+  /// Planes with a one cell zero border like in CpuFlowSolver.
+  ezInt32 m_rowPitch;
+  ezUInt32 m_planeSize;
+  ezInt32* m_data;
+  /// Point to cell (0,0) of each plane.
+  ezInt32* m_planes[NUM_PLANES];
+
+  SimulationParameters m_parameters;
+  /// pow(friction, TimeStep) in 2.30
+  ezInt64 m_flowFriction;
+  /// TimeStep * FlowAcceleration * CellDistance * (TimeStep / CellDistance²) in 2.30, turns a height difference into outgoing height per step.
+  ezInt64 m_flowAcceleration;
+
+  ezUInt32 m_numThreads;
+};
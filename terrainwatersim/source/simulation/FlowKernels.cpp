@@ -0,0 +1,130 @@
+#include "PCH.h"
+#include "FlowKernels.h"
+#include "SimdFloat.h"
+
+namespace FlowKernels
+{
+  // Scalar versions are used for the remainder of a run that doesn't fill a whole vector.
+  // They follow the shader code operation by operation, the vectorized versions do the same per lane.
+
+  static EZ_FORCE_INLINE void UpdateFlowCell(const FlowGridView& grid, ezInt32 i, const SimulationParameters& parameters)
+  {
+    float ownWaterHeight = grid.water[i] + grid.terrain[i];
+
+    float newFlowOut[FlowGridView::NUM_FLOW_DIRECTIONS];
+    newFlowOut[FlowGridView::FLOW_POS_X] = ownWaterHeight - (grid.water[i + 1] + grid.terrain[i + 1]);
+    newFlowOut[FlowGridView::FLOW_NEG_X] = ownWaterHeight - (grid.water[i - 1] + grid.terrain[i - 1]);
+    newFlowOut[FlowGridView::FLOW_POS_Y] = ownWaterHeight - (grid.water[i + grid.rowPitch] + grid.terrain[i + grid.rowPitch]);
+    newFlowOut[FlowGridView::FLOW_NEG_Y] = ownWaterHeight - (grid.water[i - grid.rowPitch] + grid.terrain[i - grid.rowPitch]);
+
+    for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+    {
+      newFlowOut[dir] = grid.flow[dir][i] * parameters.flowFriction_perStep + newFlowOut[dir] * parameters.waterAcceleration_perStep;
+      newFlowOut[dir] = ezMath::Max(0.0f, newFlowOut[dir]);
+    }
+
+    // scale newFlowOut down, so that water height won't be below zero in the next step!
+    float totalOutgoingFlow = (newFlowOut[0] + newFlowOut[1] + newFlowOut[2] + newFlowOut[3]) * parameters.cellAreaInv_timeScaled;
+    float scale = totalOutgoingFlow > grid.water[i] ? grid.water[i] / totalOutgoingFlow : 1.0f;
+
+    for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+      grid.flow[dir][i] = newFlowOut[dir] * scale;
+  }
+
+  static EZ_FORCE_INLINE void ApplyFlowCell(const FlowGridView& grid, ezInt32 i, const SimulationParameters& parameters)
+  {
+    float flowOutX1 = grid.flow[FlowGridView::FLOW_NEG_X][i + 1];
+    float flowOutX0 = grid.flow[FlowGridView::FLOW_POS_X][i - 1];
+    float flowOutY1 = grid.flow[FlowGridView::FLOW_NEG_Y][i + grid.rowPitch];
+    float flowOutY0 = grid.flow[FlowGridView::FLOW_POS_Y][i - grid.rowPitch];
+
+    float ownFlowPosX = grid.flow[FlowGridView::FLOW_POS_X][i];
+    float ownFlowNegX = grid.flow[FlowGridView::FLOW_NEG_X][i];
+    float ownFlowPosY = grid.flow[FlowGridView::FLOW_POS_Y][i];
+    float ownFlowNegY = grid.flow[FlowGridView::FLOW_NEG_Y][i];
+
+    float ingoingFlow = flowOutX1 + flowOutX0 + flowOutY1 + flowOutY0;
+    float outgoingFlow = ownFlowPosX + ownFlowNegX + ownFlowPosY + ownFlowNegY;
+    grid.water[i] = ezMath::Max(0.0f, grid.water[i] + (ingoingFlow - outgoingFlow) * parameters.cellAreaInv_timeScaled);
+
+    grid.flowMapX[i] = (flowOutX1 - ownFlowPosX) - (flowOutX0 - ownFlowNegX);
+    grid.flowMapY[i] = (flowOutY1 - ownFlowPosY) - (flowOutY0 - ownFlowNegY);
+  }
+
+  void UpdateFlow(const FlowGridView& grid, ezInt32 cellIndex, ezUInt32 numCells, const SimulationParameters& parameters)
+  {
+    const Simd::Float friction = Simd::Set(parameters.flowFriction_perStep);
+    const Simd::Float acceleration = Simd::Set(parameters.waterAcceleration_perStep);
+    const Simd::Float cellAreaInv = Simd::Set(parameters.cellAreaInv_timeScaled);
+    const Simd::Float zero = Simd::Zero();
+    const Simd::Float one = Simd::Set(1.0f);
+
+    const ezInt32 end = cellIndex + static_cast<ezInt32>(numCells);
+    ezInt32 i = cellIndex;
+    for(; i + Simd::s_width <= end; i += Simd::s_width)
+    {
+      Simd::Float water = Simd::Load(grid.water + i);
+      Simd::Float ownWaterHeight = Simd::Add(water, Simd::Load(grid.terrain + i));
+      Simd::Float waterHeightX1 = Simd::Add(Simd::Load(grid.water + i + 1), Simd::Load(grid.terrain + i + 1));
+      Simd::Float waterHeightX0 = Simd::Add(Simd::Load(grid.water + i - 1), Simd::Load(grid.terrain + i - 1));
+      Simd::Float waterHeightY1 = Simd::Add(Simd::Load(grid.water + i + grid.rowPitch), Simd::Load(grid.terrain + i + grid.rowPitch));
+      Simd::Float waterHeightY0 = Simd::Add(Simd::Load(grid.water + i - grid.rowPitch), Simd::Load(grid.terrain + i - grid.rowPitch));
+
+      Simd::Float newFlowOut[FlowGridView::NUM_FLOW_DIRECTIONS];
+      newFlowOut[FlowGridView::FLOW_POS_X] = Simd::Sub(ownWaterHeight, waterHeightX1);
+      newFlowOut[FlowGridView::FLOW_NEG_X] = Simd::Sub(ownWaterHeight, waterHeightX0);
+      newFlowOut[FlowGridView::FLOW_POS_Y] = Simd::Sub(ownWaterHeight, waterHeightY1);
+      newFlowOut[FlowGridView::FLOW_NEG_Y] = Simd::Sub(ownWaterHeight, waterHeightY0);
+
+      for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+      {
+        Simd::Float flowOut = Simd::Load(grid.flow[dir] + i);
+        newFlowOut[dir] = Simd::Add(Simd::Mul(flowOut, friction), Simd::Mul(newFlowOut[dir], acceleration));
+        newFlowOut[dir] = Simd::Max(zero, newFlowOut[dir]);
+      }
+
+      Simd::Float totalOutgoingFlow = Simd::Mul(Simd::Add(Simd::Add(Simd::Add(newFlowOut[0], newFlowOut[1]), newFlowOut[2]), newFlowOut[3]), cellAreaInv);
+      // Lanes without clamping may divide by zero, their result is discarded by the select.
+      Simd::Float scale = Simd::Select(Simd::CmpGreater(totalOutgoingFlow, water), Simd::Div(water, totalOutgoingFlow), one);
+
+      for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+        Simd::Store(grid.flow[dir] + i, Simd::Mul(newFlowOut[dir], scale));
+    }
+
+    for(; i < end; ++i)
+      UpdateFlowCell(grid, i, parameters);
+  }
+
+  void ApplyFlow(const FlowGridView& grid, ezInt32 cellIndex, ezUInt32 numCells, const SimulationParameters& parameters)
+  {
+    const Simd::Float cellAreaInv = Simd::Set(parameters.cellAreaInv_timeScaled);
+    const Simd::Float zero = Simd::Zero();
+
+    const ezInt32 end = cellIndex + static_cast<ezInt32>(numCells);
+    ezInt32 i = cellIndex;
+    for(; i + Simd::s_width <= end; i += Simd::s_width)
+    {
+      Simd::Float flowOutX1 = Simd::Load(grid.flow[FlowGridView::FLOW_NEG_X] + i + 1);
+      Simd::Float flowOutX0 = Simd::Load(grid.flow[FlowGridView::FLOW_POS_X] + i - 1);
+      Simd::Float flowOutY1 = Simd::Load(grid.flow[FlowGridView::FLOW_NEG_Y] + i + grid.rowPitch);
+      Simd::Float flowOutY0 = Simd::Load(grid.flow[FlowGridView::FLOW_POS_Y] + i - grid.rowPitch);
+
+      Simd::Float ownFlowPosX = Simd::Load(grid.flow[FlowGridView::FLOW_POS_X] + i);
+      Simd::Float ownFlowNegX = Simd::Load(grid.flow[FlowGridView::FLOW_NEG_X] + i);
+      Simd::Float ownFlowPosY = Simd::Load(grid.flow[FlowGridView::FLOW_POS_Y] + i);
+      Simd::Float ownFlowNegY = Simd::Load(grid.flow[FlowGridView::FLOW_NEG_Y] + i);
+
+      Simd::Float ingoingFlow = Simd::Add(Simd::Add(Simd::Add(flowOutX1, flowOutX0), flowOutY1), flowOutY0);
+      Simd::Float outgoingFlow = Simd::Add(Simd::Add(Simd::Add(ownFlowPosX, ownFlowNegX), ownFlowPosY), ownFlowNegY);
+      Simd::Float water = Simd::Load(grid.water + i);
+      water = Simd::Max(zero, Simd::Add(water, Simd::Mul(Simd::Sub(ingoingFlow, outgoingFlow), cellAreaInv)));
+      Simd::Store(grid.water + i, water);
+
+      Simd::Store(grid.flowMapX + i, Simd::Sub(Simd::Sub(flowOutX1, ownFlowPosX), Simd::Sub(flowOutX0, ownFlowNegX)));
+      Simd::Store(grid.flowMapY + i, Simd::Sub(Simd::Sub(flowOutY1, ownFlowPosY), Simd::Sub(flowOutY0, ownFlowNegY)));
+    }
+
+    for(; i < end; ++i)
+      ApplyFlowCell(grid, i, parameters);
+  }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "SimulationParameters.h"
+
+/// Pointers into structure of arrays flow grid data.
+///
+/// All planes share the same row pitch. Neighbours are addressed with +-1 and +-rowPitch, so whoever owns the data has to provide
+/// a readable one cell border around every cell that is passed to the kernels.
+struct FlowGridView
+{
+  enum FlowDirection
+  {
+    FLOW_POS_X,   ///< x component of the outgoing flow texture
+    FLOW_NEG_X,   ///< y component of the outgoing flow texture
+    FLOW_POS_Y,   ///< z component of the outgoing flow texture
+    FLOW_NEG_Y,   ///< w component of the outgoing flow texture
+
+    NUM_FLOW_DIRECTIONS
+  };
+
+  float* terrain;
+  float* water;
+  float* flow[NUM_FLOW_DIRECTIONS];
+  float* flowMapX;
+  float* flowMapY;
+
+  /// Distance between two rows in floats. Signed since cells are addressed relative to the pointers in both directions.
+  ezInt32 rowPitch;
+};
+
+/// CPU versions of flowUpdate.comp and flowApply.comp.
+///
+/// Every function processes a horizontal run of cells starting at cellIndex. Within a single pass cells only write their own data,
+/// so runs can be processed in any order and in parallel as long as update and apply passes are not mixed.
+namespace FlowKernels
+{
+  /// Computes new outgoing flow from water height differences. Equivalent to flowUpdate.comp.
+  void UpdateFlow(const FlowGridView& grid, ezInt32 cellIndex, ezUInt32 numCells, const SimulationParameters& parameters);
+
+  /// Moves water according to in- and outgoing flow and writes the flow map. Equivalent to flowApply.comp.
+  void ApplyFlow(const FlowGridView& grid, ezInt32 cellIndex, ezUInt32 numCells, const SimulationParameters& parameters);
+}
@@ -0,0 +1,280 @@
+#include "PCH.h"
+#include "HeightBoundsPyramid.h"
+
+namespace
+{
+  struct NodeRef
+  {
+    ezUInt32 level;
+    ezUInt32 x;
+    ezUInt32 y;
+    float entryDistance;
+  };
+
+  /// Spreads the lower 16 bits to the even bits.
+  EZ_FORCE_INLINE ezUInt32 SpreadBits(ezUInt32 v)
+  {
+    v &= 0x0000FFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+  }
+
+  /// Axis parallel rays get a huge instead of an infinite inverse, so that an origin on a box face does not produce NaN.
+  EZ_FORCE_INLINE float InverseComponent(float d)
+  {
+    return ezMath::Abs(d) > 1e-30f ? 1.0f / d : (d < 0.0f ? -1e30f : 1e30f);
+  }
+}
+
+HeightBoundsPyramid::HeightBoundsPyramid(ezUInt32 numTilesPerSide, float tileWorldSize) :
+  m_numTilesPerSide(numTilesPerSide),
+  m_tileWorldSize(tileWorldSize),
+  m_numLevels(1)
+{
+  EZ_ASSERT(numTilesPerSide > 0 && (numTilesPerSide & (numTilesPerSide - 1)) == 0 && numTilesPerSide <= (1 << 16),
+            "Height bounds pyramid needs a power of two number of tiles per side, got %u.", numTilesPerSide);
+
+  while((1u << (m_numLevels - 1)) < numTilesPerSide)
+    ++m_numLevels;
+
+  ezUInt32 numNodes = 0;
+  m_levelOffsets.SetCount(m_numLevels);
+  for(ezUInt32 level = 0; level < m_numLevels; ++level)
+  {
+    m_levelOffsets[level] = numNodes;
+    numNodes += 1u << (2 * level);
+  }
+
+  Bounds empty = { 0.0f, 0.0f, 0.0f, 0.0f };
+  m_nodes.SetCount(numNodes);
+  for(ezUInt32 i = 0; i < numNodes; ++i)
+    m_nodes[i] = empty;
+  m_nodeChanged.SetCount(numNodes);
+  for(ezUInt32 i = 0; i < numNodes; ++i)
+    m_nodeChanged[i] = false;
+}
+
+ezUInt32 HeightBoundsPyramid::MortonCode(ezUInt32 x, ezUInt32 y)
+{
+  return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+void HeightBoundsPyramid::Merge(Bounds& bounds, const Bounds& other)
+{
+  bounds.minTerrainHeight = ezMath::Min(bounds.minTerrainHeight, other.minTerrainHeight);
+  bounds.maxTerrainHeight = ezMath::Max(bounds.maxTerrainHeight, other.maxTerrainHeight);
+  bounds.minSurfaceHeight = ezMath::Min(bounds.minSurfaceHeight, other.minSurfaceHeight);
+  bounds.maxSurfaceHeight = ezMath::Max(bounds.maxSurfaceHeight, other.maxSurfaceHeight);
+}
+
+void HeightBoundsPyramid::Build(const ezColor* terrainData, ezUInt32 gridResolution)
+{
+  EZ_ASSERT(gridResolution % m_numTilesPerSide == 0, "Grid resolution %u is not a multiple of the tile count %u.", gridResolution, m_numTilesPerSide);
+  ezUInt32 tileSize = gridResolution / m_numTilesPerSide;
+
+  for(ezUInt32 tileY = 0; tileY < m_numTilesPerSide; ++tileY)
+  {
+    for(ezUInt32 tileX = 0; tileX < m_numTilesPerSide; ++tileX)
+    {
+      const ezColor* tileData = terrainData + tileX * tileSize + tileY * tileSize * gridResolution;
+      Bounds bounds = { tileData->r, tileData->r, tileData->r + tileData->a, tileData->r + tileData->a };
+      for(ezUInt32 y = 0; y < tileSize; ++y)
+      {
+        for(ezUInt32 x = 0; x < tileSize; ++x)
+        {
+          const ezColor& cell = tileData[x + y * gridResolution];
+          Bounds cellBounds = { cell.r, cell.r, cell.r + cell.a, cell.r + cell.a };
+          Merge(bounds, cellBounds);
+        }
+      }
+      SetTileBounds(tileX, tileY, bounds);
+    }
+  }
+
+  UpdateInnerNodes();
+}
+
+void HeightBoundsPyramid::SetTileBounds(ezUInt32 tileX, ezUInt32 tileY, const Bounds& bounds)
+{
+  EZ_ASSERT(tileX < m_numTilesPerSide && tileY < m_numTilesPerSide, "Tile %u, %u is outside of the height bounds pyramid.", tileX, tileY);
+
+  ezUInt32 code = MortonCode(tileX, tileY);
+  ezUInt32 nodeIndex = m_levelOffsets[m_numLevels - 1] + code;
+  m_nodes[nodeIndex] = bounds;
+  if(!m_nodeChanged[nodeIndex])
+  {
+    m_nodeChanged[nodeIndex] = true;
+    m_changedNodes.PushBack(code);
+  }
+}
+
+void HeightBoundsPyramid::UpdateInnerNodes()
+{
+  // m_changedNodes holds the codes of the current level and is overwritten with those of the parent level in place. There are never
+  // more parents than children, so no code is overwritten before it was read.
+  for(ezUInt32 level = m_numLevels - 1; level > 0; --level)
+  {
+    ezUInt32 levelOffset = m_levelOffsets[level];
+    ezUInt32 parentLevelOffset = m_levelOffsets[level - 1];
+    ezUInt32 numParents = 0;
+    for(ezUInt32 i = 0; i < m_changedNodes.GetCount(); ++i)
+    {
+      m_nodeChanged[levelOffset + m_changedNodes[i]] = false;
+
+      ezUInt32 parentCode = m_changedNodes[i] >> 2;
+      if(m_nodeChanged[parentLevelOffset + parentCode])
+        continue;
+      m_nodeChanged[parentLevelOffset + parentCode] = true;
+      m_changedNodes[numParents++] = parentCode;
+
+      const Bounds* children = &m_nodes[levelOffset + (parentCode << 2)];
+      Bounds bounds = children[0];
+      Merge(bounds, children[1]);
+      Merge(bounds, children[2]);
+      Merge(bounds, children[3]);
+      m_nodes[parentLevelOffset + parentCode] = bounds;
+    }
+    m_changedNodes.SetCount(numParents);
+  }
+
+  for(ezUInt32 i = 0; i < m_changedNodes.GetCount(); ++i)
+    m_nodeChanged[m_changedNodes[i]] = false;
+  m_changedNodes.Clear();
+}
+
+ezResult HeightBoundsPyramid::QueryRegion(const ezVec2& minXZ, const ezVec2& maxXZ, Bounds& bounds) const
+{
+  float gridWorldSize = m_tileWorldSize * m_numTilesPerSide;
+  if(maxXZ.x < 0.0f || maxXZ.y < 0.0f || minXZ.x > gridWorldSize || minXZ.y > gridWorldSize || minXZ.x > maxXZ.x || minXZ.y > maxXZ.y)
+    return EZ_FAILURE;
+
+  // Inclusive tile range.
+  float maxTile = static_cast<float>(m_numTilesPerSide - 1);
+  ezUInt32 minTileX = static_cast<ezUInt32>(ezMath::Clamp(minXZ.x / m_tileWorldSize, 0.0f, maxTile));
+  ezUInt32 minTileY = static_cast<ezUInt32>(ezMath::Clamp(minXZ.y / m_tileWorldSize, 0.0f, maxTile));
+  ezUInt32 maxTileX = static_cast<ezUInt32>(ezMath::Clamp(maxXZ.x / m_tileWorldSize, 0.0f, maxTile));
+  ezUInt32 maxTileY = static_cast<ezUInt32>(ezMath::Clamp(maxXZ.y / m_tileWorldSize, 0.0f, maxTile));
+
+  // Nodes completely inside the range contribute as a whole, the others are split.
+  NodeRef stack[4 * 17];
+  ezUInt32 stackSize = 0;
+  NodeRef root = { 0, 0, 0, 0.0f };
+  stack[stackSize++] = root;
+  bool anyNode = false;
+  while(stackSize > 0)
+  {
+    NodeRef node = stack[--stackSize];
+    ezUInt32 span = m_numTilesPerSide >> node.level;
+    ezUInt32 firstTileX = node.x * span;
+    ezUInt32 firstTileY = node.y * span;
+    if(firstTileX > maxTileX || firstTileY > maxTileY || firstTileX + span <= minTileX || firstTileY + span <= minTileY)
+      continue;
+
+    bool inside = firstTileX >= minTileX && firstTileY >= minTileY && firstTileX + span - 1 <= maxTileX && firstTileY + span - 1 <= maxTileY;
+    if(inside || node.level == m_numLevels - 1)
+    {
+      const Bounds& nodeBounds = GetNode(node.level, node.x, node.y);
+      if(anyNode)
+        Merge(bounds, nodeBounds);
+      else
+        bounds = nodeBounds;
+      anyNode = true;
+      continue;
+    }
+
+    for(ezUInt32 child = 0; child < 4; ++child)
+    {
+      NodeRef childNode = { node.level + 1, node.x * 2 + (child & 1), node.y * 2 + (child >> 1), 0.0f };
+      stack[stackSize++] = childNode;
+    }
+  }
+
+  return anyNode ? EZ_SUCCESS : EZ_FAILURE;
+}
+
+bool HeightBoundsPyramid::IntersectNode(ezUInt32 level, ezUInt32 x, ezUInt32 y, const ezVec3& origin, const ezVec3& inverseDirection,
+                                        float maxDistance, float& entryDistance) const
+{
+  const Bounds& bounds = GetNode(level, x, y);
+  float nodeWorldSize = m_tileWorldSize * (m_numTilesPerSide >> level);
+  float boxMin[3] = { x * nodeWorldSize, bounds.minTerrainHeight, y * nodeWorldSize };
+  float boxMax[3] = { boxMin[0] + nodeWorldSize, bounds.maxSurfaceHeight, boxMin[2] + nodeWorldSize };
+  float rayOrigin[3] = { origin.x, origin.y, origin.z };
+  float rayInverseDirection[3] = { inverseDirection.x, inverseDirection.y, inverseDirection.z };
+
+  float entry = 0.0f;
+  float exit = maxDistance;
+  for(int axis = 0; axis < 3; ++axis)
+  {
+    float t0 = (boxMin[axis] - rayOrigin[axis]) * rayInverseDirection[axis];
+    float t1 = (boxMax[axis] - rayOrigin[axis]) * rayInverseDirection[axis];
+    entry = ezMath::Max(entry, ezMath::Min(t0, t1));
+    exit = ezMath::Min(exit, ezMath::Max(t0, t1));
+  }
+
+  entryDistance = entry;
+  return entry <= exit;
+}
+
+ezResult HeightBoundsPyramid::IntersectRay(const ezVec3& origin, const ezVec3& direction, float maxDistance, float& entryDistance) const
+{
+  ezVec3 inverseDirection(InverseComponent(direction.x), InverseComponent(direction.y), InverseComponent(direction.z));
+
+  // Depth first, children are visited near to far. Nodes entered behind the best leaf so far cannot contain an earlier hit.
+  // Each level pushes at most four nodes.
+  NodeRef stack[4 * 17];
+  ezUInt32 stackSize = 0;
+  NodeRef root = { 0, 0, 0, 0.0f };
+  if(!IntersectNode(0, 0, 0, origin, inverseDirection, maxDistance, root.entryDistance))
+    return EZ_FAILURE;
+  stack[stackSize++] = root;
+
+  float bestDistance = maxDistance;
+  bool anyHit = false;
+  while(stackSize > 0)
+  {
+    NodeRef node = stack[--stackSize];
+    if(anyHit && node.entryDistance >= bestDistance)
+      continue;
+
+    if(node.level == m_numLevels - 1)
+    {
+      bestDistance = node.entryDistance;
+      anyHit = true;
+      continue;
+    }
+
+    NodeRef children[4];
+    ezUInt32 numChildren = 0;
+    for(ezUInt32 child = 0; child < 4; ++child)
+    {
+      NodeRef& childNode = children[numChildren];
+      childNode.level = node.level + 1;
+      childNode.x = node.x * 2 + (child & 1);
+      childNode.y = node.y * 2 + (child >> 1);
+      if(IntersectNode(childNode.level, childNode.x, childNode.y, origin, inverseDirection, bestDistance, childNode.entryDistance))
+        ++numChildren;
+    }
+
+    // Sorted far to near, so that the nearest child is popped first.
+    for(ezUInt32 i = 1; i < numChildren; ++i)
+    {
+      for(ezUInt32 j = i; j > 0 && children[j - 1].entryDistance < children[j].entryDistance; --j)
+      {
+        NodeRef swap = children[j];
+        children[j] = children[j - 1];
+        children[j - 1] = swap;
+      }
+    }
+    for(ezUInt32 i = 0; i < numChildren; ++i)
+      stack[stackSize++] = children[i];
+  }
+
+  if(!anyHit)
+    return EZ_FAILURE;
+  entryDistance = bestDistance;
+  return EZ_SUCCESS;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+/// Min/max quadtree of terrain height and water surface height over the simulation tiles, for conservative culling and ray queries.
+///
+/// The leaves are the 16x16 cell simulation tiles, every inner node bounds its four children. All levels are stored in a single array,
+/// root first. Within a level nodes are in Morton order, so the four children of a node are adjacent and share a cache line.
+///
+/// Leaves are set individually, usually only for tiles that changed, and UpdateInnerNodes only recomputes their ancestors.
+class HeightBoundsPyramid
+{
+public:
+  /// Layout matches the tile bounds written by heightBounds.comp.
+  struct Bounds
+  {
+    float minTerrainHeight;
+    float maxTerrainHeight;
+    /// Terrain plus water height, equal to the terrain height of dry cells.
+    float minSurfaceHeight;
+    float maxSurfaceHeight;
+  };
+
+  /// \param numTilesPerSide   Needs to be a power of two.
+  HeightBoundsPyramid(ezUInt32 numTilesPerSide, float tileWorldSize);
+
+  ezUInt32 GetNumTilesPerSide() const { return m_numTilesPerSide; }
+  /// Level 0 is the root, the last level holds the tiles.
+  ezUInt32 GetNumLevels() const { return m_numLevels; }
+  const Bounds& GetNode(ezUInt32 level, ezUInt32 x, ezUInt32 y) const { return m_nodes[GetNodeIndex(level, x, y)]; }
+  const Bounds& GetRootBounds() const { return m_nodes[0]; }
+
+  // Updates
+
+  /// Sets all leaves from terrain data with terrain height in .r and water height in .a, including the inner nodes.
+  void Build(const ezColor* terrainData, ezUInt32 gridResolution);
+
+  /// Inner nodes are out of date until the next UpdateInnerNodes.
+  void SetTileBounds(ezUInt32 tileX, ezUInt32 tileY, const Bounds& bounds);
+  /// Recomputes the ancestors of all tiles that were set since the last call.
+  void UpdateInnerNodes();
+
+  // Queries, in world space with the grid starting at the origin
+
+  /// Bounds of all tiles overlapping the given XZ rectangle. Conservative, since whole tiles are considered. Fails if the rectangle
+  /// misses the grid.
+  ezResult QueryRegion(const ezVec2& minXZ, const ezVec2& maxXZ, Bounds& bounds) const;
+
+  /// Distance along the ray at which it first enters the surface bounds of a tile, a lower bound for the actual hit with terrain or
+  /// water. Fails if the ray passes above or beside everything within maxDistance.
+  ezResult IntersectRay(const ezVec3& origin, const ezVec3& direction, float maxDistance, float& entryDistance) const;
+
+private:
+  ezUInt32 GetNodeIndex(ezUInt32 level, ezUInt32 x, ezUInt32 y) const { return m_levelOffsets[level] + MortonCode(x, y); }
+  static ezUInt32 MortonCode(ezUInt32 x, ezUInt32 y);
+  static void Merge(Bounds& bounds, const Bounds& other);
+
+  /// Entry and exit distance of the ray into the node's box, fails if there is no overlap with [0, maxDistance].
+  bool IntersectNode(ezUInt32 level, ezUInt32 x, ezUInt32 y, const ezVec3& origin, const ezVec3& inverseDirection, float maxDistance,
+                     float& entryDistance) const;
+
+  const ezUInt32 m_numTilesPerSide;
+  const float m_tileWorldSize;
+  ezUInt32 m_numLevels;
+  ezDynamicArray<ezUInt32> m_levelOffsets;
+
+  ezDynamicArray<Bounds> m_nodes;
+  /// Morton codes of the leaves set since the last UpdateInnerNodes and a flag per node to avoid duplicates.
+  ezDynamicArray<ezUInt32> m_changedNodes;
+  ezDynamicArray<bool> m_nodeChanged;
+};
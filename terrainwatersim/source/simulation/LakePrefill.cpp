@@ -0,0 +1,320 @@
+#include "PCH.h"
+#include "LakePrefill.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace
+{
+  struct FloodCell
+  {
+    FloodCell(float passHeight, ezUInt32 cell) : passHeight(passHeight), cell(cell) {}
+
+    /// Ties are broken by index, so that the flood order doesn't depend on the queue implementation.
+    bool operator > (const FloodCell& other) const
+    {
+      return passHeight > other.passHeight || (passHeight == other.passHeight && cell > other.cell);
+    }
+
+    float passHeight;
+    ezUInt32 cell;
+  };
+}
+
+LakePrefill::LakePrefill(const ezColor* terrainData, ezUInt32 gridResolution) :
+  m_gridResolution(gridResolution),
+  m_totalCapacity(0.0)
+{
+  EZ_ASSERT(gridResolution >= 2, "Lake prefill needs a grid of at least 2x2 cells.");
+
+  ezUInt32 numCells = gridResolution * gridResolution;
+  m_floodOrder.Reserve(numCells);
+  m_drainsTo.SetCount(numCells);
+  m_cellBasins.SetCount(numCells);
+  ezDynamicArray<float> passHeights;
+  passHeights.SetCount(numCells);
+  ezDynamicArray<bool> reached;
+  reached.SetCount(numCells);
+  for(ezUInt32 i = 0; i < numCells; ++i)
+  {
+    reached[i] = false;
+    m_cellBasins[i] = s_none;
+  }
+
+  // Priority-flood from the edges. Cells below the current pass can't drain anywhere else and skip the priority queue (Barnes et al.),
+  // which leaves only the cells on slopes for the O(log n) queue.
+  std::priority_queue<FloodCell, std::vector<FloodCell>, std::greater<FloodCell>> slopeCells;
+  ezDynamicArray<ezUInt32> pitCells;
+  ezUInt32 nextPitCell = 0;
+  for(ezUInt32 y = 0; y < gridResolution; ++y)
+  {
+    for(ezUInt32 x = 0; x < gridResolution; ++x)
+    {
+      if(x != 0 && y != 0 && x != gridResolution - 1 && y != gridResolution - 1)
+        continue;
+      ezUInt32 cell = x + y * gridResolution;
+      reached[cell] = true;
+      passHeights[cell] = terrainData[cell].r;
+      m_drainsTo[cell] = s_none;
+      slopeCells.push(FloodCell(passHeights[cell], cell));
+    }
+  }
+
+  while(!slopeCells.empty() || nextPitCell < pitCells.GetCount())
+  {
+    ezUInt32 cell;
+    if(nextPitCell < pitCells.GetCount())
+    {
+      cell = pitCells[nextPitCell++];
+      if(nextPitCell == pitCells.GetCount())
+      {
+        pitCells.Clear();
+        nextPitCell = 0;
+      }
+    }
+    else
+    {
+      cell = slopeCells.top().cell;
+      slopeCells.pop();
+    }
+    m_floodOrder.PushBack(cell);
+
+    ezUInt32 neighbours[4];
+    GetNeighbours(cell, neighbours);
+    float passHeight = passHeights[cell];
+    for(ezUInt32 i = 0; i < 4; ++i)
+    {
+      ezUInt32 neighbour = neighbours[i];
+      if(neighbour == s_none || reached[neighbour])
+        continue;
+      reached[neighbour] = true;
+      m_drainsTo[neighbour] = cell;
+
+      float terrainHeight = terrainData[neighbour].r;
+      if(terrainHeight <= passHeight)
+      {
+        passHeights[neighbour] = passHeight;
+        pitCells.PushBack(neighbour);
+      }
+      else
+      {
+        passHeights[neighbour] = terrainHeight;
+        slopeCells.push(FloodCell(terrainHeight, neighbour));
+      }
+    }
+  }
+
+  // Basins are the connected cells below the same pass. Labeled in flood order, so the first cell of each comes first.
+  ezDynamicArray<ezUInt32> stack;
+  for(ezUInt32 i = 0; i < numCells; ++i)
+  {
+    ezUInt32 entryCell = m_floodOrder[i];
+    if(m_cellBasins[entryCell] != s_none || terrainData[entryCell].r >= passHeights[entryCell])
+      continue;
+
+    Basin basin;
+    basin.passHeight = passHeights[entryCell];
+    basin.entryCell = entryCell;
+    basin.firstHeight = 0;
+    basin.numCells = 0;
+    basin.capacity = 0.0;
+    ezUInt32 basinIndex = m_basins.GetCount();
+
+    m_cellBasins[entryCell] = basinIndex;
+    stack.PushBack(entryCell);
+    while(!stack.IsEmpty())
+    {
+      ezUInt32 cell = stack.PeekBack();
+      stack.PopBack();
+      ++basin.numCells;
+
+      ezUInt32 neighbours[4];
+      GetNeighbours(cell, neighbours);
+      for(ezUInt32 n = 0; n < 4; ++n)
+      {
+        ezUInt32 neighbour = neighbours[n];
+        if(neighbour == s_none || m_cellBasins[neighbour] != s_none || passHeights[neighbour] != basin.passHeight ||
+           terrainData[neighbour].r >= basin.passHeight)
+          continue;
+        m_cellBasins[neighbour] = basinIndex;
+        stack.PushBack(neighbour);
+      }
+    }
+    m_basins.PushBack(basin);
+  }
+
+  // Sorted terrain heights of every basin, for the level at which it holds a given volume.
+  ezUInt32 numBasinCells = 0;
+  for(ezUInt32 b = 0; b < m_basins.GetCount(); ++b)
+  {
+    m_basins[b].firstHeight = numBasinCells;
+    numBasinCells += m_basins[b].numCells;
+  }
+  m_basinHeights.SetCount(numBasinCells);
+  m_basinHeightSums.SetCount(numBasinCells);
+  ezDynamicArray<ezUInt32> basinFill;
+  basinFill.SetCount(m_basins.GetCount());
+  for(ezUInt32 b = 0; b < m_basins.GetCount(); ++b)
+    basinFill[b] = m_basins[b].firstHeight;
+  for(ezUInt32 cell = 0; cell < numCells; ++cell)
+  {
+    if(m_cellBasins[cell] != s_none)
+      m_basinHeights[basinFill[m_cellBasins[cell]]++] = terrainData[cell].r;
+  }
+
+#pragma omp parallel for schedule(dynamic, 16)
+  for(ezInt32 b = 0; b < static_cast<ezInt32>(m_basins.GetCount()); ++b) // Needs to be signed for OpenMP.
+  {
+    Basin& basin = m_basins[b];
+    float* heights = &m_basinHeights[basin.firstHeight];
+    double* heightSums = &m_basinHeightSums[basin.firstHeight];
+    std::sort(heights, heights + basin.numCells);
+
+    double heightSum = 0.0;
+    for(ezUInt32 i = 0; i < basin.numCells; ++i)
+    {
+      heightSums[i] = heightSum;
+      heightSum += heights[i];
+    }
+    basin.capacity = static_cast<double>(basin.passHeight) * basin.numCells - heightSum;
+  }
+
+  for(ezUInt32 b = 0; b < m_basins.GetCount(); ++b)
+    m_totalCapacity += m_basins[b].capacity;
+}
+
+void LakePrefill::GetNeighbours(ezUInt32 cell, ezUInt32* neighbours) const
+{
+  ezUInt32 x = cell % m_gridResolution;
+  ezUInt32 y = cell / m_gridResolution;
+  neighbours[0] = x + 1 < m_gridResolution ? cell + 1 : s_none;
+  neighbours[1] = x > 0 ? cell - 1 : s_none;
+  neighbours[2] = y + 1 < m_gridResolution ? cell + m_gridResolution : s_none;
+  neighbours[3] = y > 0 ? cell - m_gridResolution : s_none;
+}
+
+double LakePrefill::RouteRain(float rainDepth, ezDynamicArray<float>& cellInflow, ezDynamicArray<double>& basinVolumes) const
+{
+  ezUInt32 numCells = m_floodOrder.GetCount();
+  cellInflow.SetCount(numCells);
+  ezMemoryUtils::ZeroFill(static_cast<ezArrayPtr<float>>(cellInflow).GetPtr(), numCells);
+  basinVolumes.SetCount(m_basins.GetCount());
+  for(ezUInt32 b = 0; b < basinVolumes.GetCount(); ++b)
+    basinVolumes[b] = 0.0;
+
+  // Against the flood order, so everything upstream of a cell is collected before the cell passes it on.
+  double totalVolume = 0.0;
+  for(ezUInt32 i = numCells; i-- > 0;)
+  {
+    ezUInt32 cell = m_floodOrder[i];
+    float water = rainDepth + cellInflow[cell];
+    ezUInt32 basinIndex = m_cellBasins[cell];
+    if(basinIndex == s_none)
+    {
+      if(m_drainsTo[cell] != s_none)
+        cellInflow[m_drainsTo[cell]] += water;
+      continue;
+    }
+
+    // Within a basin everything is collected, only the entry cell passes on what doesn't fit.
+    const Basin& basin = m_basins[basinIndex];
+    basinVolumes[basinIndex] += water;
+    if(cell == basin.entryCell)
+    {
+      double overflow = basinVolumes[basinIndex] - basin.capacity;
+      if(overflow > 0.0)
+      {
+        basinVolumes[basinIndex] = basin.capacity;
+        if(m_drainsTo[cell] != s_none)
+          cellInflow[m_drainsTo[cell]] += static_cast<float>(overflow);
+      }
+      totalVolume += basinVolumes[basinIndex];
+    }
+  }
+  return totalVolume;
+}
+
+float LakePrefill::ComputeBasinLevel(const Basin& basin, double volume) const
+{
+  if(volume >= basin.capacity)
+    return basin.passHeight;
+
+  // Smallest number of lowest cells that hold the volume below the height of the next one.
+  const float* heights = &m_basinHeights[basin.firstHeight];
+  const double* heightSums = &m_basinHeightSums[basin.firstHeight];
+  ezUInt32 low = 1;
+  ezUInt32 high = basin.numCells;
+  while(low < high)
+  {
+    ezUInt32 numWetCells = (low + high) / 2;
+    if(static_cast<double>(heights[numWetCells]) * numWetCells - heightSums[numWetCells] >= volume)
+      high = numWetCells;
+    else
+      low = numWetCells + 1;
+  }
+  double wetHeightSum = heightSums[low - 1] + heights[low - 1];
+  return ezMath::Min(static_cast<float>((volume + wetHeightSum) / low), basin.passHeight);
+}
+
+void LakePrefill::WriteWater(ezColor* terrainData, const ezDynamicArray<double>& basinVolumes) const
+{
+  ezDynamicArray<float> basinLevels;
+  basinLevels.SetCount(m_basins.GetCount());
+  for(ezUInt32 b = 0; b < m_basins.GetCount(); ++b)
+    basinLevels[b] = ComputeBasinLevel(m_basins[b], basinVolumes[b]);
+
+  ezInt32 numCells = static_cast<ezInt32>(m_floodOrder.GetCount());
+#pragma omp parallel for
+  for(ezInt32 cell = 0; cell < numCells; ++cell)
+  {
+    ezUInt32 basinIndex = m_cellBasins[cell];
+    terrainData[cell].a = basinIndex == s_none ? 0.0f : ezMath::Max(basinLevels[basinIndex] - terrainData[cell].r, 0.0f);
+  }
+}
+
+double LakePrefill::FillFromRain(ezColor* terrainData, float rainDepth) const
+{
+  ezDynamicArray<float> cellInflow;
+  ezDynamicArray<double> basinVolumes;
+  double totalVolume = RouteRain(rainDepth, cellInflow, basinVolumes);
+  WriteWater(terrainData, basinVolumes);
+  return totalVolume;
+}
+
+double LakePrefill::FillToVolume(ezColor* terrainData, double volume) const
+{
+  ezDynamicArray<float> cellInflow;
+  ezDynamicArray<double> basinVolumes;
+  if(volume >= m_totalCapacity)
+  {
+    basinVolumes.SetCount(m_basins.GetCount());
+    for(ezUInt32 b = 0; b < m_basins.GetCount(); ++b)
+      basinVolumes[b] = m_basins[b].capacity;
+    WriteWater(terrainData, basinVolumes);
+    return m_totalCapacity;
+  }
+
+  // The volume that stays grows monotonically with the rain depth. Less rain than the volume spread over all cells never suffices, and
+  // enough rain fills every basin, so doubling finds an upper bound.
+  float lowRainDepth = 0.0f;
+  float highRainDepth = static_cast<float>(volume / m_floodOrder.GetCount());
+  while(highRainDepth > 0.0f && RouteRain(highRainDepth, cellInflow, basinVolumes) < volume)
+  {
+    lowRainDepth = highRainDepth;
+    highRainDepth *= 2.0f;
+  }
+  for(ezUInt32 i = 0; i < 32 && highRainDepth - lowRainDepth > highRainDepth * 1e-6f; ++i)
+  {
+    float rainDepth = (lowRainDepth + highRainDepth) * 0.5f;
+    if(RouteRain(rainDepth, cellInflow, basinVolumes) < volume)
+      lowRainDepth = rainDepth;
+    else
+      highRainDepth = rainDepth;
+  }
+
+  double totalVolume = RouteRain(highRainDepth, cellInflow, basinVolumes);
+  WriteWater(terrainData, basinVolumes);
+  return totalVolume;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+/// Initial water in equilibrium, so that a new scenario doesn't need thousands of simulation steps until water settled into the basins.
+///
+/// A priority-flood from the grid edges, where water leaves the simulation, gives every cell the height of the lowest pass towards the
+/// edges and the neighbour it drains into. Connected cells below their pass form a basin. Rain is routed along the drainage towards the
+/// edges: Every basin keeps up to its capacity and passes the rest on over its pass. Partially filled basins get a flat water level at the
+/// height that holds their volume. Where that level splits a basin into several pools, all of them are at rest as well.
+///
+/// Volumes are in cell heights, i.e. the sum of the water heights of all cells.
+class LakePrefill
+{
+public:
+  /// Floods the terrain height in .r of terrain data in the RGBA32F layout of the terrain data texture. O(n log n) in the number of cells.
+  LakePrefill(const ezColor* terrainData, ezUInt32 gridResolution);
+
+  ezUInt32 GetNumBasins() const { return m_basins.GetCount(); }
+  /// Volume of all basins filled up to their pass.
+  double GetTotalCapacity() const { return m_totalCapacity; }
+
+  /// Rains rainDepth onto every cell and sets the water height in .a to what stays. Returns the volume that stays.
+  double FillFromRain(ezColor* terrainData, float rainDepth) const;
+
+  /// Sets the water height in .a so that the given volume stays, by finding the rain depth that leaves it. Fills all basins if the volume
+  /// exceeds their capacity. Returns the volume that stays.
+  double FillToVolume(ezColor* terrainData, double volume) const;
+
+private:
+  struct Basin
+  {
+    /// Height of the pass over which the basin overflows.
+    float passHeight;
+    /// First cell in flood order, all water that reaches the basin passes cells that were flooded after it.
+    ezUInt32 entryCell;
+    /// Range in m_basinHeights.
+    ezUInt32 firstHeight;
+    ezUInt32 numCells;
+    double capacity;
+  };
+
+  /// The four neighbours of a cell, s_none outside the grid.
+  void GetNeighbours(ezUInt32 cell, ezUInt32* neighbours) const;
+  /// Routes the rain and fills basinVolumes with the volume each basin keeps. Returns the total.
+  double RouteRain(float rainDepth, ezDynamicArray<float>& cellInflow, ezDynamicArray<double>& basinVolumes) const;
+  /// Water level at which a basin holds the given volume, at most its pass height.
+  float ComputeBasinLevel(const Basin& basin, double volume) const;
+  /// Writes the water heights for the given basin volumes.
+  void WriteWater(ezColor* terrainData, const ezDynamicArray<double>& basinVolumes) const;
+
+  static const ezUInt32 s_none = 0xFFFFFFFF;
+
+  const ezUInt32 m_gridResolution;
+
+  /// All cells in the order they were flooded, every cell comes after the one it drains into.
+  ezDynamicArray<ezUInt32> m_floodOrder;
+  /// Neighbour each cell drains into, s_none for the grid edges.
+  ezDynamicArray<ezUInt32> m_drainsTo;
+  /// Basin of each cell, s_none for cells above their pass.
+  ezDynamicArray<ezUInt32> m_cellBasins;
+
+  ezDynamicArray<Basin> m_basins;
+  /// Terrain heights of the cells of each basin in ascending order and the sum of all heights before each within the basin.
+  ezDynamicArray<float> m_basinHeights;
+  ezDynamicArray<double> m_basinHeightSums;
+  double m_totalCapacity;
+};
@@ -0,0 +1,285 @@
+#include "PCH.h"
+#include "NestedFlowSolver.h"
+
+namespace
+{
+  /// Sides of a finer level. Each side is walked along its edge cells, starting at edgeStart and moving by edgeStep.
+  struct LevelSide
+  {
+    /// Direction of the flow that leaves the finer level on this side.
+    FlowGridView::FlowDirection outwardDirection;
+    ezInt32 normalX, normalY;
+    ezInt32 edgeStepX, edgeStepY;
+    /// Multiplied with the resolution of the finer level minus one.
+    ezInt32 edgeStartX, edgeStartY;
+  };
+
+  const LevelSide s_levelSides[] =
+  {
+    { FlowGridView::FLOW_POS_X, 1, 0, 0, 1, 1, 0 },
+    { FlowGridView::FLOW_NEG_X, -1, 0, 0, 1, 0, 0 },
+    { FlowGridView::FLOW_POS_Y, 0, 1, 1, 0, 0, 1 },
+    { FlowGridView::FLOW_NEG_Y, 0, -1, 1, 0, 0, 0 },
+  };
+
+  /// FLOW_POS_X <-> FLOW_NEG_X, FLOW_POS_Y <-> FLOW_NEG_Y
+  ezUInt32 GetOppositeDirection(ezUInt32 direction)
+  {
+    return direction ^ 1;
+  }
+}
+
+ezResult NestedFlowSolver::ValidateLevels(const SimulationLevelConfig* levels, ezUInt32 numLevels)
+{
+  if(numLevels == 0)
+  {
+    ezLog::Error("At least one simulation level is needed.");
+    return EZ_FAILURE;
+  }
+
+  for(ezUInt32 level = 0; level < numLevels; ++level)
+  {
+    if(levels[level].gridResolution < 2 || levels[level].gridWorldSize <= 0.0f)
+    {
+      ezLog::Error("Simulation level %u needs a positive world size and at least 2 cells per side.", level);
+      return EZ_FAILURE;
+    }
+    if(level == 0)
+      continue;
+
+    const SimulationLevelConfig& finer = levels[level - 1];
+    const SimulationLevelConfig& coarser = levels[level];
+    if(ezMath::Abs(coarser.GetCellDistance() - 2.0f * finer.GetCellDistance()) > coarser.GetCellDistance() * 0.0001f)
+    {
+      ezLog::Error("Cell distance of simulation level %u needs to be twice the cell distance of level %u.", level, level - 1);
+      return EZ_FAILURE;
+    }
+
+    // Finer level needs to cover whole coarse cells and its border needs to lie inside the coarser level.
+    ezInt32 margin = static_cast<ezInt32>(coarser.gridResolution) - static_cast<ezInt32>(finer.gridResolution / 2);
+    if(finer.gridResolution % 2 != 0 || margin % 2 != 0 || margin < 2)
+    {
+      ezLog::Error("Simulation level %u (%u cells) needs to contain level %u (%u cells) centered with whole cells and at least one cell margin.",
+                   level, coarser.gridResolution, level - 1, finer.gridResolution);
+      return EZ_FAILURE;
+    }
+  }
+
+  return EZ_SUCCESS;
+}
+
+NestedFlowSolver::NestedFlowSolver(const SimulationLevelConfig* levels, ezUInt32 numLevels)
+{
+  EZ_ASSERT(ValidateLevels(levels, numLevels) == EZ_SUCCESS, "Invalid simulation levels.");
+
+  m_levels.SetCount(numLevels);
+  for(ezUInt32 level = 0; level < numLevels; ++level)
+  {
+    m_levels[level].config = levels[level];
+    m_levels[level].solver = EZ_DEFAULT_NEW(CpuFlowSolver)(levels[level].gridResolution);
+    if(level > 0)
+    {
+      m_levels[level].finerLevelSize = levels[level - 1].gridResolution / 2;
+      m_levels[level].finerLevelOffset = (static_cast<ezInt32>(levels[level].gridResolution) - m_levels[level].finerLevelSize) / 2;
+      m_levels[level].refluxDeficit.SetCount(EZ_ARRAY_SIZE(s_levelSides) * m_levels[level].finerLevelSize);
+    }
+    else
+    {
+      m_levels[level].finerLevelSize = 0;
+      m_levels[level].finerLevelOffset = 0;
+    }
+  }
+}
+
+NestedFlowSolver::~NestedFlowSolver()
+{
+  for(ezUInt32 level = 0; level < m_levels.GetCount(); ++level)
+    EZ_DEFAULT_DELETE(m_levels[level].solver);
+}
+
+void NestedFlowSolver::SetSimulationParameters(ezTime stepLength, float flowDamping, float flowAcceleration)
+{
+  for(ezUInt32 level = 0; level < m_levels.GetCount(); ++level)
+  {
+    m_levels[level].solver->SetSimulationParameters(SimulationParameters::Compute(stepLength, flowDamping, flowAcceleration,
+                                                                                  m_levels[level].config.GetCellDistance()));
+  }
+}
+
+void NestedFlowSolver::SetState(const ezColor* const* terrainData)
+{
+  for(ezUInt32 level = 0; level < m_levels.GetCount(); ++level)
+  {
+    m_levels[level].solver->SetState(terrainData[level], NULL);
+    for(ezUInt32 i = 0; i < m_levels[level].refluxDeficit.GetCount(); ++i)
+      m_levels[level].refluxDeficit[i] = 0.0f;
+  }
+
+  // Coarse terrain has to match the finer levels, otherwise prolongated borders would not fit to the finer level.
+  for(ezUInt32 level = 0; level + 1 < m_levels.GetCount(); ++level)
+    RestrictToCoarserLevel(level, true);
+}
+
+void NestedFlowSolver::PerformSimulationStep()
+{
+  for(ezInt32 level = static_cast<ezInt32>(m_levels.GetCount()) - 1; level >= 0; --level)
+  {
+    if(level + 1 < static_cast<ezInt32>(m_levels.GetCount()))
+      ProlongateBorder(level);
+    m_levels[level].solver->PerformSimulationStep();
+  }
+
+  // Finer levels are more accurate, coarse levels take their results where they overlap.
+  for(ezUInt32 level = 0; level + 1 < m_levels.GetCount(); ++level)
+  {
+    RefluxToCoarserLevel(level);
+    RestrictToCoarserLevel(level, false);
+  }
+}
+
+void NestedFlowSolver::PerformSimulationSteps(ezUInt32 numSteps)
+{
+  for(ezUInt32 step = 0; step < numSteps; ++step)
+    PerformSimulationStep();
+}
+
+void NestedFlowSolver::ProlongateBorder(ezUInt32 level)
+{
+  FlowGridView& fine = m_levels[level].solver->GetGridView();
+  const CpuFlowSolver& coarseSolver = *m_levels[level + 1].solver;
+  const FlowGridView& coarse = coarseSolver.GetGridView();
+  ezInt32 offset = m_levels[level + 1].finerLevelOffset;
+  ezInt32 edgeLength = m_levels[level].config.gridResolution;
+
+  for(ezUInt32 side = 0; side < EZ_ARRAY_SIZE(s_levelSides); ++side)
+  {
+    const LevelSide& s = s_levelSides[side];
+    ezUInt32 inwardDirection = GetOppositeDirection(s.outwardDirection);
+    for(ezInt32 i = 0; i < edgeLength; ++i)
+    {
+      ezInt32 edgeX = s.edgeStartX * (edgeLength - 1) + s.edgeStepX * i;
+      ezInt32 edgeY = s.edgeStartY * (edgeLength - 1) + s.edgeStepY * i;
+      ezInt32 borderIndex = (edgeX + s.normalX) + (edgeY + s.normalY) * fine.rowPitch;
+      ezInt32 outsideIndex = coarseSolver.GetCellIndex(offset + edgeX / 2 + s.normalX, offset + edgeY / 2 + s.normalY);
+
+      // Every coarse face is split into two fine faces.
+      fine.terrain[borderIndex] = coarse.terrain[outsideIndex];
+      fine.water[borderIndex] = coarse.water[outsideIndex];
+      fine.flow[inwardDirection][borderIndex] = coarse.flow[inwardDirection][outsideIndex] * 0.5f;
+    }
+  }
+}
+
+void NestedFlowSolver::RefluxToCoarserLevel(ezUInt32 level)
+{
+  const CpuFlowSolver& fineSolver = *m_levels[level].solver;
+  const FlowGridView& fine = fineSolver.GetGridView();
+  CpuFlowSolver& coarseSolver = *m_levels[level + 1].solver;
+  FlowGridView& coarse = coarseSolver.GetGridView();
+  float cellAreaInv = coarseSolver.GetSimulationParameters().cellAreaInv_timeScaled;
+  ezInt32 offset = m_levels[level + 1].finerLevelOffset;
+  ezInt32 edgeLength = m_levels[level].config.gridResolution;
+  ezDynamicArray<float>& deficit = m_levels[level + 1].refluxDeficit;
+
+  // The coarse step already moved water between the outside cells and the covered cells. Inflow into the covered cells is exactly what
+  // the border of the finer level received, outflow is replaced by what actually left the finer level.
+  for(ezUInt32 side = 0; side < EZ_ARRAY_SIZE(s_levelSides); ++side)
+  {
+    const LevelSide& s = s_levelSides[side];
+    for(ezInt32 i = 0; i < edgeLength; i += 2)
+    {
+      ezInt32 edgeX = s.edgeStartX * (edgeLength - 1) + s.edgeStepX * i;
+      ezInt32 edgeY = s.edgeStartY * (edgeLength - 1) + s.edgeStepY * i;
+      float fineOutflow = fine.flow[s.outwardDirection][fineSolver.GetCellIndex(edgeX, edgeY)] +
+                          fine.flow[s.outwardDirection][fineSolver.GetCellIndex(edgeX + s.edgeStepX, edgeY + s.edgeStepY)];
+
+      ezInt32 coveredIndex = coarseSolver.GetCellIndex(offset + edgeX / 2, offset + edgeY / 2);
+      ezInt32 outsideIndex = coveredIndex + s.normalX + s.normalY * coarse.rowPitch;
+      float coarseOutflow = coarse.flow[s.outwardDirection][coveredIndex];
+
+      // The outside cell may have passed on the water of the coarse outflow already. Clamping would create what it can't give back, so
+      // that is taken from the water it gets in later steps instead.
+      ezUInt32 deficitIndex = side * (edgeLength / 2) + i / 2;
+      float water = coarse.water[outsideIndex] + (fineOutflow - coarseOutflow) * cellAreaInv - deficit[deficitIndex];
+      coarse.water[outsideIndex] = ezMath::Max(0.0f, water);
+      deficit[deficitIndex] = ezMath::Max(0.0f, -water);
+    }
+  }
+}
+
+void NestedFlowSolver::RestrictToCoarserLevel(ezUInt32 level, bool restrictTerrain)
+{
+  const CpuFlowSolver& fineSolver = *m_levels[level].solver;
+  const FlowGridView& fine = fineSolver.GetGridView();
+  CpuFlowSolver& coarseSolver = *m_levels[level + 1].solver;
+  FlowGridView& coarse = coarseSolver.GetGridView();
+  ezInt32 offset = m_levels[level + 1].finerLevelOffset;
+  ezInt32 size = m_levels[level + 1].finerLevelSize;
+
+  for(ezInt32 y = 0; y < size; ++y)
+  {
+    for(ezInt32 x = 0; x < size; ++x)
+    {
+      // A coarse cell has four times the area of a fine cell, so the average height keeps the volume.
+      ezInt32 fineIndex = fineSolver.GetCellIndex(x * 2, y * 2);
+      ezInt32 coarseIndex = coarseSolver.GetCellIndex(offset + x, offset + y);
+      coarse.water[coarseIndex] = (fine.water[fineIndex] + fine.water[fineIndex + 1] +
+                                   fine.water[fineIndex + fine.rowPitch] + fine.water[fineIndex + fine.rowPitch + 1]) * 0.25f;
+      if(restrictTerrain)
+      {
+        coarse.terrain[coarseIndex] = (fine.terrain[fineIndex] + fine.terrain[fineIndex + 1] +
+                                       fine.terrain[fineIndex + fine.rowPitch] + fine.terrain[fineIndex + fine.rowPitch + 1]) * 0.25f;
+      }
+
+      // Every coarse face consists of two fine faces, see ProlongateBorder.
+      ezInt32 fineIndex10 = fineIndex + 1;
+      ezInt32 fineIndex01 = fineIndex + fine.rowPitch;
+      coarse.flow[FlowGridView::FLOW_POS_X][coarseIndex] = fine.flow[FlowGridView::FLOW_POS_X][fineIndex10] +
+                                                           fine.flow[FlowGridView::FLOW_POS_X][fineIndex10 + fine.rowPitch];
+      coarse.flow[FlowGridView::FLOW_NEG_X][coarseIndex] = fine.flow[FlowGridView::FLOW_NEG_X][fineIndex] +
+                                                           fine.flow[FlowGridView::FLOW_NEG_X][fineIndex01];
+      coarse.flow[FlowGridView::FLOW_POS_Y][coarseIndex] = fine.flow[FlowGridView::FLOW_POS_Y][fineIndex01] +
+                                                           fine.flow[FlowGridView::FLOW_POS_Y][fineIndex01 + 1];
+      coarse.flow[FlowGridView::FLOW_NEG_Y][coarseIndex] = fine.flow[FlowGridView::FLOW_NEG_Y][fineIndex] +
+                                                           fine.flow[FlowGridView::FLOW_NEG_Y][fineIndex10];
+    }
+  }
+}
+
+double NestedFlowSolver::ComputeTotalWaterVolume() const
+{
+  double totalVolume = 0.0;
+  for(ezUInt32 level = 0; level < m_levels.GetCount(); ++level)
+  {
+    const Level& l = m_levels[level];
+    const FlowGridView& grid = l.solver->GetGridView();
+    ezInt32 coveredMin = l.finerLevelOffset;
+    ezInt32 coveredMax = l.finerLevelOffset + l.finerLevelSize;
+
+    double levelWater = 0.0;
+    for(ezInt32 y = 0; y < static_cast<ezInt32>(l.config.gridResolution); ++y)
+    {
+      bool rowCovered = y >= coveredMin && y < coveredMax;
+      for(ezInt32 x = 0; x < static_cast<ezInt32>(l.config.gridResolution); ++x)
+      {
+        if(!rowCovered || x < coveredMin || x >= coveredMax)
+          levelWater += grid.water[l.solver->GetCellIndex(x, y)];
+      }
+    }
+    // Water the cells around the finer level still owe.
+    for(ezUInt32 i = 0; i < l.refluxDeficit.GetCount(); ++i)
+      levelWater -= l.refluxDeficit[i];
+
+    double cellDistance = l.config.GetCellDistance();
+    totalVolume += levelWater * cellDistance * cellDistance;
+  }
+  return totalVolume;
+}
+
+ezUInt64 NestedFlowSolver::GetNumCells() const
+{
+  ezUInt64 numCells = 0;
+  for(ezUInt32 level = 0; level < m_levels.GetCount(); ++level)
+    numCells += static_cast<ezUInt64>(m_levels[level].config.gridResolution) * m_levels[level].config.gridResolution;
+  return numCells;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "CpuFlowSolver.h"
+
+/// Size and resolution of a single grid level of NestedFlowSolver.
+struct SimulationLevelConfig
+{
+  SimulationLevelConfig() : gridWorldSize(0.0f), gridResolution(0) {}
+  SimulationLevelConfig(float gridWorldSize, ezUInt32 gridResolution) : gridWorldSize(gridWorldSize), gridResolution(gridResolution) {}
+
+  float GetCellDistance() const { return gridWorldSize / gridResolution; }
+
+  /// Edge length of the square area covered by the level. All levels are centered around the same point.
+  float gridWorldSize;
+  /// Number of cells per side.
+  ezUInt32 gridResolution;
+};
+
+/// Water simulation on several nested grids, similar to the rings of the geometry clipmap.
+///
+/// Level 0 is the finest grid in the center, every further level has twice the cell distance and surrounds the previous one. Memory and
+/// computation grow with the number of levels instead of the covered area. Every level is simulated by its own CpuFlowSolver; per step:
+///  - Levels are stepped from coarse to fine. Before a finer level is stepped, its border is prolongated from the coarser level:
+///    Border cells get terrain and water of the coarse cell they lie in and half of its flow towards the finer level.
+///  - Afterwards, levels are restricted from fine to coarse. Coarse cells adjacent to the finer level get the difference between the
+///    outflow of the finer level and the coarse outflow of the covered cells, so exactly the water that left the finer level arrives.
+///    If an adjacent cell already passed on more water than the correction takes back, the rest is taken in later steps.
+///    Coarse cells covered by the finer level get the average water height of the fine cells they contain and the summed flow of the
+///    fine faces on their faces, so they never keep flows of their own from before the finer level covered them.
+/// Water volume is conserved over all levels, apart from the clamping to zero water that is also done by a single grid.
+class NestedFlowSolver
+{
+public:
+  /// Checks that levels are ordered from fine to coarse, each with twice the cell distance of its predecessor, and that every level
+  /// contains the previous one with at least one cell margin and aligned to its cells.
+  static ezResult ValidateLevels(const SimulationLevelConfig* levels, ezUInt32 numLevels);
+
+  /// Levels need to pass ValidateLevels. All cells start flat, dry and without flow.
+  NestedFlowSolver(const SimulationLevelConfig* levels, ezUInt32 numLevels);
+  ~NestedFlowSolver();
+
+  ezUInt32 GetNumLevels() const { return m_levels.GetCount(); }
+  const SimulationLevelConfig& GetLevelConfig(ezUInt32 level) const { return m_levels[level].config; }
+
+  /// Solver of a single level, can be used to change performance settings like the number of threads.
+  /// Stepping levels directly bypasses the coupling between levels.
+  CpuFlowSolver& GetLevelSolver(ezUInt32 level) { return *m_levels[level].solver; }
+  const CpuFlowSolver& GetLevelSolver(ezUInt32 level) const { return *m_levels[level].solver; }
+
+  /// Computes the parameters of all levels from the user facing simulation settings. All levels use the same time step.
+  void SetSimulationParameters(ezTime stepLength, float flowDamping, float flowAcceleration);
+
+  /// Reads terrain and water in the layout of the terrain data texture, see CpuFlowSolver::SetState.
+  /// \param terrainData   One pointer per level to gridResolution² texels. Coarse cells covered by a finer level are overwritten.
+  void SetState(const ezColor* const* terrainData);
+
+  /// Advances all levels by one step.
+  void PerformSimulationStep();
+  void PerformSimulationSteps(ezUInt32 numSteps);
+
+  /// Sum of the water volume of all levels. Coarse cells covered by a finer level are only counted once.
+  double ComputeTotalWaterVolume() const;
+
+  /// Number of simulated cells over all levels.
+  ezUInt64 GetNumCells() const;
+
+private:
+  struct Level
+  {
+    SimulationLevelConfig config;
+    CpuFlowSolver* solver;
+
+    /// Position of the first cell of the next finer level in cells of this level; the finer level covers
+    /// finerLevelSize² cells of this level. Both are 0 for the finest level.
+    ezInt32 finerLevelOffset;
+    ezInt32 finerLevelSize;
+
+    /// Water height that the reflux correction could not yet take from the cells around the finer level, finerLevelSize per side.
+    ezDynamicArray<float> refluxDeficit;
+  };
+
+  /// Sets the border of the given level from the next coarser level.
+  void ProlongateBorder(ezUInt32 level);
+  /// Corrects the cells of the next coarser level around the given level for the actual outflow of the given level.
+  void RefluxToCoarserLevel(ezUInt32 level);
+  /// Averages water and sums up flows of the given level into the covered cells of the next coarser level.
+  void RestrictToCoarserLevel(ezUInt32 level, bool restrictTerrain);
+
+  ezDynamicArray<Level> m_levels;
+};
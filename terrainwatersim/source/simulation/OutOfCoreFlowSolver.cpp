@@ -0,0 +1,318 @@
+#include "PCH.h"
+#include "OutOfCoreFlowSolver.h"
+
+namespace
+{
+  /// Number of active tiles ahead of the current one that are prefetched.
+  const ezUInt32 s_prefetchDistance = 2;
+
+  const ezInt32 s_neighbourOffsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+}
+
+OutOfCoreFlowSolver::OutOfCoreFlowSolver(ezUInt32 gridResolution, ezUInt32 tileSize, ezUInt64 memoryBudget) :
+  m_gridResolution(gridResolution),
+  m_tileSize(tileSize),
+  m_tileCache(memoryBudget)
+{
+  EZ_ASSERT(tileSize > 0 && gridResolution % tileSize == 0, "Grid resolution %u is not a multiple of the tile size %u.", gridResolution, tileSize);
+
+  m_parameters = SimulationParameters::Compute(ezTime::Seconds(1.0f / 60.0f), 0.98f, 10.0f, 1.0f);
+
+  ezInt32 rowPitch = m_tileSize + 2;
+  ezUInt32 planeSize = rowPitch * rowPitch;
+  m_scratchData.SetCount(planeSize * NUM_SCRATCH_PLANES);
+  ezMemoryUtils::ZeroFill(static_cast<ezArrayPtr<float>>(m_scratchData).GetPtr(), m_scratchData.GetCount());
+
+  // Same layout as CpuFlowSolver, pointers skip the first border row and column.
+  float* firstCell = static_cast<ezArrayPtr<float>>(m_scratchData).GetPtr() + rowPitch + 1;
+  m_scratch.rowPitch = rowPitch;
+  m_scratch.terrain = firstCell + PLANE_TERRAIN * planeSize;
+  m_scratch.water = firstCell + PLANE_WATER * planeSize;
+  for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+    m_scratch.flow[dir] = firstCell + (PLANE_FLOW_POS_X + dir) * planeSize;
+  m_scratch.flowMapX = firstCell + PLANE_FLOWMAP_X * planeSize;
+  m_scratch.flowMapY = firstCell + PLANE_FLOWMAP_Y * planeSize;
+}
+
+ezResult OutOfCoreFlowSolver::CreateStore(const char* szFilename)
+{
+  ezUInt32 numTiles = GetNumTilesPerSide() * GetNumTilesPerSide();
+  if(m_tileCache.Create(szFilename, numTiles, NUM_TILE_PLANES * m_tileSize * m_tileSize) == EZ_FAILURE)
+    return EZ_FAILURE;
+
+  m_tileWet.SetCount(numTiles);
+  for(ezUInt32 i = 0; i < numTiles; ++i)
+    m_tileWet[i] = false;
+  m_focusTiles.Clear();
+  return EZ_SUCCESS;
+}
+
+ezResult OutOfCoreFlowSolver::OpenStore(const char* szFilename)
+{
+  ezUInt32 numTiles = GetNumTilesPerSide() * GetNumTilesPerSide();
+  if(m_tileCache.Open(szFilename, numTiles, NUM_TILE_PLANES * m_tileSize * m_tileSize) == EZ_FAILURE)
+    return EZ_FAILURE;
+
+  // Without reading everything there is no way to tell which tiles are dry. The first step finds out.
+  m_tileWet.SetCount(numTiles);
+  for(ezUInt32 i = 0; i < numTiles; ++i)
+    m_tileWet[i] = true;
+  m_focusTiles.Clear();
+  return EZ_SUCCESS;
+}
+
+void OutOfCoreFlowSolver::SetTileState(ezUInt32 tileX, ezUInt32 tileY, const ezColor* terrainData)
+{
+  ezUInt32 tileIndex = GetTileIndex(tileX, tileY);
+  float* tileData = m_tileCache.AcquireTile(tileIndex);
+
+  ezUInt32 numCells = m_tileSize * m_tileSize;
+  float* terrain = GetTilePlane(tileData, PLANE_TERRAIN);
+  float* water = GetTilePlane(tileData, PLANE_WATER);
+  bool isWet = false;
+  for(ezUInt32 i = 0; i < numCells; ++i)
+  {
+    terrain[i] = terrainData[i].r;
+    water[i] = terrainData[i].a;
+    isWet |= water[i] > 0.0f;
+  }
+  ezMemoryUtils::ZeroFill(GetTilePlane(tileData, PLANE_FLOW_POS_X), numCells * FlowGridView::NUM_FLOW_DIRECTIONS);
+
+  m_tileCache.ReleaseTile(tileIndex, true);
+  m_tileWet[tileIndex] = isWet;
+}
+
+void OutOfCoreFlowSolver::GetTileState(ezUInt32 tileX, ezUInt32 tileY, ezColor* terrainData, ezColor* outgoingFlow)
+{
+  ezUInt32 tileIndex = GetTileIndex(tileX, tileY);
+  float* tileData = m_tileCache.AcquireTile(tileIndex);
+
+  ezUInt32 numCells = m_tileSize * m_tileSize;
+  const float* terrain = GetTilePlane(tileData, PLANE_TERRAIN);
+  const float* water = GetTilePlane(tileData, PLANE_WATER);
+  const float* flow[FlowGridView::NUM_FLOW_DIRECTIONS];
+  for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+    flow[dir] = GetTilePlane(tileData, static_cast<Plane>(PLANE_FLOW_POS_X + dir));
+
+  for(ezUInt32 i = 0; i < numCells; ++i)
+  {
+    terrainData[i].r = terrain[i];
+    terrainData[i].a = water[i];
+    if(outgoingFlow)
+      outgoingFlow[i] = ezColor(flow[FlowGridView::FLOW_POS_X][i], flow[FlowGridView::FLOW_NEG_X][i], flow[FlowGridView::FLOW_POS_Y][i], flow[FlowGridView::FLOW_NEG_Y][i]);
+  }
+
+  m_tileCache.ReleaseTile(tileIndex, false);
+}
+
+void OutOfCoreFlowSolver::SetFocus(const ezVec2& cellPosition, float radius)
+{
+  for(ezUInt32 i = 0; i < m_focusTiles.GetCount(); ++i)
+    m_tileCache.SetTileProtected(m_focusTiles[i], false);
+  m_focusTiles.Clear();
+
+  for(ezUInt32 tileY = 0; tileY < GetNumTilesPerSide(); ++tileY)
+  {
+    for(ezUInt32 tileX = 0; tileX < GetNumTilesPerSide(); ++tileX)
+    {
+      // Distance from the focus to the closest point of the tile.
+      float minX = static_cast<float>(tileX * m_tileSize);
+      float minY = static_cast<float>(tileY * m_tileSize);
+      ezVec2 closest(ezMath::Clamp(cellPosition.x, minX, minX + m_tileSize), ezMath::Clamp(cellPosition.y, minY, minY + m_tileSize));
+      if((closest - cellPosition).GetLengthSquared() > radius * radius)
+        continue;
+
+      ezUInt32 tileIndex = GetTileIndex(tileX, tileY);
+      m_tileCache.SetTileProtected(tileIndex, true);
+      m_tileCache.PrefetchTile(tileIndex);
+      m_focusTiles.PushBack(tileIndex);
+    }
+  }
+}
+
+void OutOfCoreFlowSolver::GatherActiveTiles()
+{
+  m_activeTiles.Clear();
+  ezInt32 numTilesPerSide = static_cast<ezInt32>(GetNumTilesPerSide());
+  for(ezInt32 tileY = 0; tileY < numTilesPerSide; ++tileY)
+  {
+    for(ezInt32 tileX = 0; tileX < numTilesPerSide; ++tileX)
+    {
+      // Dry tiles without wet neighbours neither get nor lose water, their flow stays zero.
+      bool isActive = m_tileWet[GetTileIndex(tileX, tileY)];
+      for(ezUInt32 n = 0; n < 4 && !isActive; ++n)
+      {
+        ezInt32 neighbourX = tileX + s_neighbourOffsets[n][0];
+        ezInt32 neighbourY = tileY + s_neighbourOffsets[n][1];
+        if(neighbourX >= 0 && neighbourY >= 0 && neighbourX < numTilesPerSide && neighbourY < numTilesPerSide)
+          isActive = m_tileWet[GetTileIndex(neighbourX, neighbourY)];
+      }
+      if(isActive)
+        m_activeTiles.PushBack(GetTileIndex(tileX, tileY));
+    }
+  }
+}
+
+void OutOfCoreFlowSolver::PrefetchActiveTile(ezUInt32 activeTileIndex)
+{
+  if(activeTileIndex >= m_activeTiles.GetCount())
+    return;
+
+  ezInt32 numTilesPerSide = static_cast<ezInt32>(GetNumTilesPerSide());
+  ezInt32 tileX = m_activeTiles[activeTileIndex] % numTilesPerSide;
+  ezInt32 tileY = m_activeTiles[activeTileIndex] / numTilesPerSide;
+  m_tileCache.PrefetchTile(m_activeTiles[activeTileIndex]);
+  for(ezUInt32 n = 0; n < 4; ++n)
+  {
+    ezInt32 neighbourX = tileX + s_neighbourOffsets[n][0];
+    ezInt32 neighbourY = tileY + s_neighbourOffsets[n][1];
+    if(neighbourX >= 0 && neighbourY >= 0 && neighbourX < numTilesPerSide && neighbourY < numTilesPerSide)
+      m_tileCache.PrefetchTile(GetTileIndex(neighbourX, neighbourY));
+  }
+}
+
+void OutOfCoreFlowSolver::LoadScratch(ezUInt32 tileX, ezUInt32 tileY, const float* tileData, const Plane* planes, ezUInt32 numPlanes)
+{
+  ezInt32 size = static_cast<ezInt32>(m_tileSize);
+  float* scratchPlanes[NUM_SCRATCH_PLANES] = { m_scratch.terrain, m_scratch.water, m_scratch.flow[0], m_scratch.flow[1], m_scratch.flow[2],
+                                               m_scratch.flow[3], m_scratch.flowMapX, m_scratch.flowMapY };
+
+  for(ezUInt32 plane = 0; plane < numPlanes; ++plane)
+  {
+    const float* source = tileData + planes[plane] * size * size;
+    for(ezInt32 y = 0; y < size; ++y)
+      ezMemoryUtils::Copy(scratchPlanes[planes[plane]] + y * m_scratch.rowPitch, source + y * size, size);
+  }
+
+  // Border from the adjacent edge of each neighbour, zero at the grid edges. Corners are never read by the kernels.
+  for(ezUInt32 n = 0; n < 4; ++n)
+  {
+    ezInt32 neighbourX = static_cast<ezInt32>(tileX) + s_neighbourOffsets[n][0];
+    ezInt32 neighbourY = static_cast<ezInt32>(tileY) + s_neighbourOffsets[n][1];
+    bool exists = neighbourX >= 0 && neighbourY >= 0 && neighbourX < static_cast<ezInt32>(GetNumTilesPerSide()) &&
+                  neighbourY < static_cast<ezInt32>(GetNumTilesPerSide());
+
+    ezUInt32 neighbourIndex = exists ? GetTileIndex(neighbourX, neighbourY) : 0;
+    const float* neighbourData = exists ? m_tileCache.AcquireTile(neighbourIndex) : NULL;
+
+    // First border cell in the scratch grid, first source cell in the neighbour and the step along the edge for both.
+    ezInt32 borderIndex = s_neighbourOffsets[n][0] < 0 ? -1 : s_neighbourOffsets[n][0] > 0 ? size :
+                          s_neighbourOffsets[n][1] < 0 ? -m_scratch.rowPitch : size * m_scratch.rowPitch;
+    ezInt32 borderStep = s_neighbourOffsets[n][0] != 0 ? m_scratch.rowPitch : 1;
+    ezInt32 sourceIndex = s_neighbourOffsets[n][0] < 0 ? size - 1 : s_neighbourOffsets[n][0] > 0 ? 0 :
+                          s_neighbourOffsets[n][1] < 0 ? (size - 1) * size : 0;
+    ezInt32 sourceStep = s_neighbourOffsets[n][0] != 0 ? size : 1;
+
+    for(ezUInt32 plane = 0; plane < numPlanes; ++plane)
+    {
+      float* border = scratchPlanes[planes[plane]] + borderIndex;
+      const float* source = exists ? neighbourData + planes[plane] * size * size + sourceIndex : NULL;
+      for(ezInt32 i = 0; i < size; ++i)
+        border[i * borderStep] = exists ? source[i * sourceStep] : 0.0f;
+    }
+
+    if(exists)
+      m_tileCache.ReleaseTile(neighbourIndex, false);
+  }
+}
+
+void OutOfCoreFlowSolver::UpdateFlowTile(ezUInt32 tileX, ezUInt32 tileY)
+{
+  ezUInt32 tileIndex = GetTileIndex(tileX, tileY);
+  float* tileData = m_tileCache.AcquireTile(tileIndex);
+
+  const Plane planes[] = { PLANE_TERRAIN, PLANE_WATER, PLANE_FLOW_POS_X, PLANE_FLOW_NEG_X, PLANE_FLOW_POS_Y, PLANE_FLOW_NEG_Y };
+  LoadScratch(tileX, tileY, tileData, planes, EZ_ARRAY_SIZE(planes));
+
+  ezInt32 size = static_cast<ezInt32>(m_tileSize);
+  for(ezInt32 y = 0; y < size; ++y)
+    FlowKernels::UpdateFlow(m_scratch, y * m_scratch.rowPitch, size, m_parameters);
+
+  for(ezUInt32 dir = 0; dir < FlowGridView::NUM_FLOW_DIRECTIONS; ++dir)
+  {
+    float* target = GetTilePlane(tileData, static_cast<Plane>(PLANE_FLOW_POS_X + dir));
+    for(ezInt32 y = 0; y < size; ++y)
+      ezMemoryUtils::Copy(target + y * size, m_scratch.flow[dir] + y * m_scratch.rowPitch, size);
+  }
+
+  m_tileCache.ReleaseTile(tileIndex, true);
+}
+
+bool OutOfCoreFlowSolver::ApplyFlowTile(ezUInt32 tileX, ezUInt32 tileY)
+{
+  ezUInt32 tileIndex = GetTileIndex(tileX, tileY);
+  float* tileData = m_tileCache.AcquireTile(tileIndex);
+
+  // Terrain isn't needed, the neighbours only contribute their flow.
+  const Plane planes[] = { PLANE_WATER, PLANE_FLOW_POS_X, PLANE_FLOW_NEG_X, PLANE_FLOW_POS_Y, PLANE_FLOW_NEG_Y };
+  LoadScratch(tileX, tileY, tileData, planes, EZ_ARRAY_SIZE(planes));
+
+  ezInt32 size = static_cast<ezInt32>(m_tileSize);
+  for(ezInt32 y = 0; y < size; ++y)
+    FlowKernels::ApplyFlow(m_scratch, y * m_scratch.rowPitch, size, m_parameters);
+
+  float* water = GetTilePlane(tileData, PLANE_WATER);
+  for(ezInt32 y = 0; y < size; ++y)
+    ezMemoryUtils::Copy(water + y * size, m_scratch.water + y * m_scratch.rowPitch, size);
+
+  // Flow alone keeps a tile wet, in the next step it may still push water out of neighbouring cells.
+  bool isWet = false;
+  ezUInt32 numCells = m_tileSize * m_tileSize;
+  const float* flow = GetTilePlane(tileData, PLANE_FLOW_POS_X);
+  for(ezUInt32 i = 0; i < numCells && !isWet; ++i)
+    isWet = water[i] > 0.0f;
+  for(ezUInt32 i = 0; i < numCells * FlowGridView::NUM_FLOW_DIRECTIONS && !isWet; ++i)
+    isWet = flow[i] > 0.0f;
+
+  m_tileCache.ReleaseTile(tileIndex, true);
+  return isWet;
+}
+
+void OutOfCoreFlowSolver::PerformSimulationStep()
+{
+  for(ezUInt32 i = 0; i < m_focusTiles.GetCount(); ++i)
+    m_tileCache.PrefetchTile(m_focusTiles[i]);
+
+  GatherActiveTiles();
+  ezUInt32 numTilesPerSide = GetNumTilesPerSide();
+
+  for(ezUInt32 i = 0; i < s_prefetchDistance; ++i)
+    PrefetchActiveTile(i);
+  for(ezUInt32 i = 0; i < m_activeTiles.GetCount(); ++i)
+  {
+    PrefetchActiveTile(i + s_prefetchDistance);
+    UpdateFlowTile(m_activeTiles[i] % numTilesPerSide, m_activeTiles[i] / numTilesPerSide);
+  }
+
+  // Applying needs the new flow of all neighbours. Wet flags only change here, after the active tiles were gathered.
+  for(ezUInt32 i = 0; i < s_prefetchDistance; ++i)
+    PrefetchActiveTile(i);
+  for(ezUInt32 i = 0; i < m_activeTiles.GetCount(); ++i)
+  {
+    PrefetchActiveTile(i + s_prefetchDistance);
+    m_tileWet[m_activeTiles[i]] = ApplyFlowTile(m_activeTiles[i] % numTilesPerSide, m_activeTiles[i] / numTilesPerSide);
+  }
+}
+
+void OutOfCoreFlowSolver::PerformSimulationSteps(ezUInt32 numSteps)
+{
+  for(ezUInt32 step = 0; step < numSteps; ++step)
+    PerformSimulationStep();
+}
+
+double OutOfCoreFlowSolver::ComputeTotalWater()
+{
+  double totalWater = 0.0;
+  ezUInt32 numCells = m_tileSize * m_tileSize;
+  for(ezUInt32 tileIndex = 0; tileIndex < m_tileWet.GetCount(); ++tileIndex)
+  {
+    if(!m_tileWet[tileIndex])
+      continue;
+
+    const float* water = GetTilePlane(m_tileCache.AcquireTile(tileIndex), PLANE_WATER);
+    for(ezUInt32 i = 0; i < numCells; ++i)
+      totalWater += water[i];
+    m_tileCache.ReleaseTile(tileIndex, false);
+  }
+  return totalWater;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "FlowKernels.h"
+#include "TileCache.h"
+
+/// Virtual pipe model on a grid that is stored on disk and only partially held in memory.
+///
+/// The grid is split into square tiles that live in a TileCache. Like the sparse GPU simulation (see activeTiles.glsl), a step only
+/// processes tiles that are wet or have a wet neighbour, so dry parts of the map are never loaded. Every tile is copied together with a
+/// one cell halo from its neighbours into a scratch grid and processed there with the same kernels as CpuFlowSolver, which gives
+/// identical results.
+///
+/// While a pass runs, the tiles that come next are prefetched. Tiles around the focus point, e.g. the camera, are protected from
+/// eviction and prefetched at the start of every step.
+class OutOfCoreFlowSolver
+{
+public:
+  /// \param tileSize       Edge length of the tiles, gridResolution needs to be a multiple of it.
+  /// \param memoryBudget   Bytes of tile data that may be held in memory, see TileCache.
+  OutOfCoreFlowSolver(ezUInt32 gridResolution, ezUInt32 tileSize, ezUInt64 memoryBudget);
+
+  /// Creates a new tile file. All cells start flat, dry and without flow.
+  ezResult CreateStore(const char* szFilename);
+  /// Continues with a tile file that was written by a solver with the same grid and tile size.
+  ezResult OpenStore(const char* szFilename);
+
+  ezUInt32 GetGridResolution() const { return m_gridResolution; }
+  ezUInt32 GetTileSize() const { return m_tileSize; }
+  ezUInt32 GetNumTilesPerSide() const { return m_gridResolution / m_tileSize; }
+
+  void SetSimulationParameters(const SimulationParameters& parameters) { m_parameters = parameters; }
+  const SimulationParameters& GetSimulationParameters() const { return m_parameters; }
+
+  /// Sets terrain and water of a tile from tileSize² texels in the layout of the terrain data texture and resets its flow.
+  void SetTileState(ezUInt32 tileX, ezUInt32 tileY, const ezColor* terrainData);
+  /// Writes terrain height to .r and water height to .a of tileSize² texels and the outgoing flow like the Flow image.
+  void GetTileState(ezUInt32 tileX, ezUInt32 tileY, ezColor* terrainData, ezColor* outgoingFlow);
+
+  /// Tiles within radius of the given cell position are kept resident if possible.
+  void SetFocus(const ezVec2& cellPosition, float radius);
+
+  void PerformSimulationStep();
+  void PerformSimulationSteps(ezUInt32 numSteps);
+
+  /// Number of tiles processed by the last step.
+  ezUInt32 GetNumActiveTiles() const { return m_activeTiles.GetCount(); }
+
+  /// Sum of all water heights. Only loads tiles that are wet.
+  double ComputeTotalWater();
+
+  /// Writes back all modified tiles.
+  void Flush() { m_tileCache.Flush(); }
+
+  const TileCache& GetTileCache() const { return m_tileCache; }
+
+private:
+  enum Plane
+  {
+    PLANE_TERRAIN,
+    PLANE_WATER,
+    PLANE_FLOW_POS_X,
+    PLANE_FLOW_NEG_X,
+    PLANE_FLOW_POS_Y,
+    PLANE_FLOW_NEG_Y,
+
+    /// Planes stored per tile. The flow map is only needed by the renderer and can be derived from the outgoing flow.
+    NUM_TILE_PLANES,
+
+    PLANE_FLOWMAP_X = NUM_TILE_PLANES,
+    PLANE_FLOWMAP_Y,
+
+    NUM_SCRATCH_PLANES
+  };
+
+  ezUInt32 GetTileIndex(ezUInt32 tileX, ezUInt32 tileY) const { return tileX + tileY * GetNumTilesPerSide(); }
+  float* GetTilePlane(float* tileData, Plane plane) const { return tileData + plane * m_tileSize * m_tileSize; }
+
+  /// Collects all tiles that are wet or have a wet neighbour.
+  void GatherActiveTiles();
+  /// Prefetches an active tile and its neighbours.
+  void PrefetchActiveTile(ezUInt32 activeTileIndex);
+
+  /// Copies the given planes of a tile to the scratch grid and the adjacent edges of its neighbours to the scratch border.
+  void LoadScratch(ezUInt32 tileX, ezUInt32 tileY, const float* tileData, const Plane* planes, ezUInt32 numPlanes);
+
+  void UpdateFlowTile(ezUInt32 tileX, ezUInt32 tileY);
+  /// Returns whether the tile contains any water or flow afterwards.
+  bool ApplyFlowTile(ezUInt32 tileX, ezUInt32 tileY);
+
+  const ezUInt32 m_gridResolution;
+  const ezUInt32 m_tileSize;
+
+  SimulationParameters m_parameters;
+  TileCache m_tileCache;
+
+  /// Per tile flag whether there is water or flow in it, all tiles count as wet until the first step.
+  ezDynamicArray<bool> m_tileWet;
+  ezDynamicArray<ezUInt32> m_activeTiles;
+
+  /// Tiles protected by SetFocus.
+  ezDynamicArray<ezUInt32> m_focusTiles;
+
+  /// Single tile with border, see CpuFlowSolver.
+  ezDynamicArray<float> m_scratchData;
+  FlowGridView m_scratch;
+};
@@ -0,0 +1,213 @@
+#include "PCH.h"
+#include "SemiImplicitFlowIntegrator.h"
+
+#include <omp.h>
+
+const float SemiImplicitFlowIntegrator::s_fullConductanceDepth = 0.05f;
+
+SemiImplicitFlowIntegrator::SemiImplicitFlowIntegrator(ezUInt32 gridResolution, ezInt32 rowPitch) :
+  m_gridResolution(static_cast<ezInt32>(gridResolution)),
+  m_rowPitch(rowPitch),
+  m_maxIterations(50),
+  m_tolerance(1e-4f),
+  m_relaxationFactor(1.5f),
+  m_lastNumIterations(0),
+  m_lastMaxChange(0.0f)
+{
+  ezUInt32 planeSize = rowPitch * (gridResolution + 2);
+  m_data = EZ_DEFAULT_NEW_RAW_BUFFER(float, planeSize * NUM_PLANES);
+  ezMemoryUtils::ZeroFill(m_data, planeSize * NUM_PLANES);
+
+  float* firstCell = m_data + rowPitch + 1;
+  m_surfaceHeight = firstCell + PLANE_SURFACE_HEIGHT * planeSize;
+  m_rightHandSide = firstCell + PLANE_RIGHT_HAND_SIDE * planeSize;
+  m_conductanceX = firstCell + PLANE_CONDUCTANCE_X * planeSize;
+  m_conductanceY = firstCell + PLANE_CONDUCTANCE_Y * planeSize;
+  m_fluxX = firstCell + PLANE_FLUX_X * planeSize;
+  m_fluxY = firstCell + PLANE_FLUX_Y * planeSize;
+  m_outflowScale = firstCell + PLANE_OUTFLOW_SCALE * planeSize;
+
+  // Only computed for grid cells. Border cells are never drained, whatever flows out of them is given.
+  for(ezUInt32 i = 0; i < planeSize; ++i)
+    m_data[PLANE_OUTFLOW_SCALE * planeSize + i] = 1.0f;
+
+  m_rowMaxChange.SetCount(gridResolution);
+}
+
+SemiImplicitFlowIntegrator::~SemiImplicitFlowIntegrator()
+{
+  EZ_DEFAULT_DELETE_RAW_BUFFER(m_data);
+}
+
+void SemiImplicitFlowIntegrator::SetRelaxationFactor(float relaxationFactor)
+{
+  EZ_ASSERT(relaxationFactor > 0.0f && relaxationFactor < 2.0f, "Over-relaxation only converges for factors between 0 and 2.");
+  m_relaxationFactor = relaxationFactor;
+}
+
+void SemiImplicitFlowIntegrator::PrepareRow(const FlowGridView& grid, ezInt32 y, const SimulationParameters& parameters)
+{
+  // Rows and columns from -1 to gridResolution, faces are only needed towards grid cells.
+  ezInt32 rowStart = y * m_rowPitch;
+  for(ezInt32 x = -1; x <= m_gridResolution; ++x)
+  {
+    ezInt32 i = rowStart + x;
+    float surfaceHeight = grid.terrain[i] + grid.water[i];
+    m_surfaceHeight[i] = surfaceHeight;
+
+    // Face towards +x, both cells in the same row.
+    if(y >= 0 && y < m_gridResolution && x < m_gridResolution)
+    {
+      float neighbourSurfaceHeight = grid.terrain[i + 1] + grid.water[i + 1];
+      float upwindDepth = surfaceHeight >= neighbourSurfaceHeight ? grid.water[i] : grid.water[i + 1];
+      m_conductanceX[i] = parameters.waterAcceleration_perStep * ezMath::Min(upwindDepth / s_fullConductanceDepth, 1.0f);
+      m_fluxX[i] = (grid.flow[FlowGridView::FLOW_POS_X][i] - grid.flow[FlowGridView::FLOW_NEG_X][i + 1]) * parameters.flowFriction_perStep;
+    }
+    // Face towards +y.
+    if(y < m_gridResolution && x >= 0 && x < m_gridResolution)
+    {
+      float neighbourSurfaceHeight = grid.terrain[i + m_rowPitch] + grid.water[i + m_rowPitch];
+      float upwindDepth = surfaceHeight >= neighbourSurfaceHeight ? grid.water[i] : grid.water[i + m_rowPitch];
+      m_conductanceY[i] = parameters.waterAcceleration_perStep * ezMath::Min(upwindDepth / s_fullConductanceDepth, 1.0f);
+      m_fluxY[i] = (grid.flow[FlowGridView::FLOW_POS_Y][i] - grid.flow[FlowGridView::FLOW_NEG_Y][i + m_rowPitch]) * parameters.flowFriction_perStep;
+    }
+  }
+}
+
+void SemiImplicitFlowIntegrator::ComputeRightHandSideRow(ezInt32 y, const SimulationParameters& parameters)
+{
+  ezInt32 rowStart = y * m_rowPitch;
+  for(ezInt32 i = rowStart; i < rowStart + m_gridResolution; ++i)
+  {
+    float explicitOutflow = m_fluxX[i] - m_fluxX[i - 1] + m_fluxY[i] - m_fluxY[i - m_rowPitch];
+    m_rightHandSide[i] = m_surfaceHeight[i] - explicitOutflow * parameters.cellAreaInv_timeScaled;
+  }
+}
+
+float SemiImplicitFlowIntegrator::RelaxRow(ezInt32 y, ezUInt32 color, float cellAreaInv)
+{
+  // (1 + cellAreaInv * sum(conductance)) * h - cellAreaInv * sum(conductance * neighbourH) = rightHandSide
+  float maxChange = 0.0f;
+  ezInt32 rowStart = y * m_rowPitch;
+  for(ezInt32 i = rowStart + ((y + color) & 1); i < rowStart + m_gridResolution; i += 2)
+  {
+    float conductanceX1 = m_conductanceX[i];
+    float conductanceX0 = m_conductanceX[i - 1];
+    float conductanceY1 = m_conductanceY[i];
+    float conductanceY0 = m_conductanceY[i - m_rowPitch];
+
+    float diagonal = 1.0f + (conductanceX1 + conductanceX0 + conductanceY1 + conductanceY0) * cellAreaInv;
+    float neighbours = conductanceX1 * m_surfaceHeight[i + 1] + conductanceX0 * m_surfaceHeight[i - 1] +
+                       conductanceY1 * m_surfaceHeight[i + m_rowPitch] + conductanceY0 * m_surfaceHeight[i - m_rowPitch];
+    float solution = (m_rightHandSide[i] + neighbours * cellAreaInv) / diagonal;
+
+    float change = (solution - m_surfaceHeight[i]) * m_relaxationFactor;
+    m_surfaceHeight[i] += change;
+    maxChange = ezMath::Max(maxChange, ezMath::Abs(change));
+  }
+  return maxChange;
+}
+
+void SemiImplicitFlowIntegrator::ComputeFluxRow(ezInt32 y)
+{
+  ezInt32 rowStart = y * m_rowPitch;
+  for(ezInt32 x = -1; x < m_gridResolution; ++x)
+  {
+    ezInt32 i = rowStart + x;
+    if(y >= 0)
+      m_fluxX[i] += m_conductanceX[i] * (m_surfaceHeight[i] - m_surfaceHeight[i + 1]);
+    if(x >= 0)
+      m_fluxY[i] += m_conductanceY[i] * (m_surfaceHeight[i] - m_surfaceHeight[i + m_rowPitch]);
+  }
+}
+
+void SemiImplicitFlowIntegrator::ComputeOutflowScaleRow(const FlowGridView& grid, ezInt32 y, float cellAreaInv)
+{
+  ezInt32 rowStart = y * m_rowPitch;
+  for(ezInt32 i = rowStart; i < rowStart + m_gridResolution; ++i)
+  {
+    float outflow = (ezMath::Max(m_fluxX[i], 0.0f) + ezMath::Max(-m_fluxX[i - 1], 0.0f) +
+                     ezMath::Max(m_fluxY[i], 0.0f) + ezMath::Max(-m_fluxY[i - m_rowPitch], 0.0f)) * cellAreaInv;
+    m_outflowScale[i] = outflow > grid.water[i] ? grid.water[i] / outflow : 1.0f;
+  }
+}
+
+void SemiImplicitFlowIntegrator::ApplyFluxRow(const FlowGridView& grid, ezInt32 y, float cellAreaInv)
+{
+  ezInt32 rowStart = y * m_rowPitch;
+  for(ezInt32 i = rowStart; i < rowStart + m_gridResolution; ++i)
+  {
+    float fluxX1 = GetScaledFluxX(i);
+    float fluxX0 = GetScaledFluxX(i - 1);
+    float fluxY1 = GetScaledFluxY(i);
+    float fluxY0 = GetScaledFluxY(i - m_rowPitch);
+
+    // Rounding may leave a tiny negative remainder where all water flows out.
+    grid.water[i] = ezMath::Max(0.0f, grid.water[i] - (fluxX1 - fluxX0 + fluxY1 - fluxY0) * cellAreaInv);
+
+    grid.flow[FlowGridView::FLOW_POS_X][i] = ezMath::Max(fluxX1, 0.0f);
+    grid.flow[FlowGridView::FLOW_NEG_X][i] = ezMath::Max(-fluxX0, 0.0f);
+    grid.flow[FlowGridView::FLOW_POS_Y][i] = ezMath::Max(fluxY1, 0.0f);
+    grid.flow[FlowGridView::FLOW_NEG_Y][i] = ezMath::Max(-fluxY0, 0.0f);
+
+    // Same as in ApplyFlow, which only sees the two one-sided flows of each face.
+    grid.flowMapX[i] = -(fluxX1 + fluxX0);
+    grid.flowMapY[i] = -(fluxY1 + fluxY0);
+  }
+}
+
+void SemiImplicitFlowIntegrator::PerformSimulationStep(const FlowGridView& grid, const SimulationParameters& parameters, ezUInt32 numThreads)
+{
+  EZ_ASSERT(grid.rowPitch == m_rowPitch, "Grid layout does not match the one the integrator was created for.");
+
+  float cellAreaInv = parameters.cellAreaInv_timeScaled;
+  m_lastNumIterations = 0;
+  m_lastMaxChange = 0.0f;
+
+#pragma omp parallel num_threads(numThreads)
+  {
+#pragma omp for schedule(static)
+    for(ezInt32 y = -1; y <= m_gridResolution; ++y)
+      PrepareRow(grid, y, parameters);
+
+#pragma omp for schedule(static)
+    for(ezInt32 y = 0; y < m_gridResolution; ++y)
+      ComputeRightHandSideRow(y, parameters);
+
+    // Starts from the current surface heights. All threads evaluate the same stop condition after the implicit barriers.
+    for(ezUInt32 iteration = 0; iteration < m_maxIterations; ++iteration)
+    {
+      for(ezUInt32 color = 0; color < 2; ++color)
+      {
+#pragma omp for schedule(static)
+        for(ezInt32 y = 0; y < m_gridResolution; ++y)
+        {
+          float maxChange = RelaxRow(y, color, cellAreaInv);
+          m_rowMaxChange[y] = color == 0 ? maxChange : ezMath::Max(m_rowMaxChange[y], maxChange);
+        }
+      }
+
+#pragma omp single
+      {
+        m_lastMaxChange = 0.0f;
+        for(ezInt32 y = 0; y < m_gridResolution; ++y)
+          m_lastMaxChange = ezMath::Max(m_lastMaxChange, m_rowMaxChange[y]);
+        m_lastNumIterations = iteration + 1;
+      }
+      if(m_lastMaxChange < m_tolerance)
+        break;
+    }
+
+#pragma omp for schedule(static)
+    for(ezInt32 y = -1; y < m_gridResolution; ++y)
+      ComputeFluxRow(y);
+
+#pragma omp for schedule(static)
+    for(ezInt32 y = 0; y < m_gridResolution; ++y)
+      ComputeOutflowScaleRow(grid, y, cellAreaInv);
+
+#pragma omp for schedule(static)
+    for(ezInt32 y = 0; y < m_gridResolution; ++y)
+      ApplyFluxRow(grid, y, cellAreaInv);
+  }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "FlowKernels.h"
+
+#include <Foundation/Containers/DynamicArray.h>
+
+/// Semi-implicit alternative to the virtual pipe model of FlowKernels, stays stable at steps far beyond the limit of the explicit one.
+///
+/// Works on the same state and parameters. The outgoing flows of the two cells at a face are combined to a signed flux, which is updated
+/// like a pipe, but with the surface heights at the end of the step:
+///   flux' = friction * flux + conductance * (surfaceHeight'(from) - surfaceHeight'(to))
+/// Together with the continuity equation this gives a sparse symmetric positive definite system for the new surface heights. It is
+/// solved with red-black successive over-relaxation: cells of one color only depend on cells of the other one, so every half sweep is
+/// parallel over all rows.
+///
+/// The conductance is the pipe acceleration, tapered off linearly in water shallower than s_fullConductanceDepth on the upwind side.
+/// Dry cells thus get water but give none. Water is finally moved with the resulting fluxes, where the outgoing flux of a cell exceeds
+/// its water it is scaled down like in the pipe model. Water stays non-negative and its total is conserved, apart from the outflow at the
+/// grid edges, no matter how far the iteration converged.
+///
+/// Border cells are read but never written, like by the pipe model. Unlike there, their water takes part in the solve, so coupling a
+/// grid through the border (see NestedFlowSolver) is not supported.
+class SemiImplicitFlowIntegrator
+{
+public:
+  /// Allocates the intermediate planes for a grid with a one cell border, see CpuFlowSolver.
+  SemiImplicitFlowIntegrator(ezUInt32 gridResolution, ezInt32 rowPitch);
+  ~SemiImplicitFlowIntegrator();
+
+  /// Iteration stops after this many sweeps even if the tolerance was not reached.
+  void SetMaxIterations(ezUInt32 maxIterations) { m_maxIterations = maxIterations; }
+  ezUInt32 GetMaxIterations() const { return m_maxIterations; }
+
+  /// Iteration stops once no surface height changed by more than this in the last sweep.
+  void SetTolerance(float tolerance) { m_tolerance = tolerance; }
+  float GetTolerance() const { return m_tolerance; }
+
+  /// Over-relaxation factor between 1 (Gauss-Seidel) and 2.
+  void SetRelaxationFactor(float relaxationFactor);
+  float GetRelaxationFactor() const { return m_relaxationFactor; }
+
+  /// Advances the grid by one step of the length the parameters were computed for.
+  void PerformSimulationStep(const FlowGridView& grid, const SimulationParameters& parameters, ezUInt32 numThreads);
+
+  /// Sweeps needed by the last step.
+  ezUInt32 GetLastNumIterations() const { return m_lastNumIterations; }
+  /// Largest change of a surface height in the last sweep of the last step.
+  float GetLastMaxChange() const { return m_lastMaxChange; }
+
+  /// Water depth from which on faces conduct like pipes.
+  static const float s_fullConductanceDepth;
+
+private:
+  /// Conductance and explicit part of the flux of all faces, surface heights of all cells including the border.
+  void PrepareRow(const FlowGridView& grid, ezInt32 y, const SimulationParameters& parameters);
+  /// Right hand side of the system, the new surface height if all fluxes kept their explicit part.
+  void ComputeRightHandSideRow(ezInt32 y, const SimulationParameters& parameters);
+  /// Updates all cells of one color in a row, returns the largest change.
+  float RelaxRow(ezInt32 y, ezUInt32 color, float cellAreaInv);
+  /// Final fluxes from the solved surface heights.
+  void ComputeFluxRow(ezInt32 y);
+  /// Factor for the outgoing fluxes of every cell, so that no more water leaves than there is.
+  void ComputeOutflowScaleRow(const FlowGridView& grid, ezInt32 y, float cellAreaInv);
+  /// Moves water and writes outgoing flow and flow map in the layout of the pipe model.
+  void ApplyFluxRow(const FlowGridView& grid, ezInt32 y, float cellAreaInv);
+
+  /// Flux of the face towards +x/+y with the outflow scale of the upwind cell.
+  EZ_FORCE_INLINE float GetScaledFluxX(ezInt32 i) const { return m_fluxX[i] * (m_fluxX[i] > 0.0f ? m_outflowScale[i] : m_outflowScale[i + 1]); }
+  EZ_FORCE_INLINE float GetScaledFluxY(ezInt32 i) const
+  {
+    return m_fluxY[i] * (m_fluxY[i] > 0.0f ? m_outflowScale[i] : m_outflowScale[i + m_rowPitch]);
+  }
+
+  enum Plane
+  {
+    PLANE_SURFACE_HEIGHT,
+    PLANE_RIGHT_HAND_SIDE,
+    PLANE_CONDUCTANCE_X,
+    PLANE_CONDUCTANCE_Y,
+    PLANE_FLUX_X,
+    PLANE_FLUX_Y,
+    PLANE_OUTFLOW_SCALE,
+
+    NUM_PLANES
+  };
+
+  const ezInt32 m_gridResolution;
+  const ezInt32 m_rowPitch;
+
+  /// All planes in a single allocation, same layout as the grid.
+  float* m_data;
+  // Pointers to cell (0,0) of each plane. Face planes hold the face towards +x/+y of a cell, the faces towards the grid of the left and
+  // upper border cells included.
+  float* m_surfaceHeight;
+  float* m_rightHandSide;
+  float* m_conductanceX;
+  float* m_conductanceY;
+  float* m_fluxX;
+  float* m_fluxY;
+  float* m_outflowScale;
+
+  /// Largest change per row in the current sweep, reduced after each sweep.
+  ezDynamicArray<float> m_rowMaxChange;
+
+  ezUInt32 m_maxIterations;
+  float m_tolerance;
+  float m_relaxationFactor;
+
+  ezUInt32 m_lastNumIterations;
+  float m_lastMaxChange;
+};
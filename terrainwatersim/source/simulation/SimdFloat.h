@@ -0,0 +1,88 @@
+#pragma once
+
+#include <immintrin.h>
+
+/// Thin wrapper around the widest float vector available at compile time.
+///
+/// Compiling with /arch:AVX or /arch:AVX2 gives 8 lanes, otherwise the SSE2 baseline of x64 is used with 4 lanes.
+/// Kernels are written against this interface only, so they don't need to care about the actual width.
+namespace Simd
+{
+#if defined(__AVX__)
+
+  typedef __m256 Float;
+  static const ezInt32 s_width = 8;
+
+  EZ_FORCE_INLINE Float Load(const float* p)              { return _mm256_loadu_ps(p); }
+  EZ_FORCE_INLINE void Store(float* p, Float v)           { _mm256_storeu_ps(p, v); }
+  EZ_FORCE_INLINE Float Set(float f)                      { return _mm256_set1_ps(f); }
+  EZ_FORCE_INLINE Float Zero()                            { return _mm256_setzero_ps(); }
+
+  EZ_FORCE_INLINE Float Add(Float a, Float b)             { return _mm256_add_ps(a, b); }
+  EZ_FORCE_INLINE Float Sub(Float a, Float b)             { return _mm256_sub_ps(a, b); }
+  EZ_FORCE_INLINE Float Mul(Float a, Float b)             { return _mm256_mul_ps(a, b); }
+  EZ_FORCE_INLINE Float Div(Float a, Float b)             { return _mm256_div_ps(a, b); }
+  EZ_FORCE_INLINE Float Max(Float a, Float b)             { return _mm256_max_ps(a, b); }
+  EZ_FORCE_INLINE Float Min(Float a, Float b)             { return _mm256_min_ps(a, b); }
+
+  /// Per lane a > b, all bits set where true.
+  EZ_FORCE_INLINE Float CmpGreater(Float a, Float b)      { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  /// Per lane mask ? ifTrue : ifFalse
+  EZ_FORCE_INLINE Float Select(Float mask, Float ifTrue, Float ifFalse) { return _mm256_blendv_ps(ifFalse, ifTrue, mask); }
+
+  typedef __m256i Int;
+
+  /// Rounds towards zero.
+  EZ_FORCE_INLINE Int TruncateToInt(Float v)              { return _mm256_cvttps_epi32(v); }
+  EZ_FORCE_INLINE Float ToFloat(Int v)                    { return _mm256_cvtepi32_ps(v); }
+
+  /// Per lane base[indices]
+  EZ_FORCE_INLINE Float Gather(const float* base, Int indices)
+  {
+#if defined(__AVX2__)
+    return _mm256_i32gather_ps(base, indices, 4);
+#else
+    ezInt32 i[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(i), indices);
+    return _mm256_setr_ps(base[i[0]], base[i[1]], base[i[2]], base[i[3]], base[i[4]], base[i[5]], base[i[6]], base[i[7]]);
+#endif
+  }
+
+#else
+
+  typedef __m128 Float;
+  static const ezInt32 s_width = 4;
+
+  EZ_FORCE_INLINE Float Load(const float* p)              { return _mm_loadu_ps(p); }
+  EZ_FORCE_INLINE void Store(float* p, Float v)           { _mm_storeu_ps(p, v); }
+  EZ_FORCE_INLINE Float Set(float f)                      { return _mm_set1_ps(f); }
+  EZ_FORCE_INLINE Float Zero()                            { return _mm_setzero_ps(); }
+
+  EZ_FORCE_INLINE Float Add(Float a, Float b)             { return _mm_add_ps(a, b); }
+  EZ_FORCE_INLINE Float Sub(Float a, Float b)             { return _mm_sub_ps(a, b); }
+  EZ_FORCE_INLINE Float Mul(Float a, Float b)             { return _mm_mul_ps(a, b); }
+  EZ_FORCE_INLINE Float Div(Float a, Float b)             { return _mm_div_ps(a, b); }
+  EZ_FORCE_INLINE Float Max(Float a, Float b)             { return _mm_max_ps(a, b); }
+  EZ_FORCE_INLINE Float Min(Float a, Float b)             { return _mm_min_ps(a, b); }
+
+  /// Per lane a > b, all bits set where true.
+  EZ_FORCE_INLINE Float CmpGreater(Float a, Float b)      { return _mm_cmpgt_ps(a, b); }
+  /// Per lane mask ? ifTrue : ifFalse
+  EZ_FORCE_INLINE Float Select(Float mask, Float ifTrue, Float ifFalse) { return _mm_or_ps(_mm_and_ps(mask, ifTrue), _mm_andnot_ps(mask, ifFalse)); }
+
+  typedef __m128i Int;
+
+  /// Rounds towards zero.
+  EZ_FORCE_INLINE Int TruncateToInt(Float v)              { return _mm_cvttps_epi32(v); }
+  EZ_FORCE_INLINE Float ToFloat(Int v)                    { return _mm_cvtepi32_ps(v); }
+
+  /// Per lane base[indices]. There is no gather instruction before AVX2, the lanes are loaded one by one.
+  EZ_FORCE_INLINE Float Gather(const float* base, Int indices)
+  {
+    ezInt32 i[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(i), indices);
+    return _mm_setr_ps(base[i[0]], base[i[1]], base[i[2]], base[i[3]]);
+  }
+
+#endif
+}
@@ -0,0 +1,298 @@
+#include "PCH.h"
+#include "SimulationCheckpoint.h"
+
+#include <Foundation/IO/OSFile.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  const char s_magic[4] = { 'T', 'W', 'S', 'C' };
+
+  /// Start of the file, padded to SimulationCheckpoint::s_pageSize.
+  struct FileHeader
+  {
+    char magic[4];
+    ezUInt32 version;
+    ezUInt32 tileSize;
+    SimulationCheckpointInfo info;
+  };
+
+  // Byte offsets of the blocks within a tile.
+
+  ezUInt64 GetOutgoingFlowOffset(ezUInt32 tileSize)
+  {
+    return sizeof(ezColor) * tileSize * tileSize;
+  }
+
+  ezUInt64 GetFlowMapOffset(ezUInt32 tileSize)
+  {
+    return 2 * sizeof(ezColor) * tileSize * tileSize;
+  }
+}
+
+namespace SimulationCheckpoint
+{
+  ezUInt32 GetTileSize(ezUInt32 gridResolution)
+  {
+    // 64² cells make up exactly 40 pages. Odd grid sizes are stored as a single tile.
+    const ezUInt32 tileSize = 64;
+    return gridResolution % tileSize == 0 ? tileSize : gridResolution;
+  }
+
+  ezUInt64 GetTileStride(ezUInt32 tileSize)
+  {
+    ezUInt64 tileDataSize = (2 * sizeof(ezColor) + sizeof(ezVec2)) * static_cast<ezUInt64>(tileSize) * tileSize;
+    return (tileDataSize + s_pageSize - 1) / s_pageSize * s_pageSize;
+  }
+}
+
+SimulationCheckpointWriter::SimulationCheckpointWriter() :
+  m_isWriting(false)
+{
+}
+
+SimulationCheckpointWriter::~SimulationCheckpointWriter()
+{
+  WaitForCompletion();
+}
+
+void SimulationCheckpointWriter::WaitForCompletion()
+{
+  if(m_thread.joinable())
+    m_thread.join();
+}
+
+void SimulationCheckpointWriter::BeginCheckpoint(const SimulationCheckpointInfo& info)
+{
+  WaitForCompletion();
+
+  m_info = info;
+  ezUInt32 numCells = info.gridResolution * info.gridResolution;
+  m_terrainData.SetCount(numCells);
+  m_outgoingFlow.SetCount(numCells);
+  m_flowMap.SetCount(numCells);
+}
+
+void SimulationCheckpointWriter::WriteAsync(const char* szFilename)
+{
+  WaitForCompletion();
+
+  m_filename = szFilename;
+  m_isWriting = true;
+  m_thread = std::thread([this]() { WriteCheckpoint(); m_isWriting = false; });
+}
+
+void SimulationCheckpointWriter::WriteCheckpoint()
+{
+  ezTime startTime = ezTime::Now();
+
+  ezOSFile file;
+  if(file.Open(m_filename.GetData(), ezFileMode::Write) == EZ_FAILURE)
+  {
+    ezLog::Error("Failed to open checkpoint \"%s\" for writing.", m_filename.GetData());
+    return;
+  }
+
+  ezUInt32 tileSize = SimulationCheckpoint::GetTileSize(m_info.gridResolution);
+  ezUInt32 numTilesPerSide = m_info.gridResolution / tileSize;
+
+  ezDynamicArray<char> block;
+  block.SetCount(static_cast<ezUInt32>(ezMath::Max<ezUInt64>(SimulationCheckpoint::GetTileStride(tileSize), SimulationCheckpoint::s_pageSize)));
+  char* blockData = static_cast<ezArrayPtr<char>>(block).GetPtr();
+
+  ezMemoryUtils::ZeroFill(blockData, SimulationCheckpoint::s_pageSize);
+  FileHeader* header = reinterpret_cast<FileHeader*>(blockData);
+  ezMemoryUtils::Copy(header->magic, s_magic, 4);
+  header->version = SimulationCheckpoint::s_version;
+  header->tileSize = tileSize;
+  header->info = m_info;
+  bool success = file.Write(blockData, SimulationCheckpoint::s_pageSize) == EZ_SUCCESS;
+
+  // Padding at the end of a tile stays zero.
+  ezMemoryUtils::ZeroFill(blockData, block.GetCount());
+  ezColor* tileTerrainData = reinterpret_cast<ezColor*>(blockData);
+  ezColor* tileOutgoingFlow = reinterpret_cast<ezColor*>(blockData + GetOutgoingFlowOffset(tileSize));
+  ezVec2* tileFlowMap = reinterpret_cast<ezVec2*>(blockData + GetFlowMapOffset(tileSize));
+
+  for(ezUInt32 tileY = 0; tileY < numTilesPerSide && success; ++tileY)
+  {
+    for(ezUInt32 tileX = 0; tileX < numTilesPerSide && success; ++tileX)
+    {
+      for(ezUInt32 y = 0; y < tileSize; ++y)
+      {
+        ezUInt32 sourceIndex = tileX * tileSize + (tileY * tileSize + y) * m_info.gridResolution;
+        ezMemoryUtils::Copy(tileTerrainData + y * tileSize, &m_terrainData[sourceIndex], tileSize);
+        ezMemoryUtils::Copy(tileOutgoingFlow + y * tileSize, &m_outgoingFlow[sourceIndex], tileSize);
+        ezMemoryUtils::Copy(tileFlowMap + y * tileSize, &m_flowMap[sourceIndex], tileSize);
+      }
+      success = file.Write(blockData, SimulationCheckpoint::GetTileStride(tileSize)) == EZ_SUCCESS;
+    }
+  }
+  file.Close();
+
+  if(success)
+    ezLog::Success("Wrote checkpoint \"%s\" in %.0f ms.", m_filename.GetData(), (ezTime::Now() - startTime).GetMilliseconds());
+  else
+    ezLog::Error("Failed to write checkpoint \"%s\".", m_filename.GetData());
+}
+
+SimulationCheckpointReader::SimulationCheckpointReader() :
+  m_tileSize(0),
+  m_tileStride(0),
+  m_fileHandle(NULL),
+  m_mappingHandle(NULL),
+  m_mapping(NULL),
+  m_mappingSize(0)
+{
+}
+
+SimulationCheckpointReader::~SimulationCheckpointReader()
+{
+  Close();
+}
+
+ezResult SimulationCheckpointReader::Open(const char* szFilename)
+{
+  Close();
+
+#if defined(_WIN32)
+  m_fileHandle = CreateFileA(szFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(m_fileHandle == INVALID_HANDLE_VALUE)
+    m_fileHandle = NULL;
+  LARGE_INTEGER fileSize;
+  if(!m_fileHandle || !GetFileSizeEx(m_fileHandle, &fileSize))
+  {
+    ezLog::Error("Failed to open checkpoint \"%s\".", szFilename);
+    Close();
+    return EZ_FAILURE;
+  }
+  m_mappingSize = fileSize.QuadPart;
+  m_mappingHandle = CreateFileMappingA(m_fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(m_mappingHandle)
+    m_mapping = static_cast<const char*>(MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0));
+#else
+  int fileDescriptor = open(szFilename, O_RDONLY);
+  struct stat fileStatus;
+  if(fileDescriptor < 0 || fstat(fileDescriptor, &fileStatus) != 0)
+  {
+    if(fileDescriptor >= 0)
+      close(fileDescriptor);
+    ezLog::Error("Failed to open checkpoint \"%s\".", szFilename);
+    return EZ_FAILURE;
+  }
+  m_mappingSize = fileStatus.st_size;
+  void* mapping = m_mappingSize > 0 ? mmap(NULL, m_mappingSize, PROT_READ, MAP_SHARED, fileDescriptor, 0) : MAP_FAILED;
+  close(fileDescriptor);
+  m_mapping = mapping != MAP_FAILED ? static_cast<const char*>(mapping) : NULL;
+#endif
+  if(!m_mapping)
+  {
+    ezLog::Error("Failed to map checkpoint \"%s\".", szFilename);
+    Close();
+    return EZ_FAILURE;
+  }
+
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(m_mapping);
+  if(m_mappingSize < SimulationCheckpoint::s_pageSize || !ezMemoryUtils::IsEqual(header->magic, s_magic, 4))
+  {
+    ezLog::Error("\"%s\" is not a simulation checkpoint.", szFilename);
+    Close();
+    return EZ_FAILURE;
+  }
+  if(header->version != SimulationCheckpoint::s_version)
+  {
+    ezLog::Error("Checkpoint \"%s\" has version %u, expected %u.", szFilename, header->version, SimulationCheckpoint::s_version);
+    Close();
+    return EZ_FAILURE;
+  }
+
+  m_info = header->info;
+  m_tileSize = header->tileSize;
+  m_tileStride = SimulationCheckpoint::GetTileStride(m_tileSize);
+  if(m_tileSize == 0 || m_info.gridResolution % m_tileSize != 0 ||
+     m_mappingSize < SimulationCheckpoint::s_pageSize + m_tileStride * GetNumTilesPerSide() * GetNumTilesPerSide())
+  {
+    ezLog::Error("Checkpoint \"%s\" is truncated or corrupt.", szFilename);
+    Close();
+    return EZ_FAILURE;
+  }
+
+  return EZ_SUCCESS;
+}
+
+void SimulationCheckpointReader::Close()
+{
+#if defined(_WIN32)
+  if(m_mapping)
+    UnmapViewOfFile(m_mapping);
+  if(m_mappingHandle)
+    CloseHandle(m_mappingHandle);
+  if(m_fileHandle)
+    CloseHandle(m_fileHandle);
+#else
+  if(m_mapping)
+    munmap(const_cast<char*>(m_mapping), m_mappingSize);
+#endif
+  m_fileHandle = NULL;
+  m_mappingHandle = NULL;
+  m_mapping = NULL;
+  m_mappingSize = 0;
+}
+
+const char* SimulationCheckpointReader::GetTile(ezUInt32 tileX, ezUInt32 tileY) const
+{
+  EZ_ASSERT(m_mapping && tileX < GetNumTilesPerSide() && tileY < GetNumTilesPerSide(), "Invalid checkpoint tile.");
+  return m_mapping + SimulationCheckpoint::s_pageSize + m_tileStride * (tileX + tileY * GetNumTilesPerSide());
+}
+
+const ezColor* SimulationCheckpointReader::GetTileTerrainData(ezUInt32 tileX, ezUInt32 tileY) const
+{
+  return reinterpret_cast<const ezColor*>(GetTile(tileX, tileY));
+}
+
+const ezColor* SimulationCheckpointReader::GetTileOutgoingFlow(ezUInt32 tileX, ezUInt32 tileY) const
+{
+  return reinterpret_cast<const ezColor*>(GetTile(tileX, tileY) + GetOutgoingFlowOffset(m_tileSize));
+}
+
+const ezVec2* SimulationCheckpointReader::GetTileFlowMap(ezUInt32 tileX, ezUInt32 tileY) const
+{
+  return reinterpret_cast<const ezVec2*>(GetTile(tileX, tileY) + GetFlowMapOffset(m_tileSize));
+}
+
+void SimulationCheckpointReader::PrefetchTile(ezUInt32 tileX, ezUInt32 tileY) const
+{
+  // Windows has no equivalent before 8 (PrefetchVirtualMemory), pages are simply loaded on first access there.
+#if !defined(_WIN32)
+  madvise(const_cast<char*>(GetTile(tileX, tileY)), m_tileStride, MADV_WILLNEED);
+#endif
+}
+
+void SimulationCheckpointReader::CopyState(ezColor* terrainData, ezColor* outgoingFlow, ezVec2* flowMap) const
+{
+  for(ezUInt32 tileY = 0; tileY < GetNumTilesPerSide(); ++tileY)
+  {
+    for(ezUInt32 tileX = 0; tileX < GetNumTilesPerSide(); ++tileX)
+    {
+      for(ezUInt32 y = 0; y < m_tileSize; ++y)
+      {
+        ezUInt32 targetIndex = tileX * m_tileSize + (tileY * m_tileSize + y) * m_info.gridResolution;
+        if(terrainData)
+          ezMemoryUtils::Copy(terrainData + targetIndex, GetTileTerrainData(tileX, tileY) + y * m_tileSize, m_tileSize);
+        if(outgoingFlow)
+          ezMemoryUtils::Copy(outgoingFlow + targetIndex, GetTileOutgoingFlow(tileX, tileY) + y * m_tileSize, m_tileSize);
+        if(flowMap)
+          ezMemoryUtils::Copy(flowMap + targetIndex, GetTileFlowMap(tileX, tileY) + y * m_tileSize, m_tileSize);
+      }
+    }
+  }
+}
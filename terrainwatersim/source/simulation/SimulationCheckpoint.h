@@ -0,0 +1,121 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+#include <atomic>
+#include <thread>
+
+/// Everything besides the grids that is needed to continue a simulation from a checkpoint.
+struct SimulationCheckpointInfo
+{
+  ezUInt32 gridResolution;
+  float gridWorldSize;
+  float heightScale;
+
+  float simulationStepLengthSeconds;
+  float flowDamping;
+  float flowAcceleration;
+  ezUInt32 simulationStepIndex;
+};
+
+/// Binary checkpoint format of the complete simulation state.
+///
+/// The file starts with a header that is padded to a full page, followed by square tiles in row major order. Every tile holds the
+/// terrain data (layout of the TerrainData texture), the outgoing flow and the flow map of its cells, each block in row major order.
+/// Tiles start at page boundaries, so that a memory mapped checkpoint can be read tile by tile and only the pages of tiles that are
+/// actually accessed are ever loaded from disk.
+namespace SimulationCheckpoint
+{
+  /// Incremented with every incompatible change of the file layout, older files are rejected.
+  static const ezUInt32 s_version = 1;
+  /// Alignment of header and tiles in the file.
+  static const ezUInt32 s_pageSize = 4096;
+
+  /// Edge length of the tiles a grid of the given resolution is stored in.
+  ezUInt32 GetTileSize(ezUInt32 gridResolution);
+  /// Size in bytes that a single tile occupies in the file, including padding.
+  ezUInt64 GetTileStride(ezUInt32 tileSize);
+}
+
+/// Writes checkpoints on a background thread.
+///
+/// The caller fills the state buffers in texture layout, which is usually a direct read back from the GPU, and starts the write. The
+/// conversion to tiles and all file IO happen on the writer thread, so the caller only has to wait if it wants to start the next
+/// checkpoint before the last one is done.
+class SimulationCheckpointWriter
+{
+public:
+  SimulationCheckpointWriter();
+  /// Waits for a running write to complete.
+  ~SimulationCheckpointWriter();
+
+  bool IsWriting() const { return m_isWriting; }
+  void WaitForCompletion();
+
+  /// Waits for the last write and resizes the state buffers for a new checkpoint.
+  void BeginCheckpoint(const SimulationCheckpointInfo& info);
+
+  // State buffers in the layout of the corresponding textures, valid after BeginCheckpoint.
+
+  ezColor* GetTerrainData() { return static_cast<ezArrayPtr<ezColor>>(m_terrainData).GetPtr(); }
+  ezColor* GetOutgoingFlow() { return static_cast<ezArrayPtr<ezColor>>(m_outgoingFlow).GetPtr(); }
+  ezVec2* GetFlowMap() { return static_cast<ezArrayPtr<ezVec2>>(m_flowMap).GetPtr(); }
+
+  /// Starts writing the filled state buffers. Errors and completion are reported to the log by the writer thread.
+  void WriteAsync(const char* szFilename);
+
+private:
+  void WriteCheckpoint();
+
+  SimulationCheckpointInfo m_info;
+  ezStringBuilder m_filename;
+  ezDynamicArray<ezColor> m_terrainData;
+  ezDynamicArray<ezColor> m_outgoingFlow;
+  ezDynamicArray<ezVec2> m_flowMap;
+
+  std::thread m_thread;
+  std::atomic<bool> m_isWriting;
+};
+
+/// Provides access to a checkpoint file via a read only memory mapping.
+///
+/// Opening only maps the file and validates the header, the state is read lazily. Tile accessors return pointers directly into the
+/// mapping, pages are loaded by the OS on first access. PrefetchTile lets the OS start loading a tile in the background while the
+/// previous one is processed.
+class SimulationCheckpointReader
+{
+public:
+  SimulationCheckpointReader();
+  ~SimulationCheckpointReader();
+
+  ezResult Open(const char* szFilename);
+  void Close();
+
+  const SimulationCheckpointInfo& GetInfo() const { return m_info; }
+  ezUInt32 GetTileSize() const { return m_tileSize; }
+  ezUInt32 GetNumTilesPerSide() const { return m_info.gridResolution / m_tileSize; }
+
+  // Data of a single tile in row major order, tileSize² entries each.
+
+  const ezColor* GetTileTerrainData(ezUInt32 tileX, ezUInt32 tileY) const;
+  const ezColor* GetTileOutgoingFlow(ezUInt32 tileX, ezUInt32 tileY) const;
+  const ezVec2* GetTileFlowMap(ezUInt32 tileX, ezUInt32 tileY) const;
+
+  /// Hints the OS to load the given tile in the background.
+  void PrefetchTile(ezUInt32 tileX, ezUInt32 tileY) const;
+
+  /// Copies the whole state in the layout of the corresponding textures. Each pointer may be NULL to skip it.
+  void CopyState(ezColor* terrainData, ezColor* outgoingFlow, ezVec2* flowMap) const;
+
+private:
+  const char* GetTile(ezUInt32 tileX, ezUInt32 tileY) const;
+
+  SimulationCheckpointInfo m_info;
+  ezUInt32 m_tileSize;
+  ezUInt64 m_tileStride;
+
+  void* m_fileHandle;
+  void* m_mappingHandle;
+  const char* m_mapping;
+  ezUInt64 m_mappingSize;
+};
@@ -0,0 +1,475 @@
+#include "PCH.h"
+#include "SimulationHistory.h"
+
+namespace
+{
+  /// Unary prefixes of this length are followed by the raw value instead of the remainder.
+  const ezUInt32 s_riceEscapeLength = 24;
+  /// Channel header that marks a channel without any non-zero residual.
+  const ezUInt32 s_allZeroChannel = 31;
+
+  /// Largest magnitude of a quantized value, so that residuals always fit into 32 bit.
+  const float s_maxQuantizedValue = static_cast<float>(1 << 29);
+
+  class BitWriter
+  {
+  public:
+    BitWriter(ezDynamicArray<ezUInt8>& data) : m_data(data), m_buffer(0), m_numBits(0) { m_data.Clear(); }
+
+    void Write(ezUInt32 value, ezUInt32 numBits)
+    {
+      if(numBits == 0)
+        return;
+      m_buffer |= static_cast<ezUInt64>(value & (0xFFFFFFFFu >> (32 - numBits))) << m_numBits;
+      m_numBits += numBits;
+      while(m_numBits >= 8)
+      {
+        m_data.PushBack(static_cast<ezUInt8>(m_buffer));
+        m_buffer >>= 8;
+        m_numBits -= 8;
+      }
+    }
+
+    void Flush()
+    {
+      if(m_numBits > 0)
+        m_data.PushBack(static_cast<ezUInt8>(m_buffer));
+      m_buffer = 0;
+      m_numBits = 0;
+    }
+
+  private:
+    ezDynamicArray<ezUInt8>& m_data;
+    ezUInt64 m_buffer;
+    ezUInt32 m_numBits;
+  };
+
+  class BitReader
+  {
+  public:
+    BitReader(const ezDynamicArray<ezUInt8>& data) : m_data(data), m_position(0), m_buffer(0), m_numBits(0) {}
+
+    ezUInt32 Read(ezUInt32 numBits)
+    {
+      if(numBits == 0)
+        return 0;
+      Refill(numBits);
+      ezUInt32 value = static_cast<ezUInt32>(m_buffer & (0xFFFFFFFFu >> (32 - numBits)));
+      m_buffer >>= numBits;
+      m_numBits -= numBits;
+      return value;
+    }
+
+    /// Counts ones up to the first zero, which is consumed as well. Stops after maxLength ones without consuming anything further.
+    ezUInt32 ReadUnary(ezUInt32 maxLength)
+    {
+      Refill(maxLength + 1);
+      ezUInt32 length = 0;
+      while(length < maxLength && (m_buffer >> length) & 1)
+        ++length;
+      ezUInt32 numConsumedBits = length < maxLength ? length + 1 : length;
+      m_buffer >>= numConsumedBits;
+      m_numBits -= numConsumedBits;
+      return length;
+    }
+
+  private:
+    void Refill(ezUInt32 numBits)
+    {
+      while(m_numBits < numBits)
+      {
+        ezUInt64 byte = m_position < m_data.GetCount() ? m_data[m_position] : 0;
+        m_buffer |= byte << m_numBits;
+        m_numBits += 8;
+        ++m_position;
+      }
+    }
+
+    const ezDynamicArray<ezUInt8>& m_data;
+    ezUInt32 m_position;
+    ezUInt64 m_buffer;
+    ezUInt32 m_numBits;
+  };
+
+  /// Maps small negative and positive residuals to small unsigned values: 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+  EZ_FORCE_INLINE ezUInt32 ZigZagEncode(ezInt32 value)
+  {
+    return (static_cast<ezUInt32>(value) << 1) ^ static_cast<ezUInt32>(value >> 31);
+  }
+
+  EZ_FORCE_INLINE ezInt32 ZigZagDecode(ezUInt32 value)
+  {
+    return static_cast<ezInt32>(value >> 1) ^ -static_cast<ezInt32>(value & 1);
+  }
+
+  /// Median edge detector of LOCO-I: picks left, upper or their gradient, depending on whether there is an edge.
+  EZ_FORCE_INLINE ezInt32 PredictFromNeighbours(const ezInt32* values, ezUInt32 x, ezUInt32 y, ezUInt32 size)
+  {
+    ezUInt32 i = x + y * size;
+    if(y == 0)
+      return x == 0 ? 0 : values[i - 1];
+    if(x == 0)
+      return values[i - size];
+
+    ezInt32 left = values[i - 1];
+    ezInt32 up = values[i - size];
+    ezInt32 upLeft = values[i - size - 1];
+    if(upLeft >= ezMath::Max(left, up))
+      return ezMath::Min(left, up);
+    if(upLeft <= ezMath::Min(left, up))
+      return ezMath::Max(left, up);
+    return left + up - upLeft;
+  }
+}
+
+SimulationHistory::SimulationHistory(ezUInt32 gridResolution, ezUInt64 memoryBudget) :
+  m_gridResolution(gridResolution),
+  m_tileSize(ComputeTileSize(gridResolution)),
+  m_memoryBudget(memoryBudget),
+  m_memoryUsage(0),
+  m_isEncoding(false)
+{
+  ezUInt32 numCells = gridResolution * gridResolution;
+  m_terrainDataStaging.SetCount(numCells);
+  m_outgoingFlowStaging.SetCount(numCells);
+  m_referenceValues.SetCount(numCells * NUM_CHANNELS);
+
+  // A millimeter of water is far below anything visible.
+  SetQuantization(1.0f / 1024.0f, 1.0f / 1024.0f);
+}
+
+SimulationHistory::~SimulationHistory()
+{
+  WaitForCompletion();
+}
+
+ezUInt32 SimulationHistory::ComputeTileSize(ezUInt32 gridResolution)
+{
+  const ezUInt32 tileSize = 64;
+  return gridResolution % tileSize == 0 ? tileSize : gridResolution;
+}
+
+void SimulationHistory::SetMemoryBudget(ezUInt64 memoryBudget)
+{
+  WaitForCompletion();
+  m_memoryBudget = memoryBudget;
+  EnforceMemoryBudget();
+}
+
+void SimulationHistory::SetQuantization(float heightStep, float flowStep)
+{
+  WaitForCompletion();
+  Clear();
+  m_quantizationSteps[CHANNEL_TERRAIN] = heightStep;
+  m_quantizationSteps[CHANNEL_WATER] = heightStep;
+  for(ezUInt32 channel = CHANNEL_FLOW_POS_X; channel < NUM_CHANNELS; ++channel)
+    m_quantizationSteps[channel] = flowStep;
+}
+
+void SimulationHistory::Clear()
+{
+  WaitForCompletion();
+  m_snapshots.Clear();
+  m_blocks.Clear();
+  m_freeBlocks.Clear();
+  m_memoryUsage = 0;
+}
+
+void SimulationHistory::WaitForCompletion()
+{
+  if(m_thread.joinable())
+    m_thread.join();
+}
+
+void SimulationHistory::AddSnapshotAsync(ezUInt32 simulationStepIndex)
+{
+  WaitForCompletion();
+
+  m_isEncoding = true;
+  m_thread = std::thread([this, simulationStepIndex]() { EncodeSnapshot(simulationStepIndex); m_isEncoding = false; });
+}
+
+ezUInt32 SimulationHistory::GetNumSnapshots()
+{
+  WaitForCompletion();
+  return m_snapshots.GetCount();
+}
+
+ezUInt32 SimulationHistory::GetSnapshotStepIndex(ezUInt32 snapshot)
+{
+  WaitForCompletion();
+  return m_snapshots[snapshot].simulationStepIndex;
+}
+
+ezUInt64 SimulationHistory::GetMemoryUsage()
+{
+  WaitForCompletion();
+  return m_memoryUsage;
+}
+
+void SimulationHistory::QuantizeTile(ezUInt32 tileX, ezUInt32 tileY, ezInt32* values) const
+{
+  float inverseSteps[NUM_CHANNELS];
+  for(ezUInt32 channel = 0; channel < NUM_CHANNELS; ++channel)
+    inverseSteps[channel] = 1.0f / m_quantizationSteps[channel];
+
+  ezUInt32 numCellsPerTile = m_tileSize * m_tileSize;
+  for(ezUInt32 y = 0; y < m_tileSize; ++y)
+  {
+    for(ezUInt32 x = 0; x < m_tileSize; ++x)
+    {
+      ezUInt32 texelIndex = tileX * m_tileSize + x + (tileY * m_tileSize + y) * m_gridResolution;
+      const ezColor& terrainData = m_terrainDataStaging[texelIndex];
+      const ezColor& outgoingFlow = m_outgoingFlowStaging[texelIndex];
+      float channelValues[NUM_CHANNELS] = { terrainData.r, terrainData.a, outgoingFlow.r, outgoingFlow.g, outgoingFlow.b, outgoingFlow.a };
+
+      for(ezUInt32 channel = 0; channel < NUM_CHANNELS; ++channel)
+      {
+        float quantized = ezMath::Clamp(channelValues[channel] * inverseSteps[channel], -s_maxQuantizedValue, s_maxQuantizedValue);
+        values[channel * numCellsPerTile + x + y * m_tileSize] = static_cast<ezInt32>(ezMath::Floor(quantized + 0.5f));
+      }
+    }
+  }
+}
+
+void SimulationHistory::EncodeBlock(const ezInt32* values, const ezInt32* baseValues, ezDynamicArray<ezUInt8>& data) const
+{
+  BitWriter writer(data);
+  ezUInt32 numCellsPerTile = m_tileSize * m_tileSize;
+  ezDynamicArray<ezUInt32> residuals;
+  residuals.SetCount(numCellsPerTile);
+
+  for(ezUInt32 channel = 0; channel < NUM_CHANNELS; ++channel)
+  {
+    const ezInt32* channelValues = values + channel * numCellsPerTile;
+    const ezInt32* channelBaseValues = baseValues ? baseValues + channel * numCellsPerTile : NULL;
+
+    ezUInt64 residualSum = 0;
+    for(ezUInt32 y = 0; y < m_tileSize; ++y)
+    {
+      for(ezUInt32 x = 0; x < m_tileSize; ++x)
+      {
+        ezUInt32 i = x + y * m_tileSize;
+        ezInt32 prediction = channelBaseValues ? channelBaseValues[i] : PredictFromNeighbours(channelValues, x, y, m_tileSize);
+        residuals[i] = ZigZagEncode(channelValues[i] - prediction);
+        residualSum += residuals[i];
+      }
+    }
+
+    if(residualSum == 0)
+    {
+      writer.Write(s_allZeroChannel, 5);
+      continue;
+    }
+
+    // Rice parameter close to log2(mean * ln 2), which is optimal for geometrically distributed residuals.
+    ezUInt64 scaledMean = residualSum * 2 / (3 * numCellsPerTile);
+    ezUInt32 riceParameter = 0;
+    while(riceParameter < 30 && (2ull << riceParameter) <= scaledMean)
+      ++riceParameter;
+    writer.Write(riceParameter, 5);
+
+    for(ezUInt32 i = 0; i < numCellsPerTile; ++i)
+    {
+      ezUInt32 quotient = residuals[i] >> riceParameter;
+      if(quotient < s_riceEscapeLength)
+      {
+        // Ones terminated by a zero, then the remainder.
+        writer.Write((1u << quotient) - 1, quotient + 1);
+        writer.Write(residuals[i], riceParameter);
+      }
+      else
+      {
+        writer.Write((1u << s_riceEscapeLength) - 1, s_riceEscapeLength);
+        writer.Write(residuals[i], 32);
+      }
+    }
+  }
+  writer.Flush();
+}
+
+void SimulationHistory::DecodeBlock(const ezDynamicArray<ezUInt8>& data, const ezInt32* baseValues, ezInt32* values) const
+{
+  BitReader reader(data);
+  ezUInt32 numCellsPerTile = m_tileSize * m_tileSize;
+
+  for(ezUInt32 channel = 0; channel < NUM_CHANNELS; ++channel)
+  {
+    ezInt32* channelValues = values + channel * numCellsPerTile;
+    const ezInt32* channelBaseValues = baseValues ? baseValues + channel * numCellsPerTile : NULL;
+
+    ezUInt32 riceParameter = reader.Read(5);
+    for(ezUInt32 y = 0; y < m_tileSize; ++y)
+    {
+      for(ezUInt32 x = 0; x < m_tileSize; ++x)
+      {
+        ezUInt32 residual = 0;
+        if(riceParameter != s_allZeroChannel)
+        {
+          ezUInt32 quotient = reader.ReadUnary(s_riceEscapeLength);
+          if(quotient < s_riceEscapeLength)
+            residual = (quotient << riceParameter) | reader.Read(riceParameter);
+          else
+            residual = reader.Read(32);
+        }
+
+        ezUInt32 i = x + y * m_tileSize;
+        ezInt32 prediction = channelBaseValues ? channelBaseValues[i] : PredictFromNeighbours(channelValues, x, y, m_tileSize);
+        channelValues[i] = prediction + ZigZagDecode(residual);
+      }
+    }
+  }
+}
+
+void SimulationHistory::DecodeBlockChain(ezUInt32 block, ezInt32* values) const
+{
+  ezUInt32 chain[s_maxDeltaChainLength + 1];
+  ezUInt32 chainLength = 0;
+  for(; block != s_noBlock; block = m_blocks[block].baseBlock)
+    chain[chainLength++] = block;
+
+  // Keyframe first, then every delta is applied in place.
+  DecodeBlock(m_blocks[chain[chainLength - 1]].data, NULL, values);
+  for(ezInt32 i = static_cast<ezInt32>(chainLength) - 2; i >= 0; --i)
+    DecodeBlock(m_blocks[chain[i]].data, values, values);
+}
+
+ezUInt32 SimulationHistory::AllocateBlock()
+{
+  ezUInt32 block;
+  if(m_freeBlocks.IsEmpty())
+  {
+    block = m_blocks.GetCount();
+    m_blocks.SetCount(block + 1);
+  }
+  else
+  {
+    block = m_freeBlocks.PeekBack();
+    m_freeBlocks.PopBack();
+  }
+
+  m_blocks[block].baseBlock = s_noBlock;
+  m_blocks[block].chainLength = 0;
+  m_blocks[block].numReferences = 1;
+  return block;
+}
+
+void SimulationHistory::ReleaseBlock(ezUInt32 block)
+{
+  while(block != s_noBlock && --m_blocks[block].numReferences == 0)
+  {
+    m_memoryUsage -= m_blocks[block].data.GetCount();
+    m_blocks[block].data.Clear();
+    m_freeBlocks.PushBack(block);
+    block = m_blocks[block].baseBlock;
+  }
+}
+
+void SimulationHistory::EncodeSnapshot(ezUInt32 simulationStepIndex)
+{
+  ezUInt32 numTiles = GetNumTilesPerSide() * GetNumTilesPerSide();
+  ezUInt32 numValuesPerTile = GetNumValuesPerTile();
+  bool hasPrevious = !m_snapshots.IsEmpty();
+
+  Snapshot snapshot;
+  snapshot.simulationStepIndex = simulationStepIndex;
+  snapshot.tileBlocks.SetCount(numTiles);
+
+  ezDynamicArray<ezInt32> values;
+  values.SetCount(numValuesPerTile);
+  ezInt32* tileValues = static_cast<ezArrayPtr<ezInt32>>(values).GetPtr();
+
+  for(ezUInt32 tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+  {
+    QuantizeTile(tileIndex % GetNumTilesPerSide(), tileIndex / GetNumTilesPerSide(), tileValues);
+    ezInt32* referenceValues = GetReferenceTile(tileIndex);
+    ezUInt32 previousBlock = hasPrevious ? m_snapshots.PeekBack().tileBlocks[tileIndex] : s_noBlock;
+
+    // Unchanged tiles share the block of the previous snapshot.
+    if(previousBlock != s_noBlock && ezMemoryUtils::IsEqual(tileValues, referenceValues, numValuesPerTile))
+    {
+      ++m_blocks[previousBlock].numReferences;
+      snapshot.tileBlocks[tileIndex] = previousBlock;
+      continue;
+    }
+
+    ezUInt32 block = AllocateBlock();
+    if(previousBlock != s_noBlock && m_blocks[previousBlock].chainLength < s_maxDeltaChainLength)
+    {
+      ++m_blocks[previousBlock].numReferences;
+      m_blocks[block].baseBlock = previousBlock;
+      m_blocks[block].chainLength = m_blocks[previousBlock].chainLength + 1;
+      EncodeBlock(tileValues, referenceValues, m_blocks[block].data);
+    }
+    else
+      EncodeBlock(tileValues, NULL, m_blocks[block].data);
+
+    m_memoryUsage += m_blocks[block].data.GetCount();
+    snapshot.tileBlocks[tileIndex] = block;
+    ezMemoryUtils::Copy(referenceValues, tileValues, numValuesPerTile);
+  }
+
+  m_snapshots.PushBack(snapshot);
+  EnforceMemoryBudget();
+}
+
+void SimulationHistory::RemoveOldestSnapshot()
+{
+  for(ezUInt32 tileIndex = 0; tileIndex < m_snapshots[0].tileBlocks.GetCount(); ++tileIndex)
+    ReleaseBlock(m_snapshots[0].tileBlocks[tileIndex]);
+  m_snapshots.RemoveAt(0);
+}
+
+void SimulationHistory::EnforceMemoryBudget()
+{
+  // The newest snapshot is kept in any case, later ones are encoded relative to it.
+  while(m_memoryUsage > m_memoryBudget && m_snapshots.GetCount() > 1)
+    RemoveOldestSnapshot();
+}
+
+void SimulationHistory::DecodeTile(ezUInt32 snapshot, ezUInt32 tileX, ezUInt32 tileY, ezColor* terrainData, ezColor* outgoingFlow)
+{
+  WaitForCompletion();
+
+  ezDynamicArray<ezInt32> values;
+  values.SetCount(GetNumValuesPerTile());
+  const ezInt32* tileValues = static_cast<ezArrayPtr<ezInt32>>(values).GetPtr();
+  DecodeBlockChain(m_snapshots[snapshot].tileBlocks[tileX + tileY * GetNumTilesPerSide()], static_cast<ezArrayPtr<ezInt32>>(values).GetPtr());
+
+  ezUInt32 numCellsPerTile = m_tileSize * m_tileSize;
+  for(ezUInt32 i = 0; i < numCellsPerTile; ++i)
+  {
+    float channelValues[NUM_CHANNELS];
+    for(ezUInt32 channel = 0; channel < NUM_CHANNELS; ++channel)
+      channelValues[channel] = tileValues[channel * numCellsPerTile + i] * m_quantizationSteps[channel];
+
+    if(terrainData)
+    {
+      terrainData[i].r = channelValues[CHANNEL_TERRAIN];
+      terrainData[i].a = channelValues[CHANNEL_WATER];
+    }
+    if(outgoingFlow)
+    {
+      outgoingFlow[i] = ezColor(channelValues[CHANNEL_FLOW_POS_X], channelValues[CHANNEL_FLOW_NEG_X], channelValues[CHANNEL_FLOW_POS_Y],
+                                channelValues[CHANNEL_FLOW_NEG_Y]);
+    }
+  }
+}
+
+void SimulationHistory::DiscardSnapshotsAfter(ezUInt32 snapshot)
+{
+  WaitForCompletion();
+
+  while(m_snapshots.GetCount() > snapshot + 1)
+  {
+    const Snapshot& newest = m_snapshots.PeekBack();
+    for(ezUInt32 tileIndex = 0; tileIndex < newest.tileBlocks.GetCount(); ++tileIndex)
+      ReleaseBlock(newest.tileBlocks[tileIndex]);
+    m_snapshots.PopBack();
+  }
+
+  // The next snapshot is a delta to this one.
+  ezUInt32 numTiles = GetNumTilesPerSide() * GetNumTilesPerSide();
+  for(ezUInt32 tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+    DecodeBlockChain(m_snapshots[snapshot].tileBlocks[tileIndex], GetReferenceTile(tileIndex));
+}
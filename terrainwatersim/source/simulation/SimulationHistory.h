@@ -0,0 +1,145 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+#include <atomic>
+#include <thread>
+
+/// Compressed ring buffer of past simulation states for rewinding.
+///
+/// Snapshots hold terrain height, water height and outgoing flow. Every channel is quantized to a fixed step and stored per tile.
+/// A tile is either a keyframe, whose values are predicted from their left and upper neighbours, or a delta to the same tile of the
+/// previous snapshot. Prediction residuals are Rice coded with a parameter chosen per tile and channel. Tiles that didn't change since
+/// the previous snapshot share its block instead of storing an empty delta, so dry or settled regions cost next to nothing.
+///
+/// Delta chains are limited to s_maxDeltaChainLength, so restoring a tile decodes at most that many blocks and never touches other
+/// tiles. Once the encoded blocks exceed the memory budget, the oldest snapshots are dropped. Their blocks are freed as soon as no
+/// younger delta refers to them anymore.
+///
+/// Encoding runs on a background thread, like SimulationCheckpointWriter: the caller fills the staging buffers, usually a read back from
+/// the GPU, and starts the encoder. All other functions wait for a running encode to complete.
+class SimulationHistory
+{
+public:
+  /// \param memoryBudget   Maximum number of bytes of encoded blocks. The staging and reference buffers of the encoder come on top.
+  SimulationHistory(ezUInt32 gridResolution, ezUInt64 memoryBudget);
+  /// Waits for a running encode to complete.
+  ~SimulationHistory();
+
+  ezUInt32 GetGridResolution() const { return m_gridResolution; }
+  ezUInt32 GetTileSize() const { return m_tileSize; }
+  ezUInt32 GetNumTilesPerSide() const { return m_gridResolution / m_tileSize; }
+
+  /// Drops snapshots until the encoded blocks fit into the new budget.
+  void SetMemoryBudget(ezUInt64 memoryBudget);
+  ezUInt64 GetMemoryBudget() const { return m_memoryBudget; }
+
+  /// Sets the quantization steps of heights (terrain and water) and outgoing flow. Clears the history.
+  void SetQuantization(float heightStep, float flowStep);
+
+  /// Removes all snapshots.
+  void Clear();
+
+  // Recording
+
+  bool IsEncoding() const { return m_isEncoding; }
+  void WaitForCompletion();
+
+  /// Staging buffers in the layout of the corresponding textures. Only terrain height (.r) and water height (.a) of the terrain data are
+  /// stored. May not be written while IsEncoding.
+  ezColor* GetTerrainDataStaging() { return static_cast<ezArrayPtr<ezColor>>(m_terrainDataStaging).GetPtr(); }
+  ezColor* GetOutgoingFlowStaging() { return static_cast<ezArrayPtr<ezColor>>(m_outgoingFlowStaging).GetPtr(); }
+
+  /// Starts encoding the staging buffers as a new snapshot after all existing ones.
+  void AddSnapshotAsync(ezUInt32 simulationStepIndex);
+
+  // Access
+
+  /// Snapshots are ordered from oldest (0) to newest.
+  ezUInt32 GetNumSnapshots();
+  ezUInt32 GetSnapshotStepIndex(ezUInt32 snapshot);
+  /// Bytes of all encoded blocks.
+  ezUInt64 GetMemoryUsage();
+
+  /// Decodes terrain height to .r, water height to .a and outgoing flow of a single tile. Other channels are left untouched.
+  /// Only the blocks of this tile are decoded. Either pointer may be NULL.
+  void DecodeTile(ezUInt32 snapshot, ezUInt32 tileX, ezUInt32 tileY, ezColor* terrainData, ezColor* outgoingFlow);
+
+  /// Removes all snapshots younger than the given one. The next snapshot is encoded relative to it, so recording can continue after a
+  /// simulation was reset to it.
+  void DiscardSnapshotsAfter(ezUInt32 snapshot);
+
+  /// Edge length of the tiles, all tiles of a square grid are either 64 cells or the whole grid.
+  static ezUInt32 ComputeTileSize(ezUInt32 gridResolution);
+
+private:
+  enum Channel
+  {
+    CHANNEL_TERRAIN,
+    CHANNEL_WATER,
+    CHANNEL_FLOW_POS_X,
+    CHANNEL_FLOW_NEG_X,
+    CHANNEL_FLOW_POS_Y,
+    CHANNEL_FLOW_NEG_Y,
+
+    NUM_CHANNELS
+  };
+
+  static const ezUInt32 s_noBlock = 0xFFFFFFFF;
+  /// Number of deltas after which a tile gets a new keyframe.
+  static const ezUInt32 s_maxDeltaChainLength = 7;
+
+  struct Block
+  {
+    ezDynamicArray<ezUInt8> data;
+    /// Block this one is a delta to, s_noBlock for keyframes.
+    ezUInt32 baseBlock;
+    /// Number of deltas up to the next keyframe, 0 for keyframes.
+    ezUInt32 chainLength;
+    /// Number of snapshots and deltas that use this block.
+    ezUInt32 numReferences;
+  };
+
+  struct Snapshot
+  {
+    ezUInt32 simulationStepIndex;
+    /// Block per tile.
+    ezDynamicArray<ezUInt32> tileBlocks;
+  };
+
+  void EncodeSnapshot(ezUInt32 simulationStepIndex);
+  /// Quantizes a tile from the staging buffers to tileSize² values per channel.
+  void QuantizeTile(ezUInt32 tileX, ezUInt32 tileY, ezInt32* values) const;
+  void EncodeBlock(const ezInt32* values, const ezInt32* baseValues, ezDynamicArray<ezUInt8>& data) const;
+  void DecodeBlock(const ezDynamicArray<ezUInt8>& data, const ezInt32* baseValues, ezInt32* values) const;
+  /// Decodes a block including all blocks it depends on.
+  void DecodeBlockChain(ezUInt32 block, ezInt32* values) const;
+
+  ezUInt32 AllocateBlock();
+  void ReleaseBlock(ezUInt32 block);
+  void RemoveOldestSnapshot();
+  void EnforceMemoryBudget();
+
+  ezInt32* GetReferenceTile(ezUInt32 tileIndex) { return static_cast<ezArrayPtr<ezInt32>>(m_referenceValues).GetPtr() + tileIndex * GetNumValuesPerTile(); }
+  ezUInt32 GetNumValuesPerTile() const { return NUM_CHANNELS * m_tileSize * m_tileSize; }
+
+  const ezUInt32 m_gridResolution;
+  const ezUInt32 m_tileSize;
+  ezUInt64 m_memoryBudget;
+  float m_quantizationSteps[NUM_CHANNELS];
+
+  ezDynamicArray<Snapshot> m_snapshots;
+  ezDynamicArray<Block> m_blocks;
+  ezDynamicArray<ezUInt32> m_freeBlocks;
+  ezUInt64 m_memoryUsage;
+
+  // Encoder
+
+  ezDynamicArray<ezColor> m_terrainDataStaging;
+  ezDynamicArray<ezColor> m_outgoingFlowStaging;
+  /// Quantized values of the newest snapshot, which the next one is encoded relative to.
+  ezDynamicArray<ezInt32> m_referenceValues;
+
+  std::thread m_thread;
+  std::atomic<bool> m_isEncoding;
+};
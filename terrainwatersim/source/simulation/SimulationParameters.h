@@ -0,0 +1,26 @@
+#pragma once
+
+/// CPU side mirror of the SimulationParameters uniform block in simulationCommon.glsl.
+///
+/// Used to fill the UBO for the compute shaders and directly by the CPU solvers, so both always agree on the time scaled values.
+struct SimulationParameters
+{
+  /// pow(friction, TimeStep)
+  float flowFriction_perStep;
+
+  /// TimeStep * FlowAcceleration * CellDistance
+  float waterAcceleration_perStep;
+
+  /// TimeStep / CellDistance²
+  float cellAreaInv_timeScaled;
+
+  /// Derives all time scaled values from the user facing simulation settings.
+  static SimulationParameters Compute(ezTime stepLength, float flowDamping, float flowAcceleration, float cellDistance)
+  {
+    SimulationParameters parameters;
+    parameters.flowFriction_perStep = ezMath::Pow(flowDamping, static_cast<float>(stepLength.GetSeconds()));
+    parameters.waterAcceleration_perStep = static_cast<float>(stepLength.GetSeconds() * flowAcceleration * cellDistance);
+    parameters.cellAreaInv_timeScaled = static_cast<float>(stepLength.GetSeconds() / (cellDistance * cellDistance));
+    return parameters;
+  }
+};
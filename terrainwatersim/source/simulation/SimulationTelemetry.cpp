@@ -0,0 +1,125 @@
+#include "PCH.h"
+#include "SimulationTelemetry.h"
+
+SimulationTelemetry::SimulationTelemetry(ezUInt32 maxNumSamples) :
+  m_firstSample(0),
+  m_numSamples(0),
+  m_logOpen(false),
+  m_jsonLog(false),
+  m_firstLogEntry(true)
+{
+  m_samples.SetCount(ezMath::Max(maxNumSamples, 1u));
+}
+
+SimulationTelemetry::~SimulationTelemetry()
+{
+  CloseLog();
+}
+
+void SimulationTelemetry::AddSample(const Sample& sample)
+{
+  if(m_numSamples < m_samples.GetCount())
+    ++m_numSamples;
+  else
+    m_firstSample = (m_firstSample + 1) % m_samples.GetCount();
+  m_samples[(m_firstSample + m_numSamples - 1) % m_samples.GetCount()] = sample;
+
+  if(m_logOpen)
+    AppendLogEntry(sample);
+}
+
+void SimulationTelemetry::Clear()
+{
+  m_firstSample = 0;
+  m_numSamples = 0;
+}
+
+ezResult SimulationTelemetry::ComputeVolumeDrift(double& relativeDrift, ezUInt32& numSteps) const
+{
+  // Search backwards, brushes add or remove water on purpose.
+  const Sample* newest = NULL;
+  const Sample* oldest = NULL;
+  for(ezUInt32 i = m_numSamples; i > 0; --i)
+  {
+    const Sample& sample = GetSample(i - 1);
+    if(sample.complete)
+    {
+      if(newest == NULL)
+        newest = &sample;
+      oldest = &sample;
+    }
+    if(sample.brushApplied)
+      break;
+  }
+
+  if(newest == oldest || oldest->totalWaterVolume <= 0.0)
+    return EZ_FAILURE;
+
+  relativeDrift = (newest->totalWaterVolume - oldest->totalWaterVolume) / oldest->totalWaterVolume;
+  numSteps = newest->simulationStepIndex - oldest->simulationStepIndex;
+  return EZ_SUCCESS;
+}
+
+ezResult SimulationTelemetry::OpenLog(const char* szFilename)
+{
+  CloseLog();
+  if(m_logFile.Open(szFilename, ezFileMode::Write) == EZ_FAILURE)
+  {
+    ezLog::Error("Failed to open telemetry log \"%s\".", szFilename);
+    return EZ_FAILURE;
+  }
+
+  m_logOpen = true;
+  m_jsonLog = ezStringUtils::EndsWith_NoCase(szFilename, ".json");
+  m_firstLogEntry = true;
+  m_pendingLog.Clear();
+  if(m_jsonLog)
+    m_pendingLog.Append("[\n");
+  else
+    m_pendingLog.Append("step,complete,brush,totalWaterVolume,maxDepth,maxOutgoingFlow,clampedCells\n");
+  FlushLog();
+  return EZ_SUCCESS;
+}
+
+void SimulationTelemetry::CloseLog()
+{
+  if(!m_logOpen)
+    return;
+
+  if(m_jsonLog)
+    m_pendingLog.Append(m_firstLogEntry ? "]\n" : "\n]\n");
+  FlushLog();
+  m_logFile.Close();
+  m_logOpen = false;
+}
+
+void SimulationTelemetry::FlushLog()
+{
+  if(!m_logOpen || m_pendingLog.IsEmpty())
+    return;
+
+  m_logFile.Write(m_pendingLog.GetData(), m_pendingLog.GetElementCount());
+  m_pendingLog.Clear();
+}
+
+void SimulationTelemetry::AppendLogEntry(const Sample& sample)
+{
+  // Incomplete samples have no valid total, it is left empty.
+  ezStringBuilder totalWaterVolume;
+  if(sample.complete)
+    totalWaterVolume.Format("%.6f", sample.totalWaterVolume);
+
+  if(m_jsonLog)
+  {
+    m_pendingLog.AppendFormat("%s  { \"step\": %u, \"complete\": %s, \"brush\": %s, \"totalWaterVolume\": %s, \"maxDepth\": %.6g, "
+                              "\"maxOutgoingFlow\": %.6g, \"clampedCells\": %u }", m_firstLogEntry ? "" : ",\n", sample.simulationStepIndex,
+                              sample.complete ? "true" : "false", sample.brushApplied ? "true" : "false",
+                              sample.complete ? totalWaterVolume.GetData() : "null", sample.maxDepth, sample.maxOutgoingFlow, sample.numClampedCells);
+  }
+  else
+  {
+    m_pendingLog.AppendFormat("%u,%u,%u,%s,%.6g,%.6g,%u\n", sample.simulationStepIndex, sample.complete ? 1 : 0, sample.brushApplied ? 1 : 0,
+                              totalWaterVolume.GetData(), sample.maxDepth, sample.maxOutgoingFlow, sample.numClampedCells);
+  }
+  m_firstLogEntry = false;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+#include <Foundation/IO/OSFile.h>
+
+/// Time series of per step conservation and stability measures of the water simulation, see StepTelemetry in simulationCommon.glsl.
+///
+/// The newest samples are kept in a ring for the stats display. Optionally, every sample is also appended to a log file, which is CSV
+/// unless its name ends with .json.
+class SimulationTelemetry
+{
+public:
+  struct Sample
+  {
+    ezUInt32 simulationStepIndex;
+    /// Whether all tiles were simulated in this step. Tiles that were skipped by the multi-rate simulation are missing in the total
+    /// water volume, it is only valid for complete samples.
+    bool complete;
+    /// Brush stamps changed the amount of water right before this step.
+    bool brushApplied;
+
+    /// In m³.
+    double totalWaterVolume;
+    /// In m.
+    float maxDepth;
+    /// Largest flow out of a single cell in a single direction, in m³/s.
+    float maxOutgoingFlow;
+    /// Wet cells whose outgoing flow had to be scaled down, since it would have taken more water than there was.
+    ezUInt32 numClampedCells;
+  };
+
+  SimulationTelemetry(ezUInt32 maxNumSamples);
+  /// Closes the log.
+  ~SimulationTelemetry();
+
+  /// Samples need to be added in the order of their steps.
+  void AddSample(const Sample& sample);
+  /// Removes all samples, needed whenever the simulation state was replaced. The log continues.
+  void Clear();
+
+  ezUInt32 GetNumSamples() const { return m_numSamples; }
+  /// Sample 0 is the oldest one.
+  const Sample& GetSample(ezUInt32 index) const { return m_samples[(m_firstSample + index) % m_samples.GetCount()]; }
+
+  /// Relative change of the total water volume from the oldest to the newest complete sample, ignoring everything up to the last brush
+  /// stamp. Fails if there are not two such samples.
+  ezResult ComputeVolumeDrift(double& relativeDrift, ezUInt32& numSteps) const;
+
+  // Log
+
+  /// Closes the current log and starts writing all further samples to the given file.
+  ezResult OpenLog(const char* szFilename);
+  void CloseLog();
+  bool IsLogOpen() const { return m_logOpen; }
+  /// Samples are collected and only written to the file here, usually once per frame.
+  void FlushLog();
+
+private:
+  void AppendLogEntry(const Sample& sample);
+
+  ezDynamicArray<Sample> m_samples;
+  ezUInt32 m_firstSample;
+  ezUInt32 m_numSamples;
+
+  ezOSFile m_logFile;
+  bool m_logOpen;
+  bool m_jsonLog;
+  bool m_firstLogEntry;
+  ezStringBuilder m_pendingLog;
+};
@@ -0,0 +1,59 @@
+#include "PCH.h"
+#include "TerrainGenerator.h"
+
+#include "math/NoiseGenerator.h"
+
+namespace TerrainGenerator
+{
+  static void CreateHeightmapTexel(ezColor& texel, NoiseGenerator& noiseGen, float x, float y, float heightScale)
+  {
+    texel.r = (noiseGen.GetValueNoise(ezVec3(x, y, 0.0f), 2, 10, 0.43f, true, NULL) * 0.5f + 0.5f) * heightScale;
+    texel.g = 0.3f;
+    texel.b = 0.3f;
+    texel.a = std::max(0.0f, (0.45f - pow(ezVec2(x - 0.5f, y - 0.5f).GetLengthSquared(), 2.0f)*800.0f) *heightScale - texel.r);
+  }
+
+  void CreateHeightmapFromNoise(ezColor* terrainData, ezUInt32 gridResolution, float heightScale)
+  {
+    NoiseGenerator noiseGen;
+    float mulitplier = 1.0f / static_cast<float>(gridResolution - 1);
+
+#pragma omp parallel for // OpenMP parallel for loop.
+    for(ezInt32 y = 0; y < static_cast<ezInt32>(gridResolution); ++y) // Needs to be signed for OpenMP.
+    {
+      for(ezUInt32 x = 0; x < gridResolution; ++x)
+        CreateHeightmapTexel(terrainData[x + y * gridResolution], noiseGen, mulitplier*x, mulitplier*y, heightScale);
+    }
+  }
+
+  void CreateHeightmapSectionFromNoise(ezColor* terrainData, ezUInt32 gridResolution, float heightScale, ezUInt32 sectionX, ezUInt32 sectionY,
+                                       ezUInt32 sectionResolution)
+  {
+    NoiseGenerator noiseGen;
+    // Same sample positions as CreateHeightmapFromNoise.
+    float mulitplier = 1.0f / static_cast<float>(gridResolution - 1);
+
+#pragma omp parallel for
+    for(ezInt32 y = 0; y < static_cast<ezInt32>(sectionResolution); ++y)
+    {
+      for(ezUInt32 x = 0; x < sectionResolution; ++x)
+      {
+        CreateHeightmapTexel(terrainData[x + y * sectionResolution], noiseGen, mulitplier*(sectionX + x), mulitplier*(sectionY + y),
+                             heightScale);
+      }
+    }
+  }
+
+  void CreateHeightmapRegionFromNoise(ezColor* terrainData, ezUInt32 gridResolution, float heightScale, const ezVec2& regionMin, float regionSize)
+  {
+    NoiseGenerator noiseGen;
+    float cellSize = regionSize / static_cast<float>(gridResolution);
+
+#pragma omp parallel for
+    for(ezInt32 y = 0; y < static_cast<ezInt32>(gridResolution); ++y)
+    {
+      for(ezUInt32 x = 0; x < gridResolution; ++x)
+        CreateHeightmapTexel(terrainData[x + y * gridResolution], noiseGen, regionMin.x + (x + 0.5f) * cellSize, regionMin.y + (y + 0.5f) * cellSize, heightScale);
+    }
+  }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+/// Initial simulation states that don't need any graphics resources.
+namespace TerrainGenerator
+{
+  /// Fills terrain data in the RGBA32F layout of the terrain data texture: Terrain height from value noise in .r and a radial lake in the
+  /// center in .a. Uses Random, so call Random::Init beforehand for reproducible results.
+  void CreateHeightmapFromNoise(ezColor* terrainData, ezUInt32 gridResolution, float heightScale);
+
+  /// Cells [sectionX, sectionX + sectionResolution) x [sectionY, sectionY + sectionResolution) of the heightmap that
+  /// CreateHeightmapFromNoise creates for gridResolution, bitwise identical. Lets the processes of a distributed run create only their
+  /// own sub-domain.
+  void CreateHeightmapSectionFromNoise(ezColor* terrainData, ezUInt32 gridResolution, float heightScale, ezUInt32 sectionX, ezUInt32 sectionY,
+                                       ezUInt32 sectionResolution);
+
+  /// Like CreateHeightmapFromNoise, but covers only the square region [regionMin, regionMin + regionSize] of the heightmap in [0,1]
+  /// coordinates with gridResolution² cells. Samples are taken at cell centers, so regions of nested grids line up with each other.
+  void CreateHeightmapRegionFromNoise(ezColor* terrainData, ezUInt32 gridResolution, float heightScale, const ezVec2& regionMin, float regionSize);
+}
@@ -0,0 +1,373 @@
+#include "PCH.h"
+#include "TileCache.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  const char s_magic[4] = { 'T', 'W', 'T', 'C' };
+  const ezUInt32 s_version = 1;
+  /// Header size and tile alignment in the file.
+  const ezUInt64 s_pageSize = 4096;
+  const intptr_t s_invalidFile = -1;
+
+  struct FileHeader
+  {
+    char magic[4];
+    ezUInt32 version;
+    ezUInt32 numTiles;
+    ezUInt32 numFloatsPerTile;
+  };
+
+  bool ReadAt(intptr_t file, ezUInt64 offset, void* data, ezUInt64 numBytes)
+  {
+#if defined(_WIN32)
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD numBytesRead = 0;
+    return ReadFile(reinterpret_cast<HANDLE>(file), data, static_cast<DWORD>(numBytes), &numBytesRead, &overlapped) && numBytesRead == numBytes;
+#else
+    return pread(static_cast<int>(file), data, numBytes, offset) == static_cast<ssize_t>(numBytes);
+#endif
+  }
+
+  bool WriteAt(intptr_t file, ezUInt64 offset, const void* data, ezUInt64 numBytes)
+  {
+#if defined(_WIN32)
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD numBytesWritten = 0;
+    return WriteFile(reinterpret_cast<HANDLE>(file), data, static_cast<DWORD>(numBytes), &numBytesWritten, &overlapped) && numBytesWritten == numBytes;
+#else
+    return pwrite(static_cast<int>(file), data, numBytes, offset) == static_cast<ssize_t>(numBytes);
+#endif
+  }
+}
+
+TileCache::TileCache(ezUInt64 memoryBudget) :
+  m_memoryBudget(memoryBudget),
+  m_numFloatsPerTile(0),
+  m_tileStride(0),
+  m_maxResidentTiles(0),
+  m_file(s_invalidFile),
+  m_useCounter(0),
+  m_stopLoader(false)
+{
+  ezMemoryUtils::ZeroFill(&m_stats, 1);
+}
+
+TileCache::~TileCache()
+{
+  Close();
+}
+
+ezResult TileCache::Create(const char* szFilename, ezUInt32 numTiles, ezUInt32 numFloatsPerTile)
+{
+  Close();
+  m_numFloatsPerTile = numFloatsPerTile;
+  m_entries.SetCount(numTiles);
+  return OpenFile(szFilename, true);
+}
+
+ezResult TileCache::Open(const char* szFilename, ezUInt32 numTiles, ezUInt32 numFloatsPerTile)
+{
+  Close();
+  m_numFloatsPerTile = numFloatsPerTile;
+  m_entries.SetCount(numTiles);
+  return OpenFile(szFilename, false);
+}
+
+ezResult TileCache::OpenFile(const char* szFilename, bool create)
+{
+  m_tileStride = (sizeof(float) * m_numFloatsPerTile + s_pageSize - 1) / s_pageSize * s_pageSize;
+  m_maxResidentTiles = static_cast<ezUInt32>(ezMath::Clamp<ezUInt64>(m_memoryBudget / m_tileStride, 1, m_entries.GetCount()));
+  ezUInt64 fileSize = s_pageSize + m_tileStride * m_entries.GetCount();
+
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(szFilename, GENERIC_READ | GENERIC_WRITE, 0, NULL, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  m_file = reinterpret_cast<intptr_t>(file);
+  if(m_file != s_invalidFile && create)
+  {
+    LARGE_INTEGER size;
+    size.QuadPart = fileSize;
+    if(!SetFilePointerEx(file, size, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+    {
+      CloseHandle(file);
+      m_file = s_invalidFile;
+    }
+  }
+#else
+  m_file = open(szFilename, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+  if(m_file != s_invalidFile && create && ftruncate(static_cast<int>(m_file), fileSize) != 0)
+  {
+    close(static_cast<int>(m_file));
+    m_file = s_invalidFile;
+  }
+#endif
+  if(m_file == s_invalidFile)
+  {
+    ezLog::Error("Failed to %s tile file \"%s\".", create ? "create" : "open", szFilename);
+    return EZ_FAILURE;
+  }
+
+  FileHeader header;
+  if(create)
+  {
+    ezMemoryUtils::Copy(header.magic, s_magic, 4);
+    header.version = s_version;
+    header.numTiles = m_entries.GetCount();
+    header.numFloatsPerTile = m_numFloatsPerTile;
+    WriteAt(m_file, 0, &header, sizeof(header));
+  }
+  else if(!ReadAt(m_file, 0, &header, sizeof(header)) || !ezMemoryUtils::IsEqual(header.magic, s_magic, 4) || header.version != s_version ||
+          header.numTiles != m_entries.GetCount() || header.numFloatsPerTile != m_numFloatsPerTile)
+  {
+    ezLog::Error("Tile file \"%s\" is invalid or was created for a different grid.", szFilename);
+    Close();
+    return EZ_FAILURE;
+  }
+
+  for(ezUInt32 i = 0; i < m_entries.GetCount(); ++i)
+  {
+    m_entries[i].data = NULL;
+    m_entries[i].lastUse = 0;
+    m_entries[i].numAcquires = 0;
+    m_entries[i].state = TileState::NOT_RESIDENT;
+    m_entries[i].modified = false;
+    m_entries[i].isProtected = false;
+  }
+
+  m_stopLoader = false;
+  m_loaderThread = std::thread([this]() { RunLoader(); });
+  return EZ_SUCCESS;
+}
+
+void TileCache::Close()
+{
+  if(m_loaderThread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopLoader = true;
+      m_prefetchQueue.Clear();
+    }
+    m_loaderWakeUp.notify_all();
+    m_loaderThread.join();
+  }
+
+  if(m_file != s_invalidFile)
+  {
+    Flush();
+#if defined(_WIN32)
+    CloseHandle(reinterpret_cast<HANDLE>(m_file));
+#else
+    close(static_cast<int>(m_file));
+#endif
+    m_file = s_invalidFile;
+  }
+
+  for(ezUInt32 i = 0; i < m_residentTiles.GetCount(); ++i)
+    m_freeBuffers.PushBack(m_entries[m_residentTiles[i]].data);
+  for(ezUInt32 i = 0; i < m_freeBuffers.GetCount(); ++i)
+    EZ_DEFAULT_DELETE_RAW_BUFFER(m_freeBuffers[i]);
+  m_freeBuffers.Clear();
+  m_residentTiles.Clear();
+  m_entries.Clear();
+}
+
+void TileCache::ReadTile(ezUInt32 tileIndex, float* data)
+{
+  if(!ReadAt(m_file, s_pageSize + m_tileStride * tileIndex, data, sizeof(float) * m_numFloatsPerTile))
+  {
+    ezLog::Error("Failed to read tile %u.", tileIndex);
+    ezMemoryUtils::ZeroFill(data, m_numFloatsPerTile);
+  }
+}
+
+void TileCache::WriteTile(ezUInt32 tileIndex, const float* data)
+{
+  if(!WriteAt(m_file, s_pageSize + m_tileStride * tileIndex, data, sizeof(float) * m_numFloatsPerTile))
+    ezLog::Error("Failed to write tile %u.", tileIndex);
+}
+
+float* TileCache::AllocateTileBuffer(bool allowOverBudget)
+{
+  if(m_residentTiles.GetCount() >= m_maxResidentTiles)
+  {
+    // Least recently used tile that is not acquired, protected tiles only if there is nothing else.
+    ezUInt32 evictSlot = m_residentTiles.GetCount();
+    for(ezUInt32 slot = 0; slot < m_residentTiles.GetCount(); ++slot)
+    {
+      const TileEntry& candidate = m_entries[m_residentTiles[slot]];
+      if(candidate.numAcquires > 0)
+        continue;
+      if(evictSlot == m_residentTiles.GetCount())
+      {
+        evictSlot = slot;
+        continue;
+      }
+      const TileEntry& best = m_entries[m_residentTiles[evictSlot]];
+      if(best.isProtected != candidate.isProtected ? best.isProtected : candidate.lastUse < best.lastUse)
+        evictSlot = slot;
+    }
+
+    if(evictSlot < m_residentTiles.GetCount())
+    {
+      ezUInt32 tileIndex = m_residentTiles[evictSlot];
+      TileEntry& entry = m_entries[tileIndex];
+      if(entry.modified)
+      {
+        WriteTile(tileIndex, entry.data);
+        m_stats.bytesWritten += sizeof(float) * m_numFloatsPerTile;
+      }
+      float* data = entry.data;
+      entry.data = NULL;
+      entry.state = TileState::NOT_RESIDENT;
+      entry.modified = false;
+      m_residentTiles.RemoveAtSwap(evictSlot);
+      ++m_stats.numEvictions;
+      return data;
+    }
+    if(!allowOverBudget)
+      return NULL;
+  }
+
+  if(!m_freeBuffers.IsEmpty())
+  {
+    float* data = m_freeBuffers.PeekBack();
+    m_freeBuffers.PopBack();
+    return data;
+  }
+  return EZ_DEFAULT_NEW_RAW_BUFFER(float, m_numFloatsPerTile);
+}
+
+void TileCache::MakeResident(ezUInt32 tileIndex)
+{
+  m_entries[tileIndex].state = TileState::RESIDENT;
+  m_entries[tileIndex].lastUse = ++m_useCounter;
+  m_residentTiles.PushBack(tileIndex);
+  m_stats.maxResidentTiles = ezMath::Max(m_stats.maxResidentTiles, m_residentTiles.GetCount());
+  m_stats.bytesRead += sizeof(float) * m_numFloatsPerTile;
+  m_tileLoaded.notify_all();
+}
+
+float* TileCache::AcquireTile(ezUInt32 tileIndex)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  TileEntry& entry = m_entries[tileIndex];
+  while(entry.state == TileState::LOADING)
+    m_tileLoaded.wait(lock);
+
+  if(entry.state == TileState::RESIDENT)
+    ++m_stats.numHits;
+  else
+  {
+    ++m_stats.numMisses;
+    entry.data = AllocateTileBuffer(true);
+    entry.state = TileState::LOADING;
+
+    lock.unlock();
+    ReadTile(tileIndex, entry.data);
+    lock.lock();
+
+    MakeResident(tileIndex);
+  }
+
+  ++entry.numAcquires;
+  entry.lastUse = ++m_useCounter;
+  return entry.data;
+}
+
+void TileCache::ReleaseTile(ezUInt32 tileIndex, bool modified)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  TileEntry& entry = m_entries[tileIndex];
+  EZ_ASSERT(entry.numAcquires > 0, "Tile %u was not acquired.", tileIndex);
+  --entry.numAcquires;
+  entry.modified |= modified;
+}
+
+void TileCache::PrefetchTile(ezUInt32 tileIndex)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_entries[tileIndex].state != TileState::NOT_RESIDENT)
+      return;
+    m_prefetchQueue.PushBack(tileIndex);
+  }
+  m_loaderWakeUp.notify_one();
+}
+
+void TileCache::SetTileProtected(ezUInt32 tileIndex, bool isProtected)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_entries[tileIndex].isProtected = isProtected;
+}
+
+void TileCache::RunLoader()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while(true)
+  {
+    while(m_prefetchQueue.IsEmpty() && !m_stopLoader)
+      m_loaderWakeUp.wait(lock);
+    if(m_stopLoader)
+      return;
+
+    // Oldest request first.
+    ezUInt32 tileIndex = m_prefetchQueue[0];
+    m_prefetchQueue.RemoveAt(0);
+    TileEntry& entry = m_entries[tileIndex];
+    if(entry.state != TileState::NOT_RESIDENT)
+      continue;
+
+    // Prefetching never exceeds the budget.
+    float* data = AllocateTileBuffer(false);
+    if(!data)
+      continue;
+    entry.data = data;
+    entry.state = TileState::LOADING;
+
+    lock.unlock();
+    ReadTile(tileIndex, data);
+    lock.lock();
+
+    MakeResident(tileIndex);
+    ++m_stats.numPrefetches;
+  }
+}
+
+void TileCache::Flush()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for(ezUInt32 i = 0; i < m_residentTiles.GetCount(); ++i)
+  {
+    TileEntry& entry = m_entries[m_residentTiles[i]];
+    if(entry.modified)
+    {
+      WriteTile(m_residentTiles[i], entry.data);
+      m_stats.bytesWritten += sizeof(float) * m_numFloatsPerTile;
+      entry.modified = false;
+    }
+  }
+}
+
+TileCache::Stats TileCache::GetStats() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+ezUInt32 TileCache::GetNumResidentTiles() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_residentTiles.GetCount();
+}
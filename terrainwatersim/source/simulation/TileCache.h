@@ -0,0 +1,115 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+/// File backed store of equally sized float tiles with a cache of resident tiles that is limited by a memory budget.
+///
+/// Tiles are loaded on demand by AcquireTile and stay resident while they are acquired. Once the budget is used up, the least recently
+/// used tile that is not acquired is evicted and written back if it was modified. Protected tiles, e.g. around the camera, are only
+/// evicted if nothing else is left. PrefetchTile queues tiles for a loader thread, so they are hopefully resident once they are needed.
+///
+/// Acquire and release are meant to be called from a single thread, the loader thread is the only other one that touches the cache.
+class TileCache
+{
+public:
+  /// \param memoryBudget   Maximum number of bytes of resident tile data. Exceeded only if all resident tiles are acquired.
+  TileCache(ezUInt64 memoryBudget);
+  /// Writes back all modified tiles.
+  ~TileCache();
+
+  /// Creates a new file with all tiles zero, existing files are overwritten.
+  ezResult Create(const char* szFilename, ezUInt32 numTiles, ezUInt32 numFloatsPerTile);
+  /// Opens a file that was created with the same tile count and size.
+  ezResult Open(const char* szFilename, ezUInt32 numTiles, ezUInt32 numFloatsPerTile);
+  /// Writes back all modified tiles and closes the file.
+  void Close();
+
+  ezUInt32 GetNumTiles() const { return m_entries.GetCount(); }
+  ezUInt32 GetNumFloatsPerTile() const { return m_numFloatsPerTile; }
+
+  /// Returns the data of a tile, loading it if necessary. The pointer stays valid until the tile is released.
+  /// A tile may be acquired several times, it needs to be released as often.
+  float* AcquireTile(ezUInt32 tileIndex);
+  /// \param modified   Whether the tile needs to be written back once it is evicted.
+  void ReleaseTile(ezUInt32 tileIndex, bool modified);
+
+  /// Asks the loader thread to load a tile. Does nothing if the tile is already resident or being loaded.
+  void PrefetchTile(ezUInt32 tileIndex);
+
+  void SetTileProtected(ezUInt32 tileIndex, bool isProtected);
+
+  /// Writes back all modified resident tiles.
+  void Flush();
+
+  struct Stats
+  {
+    ezUInt64 numHits;
+    ezUInt64 numMisses;
+    /// Tiles loaded by the loader thread.
+    ezUInt64 numPrefetches;
+    ezUInt64 numEvictions;
+    ezUInt64 bytesRead;
+    ezUInt64 bytesWritten;
+    ezUInt32 maxResidentTiles;
+  };
+  Stats GetStats() const;
+  ezUInt32 GetNumResidentTiles() const;
+
+private:
+  enum class TileState
+  {
+    NOT_RESIDENT,
+    LOADING,
+    RESIDENT
+  };
+
+  struct TileEntry
+  {
+    float* data;
+    ezUInt64 lastUse;
+    ezUInt32 numAcquires;
+    TileState state;
+    bool modified;
+    bool isProtected;
+  };
+
+  ezResult OpenFile(const char* szFilename, bool create);
+  void ReadTile(ezUInt32 tileIndex, float* data);
+  void WriteTile(ezUInt32 tileIndex, const float* data);
+
+  /// Returns a buffer for a new resident tile, evicting another one if the budget is used up.
+  /// Returns NULL if nothing can be evicted and allowOverBudget is false.
+  float* AllocateTileBuffer(bool allowOverBudget);
+  void MakeResident(ezUInt32 tileIndex);
+
+  void RunLoader();
+
+  ezUInt64 m_memoryBudget;
+  ezUInt32 m_numFloatsPerTile;
+  /// Distance between two tiles in the file, tiles start at page boundaries.
+  ezUInt64 m_tileStride;
+  ezUInt32 m_maxResidentTiles;
+
+  /// File descriptor or handle, -1 if no file is open (same as INVALID_HANDLE_VALUE).
+  intptr_t m_file;
+
+  ezDynamicArray<TileEntry> m_entries;
+  ezDynamicArray<ezUInt32> m_residentTiles;
+  ezDynamicArray<float*> m_freeBuffers;
+  ezUInt64 m_useCounter;
+  Stats m_stats;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_tileLoaded;
+
+  // Loader thread
+  std::thread m_loaderThread;
+  std::condition_variable m_loaderWakeUp;
+  ezDynamicArray<ezUInt32> m_prefetchQueue;
+  bool m_stopLoader;
+};
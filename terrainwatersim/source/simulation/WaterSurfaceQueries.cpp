@@ -0,0 +1,157 @@
+#include "PCH.h"
+#include "WaterSurfaceQueries.h"
+#include "SimdFloat.h"
+
+const float WaterSurfaceQueries::s_minFlowSpeedDepth = 0.05f;
+
+namespace
+{
+  /// Bilinear interpolation of a plane with the lower left corners at index.
+  EZ_FORCE_INLINE Simd::Float GatherBilinear(const float* plane, ezUInt32 rowPitch, Simd::Int index, Simd::Float fractionX, Simd::Float fractionY)
+  {
+    Simd::Float v00 = Simd::Gather(plane, index);
+    Simd::Float v10 = Simd::Gather(plane + 1, index);
+    Simd::Float v01 = Simd::Gather(plane + rowPitch, index);
+    Simd::Float v11 = Simd::Gather(plane + rowPitch + 1, index);
+
+    Simd::Float v0 = Simd::Add(v00, Simd::Mul(Simd::Sub(v10, v00), fractionX));
+    Simd::Float v1 = Simd::Add(v01, Simd::Mul(Simd::Sub(v11, v01), fractionX));
+    return Simd::Add(v0, Simd::Mul(Simd::Sub(v1, v0), fractionY));
+  }
+}
+
+WaterSurfaceQueries::WaterSurfaceQueries(ezUInt32 gridResolution, float gridWorldSize) :
+  m_gridResolution(gridResolution),
+  m_cellDistance(gridWorldSize / gridResolution),
+  m_hasState(false),
+  m_simulationStepIndex(0),
+  m_numSortTilesPerSide((gridResolution + s_sortTileSize - 1) / s_sortTileSize)
+{
+  // Cell indices are computed in float.
+  EZ_ASSERT(gridResolution >= 2 && gridResolution * gridResolution <= (1 << 24), "Grid resolution %u is not supported for water queries.", gridResolution);
+
+  ezUInt32 numCells = gridResolution * gridResolution;
+  m_terrainHeights.SetCount(numCells);
+  m_waterDepths.SetCount(numCells);
+  m_flowX.SetCount(numCells);
+  m_flowY.SetCount(numCells);
+  m_tileQueryOffsets.SetCount(m_numSortTilesPerSide * m_numSortTilesPerSide + 1);
+}
+
+void WaterSurfaceQueries::SetState(const ezColor* terrainData, const ezVec2* flowMap, ezUInt32 simulationStepIndex)
+{
+  ezUInt32 numCells = m_gridResolution * m_gridResolution;
+  for(ezUInt32 i = 0; i < numCells; ++i)
+  {
+    m_terrainHeights[i] = terrainData[i].r;
+    m_waterDepths[i] = terrainData[i].a;
+    m_flowX[i] = flowMap[i].x;
+    m_flowY[i] = flowMap[i].y;
+  }
+
+  m_simulationStepIndex = simulationStepIndex;
+  m_hasState = true;
+}
+
+void WaterSurfaceQueries::SortQueries(const ezVec2* positionsXZ, ezUInt32 numQueries)
+{
+  float toTile = 1.0f / (m_cellDistance * s_sortTileSize);
+  float maxTile = static_cast<float>(m_numSortTilesPerSide - 1);
+
+  // Tiles are computed twice instead of being stored, that is cheaper than another pass over memory.
+  for(ezUInt32 i = 0; i < m_tileQueryOffsets.GetCount(); ++i)
+    m_tileQueryOffsets[i] = 0;
+  for(ezUInt32 i = 0; i < numQueries; ++i)
+  {
+    ezUInt32 tileX = static_cast<ezUInt32>(ezMath::Clamp(positionsXZ[i].x * toTile, 0.0f, maxTile));
+    ezUInt32 tileY = static_cast<ezUInt32>(ezMath::Clamp(positionsXZ[i].y * toTile, 0.0f, maxTile));
+    ++m_tileQueryOffsets[tileX + tileY * m_numSortTilesPerSide + 1];
+  }
+  for(ezUInt32 i = 1; i < m_tileQueryOffsets.GetCount(); ++i)
+    m_tileQueryOffsets[i] += m_tileQueryOffsets[i - 1];
+
+  m_sortedQueries.SetCount(numQueries);
+  for(ezUInt32 i = 0; i < numQueries; ++i)
+  {
+    ezUInt32 tileX = static_cast<ezUInt32>(ezMath::Clamp(positionsXZ[i].x * toTile, 0.0f, maxTile));
+    ezUInt32 tileY = static_cast<ezUInt32>(ezMath::Clamp(positionsXZ[i].y * toTile, 0.0f, maxTile));
+    m_sortedQueries[m_tileQueryOffsets[tileX + tileY * m_numSortTilesPerSide]++] = i;
+  }
+}
+
+ezResult WaterSurfaceQueries::Query(const ezVec2* positionsXZ, ezUInt32 numQueries, float* surfaceHeights, float* depths, ezVec2* velocities)
+{
+  if(!m_hasState)
+    return EZ_FAILURE;
+
+  const ezUInt32* queryOrder = NULL;
+  if(numQueries >= s_minQueriesForSorting)
+  {
+    SortQueries(positionsXZ, numQueries);
+    queryOrder = static_cast<ezArrayPtr<ezUInt32>>(m_sortedQueries).GetPtr();
+  }
+
+  const float* terrainHeights = static_cast<ezArrayPtr<float>>(m_terrainHeights).GetPtr();
+  const float* waterDepths = static_cast<ezArrayPtr<float>>(m_waterDepths).GetPtr();
+  const float* flowX = static_cast<ezArrayPtr<float>>(m_flowX).GetPtr();
+  const float* flowY = static_cast<ezArrayPtr<float>>(m_flowY).GetPtr();
+
+  // Cell values belong to the cell centers. Interpolation starts at most one cell before the border, the fraction reaches 1 there.
+  Simd::Float toCell = Simd::Set(1.0f / m_cellDistance);
+  Simd::Float halfCell = Simd::Set(0.5f);
+  Simd::Float maxCell = Simd::Set(static_cast<float>(m_gridResolution - 1));
+  Simd::Float maxBaseCell = Simd::Set(static_cast<float>(m_gridResolution - 2));
+  Simd::Float rowPitch = Simd::Set(static_cast<float>(m_gridResolution));
+  Simd::Float minFlowSpeedDepth = Simd::Set(s_minFlowSpeedDepth);
+  Simd::Float flowToVelocity = Simd::Set(1.0f / m_cellDistance);
+
+  ezUInt32 queryIndices[Simd::s_width];
+  float positionX[Simd::s_width];
+  float positionY[Simd::s_width];
+  float surfaceHeightLanes[Simd::s_width];
+  float depthLanes[Simd::s_width];
+  float velocityXLanes[Simd::s_width];
+  float velocityYLanes[Simd::s_width];
+
+  for(ezUInt32 firstQuery = 0; firstQuery < numQueries; firstQuery += Simd::s_width)
+  {
+    // A partial last batch repeats its last query in the remaining lanes.
+    ezUInt32 numLanes = ezMath::Min<ezUInt32>(Simd::s_width, numQueries - firstQuery);
+    for(ezUInt32 lane = 0; lane < static_cast<ezUInt32>(Simd::s_width); ++lane)
+    {
+      ezUInt32 query = firstQuery + ezMath::Min(lane, numLanes - 1);
+      queryIndices[lane] = queryOrder ? queryOrder[query] : query;
+      positionX[lane] = positionsXZ[queryIndices[lane]].x;
+      positionY[lane] = positionsXZ[queryIndices[lane]].y;
+    }
+
+    Simd::Float cellX = Simd::Min(Simd::Max(Simd::Sub(Simd::Mul(Simd::Load(positionX), toCell), halfCell), Simd::Zero()), maxCell);
+    Simd::Float cellY = Simd::Min(Simd::Max(Simd::Sub(Simd::Mul(Simd::Load(positionY), toCell), halfCell), Simd::Zero()), maxCell);
+    // Truncation is a floor since the cells were clamped to positive values.
+    Simd::Float baseCellX = Simd::Min(Simd::ToFloat(Simd::TruncateToInt(cellX)), maxBaseCell);
+    Simd::Float baseCellY = Simd::Min(Simd::ToFloat(Simd::TruncateToInt(cellY)), maxBaseCell);
+    Simd::Float fractionX = Simd::Sub(cellX, baseCellX);
+    Simd::Float fractionY = Simd::Sub(cellY, baseCellY);
+    Simd::Int index = Simd::TruncateToInt(Simd::Add(baseCellX, Simd::Mul(baseCellY, rowPitch)));
+
+    Simd::Float terrainHeight = GatherBilinear(terrainHeights, m_gridResolution, index, fractionX, fractionY);
+    Simd::Float depth = GatherBilinear(waterDepths, m_gridResolution, index, fractionX, fractionY);
+    Simd::Float velocityScale = Simd::Div(flowToVelocity, Simd::Max(depth, minFlowSpeedDepth));
+    Simd::Float velocityX = Simd::Mul(GatherBilinear(flowX, m_gridResolution, index, fractionX, fractionY), velocityScale);
+    Simd::Float velocityY = Simd::Mul(GatherBilinear(flowY, m_gridResolution, index, fractionX, fractionY), velocityScale);
+
+    Simd::Store(surfaceHeightLanes, Simd::Add(terrainHeight, depth));
+    Simd::Store(depthLanes, depth);
+    Simd::Store(velocityXLanes, velocityX);
+    Simd::Store(velocityYLanes, velocityY);
+    for(ezUInt32 lane = 0; lane < numLanes; ++lane)
+    {
+      ezUInt32 query = queryIndices[lane];
+      surfaceHeights[query] = surfaceHeightLanes[lane];
+      depths[query] = depthLanes[lane];
+      velocities[query].Set(velocityXLanes[lane], velocityYLanes[lane]);
+    }
+  }
+
+  return EZ_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Foundation/Containers/DynamicArray.h>
+
+/// CPU copy of the water surface that answers batches of point queries, for gameplay and analytics code.
+///
+/// The state is kept as separate planes of terrain height, water depth and flow map, so that a query only touches the four floats per
+/// plane it interpolates. Queries are processed Simd::s_width at a time, the corners of all lanes are gathered from the planes.
+/// Large batches are sorted by the tile they fall into first, so that consecutive lanes read from the same few cache lines.
+///
+/// Not thread safe, state updates and queries are expected on the same thread.
+class WaterSurfaceQueries
+{
+public:
+  WaterSurfaceQueries(ezUInt32 gridResolution, float gridWorldSize);
+
+  ezUInt32 GetGridResolution() const { return m_gridResolution; }
+
+  /// Takes over a state in the layout of the corresponding textures: terrain height in .r and water height in .a of the terrain data,
+  /// directed flow in the flow map.
+  void SetState(const ezColor* terrainData, const ezVec2* flowMap, ezUInt32 simulationStepIndex);
+  /// Forgets the state, queries fail until the next SetState.
+  void Clear() { m_hasState = false; }
+
+  bool HasState() const { return m_hasState; }
+  /// Simulation step the current state belongs to.
+  ezUInt32 GetSimulationStepIndex() const { return m_simulationStepIndex; }
+
+  /// Bilinearly filtered values at world XZ positions, clamped to the grid. Filtered like a linear texture fetch, values belong to cell
+  /// centers. All output arrays need room for numQueries entries.
+  /// \param surfaceHeights   Terrain height plus water depth.
+  /// \param velocities       Flow velocity in m/s, derived from the filtered flow and depth like the "Max Flow Speed" stat.
+  ezResult Query(const ezVec2* positionsXZ, ezUInt32 numQueries, float* surfaceHeights, float* depths, ezVec2* velocities);
+
+  /// Batches with fewer queries are processed in their given order, sorting would cost more than it saves.
+  static const ezUInt32 s_minQueriesForSorting = 1024;
+  /// Edge length in cells of the tiles queries are sorted by. A tile of all planes fits into the L2 cache.
+  static const ezUInt32 s_sortTileSize = 64;
+  /// Velocities in shallower water are computed as if it had this depth, same as MIN_FLOW_SPEED_DEPTH in simulationCommon.glsl.
+  static const float s_minFlowSpeedDepth;
+
+private:
+  /// Sorts query indices by tile into m_sortedQueries with a counting sort.
+  void SortQueries(const ezVec2* positionsXZ, ezUInt32 numQueries);
+
+  const ezUInt32 m_gridResolution;
+  const float m_cellDistance;
+
+  bool m_hasState;
+  ezUInt32 m_simulationStepIndex;
+
+  ezDynamicArray<float> m_terrainHeights;
+  ezDynamicArray<float> m_waterDepths;
+  ezDynamicArray<float> m_flowX;
+  ezDynamicArray<float> m_flowY;
+
+  ezUInt32 m_numSortTilesPerSide;
+  ezDynamicArray<ezUInt32> m_tileQueryOffsets;
+  ezDynamicArray<ezUInt32> m_sortedQueries;
+};